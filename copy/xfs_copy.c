@@ -57,7 +57,7 @@ unsigned int	kids;
 thread_control	glob_masks;
 thread_args	*targ;
 
-pthread_mutex_t	mainwait;
+#define WBUF_PIPELINE	8	/* buffers queued to or being written by targets */
 
 #define ACTIVE		1
 #define INACTIVE	2
@@ -213,18 +213,52 @@ do_write(
 	return error;
 }
 
+/*
+ * Drop a target's reference to a pipeline buffer, making it available to
+ * the reader once every target has written it.  Caller holds
+ * glob_masks.mutex.
+ */
+static void
+release_wbuf(
+	wbuf		*buf)
+{
+	if (--buf->refs == 0) {
+		glob_masks.free[glob_masks.num_free++] = buf;
+		pthread_cond_broadcast(&glob_masks.wait);
+	}
+}
+
+static wbuf *
+dequeue_wbuf(
+	thread_args	*args)
+{
+	wbuf		*buf = args->queue[args->q_head];
+
+	args->q_head = (args->q_head + 1) % WBUF_PIPELINE;
+	args->q_count--;
+	return buf;
+}
+
 void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	wbuf		*buf;
+	int		error;
 
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->q_count == 0)
+			pthread_cond_wait(&args->wait, &glob_masks.mutex);
+		buf = args->queue[args->q_head];
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		error = do_write(args, buf);
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		release_wbuf(dequeue_wbuf(args));
+		if (error)
 			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
 		pthread_mutex_unlock(&glob_masks.mutex);
 	}
 	/* NOTREACHED */
@@ -232,10 +266,9 @@ begin_reader(void *arg)
 handle_error:
 	/* error will be logged by primary thread */
 
-	pthread_mutex_lock(&glob_masks.mutex);
 	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	while (args->q_count > 0)
+		release_wbuf(dequeue_wbuf(args));
 	pthread_mutex_unlock(&glob_masks.mutex);
 	pthread_exit(NULL);
 	return NULL;
@@ -472,36 +505,71 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+static void
+wait_for_wbuf(void)
+{
+	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
+	pthread_cond_wait(&glob_masks.wait, &glob_masks.mutex);
+	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+}
+
+/*
+ * Queue the contents of w_buf to every active target.  The data is handed
+ * over to an idle pipeline buffer and w_buf gets that buffer's memory, so
+ * the caller can read the next chunk while the targets are still writing
+ * this one.  We only block if all the pipeline buffers are in use, which
+ * means the slowest target is WBUF_PIPELINE buffers behind.
+ */
 void
 write_wbuf(void)
 {
+	thread_args	*tcarg;
+	wbuf		*buf;
+	char		*data;
 	int		i;
-	int		badness = 0;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	pthread_mutex_lock(&glob_masks.mutex);
+	while (glob_masks.num_free == 0)
+		wait_for_wbuf();
+	buf = glob_masks.free[--glob_masks.num_free];
 
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+	data = buf->data;
+	buf->data = w_buf.data;
+	buf->position = w_buf.position;
+	buf->length = w_buf.length;
+	w_buf.data = data;
+
+	buf->refs = 0;
+	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
+		if (target[i].state == INACTIVE)
+			continue;
+		tcarg->queue[(tcarg->q_head + tcarg->q_count) % WBUF_PIPELINE] =
+				buf;
+		tcarg->q_count++;
+		buf->refs++;
+		pthread_cond_signal(&tcarg->wait);
+	}
 
 	/*
-	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
+	 * If all the targets are inactive then there are no io threads
+	 * left to write anything.  We're screwed, so bail out.
 	 */
-	if (badness == num_targets) {
+	if (buf->refs == 0) {
+		pthread_mutex_unlock(&glob_masks.mutex);
 		check_errors();
 		exit(1);
 	}
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
 
-	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+/* Wait until the targets have written everything queued so far. */
+static void
+drain_wbufs(void)
+{
+	pthread_mutex_lock(&glob_masks.mutex);
+	while (glob_masks.num_free < WBUF_PIPELINE)
+		wait_for_wbuf();
+	pthread_mutex_unlock(&glob_masks.mutex);
 }
 
 void
@@ -557,6 +625,8 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
+	long long	dsize;
+	int		dio_size;
 	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
 	xfs_mount_t	*mp;
@@ -881,16 +951,34 @@ main(int argc, char **argv)
 					target[i].name);
 				die_perror();
 			}
+
+			/*
+			 * Write devices with direct I/O too, now that the
+			 * unaligned size check is done.  All writes must then
+			 * be multiples of the device's logical sector size.
+			 */
+			if (!buffered_output)  {
+				platform_findsizes(target[i].name,
+						target[i].fd, &dsize, &dio_size);
+				if (fcntl(target[i].fd, F_SETFL,
+						O_RDWR | O_DIRECT) < 0)
+					do_warn(
+				_("%s:  cannot use direct I/O on \"%s\"\n"),
+						progname, target[i].name);
+				else
+					wbuf_miniosize = MAX(dio_size,
+								wbuf_miniosize);
+			}
 		}
 	}
 
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
+	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.wait, NULL) != 0)  {
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
 
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
@@ -898,6 +986,32 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
+	/*
+	 * The pipeline buffers swap memory with w_buf, so they must all be
+	 * exactly the size it ended up with.
+	 */
+	glob_masks.buffer = calloc(WBUF_PIPELINE, sizeof(wbuf));
+	glob_masks.free = calloc(WBUF_PIPELINE, sizeof(wbuf *));
+	if (!glob_masks.buffer || !glob_masks.free)  {
+		do_log(_("Couldn't allocate write pipeline\n"));
+		die_perror();
+	}
+	for (i = 0; i < WBUF_PIPELINE; i++)  {
+		wbuf	*buf = &glob_masks.buffer[i];
+
+		buf->data = memalign(w_buf.data_align, w_buf.size);
+		if (!buf->data)  {
+			do_log(_("Error initializing pipeline buffer %d\n"),
+				i);
+			die_perror();
+		}
+		buf->data_align = w_buf.data_align;
+		buf->min_io_size = w_buf.min_io_size;
+		buf->size = w_buf.size;
+		buf->id = i + 2;
+		glob_masks.free[glob_masks.num_free++] = buf;
+	}
+
 	wblocks = wbuf_size / BBSIZE;
 
 	if (wbuf_init(&btree_buf, MAX(source_blocksize, wbuf_miniosize),
@@ -906,14 +1020,6 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
-		die_perror();
-		exit(1);
-	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
-
 	/* set up sigchild signal handler */
 
 	signal(SIGCHLD, handler);
@@ -933,13 +1039,19 @@ main(int argc, char **argv)
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
 
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
+		if (pthread_cond_init(&tcarg->wait, NULL) != 0)  {
+			do_log(_("Error creating thread condvar %d\n"), i);
 			die_perror();
 			exit(1);
 		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
+		tcarg->queue = calloc(WBUF_PIPELINE, sizeof(wbuf *));
+		if (!tcarg->queue)  {
+			do_log(_("Couldn't allocate queue for target %d\n"),
+				i);
+			die_perror();
+		}
+		tcarg->q_head = 0;
+		tcarg->q_count = 0;
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -1185,6 +1297,9 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* the log and superblock writes below go straight to the targets */
+	drain_wbufs();
+
 	if (kids > 0)  {
 		if (!duplicate)
 			/* write a clean log using the specified UUID */
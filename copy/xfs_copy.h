@@ -59,19 +59,30 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	int		refs;		/* targets yet to write this buffer */
 } wbuf;
 
+/*
+ * Each target thread works through its own queue of pipeline buffers, in
+ * the order the main thread read them.  A queue never holds more than
+ * WBUF_PIPELINE entries because that is all the buffers there are.
+ */
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
+	pthread_cond_t	wait;		/* buffers were queued */
+	wbuf		**queue;
+	int		q_head;
+	int		q_count;
 	int		fd;
 } thread_args;
 
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	wait;		/* a pipeline buffer became idle */
+	wbuf		*buffer;	/* the pipeline buffers */
+	wbuf		**free;		/* idle pipeline buffers */
+	int		num_free;
 } thread_control;
 
 typedef int thread_id;
@@ -32,6 +32,8 @@
 #include "init.h"
 #include "malloc.h"
 #include "dir2.h"
+#include "usemap.h"
+#include "workqueue.h"
 
 typedef enum {
 	IS_USER_QUOTA, IS_PROJECT_QUOTA, IS_GROUP_QUOTA,
@@ -50,20 +52,43 @@ typedef enum {
 } dbm_t;
 
 typedef struct inodata {
-	struct inodata	*next;
 	nlink_t		link_set;
 	nlink_t		link_add;
 	char		isdir:1;
 	char		isreflink:1;
 	char		security;
 	char		ilist;
+	char		inuse;		/* entry has been looked up */
 	xfs_ino_t	ino;
 	struct inodata	*parent;
 	char		*name;
 } inodata_t;
-#define	MIN_INODATA_HASH_SIZE	256
-#define	MAX_INODATA_HASH_SIZE	65536
-#define	INODATA_AVG_HASH_LENGTH	8
+
+/*
+ * The inodes of an AG are kept in chunks of INOTAB_CHUNK entries, indexed
+ * directly by agino, so finding an inode needs no hashing and walking the
+ * table visits the inodes in inode number order.  The chunk pointers live
+ * in pages of INOTAB_PAGE pointers.  Pages and chunks are only allocated
+ * for the parts of the AG that are in use, and chunks are carved out of
+ * arenas of INOTAB_ARENA chunks rather than allocated one at a time.
+ */
+#define	INOTAB_CHUNK_LOG	6
+#define	INOTAB_CHUNK		(1U << INOTAB_CHUNK_LOG)
+#define	INOTAB_PAGE_LOG		12
+#define	INOTAB_PAGE		(1U << INOTAB_PAGE_LOG)
+#define	INOTAB_ARENA		32
+
+typedef struct inoarena {
+	struct inoarena	*next;
+	int		used;		/* chunks handed out */
+	inodata_t	ents[INOTAB_ARENA * INOTAB_CHUNK];
+} inoarena_t;
+
+typedef struct inotab {
+	inodata_t	***pages;	/* chunk pointers */
+	uint64_t	npages;
+	inoarena_t	*arena;		/* newest first */
+} inotab_t;
 
 typedef struct qinfo {
 	xfs_qcnt_t	bc;
@@ -112,26 +137,72 @@ typedef struct dirhash {
 #define	DIR_HASH_SIZE	1024
 #define	DIR_HASH_FUNC(h,a)	(((h) ^ (a)) % DIR_HASH_SIZE)
 
-static xfs_extlen_t	agffreeblks;
-static xfs_extlen_t	agflongest;
-static uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
-static uint32_t	agfbtreeblks;
+/*
+ * With blockget -T, the AGs are scanned by worker threads.  Blocks and
+ * inodes can be claimed from any AG, so the block usage maps and inode
+ * tables are shared, with a lock for each AG.  Everything else that the
+ * scan of an AG finds goes into an agscan_t, and the main thread merges
+ * those in AG order once all the scans are done, so that the report comes
+ * out much as a serial scan would print it.
+ */
+#define	LINK_ADD	0x1		/* addlink_inode */
+#define	LINK_ENTRY	0x2		/* addentry_inode */
+#define	LINK_PARENT	0x4		/* addparent_inode */
+
+typedef struct linkfact {
+	inodata_t	*id;
+	inodata_t	*dir;		/* directory or parent */
+	char		*name;		/* entry name, with -n */
+	xfs_ino_t	parent;
+	int		namelen;
+	int		flags;		/* LINK_* */
+} linkfact_t;
+
+typedef struct agscan {
+	char		*out;		/* captured dbprintf output */
+	size_t		outlen;
+	linkfact_t	*links;
+	int		nlinks;
+	int		maxlinks;
+	qdata_t		**qudata;
+	qdata_t		**qgdata;
+	qdata_t		**qpdata;
+	int		error;
+	int		serious_error;
+	int		sbver_err;
+	unsigned	sbversion;
+	uint64_t	agf_aggr_freeblks;
+	uint64_t	fdblocks;
+	uint64_t	frextents;
+	uint64_t	icount;
+	uint64_t	ifree;
+} agscan_t;
+
+static __thread xfs_extlen_t	agffreeblks;
+static __thread xfs_extlen_t	agflongest;
+static __thread uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
+static __thread uint32_t	agfbtreeblks;
 static int		lazycount;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
+static __thread xfs_agino_t	agicount;
+static __thread xfs_agino_t	agifreecount;
+static pthread_mutex_t	*aglocks;	/* one per AG, then the rt device */
+static agscan_t		*agscans;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
-static dirhash_t	**dirhash;
-static int		error;
-static uint64_t	fdblocks;
-static uint64_t	frextents;
-static uint64_t	icount;
-static uint64_t	ifree;
-static inodata_t	***inodata;
-static int		inodata_hash_size;
-static inodata_t	***inomap;
+static __thread agscan_t	*cur_agscan;	/* NULL unless in a worker */
+static struct usemap	**dbmap;	/* dbm_t for each block */
+static __thread dirhash_t	**dirhash;
+static __thread int	error;
+static __thread uint64_t	fdblocks;
+static __thread uint64_t	frextents;
+static __thread uint64_t	icount;
+static __thread uint64_t	ifree;
+static inotab_t		*inodata;
+static uint64_t		mem_budget;	/* bytes for usage maps, or 0 */
+static uint64_t		mem_peak;
+static struct usemap	**inomap;	/* inodata_t * for each block */
 static int		nflag;
+static int		nr_threads;
 static int		pflag;
 static int		tflag;
 static qdata_t		**qpdata;
@@ -140,9 +211,12 @@ static qdata_t		**qudata;
 static int		qudo;
 static qdata_t		**qgdata;
 static int		qgdo;
-static unsigned		sbversion;
-static int		sbver_err;
-static int		serious_error;
+static __thread unsigned	sbversion;
+static __thread int	sbver_err;
+static __thread int	serious_error;
+static pthread_mutex_t	scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		scan_abort;	/* out of memory budget */
+static xfs_agnumber_t	scan_abort_agno;
 static int		sflag;
 static xfs_suminfo_t	*sumcompute;
 static xfs_suminfo_t	*sumfile;
@@ -204,9 +278,14 @@ typedef void	(*scan_sbtree_f_t)(struct xfs_btree_block *block,
 
 static void		add_blist(xfs_fsblock_t	bno);
 static void		add_ilist(xfs_ino_t ino);
+static void		add_linkfact(int flags, inodata_t *id, inodata_t *dir,
+				     char *name, int namelen, xfs_ino_t parent);
+static void		addentry_inode(inodata_t *id, inodata_t *dir,
+				       char *name, int namelen);
 static void		addlink_inode(inodata_t *id);
 static void		addname_inode(inodata_t *id, char *name, int namelen);
 static void		addparent_inode(inodata_t *id, xfs_ino_t parent);
+static void		apply_linkfacts(agscan_t *as, int apply);
 static void		blkent_append(blkent_t **entp, xfs_fsblock_t b,
 				      xfs_extlen_t c);
 static blkent_t		*blkent_new(xfs_fileoff_t o, xfs_fsblock_t b,
@@ -266,8 +345,10 @@ static void		dir_hash_init(void);
 static int		dir_hash_see(xfs_dahash_t hash,
 				     xfs_dir2_dataptr_t addr);
 static inodata_t	*find_inode(xfs_ino_t ino, int add);
+static inodata_t	*next_inode(xfs_agnumber_t agno, uint64_t *cur);
 static void		free_inodata(xfs_agnumber_t agno);
 static int		init(int argc, char **argv);
+static inodata_t	*inotab_chunk(inotab_t *it);
 static char		*inode_name(xfs_ino_t ino, inodata_t **ipp);
 static int		ncheck_f(int argc, char **argv);
 static char		*prepend_path(char *oldpath, char *parent);
@@ -326,7 +407,12 @@ static void		quota_add1(qdata_t **qt, xfs_dqid_t id, int dq,
 				   xfs_qcnt_t rc);
 static void		quota_check(char *s, qdata_t **qt);
 static void		quota_init(void);
+static void		quota_merge(qdata_t **qt, qdata_t **from);
 static void		scan_ag(xfs_agnumber_t agno);
+static void		scan_ag_worker(struct workqueue *wq,
+				       xfs_agnumber_t agno, void *arg);
+static int		scan_ags(void);
+static int		scan_ags_parallel(void);
 static void		scan_freelist(xfs_agf_t *agf);
 static void		scan_lbtree(xfs_fsblock_t root, int nlevels,
 				    scan_lbtree_f_t func, dbm_t type,
@@ -378,7 +464,8 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-m megabytes] [-T threads] [-b bno]... "
+	     "[-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -417,10 +504,69 @@ add_ilist(
 	id->ilist = 1;
 }
 
+/*
+ * Remember a change to the link count, name or parent of an inode found
+ * while scanning an AG in a worker thread, to be made by apply_linkfacts.
+ * An entry's link and name usually come as a pair, so they share a slot.
+ */
+static void
+add_linkfact(
+	int		flags,
+	inodata_t	*id,
+	inodata_t	*dir,
+	char		*name,
+	int		namelen,
+	xfs_ino_t	parent)
+{
+	agscan_t	*as = cur_agscan;
+	linkfact_t	*lf;
+
+	lf = as->nlinks ? &as->links[as->nlinks - 1] : NULL;
+	if (!lf || lf->id != id || lf->flags != LINK_ADD ||
+	    flags != LINK_ENTRY) {
+		if (as->nlinks == as->maxlinks) {
+			as->maxlinks = as->maxlinks ? as->maxlinks * 2 : 1024;
+			as->links = xrealloc(as->links,
+					as->maxlinks * sizeof(*as->links));
+		}
+		lf = &as->links[as->nlinks++];
+		memset(lf, 0, sizeof(*lf));
+		lf->id = id;
+	}
+	lf->flags |= flags;
+	lf->dir = dir;
+	lf->parent = parent;
+	if (name && nflag) {
+		lf->name = xmalloc(namelen);
+		memcpy(lf->name, name, namelen);
+		lf->namelen = namelen;
+	}
+}
+
+static void
+addentry_inode(
+	inodata_t	*id,
+	inodata_t	*dir,
+	char		*name,
+	int		namelen)
+{
+	if (cur_agscan) {
+		add_linkfact(LINK_ENTRY, id, dir, name, namelen, 0);
+		return;
+	}
+	if (!id->parent)
+		id->parent = dir;
+	addname_inode(id, name, namelen);
+}
+
 static void
 addlink_inode(
 	inodata_t	*id)
 {
+	if (cur_agscan) {
+		add_linkfact(LINK_ADD, id, NULL, NULL, 0, 0);
+		return;
+	}
 	id->link_add++;
 	if (verbose || id->ilist)
 		dbprintf(_("inode %lld add link, now %u\n"), id->ino,
@@ -448,11 +594,44 @@ addparent_inode(
 	inodata_t	*pid;
 
 	pid = find_inode(parent, 1);
+	if (cur_agscan) {
+		add_linkfact(LINK_PARENT, id, pid, NULL, 0, parent);
+		return;
+	}
 	id->parent = pid;
 	if (verbose || id->ilist || (pid && pid->ilist))
 		dbprintf(_("inode %lld parent %lld\n"), id->ino, parent);
 }
 
+/* Make the changes saved by add_linkfact, or just free them. */
+static void
+apply_linkfacts(
+	agscan_t	*as,
+	int		apply)
+{
+	linkfact_t	*lf;
+	int		i;
+
+	for (i = 0, lf = as->links; apply && i < as->nlinks; i++, lf++) {
+		if (lf->flags & LINK_ADD)
+			addlink_inode(lf->id);
+		if (lf->flags & LINK_ENTRY)
+			addentry_inode(lf->id, lf->dir, lf->name, lf->namelen);
+		if (lf->flags & LINK_PARENT) {
+			lf->id->parent = lf->dir;
+			if (verbose || lf->id->ilist ||
+			    (lf->dir && lf->dir->ilist))
+				dbprintf(_("inode %lld parent %lld\n"),
+					lf->id->ino, lf->parent);
+		}
+	}
+	for (i = 0, lf = as->links; i < as->nlinks; i++, lf++)
+		xfree(lf->name);
+	xfree(as->links);
+	as->links = NULL;
+	as->nlinks = as->maxlinks = 0;
+}
+
 static void
 blkent_append(
 	blkent_t	**entp,
@@ -768,26 +947,53 @@ blockfree_f(
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		usemap_free(dbmap[c]);
+		usemap_free(inomap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		usemap_free(dbmap[c]);
+		usemap_free(inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
 	}
+	for (c = 0; c < mp->m_sb.sb_agcount + rt; c++)
+		pthread_mutex_destroy(&aglocks[c]);
+	xfree(aglocks);
 	xfree(dbmap);
 	xfree(inomap);
 	xfree(inodata);
+	aglocks = NULL;
 	dbmap = NULL;
 	inomap = NULL;
 	inodata = NULL;
 	return 0;
 }
 
+/*
+ * Add up the memory used by the block usage maps and remember the peak.
+ * Returns 0 if that's more than the user let us have.
+ */
+static int
+check_memory(void)
+{
+	xfs_agnumber_t	c;
+	xfs_agnumber_t	nmaps;
+	uint64_t	bytes = 0;
+
+	nmaps = mp->m_sb.sb_agcount + (mp->m_sb.sb_rextents != 0);
+	for (c = 0; c < nmaps; c++) {
+		pthread_mutex_lock(&aglocks[c]);
+		bytes += usemap_bytes(dbmap[c]) + usemap_bytes(inomap[c]);
+		pthread_mutex_unlock(&aglocks[c]);
+	}
+	pthread_mutex_lock(&scan_lock);
+	mem_peak = MAX(mem_peak, bytes);
+	pthread_mutex_unlock(&scan_lock);
+	return !mem_budget || bytes <= mem_budget;
+}
+
 /*
  * Check consistency of xfs filesystem contents.
  */
@@ -798,7 +1004,7 @@ blockget_f(
 {
 	xfs_agnumber_t	agno;
 	int		oldprefix;
-	int		sbyell;
+	int		scanned;
 
 	if (dbmap) {
 		dbprintf(_("already have block usage information\n"));
@@ -814,13 +1020,15 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
-	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		scan_ag(agno);
-		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
-			sbyell = 1;
-			dbprintf(_("WARNING: this may be a newer XFS "
-				 "filesystem.\n"));
-		}
+	if (nr_threads > 1 && mp->m_sb.sb_agcount > 1)
+		scanned = scan_ags_parallel();
+	else
+		scanned = scan_ags();
+	if (!scanned) {
+		blockfree_f(0, NULL);
+		exitcode = 1;
+		dbprefix = oldprefix;
+		return 0;
 	}
 	if (blist_size) {
 		xfree(blist);
@@ -920,6 +1128,13 @@ blockget_f(
 		quota_check("group", qgdata);
 	if (sbver_err > mp->m_sb.sb_agcount / 2)
 		dbprintf(_("WARNING: this may be a newer XFS filesystem.\n"));
+	/* a clean check prints nothing, so only report this if asked */
+	if (mem_budget || verbose)
+		dbprintf(_("block usage maps used %llu KB, %llu KB without "
+			 "compaction\n"),
+			mem_peak >> 10,
+			((uint64_t)mp->m_sb.sb_agcount * mp->m_sb.sb_agblocks +
+			 mp->m_sb.sb_rblocks) * (1 + sizeof(inodata_t *)) >> 10);
 	if (error)
 		exitcode = 3;
 	dbprefix = oldprefix;
@@ -1022,6 +1237,7 @@ blocktrash_f(
 	int		done;
 	int		goodmask;
 	int		i;
+	uint64_t	len;
 	ltab_t		*lentab;
 	int		lentablen;
 	int		max;
@@ -1033,6 +1249,7 @@ blocktrash_f(
 	uint		seed;
 	int		sopt;
 	int		tmask;
+	dbm_t		type;
 	bool		this_block = false;
 	int		bit_offset = -1;
 
@@ -1175,11 +1392,13 @@ blocktrash_f(
 		goto out;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
+		for (agbno = 0;
 		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		     agbno += len) {
+			type = usemap_get(dbmap[agno], agbno,
+					mp->m_sb.sb_agblocks - agbno, &len);
+			if ((1 << type) & tmask)
+				blocks += len;
 		}
 	}
 	if (blocks == 0) {
@@ -1192,18 +1411,23 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno += len) {
+				type = usemap_get(dbmap[agno], agbno,
+					mp->m_sb.sb_agblocks - agbno, &len);
+				if (!((1 << type) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + len <= randb) {
+					bi += len;
 					continue;
+				}
+				agbno += randb - bi;
 				push_cur();
 				set_cur(NULL,
 					XFS_AGB_TO_DADDR(mp, agno, agbno),
 					blkbb, DB_RING_IGN, NULL);
-				blocktrash_b(bit_offset, (dbm_t)*p,
+				blocktrash_b(bit_offset, type,
 					&lentab[random() % lentablen], mode);
 				pop_cur();
 				done = 1;
@@ -1264,11 +1488,11 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		i = (inodata_t *)usemap_get(inomap[agno], agbno, 1, NULL);
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_fsblock_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno,
+			typename[usemap_get(dbmap[agno], agbno, 1, NULL)]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1304,20 +1528,24 @@ check_dbmap(
 	int		ignore_reflink)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
 	dbm_t		d;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		d = (dbm_t)*p;
+	for (i = 0; i < len; i = n) {
+		d = usemap_get(dbmap[agno], agbno + i, len - i, &rlen);
+		n = MIN(len, i + rlen);
 		if (ignore_reflink && (d == DBM_UNKNOWN || d == DBM_DATA ||
 				       d == DBM_RLDATA))
 			continue;
-		if ((dbm_t)*p != type) {
+		if (d == type)
+			continue;
+		for (; i < n; i++) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i)) {
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
 					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[d]);
 			}
 			error++;
 		}
@@ -1343,7 +1571,9 @@ check_inomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
+	inodata_t	*id;
 	int		rval;
 
 	if (!check_range(agno, agbno, len))  {
@@ -1351,16 +1581,21 @@ check_inomap(
 			agno, agbno, agbno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp && !(*idp)->isreflink) {
-			if (!sflag || (*idp)->ilist ||
+	for (i = 0, rval = 1; i < len; i = n) {
+		id = (inodata_t *)usemap_get(inomap[agno], agbno + i,
+				len - i, &rlen);
+		n = MIN(len, i + rlen);
+		if (!id || id->isreflink)
+			continue;
+		for (; i < n; i++) {
+			if (!sflag || id->ilist ||
 			    CHECK_BLISTA(agno, agbno + i))
 				dbprintf(_("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					agno, agbno + i, c_ino, (*idp)->ino);
+					agno, agbno + i, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1370,51 +1605,44 @@ check_linkcounts(
 	xfs_agnumber_t	agno)
 {
 	inodata_t	*ep;
-	inodata_t	**ht;
-	int		idx;
+	uint64_t	cur = 0;
 	char		*path;
 
-	ht = inodata[agno];
-	for (idx = 0; idx < inodata_hash_size; ht++, idx++) {
-		ep = *ht;
-		while (ep) {
-			if (ep->link_set != ep->link_add || ep->link_set == 0) {
-				path = inode_name(ep->ino, NULL);
-				if (!path && ep->link_add)
-					path = xstrdup("?");
-				if (!sflag || ep->ilist) {
-					if (ep->link_add)
-						dbprintf(_("link count mismatch "
-							 "for inode %lld (name "
-							 "%s), nlink %d, "
-							 "counted %d\n"),
-							ep->ino, path,
-							ep->link_set,
-							ep->link_add);
-					else if (ep->link_set)
-						dbprintf(_("disconnected inode "
-							 "%lld, nlink %d\n"),
-							ep->ino, ep->link_set);
-					else
-						dbprintf(_("allocated inode %lld "
-							 "has 0 link count\n"),
-							ep->ino);
-				}
-				if (path)
-					xfree(path);
-				error++;
-			} else if (verbose || ep->ilist) {
-				path = inode_name(ep->ino, NULL);
-				if (path) {
-					dbprintf(_("inode %lld name %s\n"),
-						ep->ino, path);
-					xfree(path);
-				}
+	while ((ep = next_inode(agno, &cur)) != NULL) {
+		if (ep->link_set != ep->link_add || ep->link_set == 0) {
+			path = inode_name(ep->ino, NULL);
+			if (!path && ep->link_add)
+				path = xstrdup("?");
+			if (!sflag || ep->ilist) {
+				if (ep->link_add)
+					dbprintf(_("link count mismatch "
+						 "for inode %lld (name "
+						 "%s), nlink %d, "
+						 "counted %d\n"),
+						ep->ino, path,
+						ep->link_set,
+						ep->link_add);
+				else if (ep->link_set)
+					dbprintf(_("disconnected inode "
+						 "%lld, nlink %d\n"),
+						ep->ino, ep->link_set);
+				else
+					dbprintf(_("allocated inode %lld "
+						 "has 0 link count\n"),
+						ep->ino);
+			}
+			if (path)
+				xfree(path);
+			error++;
+		} else if (verbose || ep->ilist) {
+			path = inode_name(ep->ino, NULL);
+			if (path) {
+				dbprintf(_("inode %lld name %s\n"),
+					ep->ino, path);
+				xfree(path);
 			}
-			ep = ep->next;
 		}
 	}
-
 }
 
 static int
@@ -1476,15 +1704,22 @@ check_rdbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
+	dbm_t		d;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((dbm_t)*p != type) {
+	for (i = 0; i < len; i = n) {
+		d = usemap_get(dbmap[mp->m_sb.sb_agcount], bno + i,
+				len - i, &rlen);
+		n = MIN(len, i + rlen);
+		if (d == type)
+			continue;
+		for (; i < n; i++) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
 					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					typename[d]);
 			error++;
 		}
 	}
@@ -1497,7 +1732,9 @@ check_rinomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
+	inodata_t	*id;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1505,17 +1742,20 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i = n) {
+		id = (inodata_t *)usemap_get(inomap[mp->m_sb.sb_agcount],
+				bno + i, len - i, &rlen);
+		n = MIN(len, i + rlen);
+		if (!id)
+			continue;
+		for (; i < n; i++) {
+			if (!sflag || id->ilist || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					bno + i, c_ino, (*idp)->ino);
+					bno + i, c_ino, id->ino);
 			error++;
-			rval = 0;
 		}
+		rval = 0;
 	}
 	return rval;
 }
@@ -1589,24 +1829,34 @@ check_set_dbmap(
 	xfs_agblock_t	c_agbno)
 {
 	xfs_extlen_t	i;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
 	int		mayprint;
-	char		*p;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
 			agbno, agbno + len - 1, c_agno, c_agbno);
 		return;
 	}
+	pthread_mutex_lock(&aglocks[agno]);
 	check_dbmap(agno, agbno, len, type1, is_reflink(type2));
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if (*p == DBM_RLDATA && type2 == DBM_DATA)
-			;	/* do nothing */
-		else if (*p == DBM_DATA && type2 == DBM_DATA)
-			*p = (char)DBM_RLDATA;
+	for (i = 0; i < len; i = n) {
+		d = usemap_get(dbmap[agno], agbno + i, len - i, &rlen);
+		n = MIN(len, i + rlen);
+		/* Data set twice becomes rldata, and never goes back. */
+		if (type2 == DBM_DATA && (d == DBM_DATA || d == DBM_RLDATA))
+			d = DBM_RLDATA;
 		else
-			*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
+			d = type2;
+		usemap_set(dbmap[agno], agbno + i, n - i, d);
+	}
+	pthread_mutex_unlock(&aglocks[agno]);
+	if (!mayprint)
+		return;
+	for (i = 0; i < len; i++) {
+		if (verbose || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
 				typename[type2]);
 	}
@@ -1621,15 +1871,18 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
+	pthread_mutex_lock(&aglocks[mp->m_sb.sb_agcount]);
 	check_rdbmap(bno, len, type1);
+	usemap_set(dbmap[mp->m_sb.sb_agcount], bno, len, type2);
+	pthread_mutex_unlock(&aglocks[mp->m_sb.sb_agcount]);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
+	if (!mayprint)
+		return;
+	for (i = 0; i < len; i++) {
+		if (verbose || CHECK_BLIST(bno + i))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
@@ -1669,15 +1922,21 @@ checknot_dbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i = n) {
+		d = usemap_get(dbmap[agno], agbno + i, len - i, &rlen);
+		n = MIN(len, i + rlen);
+		if (!((1 << d) & typemask))
+			continue;
+		for (; i < n; i++) {
 			if (!sflag || CHECK_BLISTA(agno, agbno + i))
 				dbprintf(_("block %u/%u type %s not expected\n"),
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + i, typename[d]);
 			error++;
 		}
 	}
@@ -1690,15 +1949,22 @@ checknot_rdbmap(
 	int		typemask)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	n;
+	uint64_t	rlen;
+	dbm_t		d;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
+	for (i = 0; i < len; i = n) {
+		d = usemap_get(dbmap[mp->m_sb.sb_agcount], bno + i,
+				len - i, &rlen);
+		n = MIN(len, i + rlen);
+		if (!((1 << d) & typemask))
+			continue;
+		for (; i < n; i++) {
 			if (!sflag || CHECK_BLIST(bno + i))
 				dbprintf(_("rtblock %llu type %s not expected\n"),
-					bno + i, typename[(dbm_t)*p]);
+					bno + i, typename[d]);
 			error++;
 		}
 	}
@@ -1792,29 +2058,45 @@ find_inode(
 {
 	xfs_agino_t	agino;
 	xfs_agnumber_t	agno;
-	inodata_t	*ent;
-	inodata_t	**htab;
-	xfs_agino_t	ih;
+	inodata_t	*ent = NULL;
+	inodata_t	**page;
+	inodata_t	*chunk;
+	inotab_t	*it;
+	uint64_t	c;
 
 	agno = XFS_INO_TO_AGNO(mp, ino);
 	agino = XFS_INO_TO_AGINO(mp, ino);
 	if (agno >= mp->m_sb.sb_agcount ||
 	    XFS_AGINO_TO_INO(mp, agno, agino) != ino)
 		return NULL;
-	htab = inodata[agno];
-	ih = agino % inodata_hash_size;
-	ent = htab[ih];
-	while (ent) {
-		if (ent->ino == ino)
-			return ent;
-		ent = ent->next;
-	}
-	if (!add)
-		return NULL;
-	ent = xcalloc(1, sizeof(*ent));
-	ent->ino = ino;
-	ent->next = htab[ih];
-	htab[ih] = ent;
+	it = &inodata[agno];
+	c = agino >> INOTAB_CHUNK_LOG;
+	pthread_mutex_lock(&aglocks[agno]);
+	page = it->pages[c >> INOTAB_PAGE_LOG];
+	if (!page) {
+		if (!add)
+			goto out;
+		page = xcalloc(INOTAB_PAGE, sizeof(*page));
+		it->pages[c >> INOTAB_PAGE_LOG] = page;
+	}
+	chunk = page[c & (INOTAB_PAGE - 1)];
+	if (!chunk) {
+		if (!add)
+			goto out;
+		chunk = inotab_chunk(it);
+		page[c & (INOTAB_PAGE - 1)] = chunk;
+	}
+	ent = &chunk[agino & (INOTAB_CHUNK - 1)];
+	if (!ent->inuse) {
+		if (!add) {
+			ent = NULL;
+			goto out;
+		}
+		ent->inuse = 1;
+		ent->ino = ino;
+	}
+out:
+	pthread_mutex_unlock(&aglocks[agno]);
 	return ent;
 }
 
@@ -1822,23 +2104,21 @@ static void
 free_inodata(
 	xfs_agnumber_t	agno)
 {
-	inodata_t	*hp;
-	inodata_t	**ht;
-	int		i;
-	inodata_t	*next;
-
-	ht = inodata[agno];
-	for (i = 0; i < inodata_hash_size; i++) {
-		hp = ht[i];
-		while (hp) {
-			next = hp->next;
-			if (hp->name)
-				xfree(hp->name);
-			xfree(hp);
-			hp = next;
-		}
-	}
-	xfree(ht);
+	inotab_t	*it = &inodata[agno];
+	inoarena_t	*arena;
+	inodata_t	*ep;
+	uint64_t	cur = 0;
+	uint64_t	i;
+
+	while ((ep = next_inode(agno, &cur)) != NULL)
+		xfree(ep->name);
+	while ((arena = it->arena) != NULL) {
+		it->arena = arena->next;
+		xfree(arena);
+	}
+	for (i = 0; i < it->npages; i++)
+		xfree(it->pages[i]);
+	xfree(it->pages);
 }
 
 static int
@@ -1849,6 +2129,8 @@ init(
 	xfs_fsblock_t	bno;
 	int		c;
 	xfs_ino_t	ino;
+	uint64_t	npages;
+	char		*p;
 	int		rt;
 
 	serious_error = 0;
@@ -1863,25 +2145,29 @@ init(
 	rt = mp->m_sb.sb_rextents != 0;
 	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
 	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
-	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
-	inodata_hash_size =
-		(int)MAX(MIN(mp->m_sb.sb_icount /
-				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
-			     MAX_INODATA_HASH_SIZE),
-			 MIN_INODATA_HASH_SIZE);
+	inodata = xcalloc(mp->m_sb.sb_agcount, sizeof(*inodata));
+	aglocks = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*aglocks));
+	for (c = 0; c < mp->m_sb.sb_agcount + rt; c++)
+		pthread_mutex_init(&aglocks[c], NULL);
+	npages = ((1ULL << (mp->m_sb.sb_agblklog + mp->m_sb.sb_inopblog)) +
+		  (INOTAB_CHUNK << INOTAB_PAGE_LOG) - 1) >>
+		 (INOTAB_CHUNK_LOG + INOTAB_PAGE_LOG);
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
-		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
+		dbmap[c] = usemap_alloc(mp->m_sb.sb_agblocks, USEMAP_STATE);
+		inomap[c] = usemap_alloc(mp->m_sb.sb_agblocks, USEMAP_OWNER);
+		inodata[c].pages = xcalloc(npages, sizeof(inodata_t **));
+		inodata[c].npages = npages;
 	}
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
+		dbmap[c] = usemap_alloc(mp->m_sb.sb_rblocks, USEMAP_STATE);
+		inomap[c] = usemap_alloc(mp->m_sb.sb_rblocks, USEMAP_OWNER);
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
 	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	mem_budget = mem_peak = 0;
+	nr_threads = 1;
+	while ((c = getopt(argc, argv, "b:i:m:npstT:v")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1891,6 +2177,14 @@ init(
 			ino = strtoll(optarg, NULL, 10);
 			add_ilist(ino);
 			break;
+		case 'm':
+			mem_budget = strtoull(optarg, &p, 0) << 20;
+			if (*p != '\0' || mem_budget == 0) {
+				dbprintf(_("bad blockget memory limit %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
 		case 'n':
 			nflag = 1;
 			break;
@@ -1903,6 +2197,14 @@ init(
 		case 't':
 			tflag = 1;
 			break;
+		case 'T':
+			nr_threads = (int)strtol(optarg, &p, 0);
+			if (*p != '\0' || nr_threads <= 0) {
+				dbprintf(_("bad blockget thread count %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -1958,6 +2260,21 @@ inode_name(
 	return path;
 }
 
+/* Hand out a zeroed chunk of inode entries from the AG's arena. */
+static inodata_t *
+inotab_chunk(
+	inotab_t	*it)
+{
+	inoarena_t	*arena = it->arena;
+
+	if (!arena || arena->used == INOTAB_ARENA) {
+		arena = xcalloc(1, sizeof(*arena));
+		arena->next = it->arena;
+		it->arena = arena;
+	}
+	return &arena->ents[INOTAB_CHUNK * arena->used++];
+}
+
 static int
 ncheck_f(
 	int		argc,
@@ -1965,9 +2282,8 @@ ncheck_f(
 {
 	xfs_agnumber_t	agno;
 	int		c;
+	uint64_t	cur;
 	inodata_t	*hp;
-	inodata_t	**ht;
-	int		i;
 	inodata_t	*id;
 	xfs_ino_t	*ilist;
 	int		ilist_size;
@@ -2014,27 +2330,63 @@ ncheck_f(
 		return 0;
 	}
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		ht = inodata[agno];
-		for (i = 0; i < inodata_hash_size; i++) {
-			hp = ht[i];
-			for (hp = ht[i]; hp; hp = hp->next) {
-				ino = XFS_AGINO_TO_INO(mp, agno, hp->ino);
-				p = inode_name(ino, &id);
-				if (!p || !id)
-					continue;
-				if (!security || id->security) {
-					dbprintf("%11llu %s", ino, p);
-					if (hp->isdir)
-						dbprintf("/.");
-					dbprintf("\n");
-				}
-				xfree(p);
+		cur = 0;
+		while ((hp = next_inode(agno, &cur)) != NULL) {
+			ino = hp->ino;
+			p = inode_name(ino, &id);
+			if (!p || !id)
+				continue;
+			if (!security || id->security) {
+				dbprintf("%11llu %s", ino, p);
+				if (hp->isdir)
+					dbprintf("/.");
+				dbprintf("\n");
 			}
+			xfree(p);
 		}
 	}
 	return 0;
 }
 
+/*
+ * Return the first inode in use at or after agino *cur in an AG, and move
+ * *cur past it.  Empty pages and chunks are skipped without looking at
+ * their entries.
+ */
+static inodata_t *
+next_inode(
+	xfs_agnumber_t	agno,
+	uint64_t	*cur)
+{
+	inotab_t	*it = &inodata[agno];
+	inodata_t	**page;
+	inodata_t	*chunk;
+	uint64_t	c;
+	uint64_t	i;
+
+	while ((c = *cur >> INOTAB_CHUNK_LOG) >> INOTAB_PAGE_LOG < it->npages) {
+		page = it->pages[c >> INOTAB_PAGE_LOG];
+		if (!page) {
+			*cur = ((c >> INOTAB_PAGE_LOG) + 1) <<
+				(INOTAB_PAGE_LOG + INOTAB_CHUNK_LOG);
+			continue;
+		}
+		chunk = page[c & (INOTAB_PAGE - 1)];
+		if (!chunk) {
+			*cur = (c + 1) << INOTAB_CHUNK_LOG;
+			continue;
+		}
+		for (i = *cur & (INOTAB_CHUNK - 1); i < INOTAB_CHUNK; i++) {
+			if (chunk[i].inuse) {
+				*cur = (c << INOTAB_CHUNK_LOG) + i + 1;
+				return &chunk[i];
+			}
+		}
+		*cur = (c + 1) << INOTAB_CHUNK_LOG;
+	}
+	return NULL;
+}
+
 static char *
 prepend_path(
 	char	*oldpath,
@@ -2448,12 +2800,9 @@ process_data_dir_v2(
 				parent = cid ? lino : NULLFSINO;
 			(*dotdot)++;
 		} else if (dep->namelen != 1 || dep->name[0] != '.') {
-			if (cid != NULL) {
-				if (!cid->parent)
-					cid->parent = id;
-				addname_inode(cid, (char *)dep->name,
+			if (cid != NULL)
+				addentry_inode(cid, id, (char *)dep->name,
 					dep->namelen);
-			}
 		} else {
 			if (lino != id->ino) {
 				if (!sflag || v)
@@ -3649,9 +3998,8 @@ process_sf_dir_v2(
 			error++;
 		} else {
 			addlink_inode(cid);
-			if (!cid->parent)
-				cid->parent = id;
-			addname_inode(cid, (char *)sfe->name, sfe->namelen);
+			addentry_inode(cid, id, (char *)sfe->name,
+				sfe->namelen);
 		}
 		if (v)
 			dbprintf(_("dir %lld entry %*.*s offset %d %lld\n"),
@@ -3719,12 +4067,14 @@ quota_add(
 	xfs_qcnt_t	ic,
 	xfs_qcnt_t	rc)
 {
+	agscan_t	*as = cur_agscan;
+
 	if (qudo && usrid != NULL)
-		quota_add1(qudata, *usrid, dq, bc, ic, rc);
+		quota_add1(as ? as->qudata : qudata, *usrid, dq, bc, ic, rc);
 	if (qgdo && grpid != NULL)
-		quota_add1(qgdata, *grpid, dq, bc, ic, rc);
+		quota_add1(as ? as->qgdata : qgdata, *grpid, dq, bc, ic, rc);
 	if (qpdo && prjid != NULL)
-		quota_add1(qpdata, *prjid, dq, bc, ic, rc);
+		quota_add1(as ? as->qpdata : qpdata, *prjid, dq, bc, ic, rc);
 }
 
 static void
@@ -3829,6 +4179,42 @@ quota_init(void)
 		qpdata = xcalloc(QDATA_HASH_SIZE, sizeof(qdata_t *));
 }
 
+/*
+ * Add the quota usage counted in one AG to the totals, and free it.  Each
+ * chain gets reversed first so that the ids are added in the order they
+ * were found, which keeps quota_check's report in the same order as a
+ * serial scan.
+ */
+static void
+quota_merge(
+	qdata_t		**qt,
+	qdata_t		**from)
+{
+	int		i;
+	qdata_t		*next;
+	qdata_t		*prev;
+	qdata_t		*qp;
+
+	if (!from)
+		return;
+	for (i = 0; i < QDATA_HASH_SIZE; i++) {
+		for (prev = NULL, qp = from[i]; qp; qp = next) {
+			next = qp->next;
+			qp->next = prev;
+			prev = qp;
+		}
+		for (qp = prev; qp; qp = next) {
+			next = qp->next;
+			quota_add1(qt, qp->id, 0, qp->count.bc, qp->count.ic,
+				qp->count.rc);
+			quota_add1(qt, qp->id, 1, qp->dq.bc, qp->dq.ic,
+				qp->dq.rc);
+			xfree(qp);
+		}
+	}
+	xfree(from);
+}
+
 static void
 scan_ag(
 	xfs_agnumber_t	agno)
@@ -4022,6 +4408,173 @@ pop1_out:
 	pop_cur();
 }
 
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	agscan_t		*as = &agscans[agno];
+	FILE			*fp;
+	int			abort;
+
+	pthread_mutex_lock(&scan_lock);
+	abort = scan_abort;
+	pthread_mutex_unlock(&scan_lock);
+	if (abort)
+		return;
+
+	if (qudo)
+		as->qudata = xcalloc(QDATA_HASH_SIZE, sizeof(qdata_t *));
+	if (qgdo)
+		as->qgdata = xcalloc(QDATA_HASH_SIZE, sizeof(qdata_t *));
+	if (qpdo)
+		as->qpdata = xcalloc(QDATA_HASH_SIZE, sizeof(qdata_t *));
+	fp = open_memstream(&as->out, &as->outlen);
+	dbprintf_capture(fp);
+	cur_agscan = as;
+	scan_ag(agno);
+	cur_agscan = NULL;
+	dbprintf_capture(NULL);
+	if (fp)
+		fclose(fp);
+	free_cur_stack();
+	free(dirhash);
+	dirhash = NULL;
+
+	/* Hand this thread's counters over to the main thread. */
+	as->error = error;
+	as->serious_error = serious_error;
+	as->sbver_err = sbver_err;
+	as->sbversion = sbversion;
+	as->agf_aggr_freeblks = agf_aggr_freeblks;
+	as->fdblocks = fdblocks;
+	as->frextents = frextents;
+	as->icount = icount;
+	as->ifree = ifree;
+	error = serious_error = sbver_err = 0;
+	sbversion = 0;
+	agf_aggr_freeblks = fdblocks = frextents = icount = ifree = 0;
+
+	if (!check_memory()) {
+		pthread_mutex_lock(&scan_lock);
+		if (!scan_abort || agno < scan_abort_agno) {
+			scan_abort = 1;
+			scan_abort_agno = agno;
+		}
+		pthread_mutex_unlock(&scan_lock);
+	}
+}
+
+/* Scan the AGs one after another. */
+static int
+scan_ags(void)
+{
+	xfs_agnumber_t	agno;
+	int		sbyell;
+
+	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		scan_ag(agno);
+		if (!check_memory()) {
+			dbprintf(_("block usage maps need more than %llu MB "
+				 "after AG %u, giving up\n"),
+				mem_budget >> 20, agno);
+			return 0;
+		}
+		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
+			sbyell = 1;
+			dbprintf(_("WARNING: this may be a newer XFS "
+				 "filesystem.\n"));
+		}
+	}
+	return 1;
+}
+
+/*
+ * Scan the AGs with nr_threads worker threads, then merge what they found
+ * one AG at a time, just as scan_ags would have come across it.  Returns 0
+ * if we gave up part of the way through.
+ */
+static int
+scan_ags_parallel(void)
+{
+	struct workqueue	wq;
+	agscan_t		*as;
+	xfs_agnumber_t		agno;
+	int			sbyell = 0;
+	int			rval = 1;
+	int			err;
+
+	agscans = xcalloc(mp->m_sb.sb_agcount, sizeof(*agscans));
+	scan_abort = 0;
+	/*
+	 * A serial scan picks up lazy counters from the first superblock
+	 * that has them, which is the primary unless it is damaged.  Don't
+	 * make the AGs race for it.
+	 */
+	if (xfs_sb_version_haslazysbcount(&mp->m_sb))
+		lazycount = 1;
+
+	err = workqueue_create(&wq, NULL, nr_threads);
+	if (err) {
+		dbprintf(_("cannot create worker threads: %s\n"),
+			strerror(err));
+		xfree(agscans);
+		agscans = NULL;
+		return 0;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		err = workqueue_add(&wq, scan_ag_worker, agno, NULL);
+		if (err) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+				strerror(err));
+			rval = 0;
+			break;
+		}
+	}
+	workqueue_destroy(&wq);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		as = &agscans[agno];
+		if (rval)
+			dbprintf_replay(as->out, as->outlen);
+		free(as->out);
+		apply_linkfacts(as, rval);
+		if (qudo)
+			quota_merge(qudata, as->qudata);
+		if (qgdo)
+			quota_merge(qgdata, as->qgdata);
+		if (qpdo)
+			quota_merge(qpdata, as->qpdata);
+		error += as->error;
+		serious_error += as->serious_error;
+		sbver_err += as->sbver_err;
+		sbversion |= as->sbversion;
+		agf_aggr_freeblks += as->agf_aggr_freeblks;
+		fdblocks += as->fdblocks;
+		frextents += as->frextents;
+		icount += as->icount;
+		ifree += as->ifree;
+		if (!rval)
+			continue;
+		if (scan_abort && agno == scan_abort_agno) {
+			dbprintf(_("block usage maps need more than %llu MB "
+				 "after AG %u, giving up\n"),
+				mem_budget >> 20, agno);
+			rval = 0;
+			continue;
+		}
+		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
+			sbyell = 1;
+			dbprintf(_("WARNING: this may be a newer XFS "
+				 "filesystem.\n"));
+		}
+	}
+	xfree(agscans);
+	agscans = NULL;
+	return rval;
+}
+
 static void
 scan_freelist(
 	xfs_agf_t	*agf)
@@ -4804,16 +5357,20 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
-	if (!check_inomap(agno, agbno, len, id->ino))
+	pthread_mutex_lock(&aglocks[agno]);
+	if (!check_inomap(agno, agbno, len, id->ino)) {
+		pthread_mutex_unlock(&aglocks[agno]);
 		return;
+	}
+	usemap_set(inomap[agno], agbno, len, (uintptr_t)id);
+	pthread_mutex_unlock(&aglocks[agno]);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
-		if (mayprint &&
-		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
+	if (!mayprint)
+		return;
+	for (i = 0; i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
@@ -4835,17 +5392,20 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
-	if (!check_rinomap(bno, len, id->ino))
+	pthread_mutex_lock(&aglocks[mp->m_sb.sb_agcount]);
+	if (!check_rinomap(bno, len, id->ino)) {
+		pthread_mutex_unlock(&aglocks[mp->m_sb.sb_agcount]);
 		return;
+	}
+	usemap_set(inomap[mp->m_sb.sb_agcount], bno, len, (uintptr_t)id);
+	pthread_mutex_unlock(&aglocks[mp->m_sb.sb_agcount]);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
-		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
+	if (!mayprint)
+		return;
+	for (i = 0; i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLIST(bno + i))
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
@@ -119,6 +119,9 @@ init(
 		exit(1);
 	}
 
+	/* read the segments of discontiguous buffers in parallel */
+	libxfs_aio_init(0);
+
 	/*
 	 * Read the superblock, but don't validate it - we are a diagnostic
 	 * tool and so need to be able to mount busted filesystems.
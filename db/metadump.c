@@ -31,6 +31,10 @@
 #include "faddr.h"
 #include "field.h"
 #include "dir2.h"
+#include "workqueue.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define DEFAULT_MAX_EXT_SIZE	MAXEXTLEN
 
@@ -57,19 +61,24 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-e] [-g] [-m max_extent] [-t threads] [-v version] [-w] [-o] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
 
-static xfs_metablock_t 	*metablock;	/* header + index + buffers */
-static __be64		*block_index;
-static char		*block_buffer;
+/*
+ * Every thread stages its output in its own metablock.  The main thread
+ * writes full metablocks straight to the dump file, while the AG scanning
+ * threads of a parallel dump hand them to the main thread instead.
+ */
+static __thread xfs_metablock_t	*metablock;	/* header + index + buffers */
+static __thread __be64		*block_index;
+static __thread char		*block_buffer;
 
 static int		num_indices;
-static int		cur_index;
+static __thread int	cur_index;
 
-static xfs_ino_t	cur_ino;
+static __thread xfs_ino_t	cur_ino;
 
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
@@ -79,6 +88,57 @@ static int		zero_stale_data = 1;
 static int		show_warnings = 0;
 static int		progress_since_warning = 0;
 static bool		stdout_metadump;
+static int		nr_threads = 1;
+static int		md_version = 1;
+
+/*
+ * Version 2 image state.  Sectors are gathered into extents here and written
+ * out as extent records by the main thread.
+ */
+static char		*ext_buffer;	/* data of the pending extent */
+static char		*enc_buffer;	/* compressed extent data */
+static int64_t		ext_daddr;	/* first sector of the pending extent */
+static int		ext_len;	/* sectors in the pending extent */
+static uint64_t		md_offset;	/* bytes written to the image so far */
+static struct xfs_metadump_index *md_index;
+static uint64_t		md_index_count;
+static uint64_t		md_index_size;
+
+/*
+ * Parallel metadump.
+ *
+ * Worker threads scan one AG at a time and queue the output for each AG as a
+ * list of metablock sized chunks.  The main thread takes the chunks of each
+ * AG in turn and feeds them into the dump file, so the image contains the
+ * same blocks in the same order as a serial dump would.
+ *
+ * Only the AG that the main thread is currently writing out is allowed to
+ * queue an unlimited amount of output; the other workers wait once
+ * MD_MAX_QUEUED chunks are waiting to be written.  Because the workqueue
+ * hands out AGs in order, the AG being written out is always either being
+ * scanned or already finished, so this can't deadlock.
+ */
+struct md_chunk {
+	struct md_chunk		*next;
+	xfs_metablock_t		*block;
+};
+
+struct md_ag {
+	struct md_chunk		*head;
+	struct md_chunk		*tail;
+	bool			done;
+	int			rval;
+};
+
+#define MD_MAX_QUEUED		1024
+
+static struct md_ag		*md_ags;
+static __thread struct md_ag	*md_cur_ag;	/* NULL in the main thread */
+static pthread_mutex_t		md_lock;
+static pthread_cond_t		md_cond;
+static xfs_agnumber_t		md_write_agno;	/* AG being written out */
+static unsigned int		md_queued;	/* chunks waiting to be written */
+static bool			md_abort;
 
 void
 metadump_init(void)
@@ -100,6 +160,8 @@ metadump_help(void)
 "   -g -- Display dump progress\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
+"   -t -- Scan this many AGs in parallel (default = 1)\n"
+"   -v -- Image format version, 1 or 2 (default = 1)\n"
 "   -w -- Show warnings of bad metadata information\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
@@ -144,6 +206,65 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+static void
+set_metablock(
+	xfs_metablock_t		*mb)
+{
+	metablock = mb;
+	block_index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+	block_buffer = (char *)mb + BBSIZE;
+	cur_index = 0;
+}
+
+/*
+ * Queue this worker thread's staged output for the main thread to write, and
+ * start a fresh metablock.
+ */
+static int
+queue_index(void)
+{
+	struct md_ag		*ag = md_cur_ag;
+	struct md_chunk		*chunk;
+	xfs_metablock_t		*mb;
+
+	if (cur_index == 0)
+		return 0;
+
+	chunk = malloc(sizeof(struct md_chunk));
+	mb = calloc(num_indices + 1, BBSIZE);
+	if (!chunk || !mb) {
+		free(chunk);
+		free(mb);
+		print_warning("memory allocation failure");
+		return -ENOMEM;
+	}
+	metablock->mb_count = cpu_to_be16(cur_index);
+	chunk->block = metablock;
+	chunk->next = NULL;
+
+	pthread_mutex_lock(&md_lock);
+	while (!md_abort && md_queued >= MD_MAX_QUEUED &&
+	       ag != &md_ags[md_write_agno])
+		pthread_cond_wait(&md_cond, &md_lock);
+	if (md_abort) {
+		pthread_mutex_unlock(&md_lock);
+		free(chunk);
+		free(mb);
+		return -EIO;
+	}
+	if (ag->tail)
+		ag->tail->next = chunk;
+	else
+		ag->head = chunk;
+	ag->tail = chunk;
+	md_queued++;
+	pthread_cond_broadcast(&md_cond);
+	pthread_mutex_unlock(&md_lock);
+
+	set_metablock(mb);
+	return 0;
+}
+
 /*
  * A complete dump file will have a "zero" entry in the last index block,
  * even if the dump is exactly aligned, the last index will be full of
@@ -156,6 +277,9 @@ print_progress(const char *fmt, ...)
 static int
 write_index(void)
 {
+	if (md_cur_ag)
+		return queue_index();
+
 	/*
 	 * write index block and following data blocks (streaming)
 	 */
@@ -170,6 +294,227 @@ write_index(void)
 	return 0;
 }
 
+/*
+ * Version 2 extent data codecs, in order of preference.  ->encode returns the
+ * size of the encoded data and points @out at it, or returns -1 if it can't
+ * encode this data.  The last codec must accept anything.
+ */
+struct md_codec {
+	uint32_t	id;
+	ssize_t		(*encode)(char *data, size_t len, char **out);
+};
+
+static bool
+sector_is_zero(
+	char		*data)
+{
+	unsigned long	*p = (unsigned long *)data;
+	int		i;
+
+	for (i = 0; i < BBSIZE / sizeof(unsigned long); i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+static ssize_t
+encode_zero(
+	char		*data,
+	size_t		len,
+	char		**out)
+{
+	size_t		i;
+
+	for (i = 0; i < len; i += BBSIZE)
+		if (!sector_is_zero(data + i))
+			return -1;
+	*out = NULL;
+	return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Only worth it if the result is smaller than the data. */
+static ssize_t
+encode_zlib(
+	char		*data,
+	size_t		len,
+	char		**out)
+{
+	uLongf		size = len - 1;
+
+	if (compress2((Bytef *)enc_buffer, &size, (Bytef *)data, len,
+			Z_BEST_SPEED) != Z_OK)
+		return -1;
+	*out = enc_buffer;
+	return size;
+}
+#endif
+
+static ssize_t
+encode_none(
+	char		*data,
+	size_t		len,
+	char		**out)
+{
+	*out = data;
+	return len;
+}
+
+static const struct md_codec md_codecs[] = {
+	{ XFS_MDX_CODEC_ZERO,	encode_zero },
+#ifdef HAVE_ZLIB
+	{ XFS_MDX_CODEC_ZLIB,	encode_zlib },
+#endif
+	{ XFS_MDX_CODEC_NONE,	encode_none },
+};
+
+static int
+md_write(
+	void		*buf,
+	size_t		len)
+{
+	if (len && fwrite(buf, len, 1, outf) != 1) {
+		print_warning("error writing to file: %s", strerror(errno));
+		return -EIO;
+	}
+	md_offset += len;
+	return 0;
+}
+
+static int
+write_v2_header(void)
+{
+	struct xfs_metadump_header	xmh = {
+		.xmh_magic	= cpu_to_be32(XFS_MD_MAGIC_V2),
+		.xmh_version	= cpu_to_be32(XFS_MD_VERSION_2),
+		.xmh_info	= cpu_to_be32(metablock->mb_info),
+	};
+
+	return md_write(&xmh, sizeof(xmh));
+}
+
+/* Encode @len sectors at @daddr and write them out as one extent record. */
+static int
+write_extent_record(
+	int64_t				daddr,
+	int				len,
+	char				*data)
+{
+	struct xfs_metadump_extent	xme = { 0 };
+	struct xfs_metadump_index	*xmi;
+	const struct md_codec		*codec;
+	char				*out;
+	ssize_t				size;
+	int				ret;
+
+	for (codec = md_codecs; ; codec++) {
+		size = codec->encode(data, BBTOB(len), &out);
+		if (size >= 0)
+			break;
+	}
+
+	if (md_index_count == md_index_size) {
+		md_index_size = md_index_size ? md_index_size * 2 : 1024;
+		xmi = realloc(md_index, md_index_size * sizeof(*md_index));
+		if (!xmi) {
+			print_warning("memory allocation failure");
+			return -ENOMEM;
+		}
+		md_index = xmi;
+	}
+	xmi = &md_index[md_index_count++];
+	xmi->xmi_daddr = cpu_to_be64(daddr);
+	xmi->xmi_offset = cpu_to_be64(md_offset);
+	xmi->xmi_len = cpu_to_be32(len);
+	xmi->xmi_pad = 0;
+
+	xme.xme_daddr = cpu_to_be64(daddr);
+	xme.xme_len = cpu_to_be32(len);
+	xme.xme_size = cpu_to_be32(size);
+	xme.xme_codec = cpu_to_be32(codec->id);
+	ret = md_write(&xme, sizeof(xme));
+	if (ret)
+		return ret;
+	return md_write(out, size);
+}
+
+/*
+ * Write out the pending extent, splitting it wherever it switches between
+ * zeroed and non-zero sectors so that the zeroed runs take no space.
+ */
+static int
+flush_extent(void)
+{
+	int		start = 0;
+	int		i;
+	bool		zero;
+	int		ret;
+
+	while (start < ext_len) {
+		zero = sector_is_zero(ext_buffer + BBTOB(start));
+		for (i = start + 1; i < ext_len; i++)
+			if (sector_is_zero(ext_buffer + BBTOB(i)) != zero)
+				break;
+		ret = write_extent_record(ext_daddr + start, i - start,
+				ext_buffer + BBTOB(start));
+		if (ret)
+			return ret;
+		start = i;
+	}
+	ext_len = 0;
+	return 0;
+}
+
+static int
+write_extent_data(
+	char		*data,
+	int64_t		off,
+	int		len)
+{
+	int		ret;
+
+	for (; len > 0; len--, off++, data += BBSIZE) {
+		if (ext_len && (off != ext_daddr + ext_len ||
+				ext_len == XFS_MDX_MAX_LEN)) {
+			ret = flush_extent();
+			if (ret)
+				return ret;
+		}
+		if (!ext_len)
+			ext_daddr = off;
+		memcpy(ext_buffer + BBTOB(ext_len), data, BBSIZE);
+		ext_len++;
+	}
+	return 0;
+}
+
+/* Terminate the record stream and write the index and trailer. */
+static int
+finish_v2_dump(void)
+{
+	struct xfs_metadump_extent	xme = { 0 };
+	struct xfs_metadump_trailer	xmt = { 0 };
+	uint64_t			index_offset;
+	int				ret;
+
+	ret = flush_extent();
+	if (ret)
+		return ret;
+	ret = md_write(&xme, sizeof(xme));
+	if (ret)
+		return ret;
+
+	index_offset = md_offset;
+	ret = md_write(md_index, md_index_count * sizeof(*md_index));
+	if (ret)
+		return ret;
+
+	xmt.xmt_magic = cpu_to_be32(XFS_MD_MAGIC_V2);
+	xmt.xmt_index_offset = cpu_to_be64(index_offset);
+	xmt.xmt_index_count = cpu_to_be64(md_index_count);
+	return md_write(&xmt, sizeof(xmt));
+}
+
 /*
  * Return 0 for success, -errno for failure.
  */
@@ -182,6 +527,9 @@ write_buf_segment(
 	int		i;
 	int		ret;
 
+	if (md_version == 2 && !md_cur_ag)
+		return write_extent_data(data, off, len);
+
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
 		block_index[cur_index] = cpu_to_be64(off);
 		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
@@ -699,7 +1047,7 @@ struct name_ent {
 
 #define NAME_TABLE_SIZE		4096
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+static __thread struct name_ent	*nametable[NAME_TABLE_SIZE];
 
 static void
 nametable_clear(void)
@@ -1627,7 +1975,7 @@ process_symlink_block(
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1871,8 +2219,8 @@ out_pop:
 /*
  * Static map to aggregate multiple extents into a single directory block.
  */
-static struct bbmap mfsb_map;
-static int mfsb_length;
+static __thread struct bbmap mfsb_map;
+static __thread int mfsb_length;
 
 static int
 process_multi_fsb_objects(
@@ -2404,7 +2752,8 @@ copy_inode_chunk(
 			    XFS_INOBT_IS_FREE_DISK(rp, ioff + i)))
 				goto pop_out;
 
-			inodes_copied++;
+			__atomic_add_fetch(&inodes_copied, 1,
+					__ATOMIC_RELAXED);
 		}
 
 		if (write_buf(iocur_top))
@@ -2650,6 +2999,164 @@ pop_out:
 	return rval;
 }
 
+static void
+scan_ag_worker(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct md_ag		*ag = &md_ags[agno];
+	xfs_metablock_t		*mb;
+	bool			abort;
+	int			rval = 0;
+
+	pthread_mutex_lock(&md_lock);
+	abort = md_abort;
+	pthread_mutex_unlock(&md_lock);
+
+	mb = calloc(num_indices + 1, BBSIZE);
+	if (!mb)
+		print_warning("memory allocation failure");
+	if (mb && !abort) {
+		set_metablock(mb);
+		md_cur_ag = ag;
+		rval = scan_ag(agno);
+		if (rval)
+			rval = write_index() == 0;
+		md_cur_ag = NULL;
+		mb = metablock;
+		metablock = NULL;
+	}
+	free(mb);
+	free_cur_stack();
+
+	pthread_mutex_lock(&md_lock);
+	ag->rval = rval;
+	ag->done = true;
+	pthread_cond_broadcast(&md_cond);
+	pthread_mutex_unlock(&md_lock);
+}
+
+/* Feed a chunk queued by a worker thread into the dump file. */
+static int
+write_chunk(
+	xfs_metablock_t		*mb)
+{
+	__be64			*index;
+	char			*data;
+	int			count;
+	int			i;
+	int			ret;
+
+	index = (__be64 *)((char *)mb + sizeof(xfs_metablock_t));
+	data = (char *)mb + BBSIZE;
+	count = be16_to_cpu(mb->mb_count);
+	for (i = 0; i < count; i++, data += BBSIZE) {
+		ret = write_buf_segment(data, be64_to_cpu(index[i]), 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Scan all the AGs with nr_threads worker threads, writing their output to
+ * the dump file in AG order.
+ */
+static int
+scan_ags_parallel(void)
+{
+	struct workqueue	wq;
+	struct md_chunk		*chunk;
+	struct md_ag		*ag;
+	xfs_agnumber_t		agno;
+	int			rval = 1;
+	int			error;
+
+	md_ags = calloc(mp->m_sb.sb_agcount, sizeof(struct md_ag));
+	if (!md_ags) {
+		print_warning("memory allocation failure");
+		return 0;
+	}
+	pthread_mutex_init(&md_lock, NULL);
+	pthread_cond_init(&md_cond, NULL);
+	md_write_agno = 0;
+	md_queued = 0;
+	md_abort = false;
+
+	error = workqueue_create(&wq, NULL, nr_threads);
+	if (error) {
+		print_warning("cannot create worker threads: %s",
+				strerror(error));
+		rval = 0;
+		goto out_free;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		error = workqueue_add(&wq, scan_ag_worker, agno, NULL);
+		if (error) {
+			print_warning("cannot queue AG %u: %s", agno,
+					strerror(error));
+			/* let the queued AGs finish so we can wait for them */
+			for (; agno < mp->m_sb.sb_agcount; agno++)
+				md_ags[agno].done = true;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&md_lock);
+	for (agno = 0; agno < mp->m_sb.sb_agcount && rval; agno++) {
+		ag = &md_ags[agno];
+		md_write_agno = agno;
+		pthread_cond_broadcast(&md_cond);
+		for (;;) {
+			while (!ag->head && !ag->done)
+				pthread_cond_wait(&md_cond, &md_lock);
+			chunk = ag->head;
+			if (!chunk)
+				break;
+			ag->head = chunk->next;
+			if (!ag->head)
+				ag->tail = NULL;
+			md_queued--;
+			pthread_cond_broadcast(&md_cond);
+			pthread_mutex_unlock(&md_lock);
+
+			error = write_chunk(chunk->block);
+			free(chunk->block);
+			free(chunk);
+
+			pthread_mutex_lock(&md_lock);
+			if (error) {
+				rval = 0;
+				break;
+			}
+		}
+		if (!ag->rval)
+			rval = 0;
+	}
+
+	/* tell the workers to give up if we're not going to write anything */
+	md_abort = true;
+	pthread_cond_broadcast(&md_cond);
+	pthread_mutex_unlock(&md_lock);
+
+	workqueue_destroy(&wq);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		while ((chunk = md_ags[agno].head)) {
+			md_ags[agno].head = chunk->next;
+			free(chunk->block);
+			free(chunk);
+		}
+	}
+out_free:
+	pthread_cond_destroy(&md_cond);
+	pthread_mutex_destroy(&md_lock);
+	free(md_ags);
+	md_ags = NULL;
+	return rval;
+}
+
 static int
 copy_ino(
 	xfs_ino_t		ino,
@@ -2794,6 +3301,8 @@ metadump_f(
 	show_progress = 0;
 	show_warnings = 0;
 	stop_on_read_error = 0;
+	nr_threads = 1;
+	md_version = 1;
 
 	if (mp->m_sb.sb_magicnum != XFS_SB_MAGIC) {
 		print_warning("bad superblock magic number %x, giving up",
@@ -2811,7 +3320,7 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	while ((c = getopt(argc, argv, "aegm:ot:v:w")) != EOF) {
 		switch (c) {
 			case 'a':
 				zero_stale_data = 0;
@@ -2833,6 +3342,23 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 't':
+				nr_threads = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || nr_threads <= 0) {
+					print_warning("bad thread count %s",
+							optarg);
+					return 0;
+				}
+				break;
+			case 'v':
+				md_version = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' ||
+				    (md_version != 1 && md_version != 2)) {
+					print_warning("bad metadump version %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
@@ -2877,8 +3403,7 @@ metadump_f(
 		pop_cur();
 	}
 
-	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
-	block_buffer = (char *)metablock + BBSIZE;
+	set_metablock(metablock);
 	num_indices = (BBSIZE - sizeof(xfs_metablock_t)) / sizeof(__be64);
 
 	/*
@@ -2893,7 +3418,25 @@ metadump_f(
 		return 0;
 	}
 
-	cur_index = 0;
+	if (md_version == 2) {
+		ext_buffer = malloc(BBTOB(XFS_MDX_MAX_LEN));
+		enc_buffer = malloc(BBTOB(XFS_MDX_MAX_LEN));
+		if (!ext_buffer || !enc_buffer) {
+			print_warning("memory allocation failure");
+			free(ext_buffer);
+			ext_buffer = NULL;
+			free(enc_buffer);
+			enc_buffer = NULL;
+			free(metablock);
+			return 0;
+		}
+		ext_len = 0;
+		md_offset = 0;
+		md_index = NULL;
+		md_index_count = 0;
+		md_index_size = 0;
+	}
+
 	start_iocur_sp = iocur_sp;
 
 	if (strcmp(argv[optind], "-") == 0) {
@@ -2941,10 +3484,16 @@ metadump_f(
 
 	exitcode = 0;
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
+	if (md_version == 2 && write_v2_header() < 0)
+		exitcode = 1;
+	else if (nr_threads > 1 && mp->m_sb.sb_agcount > 1) {
+		exitcode = !scan_ags_parallel();
+	} else {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno)) {
+				exitcode = 1;
+				break;
+			}
 		}
 	}
 
@@ -2957,8 +3506,12 @@ metadump_f(
 		exitcode = !copy_log();
 
 	/* write the remaining index */
-	if (!exitcode)
-		exitcode = write_index() < 0;
+	if (!exitcode) {
+		if (md_version == 2)
+			exitcode = finish_v2_dump() < 0;
+		else
+			exitcode = write_index() < 0;
+	}
 
 	if (progress_since_warning)
 		fputc('\n', stdout_metadump ? stderr : stdout);
@@ -2978,6 +3531,12 @@ metadump_f(
 		pop_cur();
 out:
 	free(metablock);
+	free(ext_buffer);
+	ext_buffer = NULL;
+	free(enc_buffer);
+	enc_buffer = NULL;
+	free(md_index);
+	md_index = NULL;
 
 	return 0;
 }
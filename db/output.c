@@ -33,6 +33,7 @@ static const cmdinfo_t	log_cmd =
 int		dbprefix;
 static FILE	*log_file;
 static char	*log_file_name;
+static __thread FILE	*capture_file;
 
 int
 dbprintf(const char *fmt, ...)
@@ -43,6 +44,14 @@ dbprintf(const char *fmt, ...)
 	if (seenint())
 		return 0;
 	va_start(ap, fmt);
+	if (capture_file) {
+		i = 0;
+		if (dbprefix)
+			i += fprintf(capture_file, "%s: ", fsdevice);
+		i += vfprintf(capture_file, fmt, ap);
+		va_end(ap);
+		return i;
+	}
 	blockint();
 	i = 0;
 	if (dbprefix)
@@ -58,6 +67,33 @@ dbprintf(const char *fmt, ...)
 	return i;
 }
 
+/*
+ * Send this thread's dbprintf output to fp instead of stdout, or back to
+ * stdout if fp is NULL.  Worker threads use this to keep their messages
+ * apart so that they can be printed in a sensible order afterwards.
+ */
+void
+dbprintf_capture(
+	FILE		*fp)
+{
+	capture_file = fp;
+}
+
+/* Print output captured by dbprintf_capture. */
+void
+dbprintf_replay(
+	const char	*buf,
+	size_t		len)
+{
+	if (seenint() || !len)
+		return;
+	blockint();
+	fwrite(buf, 1, len, stdout);
+	unblockint();
+	if (log_file)
+		fwrite(buf, 1, len, log_file);
+}
+
 static int
 log_f(
 	int		argc,
@@ -19,5 +19,7 @@
 extern int	dbprefix;
 
 extern int	dbprintf(const char *, ...);
+extern void	dbprintf_capture(FILE *fp);
+extern void	dbprintf_replay(const char *buf, size_t len);
 extern void	logprintf(const char *, ...);
 extern void	output_init(void);
@@ -0,0 +1,411 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "libxfs.h"
+#include "malloc.h"
+#include "usemap.h"
+
+/*
+ * A usemap splits the block number space into windows of UM_WINDOW
+ * blocks.  Each window is kept in whichever of three forms suits it:
+ *
+ *  - uniform: every block has the same value and nothing is allocated.
+ *    Most of a filesystem looks like this: big free extents, big files,
+ *    and (for the owner maps) everything that isn't file data.
+ *
+ *  - runs: a sorted array of (start, value) pairs, each run lasting until
+ *    the next one starts.  Neighbouring runs never have the same value.
+ *
+ *  - dense: a value for every block.  State maps pack five bits per block,
+ *    twelve blocks to a 64-bit word, because there are more than sixteen
+ *    DBM_* states.  Owner maps keep a whole 64-bit value per block.
+ *
+ * A window starts out uniform, turns into runs on the first partial update
+ * and goes dense once it has more runs than are worth searching, which for
+ * state maps is about when the runs would take more space than the dense
+ * form.  Setting a whole window makes it uniform again.
+ */
+#define UM_WINDOW_LOG		14
+#define UM_WINDOW		(1U << UM_WINDOW_LOG)
+#define UM_MAX_RUNS		1024
+
+#define UM_STATE_BITS		5
+#define UM_STATE_MASK		((1ULL << UM_STATE_BITS) - 1)
+#define UM_STATE_PER_WORD	(64 / UM_STATE_BITS)
+#define UM_STATE_WORDS		\
+	((UM_WINDOW + UM_STATE_PER_WORD - 1) / UM_STATE_PER_WORD)
+
+enum um_form {
+	UM_UNIFORM,
+	UM_RUNS,
+	UM_DENSE,
+};
+
+struct um_run {
+	uint64_t		value;
+	uint32_t		start;		/* block offset in window */
+};
+
+struct um_window {
+	void			*data;		/* runs or dense values */
+	uint64_t		value;		/* if uniform */
+	uint16_t		nruns;
+	uint16_t		maxruns;	/* allocated */
+	uint8_t			form;
+};
+
+struct usemap {
+	struct um_window	*windows;
+	struct um_run		*scratch;	/* for rewriting runs */
+	uint64_t		nblocks;
+	uint64_t		nwindows;
+	uint64_t		bytes;		/* windows + data */
+	enum usemap_kind	kind;
+	unsigned int		max_runs;	/* before going dense */
+};
+
+static size_t
+um_dense_bytes(
+	struct usemap		*map)
+{
+	if (map->kind == USEMAP_STATE)
+		return UM_STATE_WORDS * sizeof(uint64_t);
+	return UM_WINDOW * sizeof(uint64_t);
+}
+
+struct usemap *
+usemap_alloc(
+	uint64_t		nblocks,
+	enum usemap_kind	kind)
+{
+	struct usemap		*map;
+
+	map = xcalloc(1, sizeof(*map));
+	map->nblocks = nblocks;
+	map->kind = kind;
+	map->nwindows = (nblocks + UM_WINDOW - 1) >> UM_WINDOW_LOG;
+	map->windows = xcalloc(map->nwindows, sizeof(struct um_window));
+	map->max_runs = MIN(um_dense_bytes(map) / sizeof(struct um_run),
+			    UM_MAX_RUNS);
+	map->scratch = xmalloc((map->max_runs + 3) * sizeof(struct um_run));
+	map->bytes = sizeof(*map) + map->nwindows * sizeof(struct um_window) +
+		     (map->max_runs + 3) * sizeof(struct um_run);
+	return map;
+}
+
+static void
+um_window_release(
+	struct usemap		*map,
+	struct um_window	*w)
+{
+	if (w->form == UM_RUNS)
+		map->bytes -= w->maxruns * sizeof(struct um_run);
+	else if (w->form == UM_DENSE)
+		map->bytes -= um_dense_bytes(map);
+	xfree(w->data);
+	w->data = NULL;
+	w->nruns = w->maxruns = 0;
+}
+
+void
+usemap_free(
+	struct usemap		*map)
+{
+	uint64_t		i;
+
+	if (!map)
+		return;
+	for (i = 0; i < map->nwindows; i++)
+		xfree(map->windows[i].data);
+	xfree(map->windows);
+	xfree(map->scratch);
+	xfree(map);
+}
+
+/* How much memory does this map use? */
+uint64_t
+usemap_bytes(
+	struct usemap		*map)
+{
+	return map->bytes;
+}
+
+/* Number of blocks in window w. */
+static uint32_t
+um_window_size(
+	struct usemap		*map,
+	uint64_t		w)
+{
+	return MIN(map->nblocks - (w << UM_WINDOW_LOG), (uint64_t)UM_WINDOW);
+}
+
+static uint64_t
+um_dense_get(
+	struct usemap		*map,
+	struct um_window	*w,
+	uint32_t		off)
+{
+	uint64_t		*words = w->data;
+
+	if (map->kind == USEMAP_OWNER)
+		return words[off];
+	return (words[off / UM_STATE_PER_WORD] >>
+		((off % UM_STATE_PER_WORD) * UM_STATE_BITS)) & UM_STATE_MASK;
+}
+
+static void
+um_dense_set(
+	struct usemap		*map,
+	struct um_window	*w,
+	uint32_t		off,
+	uint32_t		len,
+	uint64_t		value)
+{
+	uint64_t		*words = w->data;
+	uint64_t		*word;
+	unsigned int		shift;
+
+	if (map->kind == USEMAP_OWNER) {
+		for (; len > 0; len--, off++)
+			words[off] = value;
+		return;
+	}
+	for (; len > 0; len--, off++) {
+		word = &words[off / UM_STATE_PER_WORD];
+		shift = (off % UM_STATE_PER_WORD) * UM_STATE_BITS;
+		*word = (*word & ~(UM_STATE_MASK << shift)) | (value << shift);
+	}
+}
+
+/* Find the run containing off. */
+static unsigned int
+um_find_run(
+	struct um_window	*w,
+	uint32_t		off)
+{
+	struct um_run		*runs = w->data;
+	unsigned int		lo = 0;
+	unsigned int		hi = w->nruns - 1;
+	unsigned int		mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (runs[mid].start <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * Return the value of block bno, and in len (if not NULL) the number of
+ * blocks starting at bno, at most maxlen, that are known to have the same
+ * value.  That can be less than the whole stretch of blocks with that value.
+ * Dense windows have to be scanned to find that out, so callers that only
+ * want one block should pass a NULL len.
+ */
+uint64_t
+usemap_get(
+	struct usemap		*map,
+	uint64_t		bno,
+	uint64_t		maxlen,
+	uint64_t		*len)
+{
+	struct um_window	*w;
+	struct um_run		*runs;
+	uint64_t		wno = bno >> UM_WINDOW_LOG;
+	uint64_t		value;
+	uint32_t		off = bno & (UM_WINDOW - 1);
+	uint32_t		wsize = um_window_size(map, wno);
+	uint32_t		end;
+	unsigned int		i;
+
+	w = &map->windows[wno];
+	switch (w->form) {
+	case UM_RUNS:
+		runs = w->data;
+		i = um_find_run(w, off);
+		value = runs[i].value;
+		end = i + 1 < w->nruns ? runs[i + 1].start : wsize;
+		break;
+	case UM_DENSE:
+		value = um_dense_get(map, w, off);
+		if (!len)
+			return value;
+		if (maxlen < wsize - off)
+			wsize = off + maxlen;
+		for (end = off + 1;
+		     end < wsize && um_dense_get(map, w, end) == value;
+		     end++)
+			;
+		break;
+	default:
+		value = w->value;
+		end = wsize;
+		break;
+	}
+	if (len)
+		*len = MIN(end - off, maxlen);
+	return value;
+}
+
+/* Convert a window from runs to dense values. */
+static void
+um_make_dense(
+	struct usemap		*map,
+	struct um_window	*w)
+{
+	struct um_run		*runs = w->data;
+	void			*data;
+	uint32_t		wsize = UM_WINDOW;
+	uint32_t		end;
+	unsigned int		i;
+
+	data = xcalloc(1, um_dense_bytes(map));
+	map->bytes += um_dense_bytes(map);
+	w->data = data;
+	w->form = UM_DENSE;
+	for (i = 0; i < w->nruns; i++) {
+		end = i + 1 < w->nruns ? runs[i + 1].start : wsize;
+		um_dense_set(map, w, runs[i].start, end - runs[i].start,
+				runs[i].value);
+	}
+	map->bytes -= w->maxruns * sizeof(struct um_run);
+	xfree(runs);
+	w->nruns = w->maxruns = 0;
+}
+
+/* Append a run to the scratch array, merging it with the last one. */
+static void
+um_emit(
+	struct um_run		*runs,
+	unsigned int		*nr,
+	uint32_t		start,
+	uint64_t		value)
+{
+	if (*nr > 0 && runs[*nr - 1].value == value)
+		return;
+	runs[*nr].start = start;
+	runs[*nr].value = value;
+	(*nr)++;
+}
+
+static void
+um_window_set(
+	struct usemap		*map,
+	struct um_window	*w,
+	uint32_t		wsize,
+	uint32_t		off,
+	uint32_t		len,
+	uint64_t		value)
+{
+	struct um_run		*runs;
+	struct um_run		*new = map->scratch;
+	uint32_t		end = off + len;
+	uint32_t		rend;
+	unsigned int		nr = 0;
+	unsigned int		i;
+	bool			added = false;
+
+	/* Covering the whole window makes it uniform. */
+	if (off == 0 && len == wsize) {
+		um_window_release(map, w);
+		w->form = UM_UNIFORM;
+		w->value = value;
+		return;
+	}
+
+	if (w->form == UM_UNIFORM) {
+		if (w->value == value)
+			return;
+		/* Turn this into a single run and fall through. */
+		w->data = xmalloc(4 * sizeof(struct um_run));
+		map->bytes += 4 * sizeof(struct um_run);
+		w->maxruns = 4;
+		w->nruns = 1;
+		runs = w->data;
+		runs[0].start = 0;
+		runs[0].value = w->value;
+		w->form = UM_RUNS;
+	}
+
+	if (w->form == UM_DENSE) {
+		um_dense_set(map, w, off, len, value);
+		return;
+	}
+
+	/* Splice [off, end) into the runs. */
+	runs = w->data;
+	for (i = 0; i < w->nruns; i++) {
+		rend = i + 1 < w->nruns ? runs[i + 1].start : wsize;
+		if (runs[i].start < off)
+			um_emit(new, &nr, runs[i].start, runs[i].value);
+		if (!added && rend > off) {
+			um_emit(new, &nr, off, value);
+			added = true;
+		}
+		if (runs[i].start < end && rend > end)
+			um_emit(new, &nr, end, runs[i].value);
+		else if (runs[i].start >= end)
+			um_emit(new, &nr, runs[i].start, runs[i].value);
+	}
+
+	if (nr == 1) {
+		um_window_release(map, w);
+		w->form = UM_UNIFORM;
+		w->value = new[0].value;
+		return;
+	}
+
+	if (nr > map->max_runs) {
+		um_make_dense(map, w);
+		um_dense_set(map, w, off, len, value);
+		return;
+	}
+
+	if (nr > w->maxruns) {
+		map->bytes -= w->maxruns * sizeof(struct um_run);
+		w->maxruns = MIN(MAX(nr, w->maxruns * 2), map->max_runs);
+		w->data = xrealloc(w->data, w->maxruns * sizeof(struct um_run));
+		map->bytes += w->maxruns * sizeof(struct um_run);
+	}
+	memcpy(w->data, new, nr * sizeof(struct um_run));
+	w->nruns = nr;
+}
+
+/* Set blocks [bno, bno + len) to value. */
+void
+usemap_set(
+	struct usemap		*map,
+	uint64_t		bno,
+	uint64_t		len,
+	uint64_t		value)
+{
+	uint64_t		wno;
+	uint32_t		off;
+	uint32_t		wsize;
+	uint32_t		n;
+
+	while (len > 0) {
+		wno = bno >> UM_WINDOW_LOG;
+		off = bno & (UM_WINDOW - 1);
+		wsize = um_window_size(map, wno);
+		n = MIN(len, (uint64_t)(wsize - off));
+		um_window_set(map, &map->windows[wno], wsize, off, n, value);
+		bno += n;
+		len -= n;
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Compact maps from block numbers to a value, used by the check command
+ * to remember what each block is used for and which inode owns it.
+ */
+struct usemap;
+
+enum usemap_kind {
+	USEMAP_STATE,		/* values below 32 */
+	USEMAP_OWNER,		/* any 64-bit value, mostly zero */
+};
+
+extern struct usemap	*usemap_alloc(uint64_t nblocks, enum usemap_kind kind);
+extern void		usemap_free(struct usemap *map);
+extern uint64_t		usemap_get(struct usemap *map, uint64_t bno,
+				   uint64_t maxlen, uint64_t *len);
+extern void		usemap_set(struct usemap *map, uint64_t bno,
+				   uint64_t len, uint64_t value);
+extern uint64_t		usemap_bytes(struct usemap *map);
@@ -5,9 +5,9 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-t threads] [-v version] [-l logdev] source target"
 
-while getopts "aefgl:m:owFV" c
+while getopts "aefgl:m:ot:v:wFV" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
@@ -15,6 +15,8 @@ do
 	g)	OPTS=$OPTS"-g ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	t)	OPTS=$OPTS"-t "$OPTARG" ";;
+	v)	OPTS=$OPTS"-v "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
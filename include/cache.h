@@ -28,6 +28,19 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Heavily multithreaded users (xfs_repair) can ask for each MRU priority list
+ * to be split into one shard per CPU so that threads releasing and recycling
+ * nodes don't all serialise on the same MRU lock.  Referenced nodes are then
+ * also looked up and released without taking the node mutex, and lookups that
+ * hit a referenced node don't take the hash chain mutex either.  That walks
+ * hash chains that may be changing underneath us, so the relse method of such
+ * a cache must not give node memory back to the system while the cache is in
+ * use; libxfs buffers go onto a free list for reuse, which is fine.
+ */
+#define CACHE_SCALABLE		(1 << 1)
+#define CACHE_MAX_MRU_SHARDS	64
+
 /*
  * cache object campare return values
  */
@@ -89,6 +102,7 @@ struct cache_operations {
 struct cache_hash {
 	struct list_head	ch_list;	/* hash chain head */
 	unsigned int		ch_count;	/* hash chain length */
+	unsigned int		ch_seq;		/* odd while chain changes */
 	pthread_mutex_t		ch_mutex;	/* hash chain mutex */
 };
 
@@ -122,10 +136,17 @@ struct cache {
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
+	unsigned int		c_mru_shards;	/* MRU shards per priority */
+	unsigned int		c_shake_shard;	/* next MRU shard to shake */
+	struct cache_mru	*c_mrus[CACHE_DIRTY_PRIORITY + 1];
 	unsigned long long	c_misses;	/* cache misses */
 	unsigned long long	c_hits;		/* cache hits */
+	unsigned long long	c_lockless_hits; /* hits without hash lock */
 	unsigned int 		c_max;		/* max nodes ever used */
+	unsigned long long	c_hash_waits;	/* contended hash locks */
+	unsigned long long	c_mru_waits;	/* contended MRU locks */
+	unsigned long long	c_node_waits;	/* contended node locks */
+	unsigned long long	c_count_waits;	/* contended count locks */
 };
 
 struct cache *cache_init(int, unsigned int, struct cache_operations *);
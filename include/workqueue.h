@@ -29,27 +29,68 @@ typedef void workqueue_func_t(struct workqueue *wq, uint32_t index, void *arg);
 struct workqueue_item {
 	struct workqueue	*queue;
 	struct workqueue_item	*next;
+	struct workqueue_item	*prev;
 	workqueue_func_t	*function;
 	void			*arg;
+	uint64_t		cost;
+	uint64_t		queued_ns;
 	uint32_t		index;
 };
 
+/*
+ * In stealing mode each worker owns a deque.  The owner runs items from
+ * the back, thieves take them from the front.
+ */
+struct workqueue_deque {
+	struct workqueue	*queue;
+	pthread_mutex_t		lock;
+	struct workqueue_item	*front;
+	struct workqueue_item	*back;
+	uint64_t		cost;		/* sum of queued item costs */
+};
+
+struct workqueue_stats {
+	uint64_t		items;		/* work items run */
+	uint64_t		steals;		/* items run by a thief */
+	uint64_t		continuations;	/* items queued by workers */
+	uint64_t		wait_ns;	/* total time items sat queued */
+	uint64_t		max_wait_ns;	/* longest time an item sat queued */
+	uint64_t		idle_ns;	/* total time workers had no work */
+};
+
+/* workqueue_create_flags */
+#define WQ_STEAL	(1U << 0)	/* per-worker deques, work stealing */
+
 struct workqueue {
 	void			*wq_ctx;
 	pthread_t		*threads;
 	struct workqueue_item	*next_item;
 	struct workqueue_item	*last_item;
+	struct workqueue_deque	*deques;
 	pthread_mutex_t		lock;
 	pthread_cond_t		wakeup;
+	struct workqueue_stats	stats;
 	unsigned int		item_count;
 	unsigned int		thread_count;
+	unsigned int		flags;
+	unsigned int		nr_running;
+	unsigned int		nr_idle;
+	unsigned int		next_deque;
 	bool			terminate;
+	bool			terminated;
 };
 
 int workqueue_create(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers);
+int workqueue_create_flags(struct workqueue *wq, void *wq_ctx,
+		unsigned int nr_workers, unsigned int flags);
 int workqueue_add(struct workqueue *wq, workqueue_func_t fn,
 		uint32_t index, void *arg);
+int workqueue_add_cost(struct workqueue *wq, workqueue_func_t fn,
+		uint32_t index, void *arg, uint64_t cost);
+bool workqueue_should_split(struct workqueue *wq);
+void workqueue_terminate(struct workqueue *wq);
+void workqueue_get_stats(struct workqueue *wq, struct workqueue_stats *stats);
 void workqueue_destroy(struct workqueue *wq);
 
 #endif	/* _WORKQUEUE_H_ */
@@ -35,4 +35,53 @@ typedef struct xfs_metablock {
 #define XFS_METADUMP_FULLBLOCKS	(1 << 2)
 #define XFS_METADUMP_DIRTYLOG	(1 << 3)
 
+/*
+ * Version 2 metadump images start with a header, followed by a stream of
+ * extent records.  Each record covers a run of contiguous 512 byte sectors
+ * and carries that data encoded by one of the codecs below.  A record with a
+ * zero length ends the stream.  It is followed by an index with one entry per
+ * record, and then a trailer that locates the index.  Readers can therefore
+ * either stream the image from the start or seek straight to any record.
+ * All fields are big endian.
+ */
+#define XFS_MD_MAGIC_V2		0x584d4432	/* 'XMD2' */
+#define XFS_MD_VERSION_2	2
+
+struct xfs_metadump_header {
+	__be32		xmh_magic;	/* XFS_MD_MAGIC_V2 */
+	__be32		xmh_version;	/* XFS_MD_VERSION_2 */
+	__be32		xmh_info;	/* XFS_METADUMP_* flags */
+	__be32		xmh_pad;
+};
+
+struct xfs_metadump_extent {
+	__be64		xme_daddr;	/* first sector */
+	__be32		xme_len;	/* sectors, at most XFS_MDX_MAX_LEN */
+	__be32		xme_size;	/* bytes of encoded data that follow */
+	__be32		xme_codec;	/* XFS_MDX_CODEC_* */
+	__be32		xme_pad;
+};
+
+#define XFS_MDX_MAX_LEN		2048
+
+/* Codecs for extent data */
+#define XFS_MDX_CODEC_NONE	0	/* raw sector data */
+#define XFS_MDX_CODEC_ZERO	1	/* all zeroes, nothing stored */
+#define XFS_MDX_CODEC_ZLIB	2	/* zlib stream, smaller than the data */
+
+struct xfs_metadump_index {
+	__be64		xmi_daddr;	/* first sector of the record */
+	__be64		xmi_offset;	/* file offset of the record header */
+	__be32		xmi_len;	/* sectors */
+	__be32		xmi_pad;
+};
+
+/* The last bytes of a v2 image */
+struct xfs_metadump_trailer {
+	__be32		xmt_magic;	/* XFS_MD_MAGIC_V2 */
+	__be32		xmt_pad;
+	__be64		xmt_index_offset; /* file offset of the index */
+	__be64		xmt_index_count;  /* number of index entries */
+};
+
 #endif /* _XFS_METADUMP_H_ */
@@ -0,0 +1,652 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "platform_defs.h"
+#include "command.h"
+#include "init.h"
+#include "io.h"
+#include <sys/syscall.h>
+#ifdef HAVE_IO_URING
+# include <sys/mman.h>
+# include <linux/io_uring.h>
+#endif
+#ifdef HAVE_LINUX_AIO
+# include <linux/aio_abi.h>
+#endif
+
+/*
+ * Asynchronous pread/pwrite
+ *
+ * Instead of waiting for each read or write to finish before issuing the
+ * next one, keep up to "depth" of them in flight.  Every request slot has
+ * its own buffer of buffersize bytes; for writes each slot starts out as a
+ * copy of the buffer that alloc_buffer() set up, so the data written is the
+ * same as in synchronous mode.
+ *
+ * Offsets and lengths are handed out in the same order as the synchronous
+ * -F/-B/-R loops would use them, but the I/Os can complete in any order.
+ * A short read or write, or an error, stops us from issuing any more I/O;
+ * whatever is already in flight is allowed to finish and is counted.
+ *
+ * There are two engines: io_uring and the Linux native AIO interface that
+ * libaio wraps.  Both are driven with the raw system calls so that we do
+ * not need either library.
+ */
+struct aio_slot {
+	off64_t			offset;
+	size_t			length;
+	struct timespec		queued;		/* for latency */
+};
+
+struct aio_ctx;
+
+struct aio_ops {
+	const char		*name;
+	int			(*setup)(struct aio_ctx *);
+	void			(*teardown)(struct aio_ctx *);
+	void			(*prep)(struct aio_ctx *, unsigned int);
+	int			(*wait)(struct aio_ctx *);
+};
+
+struct aio_ctx {
+	const struct aio_ops	*ops;
+	int			fd;
+	int			do_write;
+	int			rw_flags;
+	unsigned int		depth;
+	size_t			iosize;
+
+	/* request slots */
+	char			*bufs;
+	struct aio_slot		*slots;
+	unsigned int		*free_slots;
+	unsigned int		nr_free;
+	unsigned int		nr_inflight;
+
+	/* results */
+	long long		total;
+	int			nr_ops;
+	int			error;
+	bool			stop;
+
+#ifdef HAVE_IO_URING
+	int			ring_fd;
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+#endif
+#ifdef HAVE_LINUX_AIO
+	aio_context_t		aio_ctx;
+	struct iocb		*iocbs;		/* one per slot */
+	struct iocb		**queued;	/* not yet submitted */
+	unsigned int		nr_queued;
+	struct io_event		*events;
+#endif
+};
+
+static inline void *
+aio_slot_buf(
+	struct aio_ctx		*ctx,
+	unsigned int		slot)
+{
+	return ctx->bufs + (size_t)slot * ctx->iosize;
+}
+
+/* Account for a finished request and free its slot. */
+static void
+aio_complete(
+	struct aio_ctx		*ctx,
+	unsigned int		slot,
+	long long		res)
+{
+	latency_stop(&ctx->slots[slot].queued);
+	ctx->free_slots[ctx->nr_free++] = slot;
+	ctx->nr_inflight--;
+
+	if (res < 0) {
+		if (!ctx->error)
+			ctx->error = -res;
+		ctx->stop = true;
+		return;
+	}
+	if (res == 0) {
+		ctx->stop = true;
+		return;
+	}
+	ctx->nr_ops++;
+	ctx->total += res;
+	if (res < ctx->slots[slot].length)
+		ctx->stop = true;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * IORING_OP_READ and IORING_OP_WRITE only arrived in 5.6, but older kernels
+ * still set up a ring and then fail every request with -EINVAL.  Ask the
+ * ring which opcodes it knows; kernels too old to answer lack them anyway.
+ */
+static bool
+uring_probe(
+	int			ring_fd)
+{
+	struct io_uring_probe	*probe;
+	size_t			nr_ops = IORING_OP_WRITE + 1;
+	bool			ret = false;
+
+	probe = calloc(1, sizeof(*probe) +
+			nr_ops * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+			probe, nr_ops) == 0 &&
+	    probe->ops_len > IORING_OP_WRITE &&
+	    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		ret = true;
+	free(probe);
+	return ret;
+}
+
+static int
+uring_setup(
+	struct aio_ctx		*ctx)
+{
+	struct io_uring_params	p = {0};
+
+	ctx->ring_fd = syscall(__NR_io_uring_setup, ctx->depth, &p);
+	if (ctx->ring_fd < 0)
+		return -1;
+	if (!uring_probe(ctx->ring_fd)) {
+		close(ctx->ring_fd);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	ctx->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ctx->sq_ring = mmap(NULL, ctx->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			IORING_OFF_SQ_RING);
+	if (ctx->sq_ring == MAP_FAILED)
+		goto out_close;
+
+	ctx->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	ctx->cq_ring = mmap(NULL, ctx->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			IORING_OFF_CQ_RING);
+	if (ctx->cq_ring == MAP_FAILED)
+		goto out_sq;
+
+	ctx->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = mmap(NULL, ctx->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			IORING_OFF_SQES);
+	if (ctx->sqes == MAP_FAILED)
+		goto out_cq;
+
+	ctx->sq_head = ctx->sq_ring + p.sq_off.head;
+	ctx->sq_tail = ctx->sq_ring + p.sq_off.tail;
+	ctx->sq_mask = ctx->sq_ring + p.sq_off.ring_mask;
+	ctx->sq_array = ctx->sq_ring + p.sq_off.array;
+	ctx->cq_head = ctx->cq_ring + p.cq_off.head;
+	ctx->cq_tail = ctx->cq_ring + p.cq_off.tail;
+	ctx->cq_mask = ctx->cq_ring + p.cq_off.ring_mask;
+	ctx->cqes = ctx->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_cq:
+	munmap(ctx->cq_ring, ctx->cq_ring_sz);
+out_sq:
+	munmap(ctx->sq_ring, ctx->sq_ring_sz);
+out_close:
+	close(ctx->ring_fd);
+	return -1;
+}
+
+static void
+uring_teardown(
+	struct aio_ctx		*ctx)
+{
+	/* Closing the ring waits for anything still in flight. */
+	close(ctx->ring_fd);
+	munmap(ctx->sqes, ctx->sqes_sz);
+	munmap(ctx->cq_ring, ctx->cq_ring_sz);
+	munmap(ctx->sq_ring, ctx->sq_ring_sz);
+}
+
+static void
+uring_prep(
+	struct aio_ctx		*ctx,
+	unsigned int		slot)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		tail;
+	unsigned int		idx;
+
+	tail = *ctx->sq_tail;
+	idx = tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = ctx->do_write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = ctx->fd;
+	sqe->addr = (uintptr_t)aio_slot_buf(ctx, slot);
+	sqe->len = ctx->slots[slot].length;
+	sqe->off = ctx->slots[slot].offset;
+#ifdef HAVE_PWRITEV2
+	sqe->rw_flags = ctx->rw_flags;
+#endif
+	sqe->user_data = slot;
+	ctx->sq_array[idx] = idx;
+	__atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit everything queued, wait for at least one completion, reap. */
+static int
+uring_wait(
+	struct aio_ctx		*ctx)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		to_submit;
+	unsigned int		head;
+	unsigned int		tail;
+	int			ret;
+
+	to_submit = *ctx->sq_tail -
+			__atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+	ret = syscall(__NR_io_uring_enter, ctx->ring_fd, to_submit, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		return -1;
+
+	head = *ctx->cq_head;
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ctx->cqes[head & *ctx->cq_mask];
+		aio_complete(ctx, cqe->user_data, cqe->res);
+		head++;
+	}
+	__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static const struct aio_ops uring_ops = {
+	.name		= "io_uring",
+	.setup		= uring_setup,
+	.teardown	= uring_teardown,
+	.prep		= uring_prep,
+	.wait		= uring_wait,
+};
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_LINUX_AIO
+static int
+libaio_setup(
+	struct aio_ctx		*ctx)
+{
+	ctx->iocbs = calloc(ctx->depth, sizeof(struct iocb));
+	ctx->queued = calloc(ctx->depth, sizeof(struct iocb *));
+	ctx->events = calloc(ctx->depth, sizeof(struct io_event));
+	if (!ctx->iocbs || !ctx->queued || !ctx->events)
+		goto out_free;
+
+	ctx->aio_ctx = 0;
+	if (syscall(__NR_io_setup, ctx->depth, &ctx->aio_ctx) < 0)
+		goto out_free;
+	ctx->nr_queued = 0;
+	return 0;
+
+out_free:
+	free(ctx->events);
+	free(ctx->queued);
+	free(ctx->iocbs);
+	return -1;
+}
+
+static void
+libaio_teardown(
+	struct aio_ctx		*ctx)
+{
+	/* io_destroy waits for anything still in flight. */
+	syscall(__NR_io_destroy, ctx->aio_ctx);
+	free(ctx->events);
+	free(ctx->queued);
+	free(ctx->iocbs);
+}
+
+static void
+libaio_prep(
+	struct aio_ctx		*ctx,
+	unsigned int		slot)
+{
+	struct iocb		*iocb = &ctx->iocbs[slot];
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = slot;
+	iocb->aio_lio_opcode = ctx->do_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	iocb->aio_fildes = ctx->fd;
+	iocb->aio_buf = (uintptr_t)aio_slot_buf(ctx, slot);
+	iocb->aio_nbytes = ctx->slots[slot].length;
+	iocb->aio_offset = ctx->slots[slot].offset;
+#ifdef HAVE_PWRITEV2
+	iocb->aio_rw_flags = ctx->rw_flags;
+#endif
+	ctx->queued[ctx->nr_queued++] = iocb;
+}
+
+/* Submit everything queued, wait for at least one completion, reap. */
+static int
+libaio_wait(
+	struct aio_ctx		*ctx)
+{
+	struct io_event		*ev;
+	int			ret;
+	int			i;
+
+	if (ctx->nr_queued) {
+		ret = syscall(__NR_io_submit, ctx->aio_ctx, ctx->nr_queued,
+				ctx->queued);
+		if (ret < 0 && errno != EAGAIN)
+			return -1;
+		if (ret > 0) {
+			ctx->nr_queued -= ret;
+			memmove(ctx->queued, ctx->queued + ret,
+					ctx->nr_queued * sizeof(struct iocb *));
+		}
+		/* Nothing in flight to wait for; don't sleep forever. */
+		if (ctx->nr_queued == ctx->nr_inflight)
+			return ret < 0 ? -1 : 0;
+	}
+
+	ret = syscall(__NR_io_getevents, ctx->aio_ctx, 1, ctx->depth,
+			ctx->events, NULL);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0, ev = ctx->events; i < ret; i++, ev++)
+		aio_complete(ctx, ev->data, (long long)ev->res);
+	return 0;
+}
+
+static const struct aio_ops libaio_ops = {
+	.name		= "libaio",
+	.setup		= libaio_setup,
+	.teardown	= libaio_teardown,
+	.prep		= libaio_prep,
+	.wait		= libaio_wait,
+};
+#endif /* HAVE_LINUX_AIO */
+
+static const struct aio_ops *aio_engines[AIO_ENGINE_MAX] = {
+#ifdef HAVE_IO_URING
+	[AIO_ENGINE_URING]	= &uring_ops,
+#endif
+#ifdef HAVE_LINUX_AIO
+	[AIO_ENGINE_LIBAIO]	= &libaio_ops,
+#endif
+};
+
+static const char *aio_engine_names[AIO_ENGINE_MAX] = {
+	[AIO_ENGINE_ANY]	= "any",
+	[AIO_ENGINE_URING]	= "io_uring",
+	[AIO_ENGINE_LIBAIO]	= "libaio",
+};
+
+/* Look up an engine by name; returns -1 if there isn't one. */
+int
+aio_engine(
+	const char		*name)
+{
+	int			i;
+
+	for (i = 0; i < AIO_ENGINE_MAX; i++)
+		if (!strcmp(name, aio_engine_names[i]))
+			return i;
+	return -1;
+}
+
+/*
+ * Set up the engine that was asked for, or for AIO_ENGINE_ANY the first
+ * one that works here.
+ */
+static int
+aio_setup(
+	struct aio_ctx		*ctx,
+	int			engine)
+{
+	int			i;
+
+	if (engine != AIO_ENGINE_ANY) {
+		ctx->ops = aio_engines[engine];
+		if (!ctx->ops) {
+			fprintf(stderr, _("%s: not supported\n"),
+				aio_engine_names[engine]);
+			return -1;
+		}
+		if (ctx->ops->setup(ctx) < 0) {
+			perror(ctx->ops->name);
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = AIO_ENGINE_ANY + 1; i < AIO_ENGINE_MAX; i++) {
+		ctx->ops = aio_engines[i];
+		if (ctx->ops && ctx->ops->setup(ctx) == 0)
+			return 0;
+	}
+	fprintf(stderr, _("no asynchronous I/O engine available\n"));
+	return -1;
+}
+
+/*
+ * The offsets and lengths to use, worked out exactly as read_random(),
+ * read_backward(), read_forward() and their write counterparts do.
+ */
+struct aio_pattern {
+	int			direction;
+	off64_t			offset;		/* next, or base for random */
+	long long		count;		/* bytes left to hand out */
+	off64_t			range;		/* for random */
+	size_t			bsize;
+};
+
+static void
+aio_pattern_init(
+	struct aio_pattern	*pat,
+	int			fd,
+	int			do_write,
+	struct aio_opts		*opts,
+	off64_t			*offset,
+	long long		*count)
+{
+	off64_t			off = *offset, end;
+	long long		cnt = *count;
+	size_t			bs = buffersize;
+
+	pat->direction = opts->direction;
+	pat->bsize = bs;
+	pat->range = 0;
+
+	switch (opts->direction) {
+	case IO_RANDOM:
+		srandom(opts->seed);
+		if (!do_write) {
+			end = lseek(fd, 0, SEEK_END);
+			off = (opts->eof || off > end) ? end : off;
+		}
+		off -= off % bs;
+		off = max(0, off);
+		if (cnt % bs)
+			cnt += cnt % bs;
+		cnt = max(bs, cnt);
+		pat->range = cnt - bs;
+		break;
+	case IO_BACKWARD:
+		if (!do_write) {
+			end = lseek(fd, 0, SEEK_END);
+			off = opts->eof ? end : min(end, off);
+			*offset = off;
+		}
+		if (off - cnt < 0)
+			cnt = off;
+		*count = cnt;
+		break;
+	default:
+		if (!do_write && opts->eof) {
+			end = lseek(fd, 0, SEEK_END);
+			cnt = max(0, end - off);
+			*count = cnt;
+		}
+		break;
+	}
+	pat->offset = off;
+	pat->count = cnt;
+}
+
+static bool
+aio_pattern_next(
+	struct aio_pattern	*pat,
+	struct aio_slot		*slot)
+{
+	size_t			bs = pat->bsize;
+
+	if (pat->count <= 0)
+		return false;
+
+	switch (pat->direction) {
+	case IO_RANDOM:
+		if (pat->range)
+			slot->offset = ((pat->offset + (random() % pat->range)) /
+					bs) * bs;
+		else
+			slot->offset = pat->offset;
+		slot->length = bs;
+		break;
+	case IO_BACKWARD:
+		/* Do the unaligned tail first, then whole blocks. */
+		slot->length = pat->offset % bs;
+		if (!slot->length)
+			slot->length = bs;
+		slot->length = min(pat->count, slot->length);
+		pat->offset -= slot->length;
+		slot->offset = pat->offset;
+		break;
+	default:
+		slot->length = min(pat->count, bs);
+		slot->offset = pat->offset;
+		pat->offset += slot->length;
+		break;
+	}
+	pat->count -= slot->length;
+	return true;
+}
+
+/*
+ * Read or write the range the way the options say, with up to opts->depth
+ * I/Os in flight.  The range is trimmed as in the synchronous loops and
+ * passed back through offset and count for report_io_times().  Returns
+ * the number of I/Os done, or -1.
+ */
+int
+aio_rw(
+	int			fd,
+	int			do_write,
+	struct aio_opts		*opts,
+	off64_t			*offset,
+	long long		*count,
+	long long		*total)
+{
+	struct aio_ctx		ctx = {0};
+	struct aio_pattern	pat;
+	unsigned int		slot;
+	unsigned int		i;
+	int			error;
+	int			ret = -1;
+
+	if (vectors) {
+		fprintf(stderr, _("vectored I/O cannot be done asynchronously\n"));
+		return -1;
+	}
+
+	ctx.fd = fd;
+	ctx.do_write = do_write;
+	ctx.rw_flags = opts->rw_flags;
+	ctx.depth = opts->depth;
+	ctx.iosize = buffersize;
+
+	ctx.bufs = memalign(pagesize, ctx.depth * ctx.iosize);
+	ctx.slots = calloc(ctx.depth, sizeof(struct aio_slot));
+	ctx.free_slots = calloc(ctx.depth, sizeof(unsigned int));
+	if (!ctx.bufs || !ctx.slots || !ctx.free_slots) {
+		perror("malloc");
+		goto out_free;
+	}
+	for (i = 0; i < ctx.depth; i++) {
+		memcpy(aio_slot_buf(&ctx, i), buffer, ctx.iosize);
+		ctx.free_slots[i] = i;
+	}
+	ctx.nr_free = ctx.depth;
+
+	if (aio_setup(&ctx, opts->engine) < 0)
+		goto out_free;
+
+	aio_pattern_init(&pat, fd, do_write, opts, offset, count);
+	for (;;) {
+		while (!ctx.stop && ctx.nr_free > 0) {
+			slot = ctx.free_slots[ctx.nr_free - 1];
+			if (!aio_pattern_next(&pat, &ctx.slots[slot]))
+				break;
+			ctx.nr_free--;
+			ctx.nr_inflight++;
+			latency_start(&ctx.slots[slot].queued);
+			ctx.ops->prep(&ctx, slot);
+		}
+		if (!ctx.nr_inflight)
+			break;
+		if (ctx.ops->wait(&ctx) < 0) {
+			error = errno;
+			ctx.ops->teardown(&ctx);
+			errno = error;
+			perror(ctx.ops->name);
+			goto out_free;
+		}
+	}
+	ctx.ops->teardown(&ctx);
+
+	if (ctx.error) {
+		errno = ctx.error;
+		perror(do_write ? "pwrite" : "pread");
+		goto out_free;
+	}
+	*total = ctx.total;
+	ret = ctx.nr_ops;
+
+out_free:
+	free(ctx.free_slots);
+	free(ctx.slots);
+	free(ctx.bufs);
+	return ret;
+}
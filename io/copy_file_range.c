@@ -49,11 +49,14 @@ copy_range_help(void)
 static loff_t
 copy_file_range_cmd(int fd, loff_t *src, loff_t *dst, size_t len)
 {
+	struct timespec ts;
 	loff_t ret;
 
 	do {
+		latency_start(&ts);
 		ret = syscall(__NR_copy_file_range, fd, src, file->fd, dst,
 				len, 0);
+		latency_stop(&ts);
 		if (ret == -1) {
 			perror("copy_range");
 			return errno;
@@ -135,7 +138,10 @@ copy_range_f(int argc, char **argv)
 		copy_dst_truncate();
 	}
 
+	latency_begin();
 	ret = copy_file_range_cmd(fd, &src, &dst, len);
+	if (!ret)
+		latency_report();
 	close(fd);
 	return ret;
 }
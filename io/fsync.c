@@ -29,10 +29,16 @@ fsync_f(
 	int			argc,
 	char			**argv)
 {
+	struct timespec		ts;
+
+	latency_begin();
+	latency_start(&ts);
 	if (fsync(file->fd) < 0) {
 		perror("fsync");
 		return 0;
 	}
+	latency_stop(&ts);
+	latency_report();
 	return 0;
 }
 
@@ -41,10 +47,16 @@ fdatasync_f(
 	int			argc,
 	char			**argv)
 {
+	struct timespec		ts;
+
+	latency_begin();
+	latency_start(&ts);
 	if (fdatasync(file->fd) < 0) {
 		perror("fdatasync");
 		return 0;
 	}
+	latency_stop(&ts);
+	latency_report();
 	return 0;
 }
 
@@ -72,6 +72,7 @@ init_commands(void)
 	help_init();
 	imap_init();
 	inject_init();
+	latency_init();
 	log_writes_init();
 	madvise_init();
 	mincore_init();
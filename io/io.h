@@ -98,6 +98,39 @@ extern int		read_buffer(int, off64_t, long long, long long *,
 					int, int);
 extern void		dump_buffer(off64_t, ssize_t);
 
+/*
+ * Asynchronous pread/pwrite engines
+ */
+#define AIO_ENGINE_ANY		0	/* io_uring, else libaio */
+#define AIO_ENGINE_URING	1
+#define AIO_ENGINE_LIBAIO	2
+#define AIO_ENGINE_MAX		3
+
+struct aio_opts {
+	int		engine;		/* AIO_ENGINE_* */
+	unsigned int	depth;		/* I/Os kept in flight */
+	int		direction;	/* IO_RANDOM/FORWARD/BACKWARD */
+	int		eof;		/* range is relative to EOF */
+	unsigned int	seed;		/* random offset seed */
+	int		rw_flags;	/* RWF_* */
+};
+
+extern int		aio_engine(const char *);
+extern int		aio_rw(int, int, struct aio_opts *, off64_t *,
+				long long *, long long *);
+
+/*
+ * Per-I/O latency recording
+ */
+extern void		latency_begin(void);
+extern void		latency_hold(void);
+extern void		latency_release(void);
+extern void		latency_start(struct timespec *);
+extern void		latency_stop(struct timespec *);
+extern void		latency_pause(struct timespec *);
+extern void		latency_resume(struct timespec *, struct timespec *);
+extern void		latency_report(void);
+
 extern void		attr_init(void);
 extern void		bmap_init(void);
 extern void		encrypt_init(void);
@@ -109,6 +142,7 @@ extern void		getrusage_init(void);
 extern void		help_init(void);
 extern void		imap_init(void);
 extern void		inject_init(void);
+extern void		latency_init(void);
 extern void		mmap_init(void);
 extern void		open_init(void);
 extern void		parent_init(void);
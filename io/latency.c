@@ -0,0 +1,326 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "platform_defs.h"
+#include "command.h"
+#include "init.h"
+#include "io.h"
+
+static cmdinfo_t latency_cmd;
+
+/*
+ * Per-I/O latency histogram
+ *
+ * Latencies are recorded in nanoseconds into a log-linear histogram, as
+ * HdrHistogram does: values below 2 * LAT_SUB are counted exactly, and
+ * every power of two above that is split into LAT_SUB equal buckets, so a
+ * bucket is never wider than 1/64 of its lower bound.  That is better
+ * than 2% resolution over the whole 64-bit range in under 4000 counters.
+ *
+ * Each command that does I/O resets the histogram when it starts, so it
+ * always describes the last such command.
+ */
+#define LAT_SUB_BITS	6
+#define LAT_SUB		(1ULL << LAT_SUB_BITS)
+#define LAT_BUCKETS	((65 - LAT_SUB_BITS) * LAT_SUB)
+
+static struct {
+	uint64_t	counts[LAT_BUCKETS];
+	uint64_t	nr;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	sum;
+} lat;
+
+static bool	latency_on;
+static int	latency_held;
+
+static unsigned int
+lat_bucket(
+	uint64_t	ns)
+{
+	unsigned int	shift = 0;
+
+	if (ns >= LAT_SUB)
+		shift = (63 - __builtin_clzll(ns)) - LAT_SUB_BITS;
+	return shift * LAT_SUB + (ns >> shift);
+}
+
+/* Smallest and largest values counted in a bucket. */
+static void
+lat_bucket_range(
+	unsigned int	idx,
+	uint64_t	*low,
+	uint64_t	*high)
+{
+	unsigned int	shift = 0;
+	uint64_t	mant = idx;
+
+	if (idx >= 2 * LAT_SUB) {
+		shift = idx / LAT_SUB - 1;
+		mant = idx - shift * LAT_SUB;
+	}
+	*low = mant << shift;
+	*high = *low + (1ULL << shift) - 1;
+}
+
+/* Start a new histogram for this command. */
+void
+latency_begin(void)
+{
+	if (!latency_on)
+		return;
+	memset(&lat, 0, sizeof(lat));
+	lat.min = UINT64_MAX;
+	latency_held = 0;
+}
+
+/* Don't record anything until latency_release(), e.g. for pwrite -i. */
+void
+latency_hold(void)
+{
+	latency_held++;
+}
+
+void
+latency_release(void)
+{
+	latency_held--;
+}
+
+void
+latency_start(
+	struct timespec	*ts)
+{
+	if (latency_on)
+		clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/* Record the time since latency_start() was called on ts. */
+void
+latency_stop(
+	struct timespec	*ts)
+{
+	struct timespec	now;
+	uint64_t	ns;
+
+	if (!latency_on || latency_held)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - ts->tv_sec) * 1000000000ULL +
+	     now.tv_nsec - ts->tv_nsec;
+	lat.counts[lat_bucket(ns)]++;
+	lat.nr++;
+	lat.sum += ns;
+	lat.min = min(lat.min, ns);
+	lat.max = max(lat.max, ns);
+}
+
+/*
+ * Leave whatever happens between latency_pause() and latency_resume(),
+ * such as dumping what was just read, out of the I/O being timed on ts.
+ */
+void
+latency_pause(
+	struct timespec	*paused)
+{
+	if (latency_on)
+		clock_gettime(CLOCK_MONOTONIC, paused);
+}
+
+void
+latency_resume(
+	struct timespec	*ts,
+	struct timespec	*paused)
+{
+	struct timespec	now;
+
+	if (!latency_on)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts->tv_sec += now.tv_sec - paused->tv_sec;
+	ts->tv_nsec += now.tv_nsec - paused->tv_nsec;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	} else if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000L;
+	}
+}
+
+/*
+ * The highest value that could be in the bucket holding the pct'th
+ * percentile, but no more than the largest value actually seen.
+ */
+static uint64_t
+lat_percentile(
+	double		pct)
+{
+	uint64_t	want, seen = 0;
+	uint64_t	low, high;
+	unsigned int	i;
+
+	want = (uint64_t)(pct / 100.0 * lat.nr + 0.5);
+	want = max(want, 1ULL);
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat.counts[i];
+		if (seen >= want)
+			break;
+	}
+	lat_bucket_range(i, &low, &high);
+	return min(high, lat.max);
+}
+
+static void
+lat_print_ns(
+	const char	*name,
+	uint64_t	ns)
+{
+	if (ns < 10000)
+		printf(" %s %lluns", name, (unsigned long long)ns);
+	else if (ns < 10000000)
+		printf(" %s %.1fus", name, ns / 1000.0);
+	else
+		printf(" %s %.1fms", name, ns / 1000000.0);
+}
+
+/* Summarise the histogram at the end of a command. */
+void
+latency_report(void)
+{
+	if (!latency_on || !lat.nr)
+		return;
+
+	printf(_("latency: %llu ops;"), (unsigned long long)lat.nr);
+	lat_print_ns("min", lat.min);
+	lat_print_ns("avg", lat.sum / lat.nr);
+	lat_print_ns("p50", lat_percentile(50.0));
+	lat_print_ns("p99", lat_percentile(99.0));
+	lat_print_ns("p99.9", lat_percentile(99.9));
+	lat_print_ns("max", lat.max);
+	printf("\n");
+}
+
+/*
+ * Machine readable dump: a summary line, then one line for every
+ * non-empty bucket, all in nanoseconds.
+ */
+static void
+latency_dump(void)
+{
+	uint64_t	low, high;
+	unsigned int	i;
+
+	printf("# ops min avg p50 p99 p99.9 max\n");
+	if (!lat.nr) {
+		printf("0 0 0 0 0 0 0\n");
+		return;
+	}
+	printf("%llu %llu %llu %llu %llu %llu %llu\n",
+		(unsigned long long)lat.nr,
+		(unsigned long long)lat.min,
+		(unsigned long long)(lat.sum / lat.nr),
+		(unsigned long long)lat_percentile(50.0),
+		(unsigned long long)lat_percentile(99.0),
+		(unsigned long long)lat_percentile(99.9),
+		(unsigned long long)lat.max);
+	printf("# low high count\n");
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		if (!lat.counts[i])
+			continue;
+		lat_bucket_range(i, &low, &high);
+		printf("%llu %llu %llu\n", (unsigned long long)low,
+			(unsigned long long)high,
+			(unsigned long long)lat.counts[i]);
+	}
+}
+
+static void
+latency_help(void)
+{
+	printf(_(
+"\n"
+" records how long each I/O takes and reports latency percentiles\n"
+"\n"
+" Example:\n"
+" 'latency on' - report the latency spread of every following I/O command\n"
+"\n"
+" Once turned on, pread, pwrite, sendfile, copy_range, fsync, fdatasync,\n"
+" mread and mwrite time every I/O they do and print the minimum, mean,\n"
+" 50th, 99th and 99.9th percentile and maximum latency when they finish\n"
+" (unless run with -q).  For mread and mwrite each page touched counts as\n"
+" one I/O.  With asynchronous pread and pwrite, an I/O is timed from when\n"
+" it is queued until its completion is seen.\n"
+" -d -- dump the histogram of the last command in a machine readable form:\n"
+"       a summary line, then a low/high/count line for every non-empty\n"
+"       bucket, all in nanoseconds.\n"
+" With no arguments, say whether latency recording is on.\n"
+"\n"));
+}
+
+static int
+latency_f(
+	int		argc,
+	char		**argv)
+{
+	int		dflag = 0;
+	int		c;
+
+	while ((c = getopt(argc, argv, "d")) != EOF) {
+		switch (c) {
+		case 'd':
+			dflag = 1;
+			break;
+		default:
+			return command_usage(&latency_cmd);
+		}
+	}
+	if (optind < argc - 1)
+		return command_usage(&latency_cmd);
+
+	if (optind == argc - 1) {
+		if (!strcmp(argv[optind], "on"))
+			latency_on = true;
+		else if (!strcmp(argv[optind], "off"))
+			latency_on = false;
+		else
+			return command_usage(&latency_cmd);
+	} else if (!dflag) {
+		printf(_("latency recording is %s\n"),
+			latency_on ? _("on") : _("off"));
+	}
+
+	if (dflag)
+		latency_dump();
+	return 0;
+}
+
+void
+latency_init(void)
+{
+	latency_cmd.name = "latency";
+	latency_cmd.cfunc = latency_f;
+	latency_cmd.argmin = 0;
+	latency_cmd.argmax = 2;
+	latency_cmd.flags = CMD_NOFILE_OK | CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	latency_cmd.args = _("[-d] [on|off]");
+	latency_cmd.oneline = _("record and report per-I/O latency");
+	latency_cmd.help = latency_help;
+
+	add_command(&latency_cmd);
+}
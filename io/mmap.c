@@ -394,6 +394,7 @@ mread_f(
 	off64_t		offset, tmp, dumpoffset, printoffset;
 	ssize_t		length;
 	size_t		dumplen, cnt = 0;
+	struct timespec	ts, paused;
 	char		*bp;
 	void		*start;
 	int		dump = 0, rflag = 0, c;
@@ -454,13 +455,22 @@ mread_f(
 	if (!dumplen)
 		dumplen = pagesize;
 
+	/* Each page touched counts as one I/O for latency purposes. */
+	latency_begin();
+	latency_start(&ts);
 	if (rflag) {
 		for (tmp = length - 1, c = 0; tmp >= 0; tmp--, c = 1) {
 			*bp = *(((char *)mapping->addr) + dumpoffset + tmp);
+			if (!((dumpoffset + tmp) & (pagesize - 1))) {
+				latency_stop(&ts);
+				latency_start(&ts);
+			}
 			cnt++;
 			if (c && cnt == dumplen) {
 				if (dump) {
+					latency_pause(&paused);
 					dump_buffer(printoffset, dumplen);
+					latency_resume(&ts, &paused);
 					printoffset += dumplen;
 				}
 				bp = (char *)buffer;
@@ -473,11 +483,18 @@ mread_f(
 	} else {
 		for (tmp = 0, c = 0; tmp < length; tmp++, c = 1) {
 			*bp = *(((char *)mapping->addr) + dumpoffset + tmp);
+			if (!((dumpoffset + tmp + 1) & (pagesize - 1))) {
+				latency_stop(&ts);
+				latency_start(&ts);
+			}
 			cnt++;
 			if (c && cnt == dumplen) {
-				if (dump)
+				if (dump) {
+					latency_pause(&paused);
 					dump_buffer(printoffset + tmp -
 						(dumplen - 1), dumplen);
+					latency_resume(&ts, &paused);
+				}
 				bp = (char *)buffer;
 				dumplen = pagesize;
 				cnt = 0;
@@ -486,6 +503,11 @@ mread_f(
 			}
 		}
 	}
+	/* Partial page at the end? */
+	if (length &&
+	    ((rflag ? dumpoffset : dumpoffset + length) & (pagesize - 1)))
+		latency_stop(&ts);
+	latency_report();
 	return 0;
 }
 
@@ -550,6 +572,7 @@ mwrite_f(
 {
 	off64_t		offset, tmp;
 	ssize_t		length;
+	struct timespec	ts;
 	void		*start;
 	char		*sp;
 	int		seed = 'X';
@@ -601,13 +624,30 @@ mwrite_f(
 		return 0;
 
 	offset -= mapping->offset;
+	/* Each page touched counts as one I/O for latency purposes. */
+	latency_begin();
+	latency_start(&ts);
 	if (rflag) {
-		for (tmp = offset + length -1; tmp >= offset; tmp--)
+		for (tmp = offset + length -1; tmp >= offset; tmp--) {
 			((char *)mapping->addr)[tmp] = seed;
+			if (!(tmp & (pagesize - 1))) {
+				latency_stop(&ts);
+				latency_start(&ts);
+			}
+		}
 	} else {
-		for (tmp = offset; tmp < offset + length; tmp++)
+		for (tmp = offset; tmp < offset + length; tmp++) {
 			((char *)mapping->addr)[tmp] = seed;
+			if (!((tmp + 1) & (pagesize - 1))) {
+				latency_stop(&ts);
+				latency_start(&ts);
+			}
+		}
 	}
+	/* Partial page at the end? */
+	if (length && ((rflag ? offset : offset + length) & (pagesize - 1)))
+		latency_stop(&ts);
+	latency_report();
 
 	return 0;
 }
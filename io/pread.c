@@ -51,11 +51,15 @@ pread_help(void)
 #ifdef HAVE_PREADV
 " -V N -- use vectored IO with N iovecs of blocksize each (preadv)\n"
 #endif
+" -Q N -- keep N reads in flight at once, using asynchronous IO\n"
+" -E engine -- asynchronous IO engine: io_uring, libaio or any (default)\n"
 "\n"
 " When in \"random\" mode, the number of read operations will equal the\n"
 " number required to do a complete forward/backward scan of the range.\n"
 " Note that the offset within the range is chosen at random each time\n"
 " (an offset may be read more than once when operating in this mode).\n"
+" With -Q the reads are issued in the same order, but can complete in any\n"
+" order; -Q cannot be combined with -v or -V.\n"
 "\n"));
 }
 
@@ -215,10 +219,16 @@ do_pread(
 	size_t		count,
 	size_t		buffer_size)
 {
-	if (!vectors)
-		return pread(fd, buffer, min(count, buffer_size), offset);
+	struct timespec	ts;
+	ssize_t		bytes;
 
-	return do_preadv(fd, offset, count, buffer_size);
+	latency_start(&ts);
+	if (!vectors)
+		bytes = pread(fd, buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_preadv(fd, offset, count, buffer_size);
+	latency_stop(&ts);
+	return bytes;
 }
 
 static int
@@ -371,7 +381,13 @@ read_buffer(
 	int		verbose,
 	int		onlyone)
 {
-	return read_forward(fd, offset, count, total, verbose, onlyone, 0);
+	int		ops;
+
+	/* Only the writes are timed when pwrite reads an input file. */
+	latency_hold();
+	ops = read_forward(fd, offset, count, total, verbose, onlyone, 0);
+	latency_release();
+	return ops;
 }
 
 static int
@@ -385,6 +401,7 @@ pread_f(
 	long long	count, total, tmp;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct aio_opts	aio = { 0 };
 	char		*sp;
 	int		Cflag, qflag, uflag, vflag;
 	int		eof = 0, direction = IO_FORWARD;
@@ -394,7 +411,7 @@ pread_f(
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCFRquvV:Z:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCE:FQ:RquvV:Z:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -407,12 +424,27 @@ pread_f(
 		case 'C':
 			Cflag = 1;
 			break;
+		case 'E':
+			aio.engine = aio_engine(optarg);
+			if (aio.engine < 0) {
+				printf(_("unknown IO engine -- %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'F':
 			direction = IO_FORWARD;
 			break;
 		case 'B':
 			direction = IO_BACKWARD;
 			break;
+		case 'Q':
+			aio.depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric queue depth -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
 		case 'R':
 			direction = IO_RANDOM;
 			break;
@@ -448,6 +480,8 @@ pread_f(
 	}
 	if (optind != argc - 2)
 		return command_usage(&pread_cmd);
+	if (aio.depth && (vflag || vectors))
+		return command_usage(&pread_cmd);
 
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0 && (direction & (IO_RANDOM|IO_BACKWARD))) {
@@ -468,23 +502,34 @@ pread_f(
 	if (alloc_buffer(bsize, uflag, 0xabababab) < 0)
 		return 0;
 
+	latency_begin();
 	gettimeofday(&t1, NULL);
-	switch (direction) {
-	case IO_RANDOM:
-		if (!zeed)	/* srandom seed */
-			zeed = time(NULL);
-		c = read_random(file->fd, offset, count, &total, zeed, eof);
-		break;
-	case IO_FORWARD:
-		c = read_forward(file->fd, offset, count, &total, vflag, 0, eof);
-		if (eof)
-			count = total;
-		break;
-	case IO_BACKWARD:
-		c = read_backward(file->fd, &offset, &count, &total, eof);
-		break;
-	default:
-		ASSERT(0);
+	if (aio.depth) {
+		aio.direction = direction;
+		aio.eof = eof;
+		aio.seed = zeed ? zeed : time(NULL);
+		c = aio_rw(file->fd, 0, &aio, &offset, &count, &total);
+	} else {
+		switch (direction) {
+		case IO_RANDOM:
+			if (!zeed)	/* srandom seed */
+				zeed = time(NULL);
+			c = read_random(file->fd, offset, count, &total,
+					zeed, eof);
+			break;
+		case IO_FORWARD:
+			c = read_forward(file->fd, offset, count, &total,
+					vflag, 0, eof);
+			if (eof)
+				count = total;
+			break;
+		case IO_BACKWARD:
+			c = read_backward(file->fd, &offset, &count, &total,
+					eof);
+			break;
+		default:
+			ASSERT(0);
+		}
 	}
 	if (c < 0)
 		return 0;
@@ -494,6 +539,7 @@ pread_f(
 	t2 = tsub(t2, t1);
 
 	report_io_times("read", &t2, (long long)offset, count, total, c, Cflag);
+	latency_report();
 	return 0;
 }
 
@@ -506,7 +552,8 @@ pread_init(void)
 	pread_cmd.argmin = 2;
 	pread_cmd.argmax = -1;
 	pread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	pread_cmd.args = _("[-b bs] [-v] [-i N] [-FBR [-Z N]] off len");
+	pread_cmd.args =
+_("[-b bs] [-v] [-i N] [-FBR [-Z N]] [-Q N [-E engine]] off len");
 	pread_cmd.oneline = _("reads a number of bytes at a specified offset");
 	pread_cmd.help = pread_help;
 
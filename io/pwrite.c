@@ -58,6 +58,9 @@ pwrite_help(void)
 " -N   -- Perform the pwritev2() with RWF_NOWAIT\n"
 " -D   -- Perform the pwritev2() with RWF_DSYNC\n"
 #endif
+" -Q N -- keep N writes in flight at once, using asynchronous IO\n"
+"         (the writes can complete in any order; not with -i, -O or -V)\n"
+" -E engine -- asynchronous IO engine: io_uring, libaio or any (default)\n"
 "\n"));
 }
 
@@ -114,10 +117,17 @@ do_pwrite(
 	size_t		buffer_size,
 	int		pwritev2_flags)
 {
-	if (!vectors)
-		return pwrite(fd, buffer, min(count, buffer_size), offset);
+	struct timespec	ts;
+	ssize_t		bytes;
 
-	return do_pwritev(fd, offset, count, buffer_size, pwritev2_flags);
+	latency_start(&ts);
+	if (!vectors)
+		bytes = pwrite(fd, buffer, min(count, buffer_size), offset);
+	else
+		bytes = do_pwritev(fd, offset, count, buffer_size,
+				pwritev2_flags);
+	latency_stop(&ts);
+	return bytes;
 }
 
 static int
@@ -292,6 +302,7 @@ pwrite_f(
 	unsigned int	zeed = 0, seed = 0xcdcdcdcd;
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
+	struct aio_opts	aio = { 0 };
 	char		*sp, *infile = NULL;
 	int		Cflag, qflag, uflag, dflag, wflag, Wflag;
 	int		direction = IO_FORWARD;
@@ -302,7 +313,7 @@ pwrite_f(
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCdDf:Fi:NqRs:OS:uV:wWZ:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCdDE:f:Fi:NqQ:Rs:OS:uV:wWZ:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -330,6 +341,13 @@ pwrite_f(
 		case 'd':
 			dflag = 1;
 			break;
+		case 'E':
+			aio.engine = aio_engine(optarg);
+			if (aio.engine < 0) {
+				printf(_("unknown IO engine -- %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'f':
 		case 'i':
 			infile = optarg;
@@ -342,6 +360,14 @@ pwrite_f(
 			pwritev2_flags |= RWF_DSYNC;
 			break;
 #endif
+		case 'Q':
+			aio.depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric queue depth -- %s\n"),
+					optarg);
+				return 0;
+			}
+			break;
 		case 's':
 			skip = cvtnum(fsblocksize, fssectsize, optarg);
 			if (skip < 0) {
@@ -398,6 +424,8 @@ pwrite_f(
 		return command_usage(&pwrite_cmd);
 	if (infile && direction != IO_FORWARD)
 		return command_usage(&pwrite_cmd);
+	if (aio.depth && (infile || direction == IO_ONCE || vectors))
+		return command_usage(&pwrite_cmd);
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0) {
 		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
@@ -417,26 +445,36 @@ pwrite_f(
 	if (infile && ((fd = openfile(infile, NULL, c, 0, NULL)) < 0))
 		return 0;
 
+	latency_begin();
 	gettimeofday(&t1, NULL);
-	switch (direction) {
-	case IO_RANDOM:
-		if (!zeed)	/* srandom seed */
-			zeed = time(NULL);
-		c = write_random(offset, count, zeed, &total, pwritev2_flags);
-		break;
-	case IO_FORWARD:
-		c = write_buffer(offset, count, bsize, fd, skip, &total,
-				pwritev2_flags);
-		break;
-	case IO_BACKWARD:
-		c = write_backward(offset, &count, &total, pwritev2_flags);
-		break;
-	case IO_ONCE:
-		c = write_once(offset, count, &total, pwritev2_flags);
-		break;
-	default:
-		total = 0;
-		ASSERT(0);
+	if (aio.depth) {
+		aio.direction = direction;
+		aio.seed = zeed ? zeed : time(NULL);
+		aio.rw_flags = pwritev2_flags;
+		c = aio_rw(file->fd, 1, &aio, &offset, &count, &total);
+	} else {
+		switch (direction) {
+		case IO_RANDOM:
+			if (!zeed)	/* srandom seed */
+				zeed = time(NULL);
+			c = write_random(offset, count, zeed, &total,
+					pwritev2_flags);
+			break;
+		case IO_FORWARD:
+			c = write_buffer(offset, count, bsize, fd, skip, &total,
+					pwritev2_flags);
+			break;
+		case IO_BACKWARD:
+			c = write_backward(offset, &count, &total,
+					pwritev2_flags);
+			break;
+		case IO_ONCE:
+			c = write_once(offset, count, &total, pwritev2_flags);
+			break;
+		default:
+			total = 0;
+			ASSERT(0);
+		}
 	}
 	if (c < 0)
 		goto done;
@@ -459,6 +497,7 @@ pwrite_f(
 
 	report_io_times("wrote", &t2, (long long)offset, count, total, c,
 			Cflag);
+	latency_report();
 done:
 	if (infile)
 		close(fd);
@@ -475,7 +514,7 @@ pwrite_init(void)
 	pwrite_cmd.argmax = -1;
 	pwrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	pwrite_cmd.args =
-_("[-i infile [-dDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] off len");
+_("[-i infile [-dDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] [-Q N [-E engine]] off len");
 	pwrite_cmd.oneline =
 		_("writes a number of bytes at a specified offset");
 	pwrite_cmd.help = pwrite_help;
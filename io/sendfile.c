@@ -52,11 +52,14 @@ send_buffer(
 {
 	off64_t		off = offset;
 	ssize_t		bytes, bytes_remaining = count;
+	struct timespec	ts;
 	int		ops = 0;
 
 	*total = 0;
 	while (count > 0) {
+		latency_start(&ts);
 		bytes = sendfile(file->fd, fd, &off, bytes_remaining);
+		latency_stop(&ts);
 		if (bytes == 0)
 			break;
 		if (bytes < 0) {
@@ -142,6 +145,7 @@ sendfile_f(
 		count = stat.st_size;
 	}
 
+	latency_begin();
 	gettimeofday(&t1, NULL);
 	c = send_buffer(offset, count, fd, &total);
 	if (c < 0)
@@ -152,6 +156,7 @@ sendfile_f(
 	t2 = tsub(t2, t1);
 
 	report_io_times("sent", &t2, (long long)offset, count, total, c, Cflag);
+	latency_report();
 done:
 	if (infile)
 		close(fd);
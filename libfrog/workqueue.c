@@ -28,14 +28,42 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include "workqueue.h"
 
+static uint64_t
+workqueue_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Account for an item leaving the queue.  Caller holds wq->lock. */
+static void
+workqueue_account(
+	struct workqueue	*wq,
+	struct workqueue_item	*wi,
+	bool			stolen)
+{
+	uint64_t		wait = workqueue_now() - wi->queued_ns;
+
+	wq->stats.items++;
+	wq->stats.wait_ns += wait;
+	if (wait > wq->stats.max_wait_ns)
+		wq->stats.max_wait_ns = wait;
+	if (stolen)
+		wq->stats.steals++;
+}
+
 /* Main processing thread */
 static void *
 workqueue_thread(void *arg)
 {
 	struct workqueue	*wq = arg;
 	struct workqueue_item	*wi;
+	uint64_t		idle_start;
 
 	/*
 	 * Loop pulling work from the passed in work queue.
@@ -47,9 +75,13 @@ workqueue_thread(void *arg)
 		/*
 		 * Wait for work.
 		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			assert(wq->item_count == 0);
-			pthread_cond_wait(&wq->wakeup, &wq->lock);
+		if (wq->next_item == NULL && !wq->terminate) {
+			idle_start = workqueue_now();
+			while (wq->next_item == NULL && !wq->terminate) {
+				assert(wq->item_count == 0);
+				pthread_cond_wait(&wq->wakeup, &wq->lock);
+			}
+			wq->stats.idle_ns += workqueue_now() - idle_start;
 		}
 		if (wq->next_item == NULL && wq->terminate) {
 			pthread_mutex_unlock(&wq->lock);
@@ -63,6 +95,7 @@ workqueue_thread(void *arg)
 		wi = wq->next_item;
 		wq->next_item = wi->next;
 		wq->item_count--;
+		workqueue_account(wq, wi, false);
 
 		pthread_mutex_unlock(&wq->lock);
 
@@ -73,12 +106,189 @@ workqueue_thread(void *arg)
 	return NULL;
 }
 
+/* Deque helpers for stealing mode. */
+static void
+deque_push(
+	struct workqueue_deque	*dq,
+	struct workqueue_item	*wi,
+	bool			front)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (!dq->front) {
+		wi->next = wi->prev = NULL;
+		dq->front = dq->back = wi;
+	} else if (front) {
+		wi->prev = NULL;
+		wi->next = dq->front;
+		dq->front->prev = wi;
+		dq->front = wi;
+	} else {
+		wi->next = NULL;
+		wi->prev = dq->back;
+		dq->back->next = wi;
+		dq->back = wi;
+	}
+	dq->cost += wi->cost;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static struct workqueue_item *
+deque_pop(
+	struct workqueue_deque	*dq,
+	bool			front)
+{
+	struct workqueue_item	*wi;
+
+	pthread_mutex_lock(&dq->lock);
+	wi = front ? dq->front : dq->back;
+	if (wi) {
+		if (front) {
+			dq->front = wi->next;
+			if (dq->front)
+				dq->front->prev = NULL;
+			else
+				dq->back = NULL;
+		} else {
+			dq->back = wi->prev;
+			if (dq->back)
+				dq->back->next = NULL;
+			else
+				dq->front = NULL;
+		}
+		dq->cost -= wi->cost;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return wi;
+}
+
+static uint64_t
+deque_cost(
+	struct workqueue_deque	*dq)
+{
+	uint64_t		cost;
+
+	pthread_mutex_lock(&dq->lock);
+	cost = dq->cost;
+	pthread_mutex_unlock(&dq->lock);
+	return cost;
+}
+
+/*
+ * Take the item at the front of the deque of whichever other worker has
+ * the most work.  That is either the oldest continuation its owner
+ * queued or the last item handed to it from outside, so the owner keeps
+ * the work it would have got to soonest.
+ */
+static struct workqueue_item *
+workqueue_steal(
+	struct workqueue	*wq,
+	unsigned int		self)
+{
+	struct workqueue_item	*wi;
+	uint64_t		cost, best;
+	unsigned int		i, victim;
+
+	do {
+		best = 0;
+		victim = self;
+		for (i = 0; i < wq->thread_count; i++) {
+			if (i == self)
+				continue;
+			cost = deque_cost(&wq->deques[i]);
+			if (cost > best) {
+				best = cost;
+				victim = i;
+			}
+		}
+		if (victim == self)
+			return NULL;
+		wi = deque_pop(&wq->deques[victim], true);
+	} while (!wi);
+
+	return wi;
+}
+
+/* Return the index of the calling worker, or -1 if it isn't one of ours. */
+static int
+workqueue_self(
+	struct workqueue	*wq)
+{
+	pthread_t		self = pthread_self();
+	unsigned int		i;
+
+	for (i = 0; i < wq->thread_count; i++)
+		if (pthread_equal(wq->threads[i], self))
+			return i;
+	return -1;
+}
+
+/*
+ * Worker thread for stealing mode.  Run our own most recently queued
+ * item, or steal one, or wait until something is queued.  Exit once the
+ * queue is being torn down and no running item can queue more work.
+ */
+static void *
+workqueue_steal_thread(void *arg)
+{
+	struct workqueue_deque	*dq = arg;
+	struct workqueue	*wq = dq->queue;
+	unsigned int		self = dq - wq->deques;
+	struct workqueue_item	*wi;
+	uint64_t		idle_start;
+	bool			stolen;
+
+	while (1) {
+		stolen = false;
+		wi = deque_pop(dq, false);
+		if (!wi) {
+			wi = workqueue_steal(wq, self);
+			stolen = wi != NULL;
+		}
+
+		pthread_mutex_lock(&wq->lock);
+		if (wi) {
+			wq->item_count--;
+			wq->nr_running++;
+			workqueue_account(wq, wi, stolen);
+			pthread_mutex_unlock(&wq->lock);
+
+			(wi->function)(wi->queue, wi->index, wi->arg);
+			free(wi);
+
+			pthread_mutex_lock(&wq->lock);
+			wq->nr_running--;
+			if (wq->terminate && wq->nr_running == 0 &&
+			    wq->item_count == 0)
+				pthread_cond_broadcast(&wq->wakeup);
+			pthread_mutex_unlock(&wq->lock);
+			continue;
+		}
+
+		/* item_count says something is queued; go find it */
+		if (wq->item_count == 0) {
+			if (wq->terminate && wq->nr_running == 0) {
+				pthread_mutex_unlock(&wq->lock);
+				break;
+			}
+			idle_start = workqueue_now();
+			__atomic_add_fetch(&wq->nr_idle, 1, __ATOMIC_RELAXED);
+			pthread_cond_wait(&wq->wakeup, &wq->lock);
+			__atomic_sub_fetch(&wq->nr_idle, 1, __ATOMIC_RELAXED);
+			wq->stats.idle_ns += workqueue_now() - idle_start;
+		}
+		pthread_mutex_unlock(&wq->lock);
+	}
+
+	return NULL;
+}
+
 /* Allocate a work queue and threads. */
 int
-workqueue_create(
+workqueue_create_flags(
 	struct workqueue	*wq,
 	void			*wq_ctx,
-	unsigned int		nr_workers)
+	unsigned int		nr_workers,
+	unsigned int		flags)
 {
 	unsigned int		i;
 	int			err = 0;
@@ -89,14 +299,35 @@ workqueue_create(
 
 	wq->wq_ctx = wq_ctx;
 	wq->thread_count = nr_workers;
-	wq->threads = malloc(nr_workers * sizeof(pthread_t));
+	wq->flags = flags;
 	wq->terminate = false;
+	wq->threads = malloc(nr_workers * sizeof(pthread_t));
+	if (nr_workers && !wq->threads)
+		return ENOMEM;
+
+	if (flags & WQ_STEAL) {
+		wq->deques = calloc(nr_workers, sizeof(struct workqueue_deque));
+		if (nr_workers && !wq->deques) {
+			free(wq->threads);
+			return ENOMEM;
+		}
+		for (i = 0; i < nr_workers; i++) {
+			pthread_mutex_init(&wq->deques[i].lock, NULL);
+			wq->deques[i].queue = wq;
+		}
+	}
 
 	for (i = 0; i < nr_workers; i++) {
-		err = pthread_create(&wq->threads[i], NULL, workqueue_thread,
-				wq);
-		if (err)
+		if (flags & WQ_STEAL)
+			err = pthread_create(&wq->threads[i], NULL,
+					workqueue_steal_thread, &wq->deques[i]);
+		else
+			err = pthread_create(&wq->threads[i], NULL,
+					workqueue_thread, wq);
+		if (err) {
+			wq->thread_count = i;
 			break;
+		}
 	}
 
 	if (err)
@@ -104,16 +335,71 @@ workqueue_create(
 	return err;
 }
 
+int
+workqueue_create(
+	struct workqueue	*wq,
+	void			*wq_ctx,
+	unsigned int		nr_workers)
+{
+	return workqueue_create_flags(wq, wq_ctx, nr_workers, 0);
+}
+
+/*
+ * Queue an item in stealing mode.  Items queued by a worker are
+ * continuations of its current work and go on the back of its own deque,
+ * where it will pick them up next unless an idle worker steals them
+ * first.  Anything else goes on the front of the least loaded deque, so
+ * that each worker runs the items it is handed in submission order.
+ *
+ * The item is counted and pushed under wq->lock, so a worker can never
+ * pop it and drop item_count before we have raised it.
+ */
+static void
+workqueue_add_steal(
+	struct workqueue	*wq,
+	struct workqueue_item	*wi)
+{
+	uint64_t		cost, best = UINT64_MAX;
+	unsigned int		i, j, target = 0;
+	int			self;
+
+	self = workqueue_self(wq);
+
+	pthread_mutex_lock(&wq->lock);
+	wq->item_count++;
+	if (self >= 0) {
+		wq->stats.continuations++;
+		deque_push(&wq->deques[self], wi, false);
+	} else {
+		for (i = 0; i < wq->thread_count; i++) {
+			j = (wq->next_deque + i) % wq->thread_count;
+			cost = deque_cost(&wq->deques[j]);
+			if (cost < best) {
+				best = cost;
+				target = j;
+			}
+		}
+		wq->next_deque = (target + 1) % wq->thread_count;
+		deque_push(&wq->deques[target], wi, true);
+	}
+	if (wq->nr_idle)
+		pthread_cond_signal(&wq->wakeup);
+	pthread_mutex_unlock(&wq->lock);
+}
+
 /*
  * Create a work item consisting of a function and some arguments and
- * schedule the work item to be run via the thread pool.
+ * schedule the work item to be run via the thread pool.  The cost is a
+ * hint of how much work the item represents, in whatever units the
+ * caller likes; stealing mode uses it to spread and steal work.
  */
 int
-workqueue_add(
+workqueue_add_cost(
 	struct workqueue	*wq,
 	workqueue_func_t	func,
 	uint32_t		index,
-	void			*arg)
+	void			*arg,
+	uint64_t		cost)
 {
 	struct workqueue_item	*wi;
 
@@ -131,6 +417,14 @@ workqueue_add(
 	wi->arg = arg;
 	wi->queue = wq;
 	wi->next = NULL;
+	wi->prev = NULL;
+	wi->cost = cost ? cost : 1;
+	wi->queued_ns = workqueue_now();
+
+	if (wq->flags & WQ_STEAL) {
+		workqueue_add_steal(wq, wi);
+		return 0;
+	}
 
 	/* Now queue the new work structure to the work queue. */
 	pthread_mutex_lock(&wq->lock);
@@ -148,16 +442,45 @@ workqueue_add(
 	return 0;
 }
 
+int
+workqueue_add(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	uint32_t		index,
+	void			*arg)
+{
+	return workqueue_add_cost(wq, func, index, arg, 1);
+}
+
 /*
- * Wait for all pending work items to be processed and tear down the
- * workqueue.
+ * Should a running item hand part of its remaining work to other workers?
+ * True in stealing mode when there are more idle workers than queued
+ * items.  The caller splits its work and queues the remainder with
+ * workqueue_add(); an idle worker will steal it.
+ */
+bool
+workqueue_should_split(
+	struct workqueue	*wq)
+{
+	if (!(wq->flags & WQ_STEAL) || wq->thread_count < 2)
+		return false;
+	return __atomic_load_n(&wq->nr_idle, __ATOMIC_RELAXED) >
+	       __atomic_load_n(&wq->item_count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wait for all pending work items to be processed and for the worker
+ * threads to exit.
  */
 void
-workqueue_destroy(
+workqueue_terminate(
 	struct workqueue	*wq)
 {
 	unsigned int		i;
 
+	if (wq->terminated)
+		return;
+
 	pthread_mutex_lock(&wq->lock);
 	wq->terminate = 1;
 	pthread_mutex_unlock(&wq->lock);
@@ -166,7 +489,36 @@ workqueue_destroy(
 
 	for (i = 0; i < wq->thread_count; i++)
 		pthread_join(wq->threads[i], NULL);
+	wq->terminated = true;
+}
+
+void
+workqueue_get_stats(
+	struct workqueue	*wq,
+	struct workqueue_stats	*stats)
+{
+	pthread_mutex_lock(&wq->lock);
+	*stats = wq->stats;
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * Wait for all pending work items to be processed and tear down the
+ * workqueue.
+ */
+void
+workqueue_destroy(
+	struct workqueue	*wq)
+{
+	unsigned int		i;
 
+	workqueue_terminate(wq);
+
+	if (wq->deques) {
+		for (i = 0; i < wq->thread_count; i++)
+			pthread_mutex_destroy(&wq->deques[i].lock);
+		free(wq->deques);
+	}
 	free(wq->threads);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
@@ -29,6 +29,7 @@
 #include "xfs_trans_resv.h"
 #include "xfs_mount.h"
 #include "xfs_bit.h"
+#include "init.h"
 
 #define CACHE_DEBUG 1
 #undef CACHE_DEBUG
@@ -40,6 +41,150 @@
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+/* Statistics are bumped by many threads without holding any cache lock. */
+#define cache_stat_inc(p)	__atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+
+/*
+ * Take a cache lock, counting the times we had to wait for somebody else to
+ * drop it so that cache_report() can show which of the locks are contended.
+ */
+static inline void
+cache_lock(
+	pthread_mutex_t		*lock,
+	unsigned long long	*waits)
+{
+	if (pthread_mutex_trylock(lock) == 0)
+		return;
+	cache_stat_inc(waits);
+	pthread_mutex_lock(lock);
+}
+
+/*
+ * Each priority has c_mru_shards MRU lists.  A node always goes on the shard
+ * picked by its hash bucket, so we can find it again without searching.
+ */
+static inline struct cache_mru *
+cache_node_mru(
+	struct cache		*cache,
+	struct cache_node	*node,
+	int			priority)
+{
+	return &cache->c_mrus[priority][node->cn_hashidx &
+					(cache->c_mru_shards - 1)];
+}
+
+/*
+ * Take another reference to a node that is already referenced and hence not
+ * on any MRU list.  The caller must hold the hash chain lock so that the node
+ * cannot be reclaimed underneath us.  Returns false if the node is unused,
+ * in which case the caller must go the slow way and take it off its MRU.
+ */
+static bool
+cache_node_tryget(
+	struct cache_node	*node)
+{
+	unsigned int		count;
+
+	count = __atomic_load_n(&node->cn_count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&node->cn_count, &count,
+				count + 1, false, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Drop a reference to a node unless it is the last one, in which case the
+ * caller has to put the node on an MRU list under the node lock.
+ */
+static bool
+cache_node_tryput(
+	struct cache_node	*node)
+{
+	unsigned int		count;
+
+	count = __atomic_load_n(&node->cn_count, __ATOMIC_RELAXED);
+	while (count > 1) {
+		if (__atomic_compare_exchange_n(&node->cn_count, &count,
+				count - 1, false, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Every change to a hash chain is bracketed by these, with the chain mutex
+ * held, so that lockless lookups can tell that the chain moved under them.
+ * The sequence count is odd while the chain is being changed.
+ */
+static inline void
+cache_hash_write_begin(
+	struct cache_hash	*hash)
+{
+	__atomic_store_n(&hash->ch_seq, hash->ch_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+cache_hash_write_end(
+	struct cache_hash	*hash)
+{
+	__atomic_store_n(&hash->ch_seq, hash->ch_seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Try to find and reference a node without taking the hash chain lock.  This
+ * only works for nodes that somebody else already holds a reference to, as
+ * unreferenced nodes have to come off their MRU list under the node lock.
+ *
+ * Nodes can be reclaimed and reused while we walk the chain, so everything we
+ * see is only trusted if the chain's sequence count hasn't changed by the time
+ * we've got our reference.  Reused node memory stays a cache node (see
+ * CACHE_SCALABLE), so the worst a stale pointer can do is make us give up.
+ * Returns NULL if the caller has to do the lookup the slow way.
+ */
+static struct cache_node *
+cache_node_get_lockless(
+	struct cache		*cache,
+	struct cache_hash	*hash,
+	cache_key_t		key)
+{
+	struct list_head	*head = &hash->ch_list;
+	struct list_head	*pos;
+	struct cache_node	*node = NULL;
+	unsigned int		seq;
+
+	seq = __atomic_load_n(&hash->ch_seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return NULL;
+
+	for (pos = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	     pos != head;
+	     pos = __atomic_load_n(&pos->next, __ATOMIC_ACQUIRE)) {
+		node = list_entry(pos, struct cache_node, cn_hash);
+		if (cache->compare(node, key) == CACHE_HIT)
+			break;
+
+		/* a moved node may never lead back to head, so check often */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hash->ch_seq, __ATOMIC_RELAXED) != seq)
+			return NULL;
+	}
+	if (pos == head)
+		return NULL;
+
+	if (!cache_node_tryget(node))
+		return NULL;
+	if (__atomic_load_n(&hash->ch_seq, __ATOMIC_RELAXED) != seq) {
+		cache_node_put(cache, node);
+		return NULL;
+	}
+	return node;
+}
+
 struct cache *
 cache_init(
 	int			flags,
@@ -47,22 +192,44 @@ cache_init(
 	struct cache_operations	*cache_operations)
 {
 	struct cache *		cache;
-	unsigned int		i, maxcount;
+	struct cache_mru *	mrus;
+	unsigned int		i, j, maxcount, shards;
 
 	maxcount = hashsize * HASH_CACHE_RATIO;
 
+	shards = 1;
+	if (flags & CACHE_SCALABLE) {
+		while ((int)shards < platform_nproc() &&
+		       shards < CACHE_MAX_MRU_SHARDS)
+			shards <<= 1;
+	}
+
 	if (!(cache = malloc(sizeof(struct cache))))
 		return NULL;
 	if (!(cache->c_hash = calloc(hashsize, sizeof(struct cache_hash)))) {
 		free(cache);
 		return NULL;
 	}
+	mrus = calloc((CACHE_DIRTY_PRIORITY + 1) * shards,
+			sizeof(struct cache_mru));
+	if (!mrus) {
+		free(cache->c_hash);
+		free(cache);
+		return NULL;
+	}
 
 	cache->c_flags = flags;
 	cache->c_count = 0;
 	cache->c_max = 0;
 	cache->c_hits = 0;
 	cache->c_misses = 0;
+	cache->c_lockless_hits = 0;
+	cache->c_hash_waits = 0;
+	cache->c_mru_waits = 0;
+	cache->c_node_waits = 0;
+	cache->c_count_waits = 0;
+	cache->c_mru_shards = shards;
+	cache->c_shake_shard = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
 	cache->c_hashshift = libxfs_highbit32(hashsize);
@@ -78,13 +245,17 @@ cache_init(
 	for (i = 0; i < hashsize; i++) {
 		list_head_init(&cache->c_hash[i].ch_list);
 		cache->c_hash[i].ch_count = 0;
+		cache->c_hash[i].ch_seq = 0;
 		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
 	}
 
 	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_init(&cache->c_mrus[i].cm_list);
-		cache->c_mrus[i].cm_count = 0;
-		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
+		cache->c_mrus[i] = mrus + i * shards;
+		for (j = 0; j < shards; j++) {
+			list_head_init(&cache->c_mrus[i][j].cm_list);
+			cache->c_mrus[i][j].cm_count = 0;
+			pthread_mutex_init(&cache->c_mrus[i][j].cm_mutex, NULL);
+		}
 	}
 	return cache;
 }
@@ -147,7 +318,7 @@ void
 cache_destroy(
 	struct cache *		cache)
 {
-	unsigned int		i;
+	unsigned int		i, j;
 
 	cache_destroy_check(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
@@ -155,10 +326,13 @@ cache_destroy(
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
 	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_destroy(&cache->c_mrus[i].cm_list);
-		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
+		for (j = 0; j < cache->c_mru_shards; j++) {
+			list_head_destroy(&cache->c_mrus[i][j].cm_list);
+			pthread_mutex_destroy(&cache->c_mrus[i][j].cm_mutex);
+		}
 	}
 	pthread_mutex_destroy(&cache->c_mutex);
+	free(cache->c_mrus[0]);
 	free(cache->c_hash);
 	free(cache);
 }
@@ -192,9 +366,10 @@ cache_add_to_dirty_mru(
 	struct cache		*cache,
 	struct cache_node	*node)
 {
-	struct cache_mru	*mru = &cache->c_mrus[CACHE_DIRTY_PRIORITY];
+	struct cache_mru	*mru;
 
-	pthread_mutex_lock(&mru->cm_mutex);
+	mru = cache_node_mru(cache, node, CACHE_DIRTY_PRIORITY);
+	cache_lock(&mru->cm_mutex, &cache->c_mru_waits);
 	node->cn_old_priority = node->cn_priority;
 	node->cn_priority = CACHE_DIRTY_PRIORITY;
 	list_add(&node->cn_mru, &mru->cm_list);
@@ -203,44 +378,28 @@ cache_add_to_dirty_mru(
 }
 
 /*
- * We've hit the limit on cache size, so we need to start reclaiming nodes we've
- * used. The MRU specified by the priority is shaken.  Returns new priority at
- * end of the call (in case we call again). We are not allowed to reclaim dirty
- * objects, so we have to flush them first. If flushing fails, we move them to
- * the "dirty, unreclaimable" list.
- *
- * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
- * park unflushable (and hence unreclaimable) buffers at these priorities.
- * Trying to shake unreclaimable buffer lists when there is memory pressure is a
- * waste of time and CPU and greatly slows down cache node recycling operations.
- * Hence we only try to free them if we are being asked to purge the cache of
- * all entries.
+ * Reclaim unreferenced nodes from one MRU shard, adding them to @temp.
+ * Returns the number of nodes reclaimed.
  */
 static unsigned int
-cache_shake(
+cache_shake_mru(
 	struct cache *		cache,
+	struct cache_mru *	mru,
 	unsigned int		priority,
-	bool			purge)
+	bool			purge,
+	unsigned int		max,
+	struct list_head *	temp)
 {
-	struct cache_mru	*mru;
 	struct cache_hash *	hash;
-	struct list_head	temp;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_node *	node;
-	unsigned int		count;
-
-	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
-	if (priority > CACHE_MAX_PRIORITY && !purge)
-		priority = 0;
+	unsigned int		count = 0;
 
-	mru = &cache->c_mrus[priority];
-	count = 0;
-	list_head_init(&temp);
 	head = &mru->cm_list;
 
-	pthread_mutex_lock(&mru->cm_mutex);
+	cache_lock(&mru->cm_mutex, &cache->c_mru_waits);
 	for (pos = head->prev, n = pos->prev; pos != head;
 						pos = n, n = pos->prev) {
 		node = list_entry(pos, struct cache_node, cn_mru);
@@ -267,23 +426,76 @@ cache_shake(
 		ASSERT(node->cn_priority == priority);
 		node->cn_priority = -1;
 
-		list_move(&node->cn_mru, &temp);
+		list_move(&node->cn_mru, temp);
+		cache_hash_write_begin(hash);
 		list_del_init(&node->cn_hash);
+		cache_hash_write_end(hash);
 		hash->ch_count--;
 		mru->cm_count--;
 		pthread_mutex_unlock(&hash->ch_mutex);
 		pthread_mutex_unlock(&node->cn_mutex);
 
 		count++;
-		if (!purge && count == CACHE_SHAKE_COUNT)
+		if (!purge && count == max)
 			break;
 	}
 	pthread_mutex_unlock(&mru->cm_mutex);
 
+	return count;
+}
+
+/*
+ * We've hit the limit on cache size, so we need to start reclaiming nodes we've
+ * used. The MRU specified by the priority is shaken.  Returns new priority at
+ * end of the call (in case we call again). We are not allowed to reclaim dirty
+ * objects, so we have to flush them first. If flushing fails, we move them to
+ * the "dirty, unreclaimable" list.
+ *
+ * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
+ * park unflushable (and hence unreclaimable) buffers at these priorities.
+ * Trying to shake unreclaimable buffer lists when there is memory pressure is a
+ * waste of time and CPU and greatly slows down cache node recycling operations.
+ * Hence we only try to free them if we are being asked to purge the cache of
+ * all entries.
+ *
+ * If the MRUs are sharded, start at a different shard each time so that
+ * concurrent shakers don't all pile up on the same list, and move on to the
+ * next shard until we've found CACHE_SHAKE_COUNT nodes.
+ */
+static unsigned int
+cache_shake(
+	struct cache *		cache,
+	unsigned int		priority,
+	bool			purge)
+{
+	struct list_head	temp;
+	unsigned int		count;
+	unsigned int		shard;
+	unsigned int		i;
+
+	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
+	if (priority > CACHE_MAX_PRIORITY && !purge)
+		priority = 0;
+
+	count = 0;
+	list_head_init(&temp);
+
+	shard = __atomic_fetch_add(&cache->c_shake_shard, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < cache->c_mru_shards; i++) {
+		struct cache_mru	*mru;
+
+		mru = &cache->c_mrus[priority][(shard + i) &
+					       (cache->c_mru_shards - 1)];
+		count += cache_shake_mru(cache, mru, priority, purge,
+				CACHE_SHAKE_COUNT - count, &temp);
+		if (!purge && count == CACHE_SHAKE_COUNT)
+			break;
+	}
+
 	if (count > 0) {
 		cache->bulkrelse(cache, &temp);
 
-		pthread_mutex_lock(&cache->c_mutex);
+		cache_lock(&cache->c_mutex, &cache->c_count_waits);
 		cache->c_count -= count;
 		pthread_mutex_unlock(&cache->c_mutex);
 	}
@@ -303,20 +515,20 @@ cache_node_allocate(
 	unsigned int		nodesfree;
 	struct cache_node *	node;
 
-	pthread_mutex_lock(&cache->c_mutex);
+	cache_lock(&cache->c_mutex, &cache->c_count_waits);
 	nodesfree = (cache->c_count < cache->c_maxcount);
 	if (nodesfree) {
 		cache->c_count++;
 		if (cache->c_count > cache->c_max)
 			cache->c_max = cache->c_count;
 	}
-	cache->c_misses++;
 	pthread_mutex_unlock(&cache->c_mutex);
+	cache_stat_inc(&cache->c_misses);
 	if (!nodesfree)
 		return NULL;
 	node = cache->alloc(key);
 	if (node == NULL) {	/* uh-oh */
-		pthread_mutex_lock(&cache->c_mutex);
+		cache_lock(&cache->c_mutex, &cache->c_count_waits);
 		cache->c_count--;
 		pthread_mutex_unlock(&cache->c_mutex);
 		return NULL;
@@ -343,9 +555,10 @@ __cache_node_purge(
 	struct cache_node *	node)
 {
 	int			count;
+	struct cache_hash *	hash;
 	struct cache_mru *	mru;
 
-	pthread_mutex_lock(&node->cn_mutex);
+	cache_lock(&node->cn_mutex, &cache->c_node_waits);
 	count = node->cn_count;
 	if (count != 0) {
 		pthread_mutex_unlock(&node->cn_mutex);
@@ -358,15 +571,18 @@ __cache_node_purge(
 		return 1;
 	}
 
-	mru = &cache->c_mrus[node->cn_priority];
-	pthread_mutex_lock(&mru->cm_mutex);
+	mru = cache_node_mru(cache, node, node->cn_priority);
+	cache_lock(&mru->cm_mutex, &cache->c_mru_waits);
 	list_del_init(&node->cn_mru);
 	mru->cm_count--;
 	pthread_mutex_unlock(&mru->cm_mutex);
 
 	pthread_mutex_unlock(&node->cn_mutex);
 	pthread_mutex_destroy(&node->cn_mutex);
+	hash = cache->c_hash + node->cn_hashidx;
+	cache_hash_write_begin(hash);
 	list_del_init(&node->cn_hash);
+	cache_hash_write_end(hash);
 	cache->relse(node);
 	return 0;
 }
@@ -399,8 +615,18 @@ cache_node_get(
 	hash = cache->c_hash + hashidx;
 	head = &hash->ch_list;
 
+	if (cache->c_flags & CACHE_SCALABLE) {
+		node = cache_node_get_lockless(cache, hash, key);
+		if (node) {
+			cache_stat_inc(&cache->c_hits);
+			cache_stat_inc(&cache->c_lockless_hits);
+			*nodep = node;
+			return 0;
+		}
+	}
+
 	for (;;) {
-		pthread_mutex_lock(&hash->ch_mutex);
+		cache_lock(&hash->ch_mutex, &cache->c_hash_waits);
 		for (pos = head->next, n = pos->next; pos != head;
 						pos = n, n = pos->next) {
 			int result;
@@ -423,15 +649,22 @@ cache_node_get(
 
 			/*
 			 * node found, bump node's reference count, remove it
-			 * from its MRU list, and update stats.
+			 * from its MRU list, and update stats.  If somebody
+			 * else already holds a reference the node can't be on
+			 * an MRU list, so we don't need the node lock.
 			 */
-			pthread_mutex_lock(&node->cn_mutex);
+			if ((cache->c_flags & CACHE_SCALABLE) &&
+			    cache_node_tryget(node))
+				goto hit;
+
+			cache_lock(&node->cn_mutex, &cache->c_node_waits);
 
 			if (node->cn_count == 0) {
 				ASSERT(node->cn_priority >= 0);
 				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
+				mru = cache_node_mru(cache, node,
+						node->cn_priority);
+				cache_lock(&mru->cm_mutex, &cache->c_mru_waits);
 				mru->cm_count--;
 				list_del_init(&node->cn_mru);
 				pthread_mutex_unlock(&mru->cm_mutex);
@@ -442,14 +675,13 @@ cache_node_get(
 					node->cn_old_priority = -1;
 				}
 			}
-			node->cn_count++;
+			__atomic_add_fetch(&node->cn_count, 1, __ATOMIC_ACQUIRE);
 
 			pthread_mutex_unlock(&node->cn_mutex);
+hit:
 			pthread_mutex_unlock(&hash->ch_mutex);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
+			cache_stat_inc(&cache->c_hits);
 
 			*nodep = node;
 			return 0;
@@ -478,13 +710,15 @@ next_object:
 	node->cn_hashidx = hashidx;
 
 	/* add new node to appropriate hash */
-	pthread_mutex_lock(&hash->ch_mutex);
+	cache_lock(&hash->ch_mutex, &cache->c_hash_waits);
 	hash->ch_count++;
+	cache_hash_write_begin(hash);
 	list_add(&node->cn_hash, &hash->ch_list);
+	cache_hash_write_end(hash);
 	pthread_mutex_unlock(&hash->ch_mutex);
 
 	if (purged) {
-		pthread_mutex_lock(&cache->c_mutex);
+		cache_lock(&cache->c_mutex, &cache->c_count_waits);
 		cache->c_count -= purged;
 		pthread_mutex_unlock(&cache->c_mutex);
 	}
@@ -500,7 +734,11 @@ cache_node_put(
 {
 	struct cache_mru *	mru;
 
-	pthread_mutex_lock(&node->cn_mutex);
+	/* not the last reference, so the node stays off the MRU lists */
+	if ((cache->c_flags & CACHE_SCALABLE) && cache_node_tryput(node))
+		return;
+
+	cache_lock(&node->cn_mutex, &cache->c_node_waits);
 #ifdef CACHE_DEBUG
 	if (node->cn_count < 1) {
 		fprintf(stderr, "%s: node put on refcount %u (node=%p)\n",
@@ -513,12 +751,10 @@ cache_node_put(
 		cache_abort();
 	}
 #endif
-	node->cn_count--;
-
-	if (node->cn_count == 0) {
+	if (__atomic_sub_fetch(&node->cn_count, 1, __ATOMIC_RELEASE) == 0) {
 		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
-		pthread_mutex_lock(&mru->cm_mutex);
+		mru = cache_node_mru(cache, node, node->cn_priority);
+		cache_lock(&mru->cm_mutex, &cache->c_mru_waits);
 		mru->cm_count++;
 		list_add(&node->cn_mru, &mru->cm_list);
 		pthread_mutex_unlock(&mru->cm_mutex);
@@ -664,6 +900,19 @@ cache_flush(
 	}
 }
 
+static unsigned long
+cache_mru_count(
+	struct cache		*cache,
+	int			priority)
+{
+	unsigned long		count = 0;
+	unsigned int		i;
+
+	for (i = 0; i < cache->c_mru_shards; i++)
+		count += cache->c_mrus[priority][i].cm_count;
+	return count;
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -698,15 +947,30 @@ cache_report(
 				(cache->c_hits + cache->c_misses)
 	);
 
-	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	for (i = 0; i <= CACHE_MAX_PRIORITY; i++) {
+		count = cache_mru_count(cache, i);
+		fprintf(fp, "MRU %d entries = %6lu (%3lu%%)\n",
+			i, count, count * 100 / cache->c_count);
+	}
 
 	i = CACHE_DIRTY_PRIORITY;
-	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
-		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+	count = cache_mru_count(cache, i);
+	fprintf(fp, "Dirty MRU %d entries = %6lu (%3lu%%)\n",
+		i, count, count * 100 / cache->c_count);
+
+	if (cache->c_flags & CACHE_SCALABLE)
+		fprintf(fp, "MRU shards = %u\n"
+				"Lockless hits = %llu\n"
+				"Hash lock waits = %llu\n"
+				"MRU lock waits = %llu\n"
+				"Node lock waits = %llu\n"
+				"Count lock waits = %llu\n",
+				cache->c_mru_shards,
+				cache->c_lockless_hits,
+				cache->c_hash_waits,
+				cache->c_mru_waits,
+				cache->c_node_waits,
+				cache->c_count_waits);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -180,7 +180,7 @@ u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRCPOLY_LE);
 }
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_sw(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRC32C_POLY_LE);
 }
@@ -190,13 +190,337 @@ u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32table_le, CRCPOLY_LE);
 }
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_sw(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32ctable_le, CRC32C_POLY_LE);
 }
 #endif
 
+/*
+ * Hardware crc32c.
+ *
+ * x86 CPUs with SSE4.2 and ARMv8 CPUs with the CRC extension have an
+ * instruction that folds 8 bytes into a crc32c.  The result is the same as
+ * the table code above: no inversion on the way in or out.
+ *
+ * On x86 the instruction has a latency of three cycles but a throughput of
+ * one per cycle, so large buffers are cut into three streams that are
+ * checksummed in parallel and then stitched together.  Since crc32c is
+ * linear, crc(A|B) = crc(A) * x^(8 * len(B)) ^ crc(0, B), and multiplying
+ * by a fixed power of x modulo the polynomial is either four table lookups
+ * or, if the CPU has PCLMULQDQ, one carryless multiply and one more crc32
+ * instruction.
+ */
+typedef u32 (*crc32c_fn)(u32 crc, unsigned char const *p, size_t len);
+
+struct crc32c_kernel {
+	const char	*name;
+	crc32c_fn	fn;
+	bool		(*supported)(void);
+};
+
+/* Multiply @a by @b modulo the crc32c polynomial, in bit-reflected form. */
+static u32
+crc32c_multmodp(
+	u32		a,
+	u32		b)
+{
+	u32		m = 1U << 31;
+	u32		p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY_LE : b >> 1;
+	}
+	return p;
+}
+
+/* Compute x^@n modulo the crc32c polynomial, in bit-reflected form. */
+static u32
+crc32c_xnmodp(
+	unsigned int	n)
+{
+	u32		p = 1U << 31;	/* x^0 */
+
+	while (n--)
+		p = p & 1 ? (p >> 1) ^ CRC32C_POLY_LE : p >> 1;
+	return p;
+}
+
+static inline uint64_t
+crc32c_load64(
+	unsigned char const	*p)
+{
+	uint64_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+/* Bytes in each of the three streams for long and short buffers. */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+/* Constants to shift a crc past one stream of a given length. */
+struct crc32c_shift {
+	u32		table[4][256];	/* crc * x^(8 * len) by bytes */
+	u32		k;		/* x^(8 * len - 33), for pclmul */
+};
+
+static struct crc32c_shift crc32c_shift_long;
+static struct crc32c_shift crc32c_shift_short;
+
+typedef u32 (*crc32c_shift_fn)(u32 crc, const struct crc32c_shift *sh);
+
+static void
+crc32c_shift_init(
+	struct crc32c_shift	*sh,
+	unsigned int		len)
+{
+	u32			xn = crc32c_xnmodp(8 * len);
+	int			i;
+	int			j;
+
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 256; j++)
+			sh->table[i][j] = crc32c_multmodp(xn, (u32)j << (8 * i));
+	sh->k = crc32c_xnmodp(8 * len - 33);
+}
+
+static u32
+crc32c_shift_table(
+	u32			crc,
+	const struct crc32c_shift *sh)
+{
+	return sh->table[0][crc & 0xff] ^
+	       sh->table[1][(crc >> 8) & 0xff] ^
+	       sh->table[2][(crc >> 16) & 0xff] ^
+	       sh->table[3][crc >> 24];
+}
+
+/*
+ * The carryless product of two reflected 32-bit values is their product
+ * times x as a reflected 64-bit value, and feeding that to the crc32
+ * instruction multiplies it by x^32, hence the 33 taken off k.
+ */
+static __attribute__((target("sse4.2,pclmul"))) u32
+crc32c_shift_pclmul(
+	u32			crc,
+	const struct crc32c_shift *sh)
+{
+	__m128i			prod;
+
+	prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+			_mm_cvtsi32_si128(sh->k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+static __attribute__((target("sse4.2"))) u32
+crc32c_sse42_serial(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	uint64_t		crc64;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	crc64 = crc;
+	for (; len >= 8; len -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, crc32c_load64(p));
+	crc = crc64;
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+/* Checksum three consecutive streams of @len bytes each. */
+static __attribute__((target("sse4.2"))) u32
+crc32c_sse42_streams(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len,
+	crc32c_shift_fn		shift,
+	const struct crc32c_shift *sh)
+{
+	unsigned char const	*end = p + len;
+	uint64_t		crc0 = crc;
+	uint64_t		crc1 = 0;
+	uint64_t		crc2 = 0;
+
+	do {
+		crc0 = _mm_crc32_u64(crc0, crc32c_load64(p));
+		crc1 = _mm_crc32_u64(crc1, crc32c_load64(p + len));
+		crc2 = _mm_crc32_u64(crc2, crc32c_load64(p + 2 * len));
+		p += 8;
+	} while (p < end);
+
+	crc = shift(crc0, sh) ^ crc1;
+	return shift(crc, sh) ^ crc2;
+}
+
+static __attribute__((target("sse4.2"))) u32
+crc32c_sse42_3way(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len,
+	crc32c_shift_fn		shift)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	for (; len >= 3 * CRC32C_LONG; len -= 3 * CRC32C_LONG) {
+		crc = crc32c_sse42_streams(crc, p, CRC32C_LONG, shift,
+				&crc32c_shift_long);
+		p += 3 * CRC32C_LONG;
+	}
+	for (; len >= 3 * CRC32C_SHORT; len -= 3 * CRC32C_SHORT) {
+		crc = crc32c_sse42_streams(crc, p, CRC32C_SHORT, shift,
+				&crc32c_shift_short);
+		p += 3 * CRC32C_SHORT;
+	}
+	return crc32c_sse42_serial(crc, p, len);
+}
+
+static u32
+crc32c_le_sse42(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	return crc32c_sse42_3way(crc, p, len, crc32c_shift_table);
+}
+
+static u32
+crc32c_le_pclmul(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	return crc32c_sse42_3way(crc, p, len, crc32c_shift_pclmul);
+}
+
+static bool
+crc32c_have_sse42(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static bool
+crc32c_have_pclmul(void)
+{
+	return __builtin_cpu_supports("sse4.2") &&
+	       __builtin_cpu_supports("pclmul");
+}
+
+static void
+crc32c_arch_init(void)
+{
+	crc32c_shift_init(&crc32c_shift_long, CRC32C_LONG);
+	crc32c_shift_init(&crc32c_shift_short, CRC32C_SHORT);
+}
+
+#define CRC32C_ARCH_KERNELS \
+	{ "pclmul",	crc32c_le_pclmul,	crc32c_have_pclmul }, \
+	{ "sse4.2",	crc32c_le_sse42,	crc32c_have_sse42 },
+
+#elif defined(__aarch64__) && defined(__GNUC__) && !defined(__clang__)
+#include <sys/auxv.h>
+
+static __attribute__((target("+crc"))) u32
+crc32c_le_armv8(
+	u32			crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __builtin_aarch64_crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8)
+		crc = __builtin_aarch64_crc32cx(crc, crc32c_load64(p));
+	for (; len; len--)
+		crc = __builtin_aarch64_crc32cb(crc, *p++);
+	return crc;
+}
+
+static bool
+crc32c_have_armv8(void)
+{
+#ifdef HWCAP_CRC32
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+#else
+	return false;
+#endif
+}
+
+static void
+crc32c_arch_init(void)
+{
+}
+
+#define CRC32C_ARCH_KERNELS \
+	{ "armv8",	crc32c_le_armv8,	crc32c_have_armv8 },
+
+#else
+
+static void
+crc32c_arch_init(void)
+{
+}
+
+#define CRC32C_ARCH_KERNELS
+
+#endif
+
+static bool
+crc32c_have_sw(void)
+{
+	return true;
+}
+
+/* Every crc32c implementation, fastest first. */
+static const struct crc32c_kernel crc32c_kernels[] = {
+	CRC32C_ARCH_KERNELS
+	{ "table",	crc32c_le_sw,		crc32c_have_sw },
+};
+
+#define CRC32C_NR_KERNELS \
+	(sizeof(crc32c_kernels) / sizeof(crc32c_kernels[0]))
+
+static crc32c_fn crc32c_le_fn = crc32c_le_sw;
+
+/*
+ * Pick the fastest implementation this CPU supports before anything can
+ * compute a checksum.
+ */
+static void __attribute__((constructor))
+crc32c_init(void)
+{
+	int		i;
+
+	crc32c_arch_init();
+	for (i = 0; i < CRC32C_NR_KERNELS; i++) {
+		if (crc32c_kernels[i].supported()) {
+			crc32c_le_fn = crc32c_kernels[i].fn;
+			break;
+		}
+	}
+}
+
+u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_le_fn(crc, p, len);
+}
+
 
 #ifdef CRC32_SELFTEST
 
@@ -929,7 +1253,7 @@ static struct crc_test {
 	 0x9dc0bb48},
 };
 
-static int crc32c_test(void)
+static int crc32c_test(const struct crc32c_kernel *k)
 {
 	int i;
 	int errors = 0;
@@ -945,13 +1269,13 @@ static int crc32c_test(void)
 	for (i = 0; i < 100; i++) {
 		bytes += 2*test[i].length;
 
-		crc ^= crc32c_le(test[i].crc, test_buf +
+		crc ^= k->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length);
 	}
 
 	gettimeofday(&start, NULL);
 	for (i = 0; i < 100; i++) {
-		if (test[i].crc32c_le != crc32c_le(test[i].crc, test_buf +
+		if (test[i].crc32c_le != k->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length))
 			errors++;
 	}
@@ -961,15 +1285,48 @@ static int crc32c_test(void)
 		1000000 * (stop.tv_sec - start.tv_sec);
 
 	if (errors)
-		printf("crc32c: %d self tests failed\n", errors);
+		printf("crc32c-%s: %d self tests failed\n", k->name, errors);
 	else {
-		printf("crc32c: tests passed, %d bytes in %" PRIu64 " usec\n",
-			bytes, usec);
+		printf("crc32c-%s: tests passed, %d bytes in %" PRIu64 " usec\n",
+			k->name, bytes, usec);
 	}
 
 	return errors;
 }
 
+/*
+ * The test vectors are too short to reach the interleaved paths, so compare
+ * each kernel against the table code on long buffers at odd offsets too.
+ */
+static int crc32c_long_test(const struct crc32c_kernel *k)
+{
+	static u8 buf[65536 + 64];
+	static const size_t lengths[] = {
+		767, 768, 769, 3 * 8192 - 1, 3 * 8192, 3 * 8192 + 777, 65536,
+	};
+	u32 seed = 0x12345678;
+	int errors = 0;
+	int i, j;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		for (j = 0; j < 8; j++) {
+			if (crc32c_le_sw(~0U, buf + j, lengths[i]) !=
+			    k->fn(~0U, buf + j, lengths[i]))
+				errors++;
+		}
+	}
+
+	if (errors)
+		printf("crc32c-%s: %d long buffer tests failed\n", k->name,
+			errors);
+	return errors;
+}
+
 static int crc32_test(void)
 {
 	int i;
@@ -1029,12 +1386,85 @@ static int crc32_test(void)
 int main(int argc, char **argv)
 {
 	int errors;
+	int i;
 
 	printf("CRC_LE_BITS = %d\n", CRC_LE_BITS);
 
 	errors = crc32_test();
-	errors += crc32c_test();
+	for (i = 0; i < CRC32C_NR_KERNELS; i++) {
+		if (!crc32c_kernels[i].supported())
+			continue;
+		errors += crc32c_test(&crc32c_kernels[i]);
+		errors += crc32c_long_test(&crc32c_kernels[i]);
+	}
 
 	return errors != 0;
 }
 #endif /* CRC32_SELFTEST */
+
+#ifdef CRC32_BENCHMARK
+/*
+ * Compare the crc32c implementations supported by this machine on buffer
+ * sizes from a sector up to 64k.  Build with "make crc32bench".
+ */
+#include <time.h>
+
+#define BENCH_BYTES	(256ULL << 20)	/* checksummed per kernel and size */
+
+int main(int argc, char **argv)
+{
+	static u8 buf[65536] __attribute__((__aligned__(64)));
+	struct timespec start, stop;
+	const struct crc32c_kernel *k;
+	uint64_t nsec;
+	uint64_t loops;
+	uint64_t l;
+	size_t len;
+	u32 seed = 1;
+	u32 crc;
+	int i;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	printf("%-8s", "size");
+	for (i = 0; i < CRC32C_NR_KERNELS; i++)
+		if (crc32c_kernels[i].supported())
+			printf(" %10s", crc32c_kernels[i].name);
+	printf("   (MB/s)\n");
+
+	for (len = 512; len <= sizeof(buf); len <<= 1) {
+		printf("%-8zu", len);
+		for (i = 0; i < CRC32C_NR_KERNELS; i++) {
+			k = &crc32c_kernels[i];
+			if (!k->supported())
+				continue;
+
+			if (k->fn(~0U, buf, len) != crc32c_le_sw(~0U, buf, len)) {
+				printf(" %10s", "BAD");
+				continue;
+			}
+
+			loops = BENCH_BYTES / len;
+			crc = ~0U;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (l = 0; l < loops; l++)
+				crc = k->fn(crc, buf, len);
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+
+			/* keep the compiler from throwing the loop away */
+			buf[0] ^= crc & 1;
+
+			nsec = (stop.tv_sec - start.tv_sec) * 1000000000ULL +
+				stop.tv_nsec - start.tv_nsec;
+			printf(" %10.0f", (double)BENCH_BYTES * 1000 /
+					(nsec ? nsec : 1));
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
+#endif /* CRC32_BENCHMARK */
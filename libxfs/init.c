@@ -895,6 +895,8 @@ libxfs_destroy(void)
 {
 	int	leaked;
 
+	libxfs_aio_destroy();
+
 	/* Free everything from the buffer cache before freeing buffer zone */
 	libxfs_bcache_purge();
 	libxfs_bcache_free();
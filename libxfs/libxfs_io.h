@@ -205,6 +205,24 @@ extern int	libxfs_readbufr_map(struct xfs_buftarg *, struct xfs_buf *, int);
 
 extern int	libxfs_device_zero(struct xfs_buftarg *, xfs_daddr_t, uint);
 
+/* Asynchronous I/O */
+struct xfs_iobatch {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	unsigned int		pending;	/* requests in flight */
+	int			error;		/* first error seen */
+};
+
+extern int	libxfs_aio_init(unsigned int);
+extern void	libxfs_aio_destroy(void);
+extern void	libxfs_iobatch_init(struct xfs_iobatch *);
+extern void	libxfs_iobatch_submit(struct xfs_iobatch *, int, int, void *,
+			int, off64_t, int);
+extern int	libxfs_iobatch_wait(struct xfs_iobatch *);
+extern void	libxfs_iobatch_destroy(struct xfs_iobatch *);
+extern void	libxfs_readbuf_submit(struct xfs_iobatch *,
+			struct xfs_buftarg *, struct xfs_buf *, int);
+
 extern int libxfs_bhash_size;
 
 #define LIBXFS_BREAD	0x1
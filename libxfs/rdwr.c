@@ -31,6 +31,13 @@
 #include "xfs_trans.h"
 
 #include "libxfs.h"		/* for LIBXFS_EXIT_ON_FAILURE */
+#include "workqueue.h"
+
+#ifdef HAVE_IO_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
 
 /*
  * Important design/architecture note:
@@ -918,6 +925,8 @@ libxfs_balloc(cache_key_t key)
 }
 
 
+static int __write_buf(int fd, void *buf, int len, off64_t offset, int flags);
+
 static int
 __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 {
@@ -941,6 +950,647 @@ __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
+/*
+ * Asynchronous I/O engine.
+ *
+ * Callers gather reads and writes into an I/O batch and then wait for the
+ * whole batch to complete, so that several requests can be in flight at once.
+ * That matters a great deal for discontiguous buffers and for devices that
+ * need a deep queue to perform well.
+ *
+ * Once a program has turned the engine on with libxfs_aio_init(), every
+ * thread that submits I/O gets its own io_uring, and reaps its completions
+ * while it waits for a batch.  Where io_uring isn't available the requests
+ * go to a pool of I/O threads instead, which isn't started until the first
+ * request needs it.  If the engine is off, requests are issued synchronously
+ * from libxfs_iobatch_submit().
+ */
+struct xfs_ioreq {
+	struct xfs_iobatch	*batch;
+	void			*buf;
+	off64_t			offset;
+	int			fd;
+	int			len;
+	int			flags;
+	int			rw;
+};
+
+#define LIBXFS_AIO_DEF_DEPTH	32
+
+static unsigned int	libxfs_aio_depth;	/* zero if the engine is off */
+static unsigned int	libxfs_aio_threads;
+static pthread_mutex_t	libxfs_aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct workqueue	libxfs_aio_wq;
+static bool		libxfs_aio_pool_running;
+static bool		libxfs_aio_pool_failed;
+
+static void
+libxfs_ioreq_done(
+	struct xfs_iobatch	*batch,
+	int			error)
+{
+	pthread_mutex_lock(&batch->lock);
+	if (error && !batch->error)
+		batch->error = error;
+	if (--batch->pending == 0)
+		pthread_cond_broadcast(&batch->wait);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static int
+libxfs_ioreq_issue(
+	struct xfs_ioreq	*req)
+{
+	if (req->rw == LIBXFS_BWRITE)
+		return __write_buf(req->fd, req->buf, req->len, req->offset,
+				req->flags);
+	return __read_buf(req->fd, req->buf, req->len, req->offset,
+			req->flags);
+}
+
+#ifdef HAVE_IO_URING
+struct xfs_uring {
+	int			ring_fd;
+	unsigned int		depth;
+	bool			broken;
+
+	/* mapped rings */
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	/* submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* request slots; a slot is in flight if it has a batch */
+	struct xfs_ioreq	*reqs;
+	unsigned int		*free_slots;
+	unsigned int		nr_free;
+	unsigned int		nr_inflight;
+};
+
+static pthread_key_t	libxfs_uring_key;
+static bool		libxfs_uring_key_valid;
+static bool		libxfs_uring_ok;	/* worth setting up rings */
+
+static void
+libxfs_uring_free(
+	void			*arg)
+{
+	struct xfs_uring	*ring = arg;
+
+	/* Closing the ring waits for anything still in flight. */
+	close(ring->ring_fd);
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	free(ring->free_slots);
+	free(ring->reqs);
+	free(ring);
+}
+
+/*
+ * Can this ring do plain reads and writes?  Kernels older than 5.6 have
+ * io_uring but neither those opcodes nor the probe, so a failed probe means
+ * no.
+ */
+static bool
+libxfs_uring_probe(
+	int			ring_fd)
+{
+	struct io_uring_probe	*probe;
+	size_t			nr_ops = IORING_OP_WRITE + 1;
+	bool			ret = false;
+
+	probe = calloc(1, sizeof(*probe) +
+			nr_ops * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+			probe, nr_ops) == 0 &&
+	    probe->ops_len > IORING_OP_WRITE &&
+	    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+		ret = true;
+	free(probe);
+	return ret;
+}
+
+static struct xfs_uring *
+libxfs_uring_alloc(
+	unsigned int		depth)
+{
+	struct io_uring_params	p = {0};
+	struct xfs_uring	*ring;
+	unsigned int		i;
+
+	ring = calloc(1, sizeof(struct xfs_uring));
+	if (!ring)
+		return NULL;
+
+	ring->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ring->ring_fd < 0)
+		goto out_free;
+	if (!libxfs_uring_probe(ring->ring_fd))
+		goto out_close;
+	ring->depth = min(depth, p.sq_entries);
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto out_close;
+
+	ring->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto out_sq;
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+			IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto out_cq;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	ring->reqs = calloc(ring->depth, sizeof(struct xfs_ioreq));
+	if (!ring->reqs)
+		goto out_sqes;
+	ring->free_slots = calloc(ring->depth, sizeof(unsigned int));
+	if (!ring->free_slots)
+		goto out_reqs;
+	for (i = 0; i < ring->depth; i++)
+		ring->free_slots[i] = i;
+	ring->nr_free = ring->depth;
+
+	return ring;
+
+out_reqs:
+	free(ring->reqs);
+out_sqes:
+	munmap(ring->sqes, ring->sqes_sz);
+out_cq:
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+out_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+out_close:
+	close(ring->ring_fd);
+out_free:
+	free(ring);
+	return NULL;
+}
+
+/* Find this thread's ring, setting it up if need be. */
+static struct xfs_uring *
+libxfs_uring_get(void)
+{
+	struct xfs_uring	*ring;
+
+	if (!__atomic_load_n(&libxfs_uring_ok, __ATOMIC_RELAXED))
+		return NULL;
+
+	ring = pthread_getspecific(libxfs_uring_key);
+	if (ring)
+		return ring->broken ? NULL : ring;
+
+	ring = libxfs_uring_alloc(libxfs_aio_depth);
+	if (!ring) {
+		/* No io_uring here, so nobody else should try either. */
+		__atomic_store_n(&libxfs_uring_ok, false, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (pthread_setspecific(libxfs_uring_key, ring)) {
+		libxfs_uring_free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+/*
+ * Complete a request.  Anything short of the whole transfer is redone
+ * synchronously, so that errors and short I/O are reported exactly as the
+ * synchronous path reports them.
+ */
+static void
+libxfs_uring_complete(
+	struct xfs_uring	*ring,
+	unsigned int		slot,
+	int			res)
+{
+	struct xfs_ioreq	*req = &ring->reqs[slot];
+	struct xfs_iobatch	*batch = req->batch;
+	int			error = 0;
+
+	if (res != req->len)
+		error = libxfs_ioreq_issue(req);
+
+	req->batch = NULL;
+	ring->free_slots[ring->nr_free++] = slot;
+	ring->nr_inflight--;
+	libxfs_ioreq_done(batch, error);
+}
+
+static void
+libxfs_uring_reap(
+	struct xfs_uring	*ring)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		head;
+	unsigned int		tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		libxfs_uring_complete(ring, cqe->user_data, cqe->res);
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit whatever is queued, wait for at least @min_complete completions and
+ * reap them.  If the ring stops working, redo everything still in flight
+ * synchronously and stop using the ring; reads and writes can safely be
+ * done twice.
+ */
+static void
+libxfs_uring_enter(
+	struct xfs_uring	*ring,
+	unsigned int		min_complete)
+{
+	unsigned int		to_submit;
+	unsigned int		i;
+	int			ret;
+
+	to_submit = *ring->sq_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+			min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0,
+			NULL, 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		ring->broken = true;
+		for (i = 0; i < ring->depth; i++) {
+			if (ring->reqs[i].batch)
+				libxfs_uring_complete(ring, i, -EIO);
+		}
+		return;
+	}
+
+	libxfs_uring_reap(ring);
+}
+
+/* Queue a request on this thread's ring, if it has one. */
+static bool
+libxfs_uring_submit(
+	struct xfs_ioreq	*sreq)
+{
+	struct xfs_uring	*ring;
+	struct io_uring_sqe	*sqe;
+	unsigned int		slot;
+	unsigned int		tail;
+	unsigned int		idx;
+
+	ring = libxfs_uring_get();
+	if (!ring)
+		return false;
+	while (ring->nr_free == 0 && !ring->broken)
+		libxfs_uring_enter(ring, 1);
+	if (ring->broken)
+		return false;
+
+	slot = ring->free_slots[--ring->nr_free];
+	ring->reqs[slot] = *sreq;
+	ring->nr_inflight++;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = sreq->rw == LIBXFS_BWRITE ? IORING_OP_WRITE :
+						  IORING_OP_READ;
+	sqe->fd = sreq->fd;
+	sqe->addr = (uintptr_t)sreq->buf;
+	sqe->len = sreq->len;
+	sqe->off = sreq->offset;
+	sqe->user_data = slot;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* Start it now so that it overlaps whatever the caller does next. */
+	libxfs_uring_enter(ring, 0);
+	return true;
+}
+
+static bool
+libxfs_iobatch_pending(
+	struct xfs_iobatch	*batch)
+{
+	bool			pending;
+
+	pthread_mutex_lock(&batch->lock);
+	pending = batch->pending > 0;
+	pthread_mutex_unlock(&batch->lock);
+	return pending;
+}
+
+/* Reap this thread's ring until the batch is done or the ring is idle. */
+static void
+libxfs_uring_wait(
+	struct xfs_iobatch	*batch)
+{
+	struct xfs_uring	*ring;
+
+	if (!libxfs_uring_key_valid)
+		return;
+	ring = pthread_getspecific(libxfs_uring_key);
+	if (!ring)
+		return;
+	while (ring->nr_inflight > 0 && !ring->broken &&
+	       libxfs_iobatch_pending(batch))
+		libxfs_uring_enter(ring, 1);
+}
+
+static void
+libxfs_uring_init(void)
+{
+	if (pthread_key_create(&libxfs_uring_key, libxfs_uring_free))
+		return;
+	libxfs_uring_key_valid = true;
+	libxfs_uring_ok = true;
+}
+
+static void
+libxfs_uring_destroy(void)
+{
+	struct xfs_uring	*ring;
+
+	if (!libxfs_uring_key_valid)
+		return;
+	ring = pthread_getspecific(libxfs_uring_key);
+	if (ring)
+		libxfs_uring_free(ring);
+	pthread_key_delete(libxfs_uring_key);
+	libxfs_uring_key_valid = false;
+	libxfs_uring_ok = false;
+}
+#else
+static bool
+libxfs_uring_submit(
+	struct xfs_ioreq	*sreq)
+{
+	return false;
+}
+
+static void
+libxfs_uring_wait(
+	struct xfs_iobatch	*batch)
+{
+}
+
+static void
+libxfs_uring_init(void)
+{
+}
+
+static void
+libxfs_uring_destroy(void)
+{
+}
+#endif /* HAVE_IO_URING */
+
+static void
+libxfs_ioreq_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct xfs_ioreq	*req = arg;
+	struct xfs_iobatch	*batch = req->batch;
+	int			error;
+
+	error = libxfs_ioreq_issue(req);
+	free(req);
+	libxfs_ioreq_done(batch, error);
+}
+
+/* Start the I/O thread pool the first time somebody needs it. */
+static bool
+libxfs_aio_pool_get(void)
+{
+	bool			running;
+
+	if (__atomic_load_n(&libxfs_aio_pool_running, __ATOMIC_ACQUIRE))
+		return true;
+
+	pthread_mutex_lock(&libxfs_aio_lock);
+	if (!libxfs_aio_pool_running && !libxfs_aio_pool_failed) {
+		if (workqueue_create(&libxfs_aio_wq, NULL, libxfs_aio_threads))
+			libxfs_aio_pool_failed = true;
+		else
+			__atomic_store_n(&libxfs_aio_pool_running, true,
+					__ATOMIC_RELEASE);
+	}
+	running = libxfs_aio_pool_running;
+	pthread_mutex_unlock(&libxfs_aio_lock);
+	return running;
+}
+
+/*
+ * Turn on asynchronous I/O with up to @depth requests in flight per thread,
+ * or @depth I/O threads if io_uring isn't available.  Zero picks a default:
+ * a queue depth of LIBXFS_AIO_DEF_DEPTH, or one I/O thread per CPU.  Nothing
+ * is set up until the first request is submitted.  Returns 0 or a negative
+ * errno.
+ */
+int
+libxfs_aio_init(
+	unsigned int		depth)
+{
+	if (libxfs_aio_depth)
+		return 0;
+
+	libxfs_aio_threads = depth ? depth : platform_nproc();
+	libxfs_uring_init();
+	libxfs_aio_depth = depth ? depth : LIBXFS_AIO_DEF_DEPTH;
+	return 0;
+}
+
+/* Stop the I/O threads, if they were started, and turn the engine off. */
+void
+libxfs_aio_destroy(void)
+{
+	if (!libxfs_aio_depth)
+		return;
+	if (libxfs_aio_pool_running)
+		workqueue_destroy(&libxfs_aio_wq);
+	libxfs_aio_pool_running = false;
+	libxfs_aio_pool_failed = false;
+	libxfs_uring_destroy();
+	libxfs_aio_depth = 0;
+}
+
+void
+libxfs_iobatch_init(
+	struct xfs_iobatch	*batch)
+{
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->wait, NULL);
+	batch->pending = 0;
+	batch->error = 0;
+}
+
+/*
+ * Queue a read (@rw == LIBXFS_BREAD) or write (LIBXFS_BWRITE) of @len bytes
+ * at byte @offset of @fd.  @flags are the failure flags that would be passed
+ * to the synchronous read or write path.
+ */
+void
+libxfs_iobatch_submit(
+	struct xfs_iobatch	*batch,
+	int			rw,
+	int			fd,
+	void			*buf,
+	int			len,
+	off64_t			offset,
+	int			flags)
+{
+	struct xfs_ioreq	*req;
+	struct xfs_ioreq	sreq = {
+		.batch		= batch,
+		.buf		= buf,
+		.offset		= offset,
+		.fd		= fd,
+		.len		= len,
+		.flags		= flags,
+		.rw		= rw,
+	};
+
+	pthread_mutex_lock(&batch->lock);
+	batch->pending++;
+	pthread_mutex_unlock(&batch->lock);
+
+	if (libxfs_aio_depth) {
+		if (libxfs_uring_submit(&sreq))
+			return;
+		if (libxfs_aio_pool_get()) {
+			req = malloc(sizeof(*req));
+			if (req) {
+				*req = sreq;
+				if (!workqueue_add(&libxfs_aio_wq,
+						libxfs_ioreq_worker, 0, req))
+					return;
+				free(req);
+			}
+		}
+	}
+
+	libxfs_ioreq_done(batch, libxfs_ioreq_issue(&sreq));
+}
+
+/*
+ * Wait for every request in the batch to complete and return the first
+ * error encountered.  This must be called by the thread that submitted the
+ * requests, as it reaps that thread's io_uring.  The batch can be reused
+ * afterwards.
+ */
+int
+libxfs_iobatch_wait(
+	struct xfs_iobatch	*batch)
+{
+	int			error;
+
+	libxfs_uring_wait(batch);
+
+	pthread_mutex_lock(&batch->lock);
+	while (batch->pending > 0)
+		pthread_cond_wait(&batch->wait, &batch->lock);
+	error = batch->error;
+	batch->error = 0;
+	pthread_mutex_unlock(&batch->lock);
+	return error;
+}
+
+void
+libxfs_iobatch_destroy(
+	struct xfs_iobatch	*batch)
+{
+	pthread_cond_destroy(&batch->wait);
+	pthread_mutex_destroy(&batch->lock);
+}
+
+/*
+ * Queue I/O for every segment of a buffer, merging segments that are
+ * adjacent on disk into a single request.
+ */
+static void
+libxfs_iobatch_submit_maps(
+	struct xfs_iobatch	*batch,
+	int			rw,
+	int			fd,
+	struct xfs_buf		*bp,
+	int			flags)
+{
+	char			*buf = bp->b_addr;
+	int			i = 0;
+
+	while (i < bp->b_nmaps) {
+		xfs_daddr_t	bn = bp->b_maps[i].bm_bn;
+		int		len = BBTOB(bp->b_maps[i].bm_len);
+
+		for (i++; i < bp->b_nmaps; i++) {
+			if (bp->b_maps[i].bm_bn != bn + BTOBB(len))
+				break;
+			len += BBTOB(bp->b_maps[i].bm_len);
+		}
+
+		libxfs_iobatch_submit(batch, rw, fd, buf, len,
+				LIBXFS_BBTOOFF64(bn), flags);
+		buf += len;
+	}
+}
+
+/*
+ * Start reading a discontiguous buffer as part of @batch.  The buffer is not
+ * marked up to date; the caller must do that once libxfs_iobatch_wait
+ * returns success.
+ */
+void
+libxfs_readbuf_submit(
+	struct xfs_iobatch	*batch,
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		*bp,
+	int			flags)
+{
+	libxfs_iobatch_submit_maps(batch, LIBXFS_BREAD,
+			libxfs_device_to_fd(btp->dev), bp, flags);
+}
+
 int
 libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, xfs_buf_t *bp,
 		int len, int flags)
@@ -1024,30 +1674,21 @@ libxfs_readbuf(struct xfs_buftarg *btp, xfs_daddr_t blkno, int len, int flags,
 int
 libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 {
-	int	fd;
-	int	error = 0;
-	char	*buf;
-	int	i;
+	struct xfs_iobatch	batch;
+	int			error;
 
-	fd = libxfs_device_to_fd(btp->dev);
-	buf = bp->b_addr;
-	for (i = 0; i < bp->b_nmaps; i++) {
-		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-		int len = BBTOB(bp->b_maps[i].bm_len);
-
-		error = __read_buf(fd, buf, len, offset, flags);
-		if (error) {
-			bp->b_error = error;
-			break;
-		}
-		buf += len;
-	}
+	libxfs_iobatch_init(&batch);
+	libxfs_readbuf_submit(&batch, btp, bp, flags);
+	error = libxfs_iobatch_wait(&batch);
+	libxfs_iobatch_destroy(&batch);
 
-	if (!error)
+	if (error)
+		bp->b_error = error;
+	else
 		bp->b_flags |= LIBXFS_B_UPTODATE;
 #ifdef IO_DEBUG
-	printf("%lx: %s: read %lu bytes, error %d, blkno=%llu(%llu), %p\n",
-		pthread_self(), __FUNCTION__, buf - (char *)bp->b_addr, error,
+	printf("%lx: %s: read %u bytes, error %d, blkno=%llu(%llu), %p\n",
+		pthread_self(), __FUNCTION__, bp->b_bcount, error,
 		(long long)LIBXFS_BBTOOFF64(bp->b_bn), (long long)bp->b_bn, bp);
 #endif
 	return error;
@@ -1146,19 +1787,13 @@ libxfs_writebufr(xfs_buf_t *bp)
 		bp->b_error = __write_buf(fd, bp->b_addr, bp->b_bcount,
 				    LIBXFS_BBTOOFF64(bp->b_bn), bp->b_flags);
 	} else {
-		int	i;
-		char	*buf = bp->b_addr;
+		struct xfs_iobatch	batch;
 
-		for (i = 0; i < bp->b_nmaps; i++) {
-			off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-			int len = BBTOB(bp->b_maps[i].bm_len);
-
-			bp->b_error = __write_buf(fd, buf, len, offset,
-						  bp->b_flags);
-			if (bp->b_error)
-				break;
-			buf += len;
-		}
+		libxfs_iobatch_init(&batch);
+		libxfs_iobatch_submit_maps(&batch, LIBXFS_BWRITE, fd, bp,
+				bp->b_flags);
+		bp->b_error = libxfs_iobatch_wait(&batch);
+		libxfs_iobatch_destroy(&batch);
 	}
 
 #ifdef IO_DEBUG
@@ -421,6 +421,49 @@ AC_DEFUN([AC_HAVE_HDIO_GETGEO],
     AC_SUBST(have_hdio_getgeo)
   ])
 
+#
+# Check if we have the io_uring system calls
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring ])
+    AC_TRY_COMPILE([
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+    ], [
+         struct io_uring_params p = { 0 };
+         syscall(__NR_io_uring_setup, 1, &p);
+         syscall(__NR_io_uring_enter, 0, 0, 0, IORING_ENTER_GETEVENTS,
+                 0, 0);
+         return IORING_OP_READ;
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
+#
+# Check if we have the Linux native AIO system calls
+#
+AC_DEFUN([AC_HAVE_LINUX_AIO],
+  [ AC_MSG_CHECKING([for Linux native AIO ])
+    AC_TRY_COMPILE([
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+    ], [
+         aio_context_t ctx = 0;
+         syscall(__NR_io_setup, 1, &ctx);
+         syscall(__NR_io_submit, ctx, 0, 0);
+         syscall(__NR_io_getevents, ctx, 0, 0, 0, 0);
+         syscall(__NR_io_destroy, ctx);
+         return IOCB_CMD_PREAD;
+    ], have_linux_aio=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_linux_aio)
+  ])
+
 AC_DEFUN([AC_PACKAGE_CHECK_LTO],
   [ AC_MSG_CHECKING([if C compiler supports LTO])
     OLD_CFLAGS="$CFLAGS"
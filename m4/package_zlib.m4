@@ -0,0 +1,13 @@
+#
+# See if zlib is available on the system.
+#
+AC_DEFUN([AC_HAVE_ZLIB],
+[ AC_CHECK_HEADER([zlib.h],
+    [ AC_CHECK_LIB(z, compress2,
+        libz="-lz"
+        have_zlib=yes,
+        have_zlib=no) ],
+    have_zlib=no)
+    AC_SUBST(have_zlib)
+    AC_SUBST(libz)
+])
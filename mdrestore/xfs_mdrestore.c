@@ -18,6 +18,10 @@
 
 #include "libxfs.h"
 #include "xfs_metadump.h"
+#include "workqueue.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 char 		*progname;
 int		show_progress = 0;
@@ -51,11 +55,337 @@ print_progress(const char *fmt, ...)
 	progress_since_warning = 1;
 }
 
+/*
+ * The restore engine gathers sectors that are contiguous on the target into
+ * runs of up to RESTORE_RUN_MAX bytes and hands each run to a pool of writer
+ * threads, so that the target sees a few large writes rather than one tiny
+ * write per sector.  Each thread can have a few runs queued while the main
+ * thread carries on reading the metadump.
+ */
+#define RESTORE_RUN_MAX		(1U << 20)
+#define RESTORE_BUFS_PER_THREAD	4
+
+struct restore_buf {
+	struct restore_buf	*next;		/* free list */
+	char			*data;
+	int64_t			daddr;		/* first sector of the run */
+	int			len;		/* sectors in the run */
+	bool			busy;		/* queued or being written */
+};
+
+struct restore_engine {
+	struct workqueue	wq;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct restore_buf	*bufs;
+	struct restore_buf	*free;
+	struct restore_buf	*cur;		/* run being filled */
+	int			nr_bufs;
+	int			dst_fd;
+	int			direct_fd;	/* O_DIRECT target, or -1 */
+	int			dio_align;
+	int			error;
+	int64_t			error_daddr;
+};
+
+/*
+ * Write out one run.  Runs that O_DIRECT can't handle go through the
+ * buffered descriptor instead; Linux keeps the two coherent.
+ */
+static int
+restore_pwrite(
+	struct restore_engine	*re,
+	struct restore_buf	*rb)
+{
+	char			*p = rb->data;
+	off64_t			off = BBTOB(rb->daddr);
+	size_t			len = BBTOB(rb->len);
+	ssize_t			ret;
+	int			fd = re->dst_fd;
+
+	if (re->direct_fd >= 0 &&
+	    !(off & (re->dio_align - 1)) && !(len & (re->dio_align - 1)))
+		fd = re->direct_fd;
+
+	while (len > 0) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0 && errno == EINVAL && fd == re->direct_fd) {
+			fd = re->dst_fd;
+			continue;
+		}
+		if (ret < 0)
+			return errno;
+		if (ret == 0)
+			return EIO;
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Give a buffer back to the engine once it has been written. */
+static void
+restore_buf_done(
+	struct restore_engine	*re,
+	struct restore_buf	*rb,
+	int			error)
+{
+	pthread_mutex_lock(&re->lock);
+	if (error && !re->error) {
+		re->error = error;
+		re->error_daddr = rb->daddr;
+	}
+	rb->busy = false;
+	rb->next = re->free;
+	re->free = rb;
+	pthread_cond_broadcast(&re->wait);
+	pthread_mutex_unlock(&re->lock);
+}
+
+static void
+restore_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct restore_engine	*re = wq->wq_ctx;
+	struct restore_buf	*rb = arg;
+
+	restore_buf_done(re, rb, restore_pwrite(re, rb));
+}
+
+static void
+restore_check_error(
+	struct restore_engine	*re)
+{
+	if (re->error)
+		fatal("error writing block %llu: %s\n",
+			(unsigned long long)BBTOB(re->error_daddr),
+			strerror(re->error));
+}
+
+/* Does @rb overlap a run that has been queued but not yet written? */
+static bool
+restore_overlaps_busy(
+	struct restore_engine	*re,
+	struct restore_buf	*rb)
+{
+	struct restore_buf	*b;
+
+	for (b = re->bufs; b < re->bufs + re->nr_bufs; b++) {
+		if (b->busy && b->daddr < rb->daddr + rb->len &&
+		    rb->daddr < b->daddr + b->len)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Queue the current run.  A sector can appear more than once in a metadump
+ * and the last copy must win, so wait for any overlapping run to finish
+ * first.
+ */
+static void
+restore_submit(
+	struct restore_engine	*re)
+{
+	struct restore_buf	*rb = re->cur;
+
+	if (!rb)
+		return;
+	re->cur = NULL;
+
+	pthread_mutex_lock(&re->lock);
+	while (restore_overlaps_busy(re, rb))
+		pthread_cond_wait(&re->wait, &re->lock);
+	rb->busy = true;
+	pthread_mutex_unlock(&re->lock);
+
+	if (workqueue_add(&re->wq, restore_worker, 0, rb))
+		restore_worker(&re->wq, 0, rb);
+}
+
+static struct restore_buf *
+restore_get_buf(
+	struct restore_engine	*re)
+{
+	struct restore_buf	*rb;
+
+	pthread_mutex_lock(&re->lock);
+	while (!re->free)
+		pthread_cond_wait(&re->wait, &re->lock);
+	restore_check_error(re);
+	rb = re->free;
+	re->free = rb->next;
+	pthread_mutex_unlock(&re->lock);
+
+	rb->len = 0;
+	return rb;
+}
+
+/* Write @len bytes of metadata at sector @daddr of the target. */
+static void
+restore_write(
+	struct restore_engine	*re,
+	int64_t			daddr,
+	char			*data,
+	size_t			len)
+{
+	struct restore_buf	*rb;
+	size_t			count;
+
+	while (len > 0) {
+		rb = re->cur;
+		if (rb && (daddr != rb->daddr + rb->len ||
+			   BBTOB(rb->len) == RESTORE_RUN_MAX)) {
+			restore_submit(re);
+			rb = NULL;
+		}
+		if (!rb) {
+			rb = re->cur = restore_get_buf(re);
+			rb->daddr = daddr;
+		}
+
+		count = min(len, RESTORE_RUN_MAX - BBTOB(rb->len));
+		memcpy(rb->data + BBTOB(rb->len), data, count);
+		rb->len += BTOBB(count);
+		daddr += BTOBB(count);
+		data += count;
+		len -= count;
+	}
+}
+
+/* Write out everything queued so far and wait for it to finish. */
+static void
+restore_flush(
+	struct restore_engine	*re)
+{
+	struct restore_buf	*b;
+
+	restore_submit(re);
+
+	pthread_mutex_lock(&re->lock);
+	for (b = re->bufs; b < re->bufs + re->nr_bufs; b++) {
+		while (b->busy)
+			pthread_cond_wait(&re->wait, &re->lock);
+	}
+	restore_check_error(re);
+	pthread_mutex_unlock(&re->lock);
+}
+
+static void
+restore_engine_init(
+	struct restore_engine	*re,
+	int			dst_fd,
+	int			direct_fd,
+	int			dio_align,
+	unsigned int		nr_threads)
+{
+	int			i;
+	int			error;
+
+	memset(re, 0, sizeof(*re));
+	pthread_mutex_init(&re->lock, NULL);
+	pthread_cond_init(&re->wait, NULL);
+	re->dst_fd = dst_fd;
+	re->direct_fd = direct_fd;
+	re->dio_align = dio_align;
+
+	re->nr_bufs = nr_threads * RESTORE_BUFS_PER_THREAD;
+	re->bufs = calloc(re->nr_bufs, sizeof(struct restore_buf));
+	if (re->bufs == NULL)
+		fatal("memory allocation failure\n");
+	for (i = 0; i < re->nr_bufs; i++) {
+		error = posix_memalign((void **)&re->bufs[i].data,
+				max(dio_align, getpagesize()), RESTORE_RUN_MAX);
+		if (error)
+			fatal("memory allocation failure\n");
+		re->bufs[i].next = re->free;
+		re->free = &re->bufs[i];
+	}
+
+	error = workqueue_create(&re->wq, re, nr_threads);
+	if (error)
+		fatal("cannot create writer threads: %s\n", strerror(error));
+}
+
+static void
+restore_engine_destroy(
+	struct restore_engine	*re)
+{
+	int			i;
+
+	workqueue_destroy(&re->wq);
+	for (i = 0; i < re->nr_bufs; i++)
+		free(re->bufs[i].data);
+	free(re->bufs);
+	pthread_cond_destroy(&re->wait);
+	pthread_mutex_destroy(&re->lock);
+}
+
+/*
+ * Make sure the target can hold the whole filesystem: regular files are
+ * sized to fit, devices must already be large enough.
+ */
+static void
+set_target_size(
+	int			dst_fd,
+	int			is_target_file,
+	struct xfs_sb		*sb)
+{
+	if (is_target_file)  {
+		/* ensure regular files are correctly sized */
+
+		if (ftruncate(dst_fd, sb->sb_dblocks * sb->sb_blocksize))
+			fatal("cannot set filesystem image size: %s\n",
+				strerror(errno));
+	} else  {
+		/* ensure device is sufficiently large enough */
+
+		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
+		off64_t		off;
+
+		off = sb->sb_dblocks * sb->sb_blocksize - sizeof(lb);
+		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
+			fatal("failed to write last block, is target too "
+				"small? (error: %s)\n", strerror(errno));
+	}
+}
+
+/*
+ * Rewrite the primary superblock with sb_inprogress cleared now that the
+ * rest of the metadata is in place.
+ */
+static void
+write_primary_sb(
+	int			dst_fd,
+	struct xfs_sb		*sb)
+{
+	char			*block_buffer;
+
+	block_buffer = calloc(1, sb->sb_sectsize);
+	if (block_buffer == NULL)
+		fatal("memory allocation failure\n");
+
+	sb->sb_inprogress = 0;
+	libxfs_sb_to_disk((xfs_dsb_t *)block_buffer, sb);
+	if (xfs_sb_version_hascrc(sb)) {
+		xfs_update_cksum(block_buffer, sb->sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
+
+	if (pwrite(dst_fd, block_buffer, sb->sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
+
+	free(block_buffer);
+}
+
 /*
  * perform_restore() -- do the actual work to restore the metadump
  *
  * @src_f: A FILE pointer to the source metadump
- * @dst_fd: the file descriptor for the target file
+ * @re: the restore engine writing to the target
  * @is_target_file: designates whether the target is a regular file
  * @mbp: pointer to metadump's first xfs_metablock, read and verified by the caller
  *
@@ -64,7 +394,7 @@ print_progress(const char *fmt, ...)
 static void
 perform_restore(
 	FILE			*src_f,
-	int			dst_fd,
+	struct restore_engine	*re,
 	int			is_target_file,
 	const struct xfs_metablock	*mbp)
 {
@@ -120,23 +450,7 @@ perform_restore(
 
 	((xfs_dsb_t*)block_buffer)->sb_inprogress = 1;
 
-	if (is_target_file)  {
-		/* ensure regular files are correctly sized */
-
-		if (ftruncate(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
-			fatal("cannot set filesystem image size: %s\n",
-				strerror(errno));
-	} else  {
-		/* ensure device is sufficiently large enough */
-
-		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
-		off64_t		off;
-
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
-		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
-			fatal("failed to write last block, is target too "
-				"small? (error: %s)\n", strerror(errno));
-	}
+	set_target_size(re->dst_fd, is_target_file, &sb);
 
 	bytes_read = 0;
 
@@ -144,15 +458,10 @@ perform_restore(
 		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
 			print_progress("%lld MB read", bytes_read >> 20);
 
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(dst_fd, &block_buffer[cur_index <<
-					mbp->mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
-		}
+		for (cur_index = 0; cur_index < mb_count; cur_index++)
+			restore_write(re, be64_to_cpu(block_index[cur_index]),
+				&block_buffer[cur_index << mbp->mb_blocklog],
+				block_size);
 		if (mb_count < max_indices)
 			break;
 
@@ -175,24 +484,475 @@ perform_restore(
 	if (progress_since_warning)
 		putchar('\n');
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((xfs_dsb_t *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+	restore_flush(re);
+	write_primary_sb(re->dst_fd, &sb);
+
+	free(metablock);
+}
+
+/*
+ * Version 2 extent data decoders.  Each expands the @size encoded bytes of
+ * an extent record at @in into @len bytes at @out, and returns false if
+ * they don't decode to exactly that much data.  Records stored as they are
+ * have no decoder; their data is read straight into place.
+ */
+struct md_codec {
+	uint32_t	id;
+	bool		(*decode)(char *in, size_t size, char *out,
+				  size_t len);
+};
+
+static bool
+decode_zero(
+	char		*in,
+	size_t		size,
+	char		*out,
+	size_t		len)
+{
+	if (size != 0)
+		return false;
+	memset(out, 0, len);
+	return true;
+}
+
+static bool
+decode_zlib(
+	char		*in,
+	size_t		size,
+	char		*out,
+	size_t		len)
+{
+#ifdef HAVE_ZLIB
+	uLongf		out_len = len;
+
+	return uncompress((Bytef *)out, &out_len, (Bytef *)in, size) == Z_OK &&
+	       out_len == len;
+#else
+	fatal("image is compressed with zlib, which %s was built without\n",
+		progname);
+	return false;
+#endif
+}
+
+static const struct md_codec md_codecs[] = {
+	{ XFS_MDX_CODEC_NONE,	NULL },
+	{ XFS_MDX_CODEC_ZERO,	decode_zero },
+	{ XFS_MDX_CODEC_ZLIB,	decode_zlib },
+};
+
+/*
+ * Check an extent record header and find its codec.  No codec is used if it
+ * would make the data bigger, so the encoded data of a record always fits
+ * in a buffer of XFS_MDX_MAX_LEN sectors.
+ */
+static const struct md_codec *
+extent_codec(
+	struct xfs_metadump_extent	*xme)
+{
+	uint32_t			len = be32_to_cpu(xme->xme_len);
+	uint32_t			size = be32_to_cpu(xme->xme_size);
+	uint32_t			codec = be32_to_cpu(xme->xme_codec);
+	int				i;
+
+	if (len == 0 || len > XFS_MDX_MAX_LEN)
+		fatal("bad extent length: %u\n", len);
+	if (size > BBTOB(len))
+		fatal("bad extent size: %u\n", size);
+
+	for (i = 0; i < ARRAY_SIZE(md_codecs); i++) {
+		if (md_codecs[i].id != codec)
+			continue;
+		if (!md_codecs[i].decode && size != BBTOB(len))
+			fatal("bad extent size: %u\n", size);
+		return &md_codecs[i];
 	}
+	fatal("unknown extent codec %u\n", codec);
+	return NULL;
+}
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+static void
+decode_extent(
+	const struct md_codec		*codec,
+	struct xfs_metadump_extent	*xme,
+	char				*in,
+	char				*out)
+{
+	if (!codec->decode(in, be32_to_cpu(xme->xme_size), out,
+			BBTOB(be32_to_cpu(xme->xme_len))))
+		fatal("corrupt extent data at sector %llu\n",
+			(unsigned long long)be64_to_cpu(xme->xme_daddr));
+}
 
-	free(metablock);
+/*
+ * Read the next extent record into @xme and its decoded data into @buf,
+ * using @scratch for encoded data.  Returns the length of the extent in
+ * sectors; zero marks the end of the records.
+ */
+static int
+read_extent(
+	FILE				*src_f,
+	struct xfs_metadump_extent	*xme,
+	char				*buf,
+	char				*scratch)
+{
+	const struct md_codec		*codec;
+	uint32_t			size;
+
+	if (fread(xme, sizeof(*xme), 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (xme->xme_len == 0)
+		return 0;
+
+	codec = extent_codec(xme);
+	size = be32_to_cpu(xme->xme_size);
+	if (size && fread(codec->decode ? scratch : buf, size, 1, src_f) != 1)
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (codec->decode)
+		decode_extent(codec, xme, scratch, buf);
+	return be32_to_cpu(xme->xme_len);
+}
+
+/*
+ * Check the primary superblock at the start of a version 2 image and mark
+ * the copy in @buf as being restored.
+ */
+static void
+restore_v2_sb(
+	char			*buf,
+	struct xfs_sb		*sb)
+{
+	libxfs_sb_from_disk(sb, (xfs_dsb_t *)buf);
+
+	if (sb->sb_magicnum != XFS_SB_MAGIC)
+		fatal("bad magic number for primary superblock\n");
+
+	if (sb->sb_sectsize < XFS_MIN_SECTORSIZE ||
+	    sb->sb_sectsize > XFS_MAX_SECTORSIZE)
+		fatal("bad sector size %u in metadump image\n",
+			sb->sb_sectsize);
+
+	((xfs_dsb_t*)buf)->sb_inprogress = 1;
+}
+
+/*
+ * perform_restore_v2() -- restore a version 2 metadump
+ *
+ * The extent records are read in order, so this works on a stream; the
+ * index at the end of the image is not needed here.  src_f should be
+ * positioned just past the header.
+ */
+static void
+perform_restore_v2(
+	FILE				*src_f,
+	struct restore_engine		*re,
+	int				is_target_file)
+{
+	struct xfs_metadump_extent	xme;
+	char				*buf;
+	char				*scratch;
+	xfs_sb_t			sb;
+	int64_t				bytes_read;
+	int				len;
+
+	buf = malloc(BBTOB(XFS_MDX_MAX_LEN));
+	scratch = malloc(BBTOB(XFS_MDX_MAX_LEN));
+	if (buf == NULL || scratch == NULL)
+		fatal("memory allocation failure\n");
+
+	len = read_extent(src_f, &xme, buf, scratch);
+	if (len == 0 || xme.xme_daddr != 0)
+		fatal("first block is not the primary superblock\n");
+
+	restore_v2_sb(buf, &sb);
+	set_target_size(re->dst_fd, is_target_file, &sb);
+
+	bytes_read = 0;
+
+	do {
+		if (show_progress &&
+		    (bytes_read >> 20) != ((bytes_read + BBTOB(len)) >> 20))
+			print_progress("%lld MB read",
+					(bytes_read + BBTOB(len)) >> 20);
+		bytes_read += BBTOB(len);
+
+		restore_write(re, be64_to_cpu(xme.xme_daddr), buf, BBTOB(len));
+
+		len = read_extent(src_f, &xme, buf, scratch);
+	} while (len > 0);
+
+	if (progress_since_warning)
+		putchar('\n');
+
+	restore_flush(re);
+	write_primary_sb(re->dst_fd, &sb);
+
+	free(scratch);
+	free(buf);
+}
+
+/*
+ * Restoring a version 2 image from its index.  The records are split into
+ * batches of about RESTORE_RUN_MAX bytes, and the writer threads each read,
+ * decode and write a whole batch with positioned I/O, so reading and
+ * decoding happen in parallel too.  Each queued batch holds two engine
+ * buffers: one for the decoded data and one for the encoded data.
+ */
+struct restore_batch {
+	int				src_fd;
+	struct xfs_metadump_index	*first;
+	uint64_t			count;
+	struct restore_buf		*data;
+	struct restore_buf		*scratch;
+};
+
+static bool
+read_at(
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off64_t			off)
+{
+	ssize_t			ret;
+
+	while (len > 0) {
+		ret = pread(fd, buf, len, off);
+		if (ret <= 0)
+			return false;
+		buf = (char *)buf + ret;
+		off += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* Read and decode the record that @xmi points at into @data. */
+static void
+read_indexed_extent(
+	int				src_fd,
+	struct xfs_metadump_index	*xmi,
+	struct restore_buf		*data,
+	struct restore_buf		*scratch)
+{
+	struct xfs_metadump_extent	xme;
+	const struct md_codec		*codec;
+	off64_t				off = be64_to_cpu(xmi->xmi_offset);
+	uint32_t			size;
+
+	if (!read_at(src_fd, &xme, sizeof(xme), off))
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (xme.xme_daddr != xmi->xmi_daddr || xme.xme_len != xmi->xmi_len)
+		fatal("index does not match extent record at offset %llu\n",
+			(unsigned long long)off);
+
+	codec = extent_codec(&xme);
+	size = be32_to_cpu(xme.xme_size);
+	if (!read_at(src_fd, codec->decode ? scratch->data : data->data, size,
+			off + sizeof(xme)))
+		fatal("error reading from file: %s\n", strerror(errno));
+	if (codec->decode)
+		decode_extent(codec, &xme, scratch->data, data->data);
+
+	data->daddr = be64_to_cpu(xme.xme_daddr);
+	data->len = be32_to_cpu(xme.xme_len);
+}
+
+static void
+restore_batch_worker(
+	struct workqueue		*wq,
+	uint32_t			index,
+	void				*arg)
+{
+	struct restore_engine		*re = wq->wq_ctx;
+	struct restore_batch		*rbt = arg;
+	struct xfs_metadump_index	*xmi;
+	int				error = 0;
+
+	for (xmi = rbt->first; xmi < rbt->first + rbt->count; xmi++) {
+		read_indexed_extent(rbt->src_fd, xmi, rbt->data, rbt->scratch);
+		error = restore_pwrite(re, rbt->data);
+		if (error)
+			break;
+	}
+
+	restore_buf_done(re, rbt->data, error);
+	restore_buf_done(re, rbt->scratch, 0);
+	free(rbt);
+}
+
+static int
+index_cmp(
+	const void			*a,
+	const void			*b)
+{
+	const struct xfs_metadump_index	*ia = a;
+	const struct xfs_metadump_index	*ib = b;
+	uint64_t			da = be64_to_cpu(ia->xmi_daddr);
+	uint64_t			db = be64_to_cpu(ib->xmi_daddr);
+
+	return da < db ? -1 : da > db;
+}
+
+/*
+ * Can the records be written in any order?  Only if no sector appears in
+ * more than one of them, as the last copy of a sector has to win.
+ */
+static bool
+index_is_disjoint(
+	struct xfs_metadump_index	*index,
+	uint64_t			count,
+	off64_t				index_offset)
+{
+	struct xfs_metadump_index	*sorted;
+	uint64_t			i;
+	uint32_t			len;
+	bool				ret = true;
+
+	for (i = 0; i < count; i++) {
+		len = be32_to_cpu(index[i].xmi_len);
+		if (len == 0 || len > XFS_MDX_MAX_LEN ||
+		    be64_to_cpu(index[i].xmi_offset) >= index_offset)
+			return false;
+	}
+
+	sorted = malloc(count * sizeof(*sorted));
+	if (sorted == NULL)
+		return false;
+	memcpy(sorted, index, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), index_cmp);
+	for (i = 1; i < count; i++) {
+		if (be64_to_cpu(sorted[i - 1].xmi_daddr) +
+		    be32_to_cpu(sorted[i - 1].xmi_len) >
+		    be64_to_cpu(sorted[i].xmi_daddr)) {
+			ret = false;
+			break;
+		}
+	}
+	free(sorted);
+	return ret;
+}
+
+/*
+ * perform_restore_indexed() -- restore a version 2 metadump from its index
+ *
+ * This needs a regular file whose index is intact and whose records don't
+ * overlap.  Returns false, having written nothing and leaving src_f where it
+ * was, if the image can't be restored this way.
+ */
+static bool
+perform_restore_indexed(
+	FILE				*src_f,
+	struct restore_engine		*re,
+	int				is_target_file)
+{
+	struct xfs_metadump_trailer	xmt;
+	struct xfs_metadump_index	*index;
+	struct restore_batch		*rbt;
+	struct restore_buf		*data;
+	struct restore_buf		*scratch;
+	struct stat			st;
+	int				src_fd = fileno(src_f);
+	off64_t				index_offset;
+	uint64_t			count;
+	uint64_t			i, j;
+	int64_t				bytes_read;
+	int64_t				sectors;
+	xfs_sb_t			sb;
+	int				error;
+
+	if (fstat(src_fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size < sizeof(struct xfs_metadump_header) + sizeof(xmt))
+		return false;
+	if (!read_at(src_fd, &xmt, sizeof(xmt), st.st_size - sizeof(xmt)) ||
+	    xmt.xmt_magic != cpu_to_be32(XFS_MD_MAGIC_V2))
+		return false;
+
+	count = be64_to_cpu(xmt.xmt_index_count);
+	index_offset = be64_to_cpu(xmt.xmt_index_offset);
+	if (count == 0 || count > st.st_size / sizeof(*index) ||
+	    index_offset != st.st_size - sizeof(xmt) - count * sizeof(*index))
+		return false;
+
+	index = malloc(count * sizeof(*index));
+	if (index == NULL)
+		return false;
+	if (!read_at(src_fd, index, count * sizeof(*index), index_offset) ||
+	    index[0].xmi_daddr != 0 ||
+	    !index_is_disjoint(index, count, index_offset)) {
+		free(index);
+		return false;
+	}
+
+	/* Put the superblock in place before anything else. */
+	data = restore_get_buf(re);
+	scratch = restore_get_buf(re);
+	read_indexed_extent(src_fd, &index[0], data, scratch);
+	restore_v2_sb(data->data, &sb);
+	set_target_size(re->dst_fd, is_target_file, &sb);
+	error = restore_pwrite(re, data);
+	restore_buf_done(re, data, error);
+	restore_buf_done(re, scratch, 0);
+
+	bytes_read = BBTOB(be32_to_cpu(index[0].xmi_len));
+
+	for (i = 1; i < count; i = j) {
+		sectors = 0;
+		for (j = i; j < count && BBTOB(sectors) < RESTORE_RUN_MAX; j++)
+			sectors += be32_to_cpu(index[j].xmi_len);
+
+		if (show_progress &&
+		    (bytes_read >> 20) != ((bytes_read + BBTOB(sectors)) >> 20))
+			print_progress("%lld MB read",
+					(bytes_read + BBTOB(sectors)) >> 20);
+		bytes_read += BBTOB(sectors);
+
+		rbt = malloc(sizeof(*rbt));
+		if (rbt == NULL)
+			fatal("memory allocation failure\n");
+		rbt->src_fd = src_fd;
+		rbt->first = &index[i];
+		rbt->count = j - i;
+		rbt->data = restore_get_buf(re);
+		rbt->scratch = restore_get_buf(re);
+
+		pthread_mutex_lock(&re->lock);
+		rbt->data->busy = true;
+		rbt->scratch->busy = true;
+		pthread_mutex_unlock(&re->lock);
+
+		if (workqueue_add(&re->wq, restore_batch_worker, 0, rbt))
+			restore_batch_worker(&re->wq, 0, rbt);
+	}
+
+	if (progress_since_warning)
+		putchar('\n');
+
+	restore_flush(re);
+	write_primary_sb(re->dst_fd, &sb);
+
+	free(index);
+	return true;
+}
+
+static void
+show_metadump_info(
+	const char	*name,
+	unsigned int	info)
+{
+	if (info & XFS_METADUMP_INFO_FLAGS) {
+		printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
+		name,
+		info & XFS_METADUMP_OBFUSCATED ? "":"not ",
+		info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
+		info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
+	} else {
+		printf("%s: no informational flags present\n", name);
+	}
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] [-i] source target\n", progname);
+	fprintf(stderr, "Usage: %s [-V] [-d] [-g] [-i] [-t threads] source target\n", progname);
 	exit(1);
 }
 
@@ -205,22 +965,39 @@ main(
 {
 	FILE		*src_f;
 	int		dst_fd;
+	int		direct_fd = -1;
+	int		direct = 0;
+	int		dio_align = BBSIZE;
+	long long	dsize;
+	unsigned int	nr_threads = 1;
+	char		*p;
+	struct restore_engine re;
 	int		c;
 	int		open_flags;
 	struct stat	statbuf;
 	int		is_target_file;
 	struct xfs_metablock	mb;
+	struct xfs_metadump_header xmh;
+	unsigned int	info;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "giV")) != EOF) {
+	while ((c = getopt(argc, argv, "dgit:V")) != EOF) {
 		switch (c) {
+			case 'd':
+				direct = 1;
+				break;
 			case 'g':
 				show_progress = 1;
 				break;
 			case 'i':
 				show_info = 1;
 				break;
+			case 't':
+				nr_threads = strtoul(optarg, &p, 0);
+				if (*p != '\0' || nr_threads == 0)
+					fatal("bad thread count %s\n", optarg);
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -254,20 +1031,23 @@ main(
 
 	if (fread(&mb, sizeof(mb), 1, src_f) != 1)
 		fatal("error reading from file: %s\n", strerror(errno));
-	if (mb.mb_magic != cpu_to_be32(XFS_MD_MAGIC))
+	if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_V2)) {
+		/* the v1 metablock overlays the start of the v2 header */
+		memcpy(&xmh, &mb, sizeof(mb));
+		if (fread((char *)&xmh + sizeof(mb), sizeof(xmh) - sizeof(mb),
+				1, src_f) != 1)
+			fatal("error reading from file: %s\n", strerror(errno));
+		if (be32_to_cpu(xmh.xmh_version) != XFS_MD_VERSION_2)
+			fatal("unsupported metadump version %u\n",
+				be32_to_cpu(xmh.xmh_version));
+		info = be32_to_cpu(xmh.xmh_info);
+	} else if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC)) {
+		info = mb.mb_info;
+	} else
 		fatal("specified file is not a metadata dump\n");
 
 	if (show_info) {
-		if (mb.mb_info & XFS_METADUMP_INFO_FLAGS) {
-			printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
-			argv[optind],
-			mb.mb_info & XFS_METADUMP_OBFUSCATED ? "":"not ",
-			mb.mb_info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
-			mb.mb_info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
-		} else {
-			printf("%s: no informational flags present\n",
-				argv[optind]);
-		}
+		show_metadump_info(argv[optind], info);
 
 		if (argc - optind == 1)
 			exit(0);
@@ -299,8 +1079,26 @@ main(
 	if (dst_fd < 0)
 		fatal("couldn't open target \"%s\"\n", argv[optind]);
 
-	perform_restore(src_f, dst_fd, is_target_file, &mb);
+	if (direct) {
+		direct_fd = open(argv[optind], O_RDWR | O_DIRECT);
+		if (direct_fd < 0)
+			fatal("couldn't open target \"%s\" for direct I/O\n",
+				argv[optind]);
+		platform_findsizes(argv[optind], direct_fd, &dsize, &dio_align);
+	}
+
+	restore_engine_init(&re, dst_fd, direct_fd, dio_align, nr_threads);
+
+	if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_V2)) {
+		if (nr_threads == 1 ||
+		    !perform_restore_indexed(src_f, &re, is_target_file))
+			perform_restore_v2(src_f, &re, is_target_file);
+	} else
+		perform_restore(src_f, &re, is_target_file, &mb);
 
+	restore_engine_destroy(&re);
+	if (direct_fd >= 0)
+		close(direct_fd);
 	close(dst_fd);
 	if (src_f != stdin)
 		fclose(src_f);
@@ -0,0 +1,527 @@
+/*
+ * Copyright (C) 2018 Oracle.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "libxfs.h"
+#include "bptree.h"
+
+/*
+ * Every node is BPT_NODE_SIZE bytes with its keys stored inline, so a search
+ * touches a handful of cache lines per level instead of chasing a pointer per
+ * key.  Leaves are doubly linked so in-order walks stay at the bottom of the
+ * tree.
+ *
+ * Interior node key i is a lower bound on the keys in child i + 1 and an
+ * upper bound on everything to its left.  Deletion never rebalances: leaves
+ * and interior nodes are only freed when they empty out, which is fine for
+ * the trees repair builds, since they are mostly loaded and then walked.
+ *
+ * A key larger than everything in the tree goes straight into the last leaf
+ * if there is room, and a full node that is appended to is split by starting
+ * a new node instead of halving the old one, so loading keys in ascending
+ * order packs every node full.
+ */
+#define BPT_NODE_SIZE		256
+
+#define BPT_LEAF_KEYS		((BPT_NODE_SIZE - 2 * sizeof(void *) - \
+				  sizeof(uint64_t)) / sizeof(uint64_t))
+#define BPT_NODE_PTRS		((BPT_NODE_SIZE - sizeof(uint64_t)) / \
+				 (sizeof(uint64_t) + sizeof(void *)))
+
+struct bptree_leaf {
+	struct bptree_leaf	*next;
+	struct bptree_leaf	*prev;
+	uint64_t		nr;
+	uint64_t		keys[BPT_LEAF_KEYS];
+};
+
+struct bptree_node {
+	uint64_t		nr;		/* number of children */
+	uint64_t		keys[BPT_NODE_PTRS - 1];
+	void			*ptrs[BPT_NODE_PTRS];
+};
+
+struct bptree {
+	void			*root;
+	int			height;		/* 0: root is a leaf */
+	size_t			count;
+	struct bptree_leaf	*first;
+	struct bptree_leaf	*last;
+};
+
+/* index of the first key >= @key */
+static unsigned int
+bpt_lower_bound(
+	uint64_t		*keys,
+	unsigned int		nr,
+	uint64_t		key)
+{
+	unsigned int		lo = 0;
+	unsigned int		hi = nr;
+	unsigned int		mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* index of the first key > @key, i.e. the child that covers @key */
+static unsigned int
+bpt_upper_bound(
+	uint64_t		*keys,
+	unsigned int		nr,
+	uint64_t		key)
+{
+	unsigned int		lo = 0;
+	unsigned int		hi = nr;
+	unsigned int		mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (keys[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int
+bptree_init(
+	struct bptree		**tree)
+{
+	*tree = calloc(1, sizeof(struct bptree));
+	if (!*tree)
+		return -ENOMEM;
+	return 0;
+}
+
+static void
+bpt_free(
+	void			*node,
+	int			height)
+{
+	struct bptree_node	*n = node;
+	unsigned int		i;
+
+	if (height > 0)
+		for (i = 0; i < n->nr; i++)
+			bpt_free(n->ptrs[i], height - 1);
+	free(node);
+}
+
+void
+bptree_clear(
+	struct bptree		*tree)
+{
+	if (tree->root)
+		bpt_free(tree->root, tree->height);
+	memset(tree, 0, sizeof(*tree));
+}
+
+void
+bptree_destroy(
+	struct bptree		*tree)
+{
+	if (!tree)
+		return;
+	bptree_clear(tree);
+	free(tree);
+}
+
+size_t
+bptree_count(
+	struct bptree		*tree)
+{
+	return tree->count;
+}
+
+/*
+ * Insert @key into a leaf.  Returns 1 and the new right sibling and its
+ * lowest key if the leaf had to be split.
+ */
+static int
+bpt_leaf_insert(
+	struct bptree		*tree,
+	struct bptree_leaf	*leaf,
+	uint64_t		key,
+	uint64_t		*sep,
+	void			**right)
+{
+	struct bptree_leaf	*new;
+	unsigned int		pos;
+	unsigned int		split;
+
+	pos = bpt_lower_bound(leaf->keys, leaf->nr, key);
+	if (pos < leaf->nr && leaf->keys[pos] == key)
+		return -EEXIST;
+
+	if (leaf->nr < BPT_LEAF_KEYS) {
+		memmove(&leaf->keys[pos + 1], &leaf->keys[pos],
+			(leaf->nr - pos) * sizeof(uint64_t));
+		leaf->keys[pos] = key;
+		leaf->nr++;
+		return 0;
+	}
+
+	new = malloc(sizeof(struct bptree_leaf));
+	if (!new)
+		return -ENOMEM;
+
+	split = pos == leaf->nr ? leaf->nr : leaf->nr / 2;
+	new->nr = leaf->nr - split;
+	memcpy(new->keys, &leaf->keys[split], new->nr * sizeof(uint64_t));
+	leaf->nr = split;
+
+	if (pos <= split && split < BPT_LEAF_KEYS) {
+		memmove(&leaf->keys[pos + 1], &leaf->keys[pos],
+			(leaf->nr - pos) * sizeof(uint64_t));
+		leaf->keys[pos] = key;
+		leaf->nr++;
+	} else {
+		pos -= split;
+		memmove(&new->keys[pos + 1], &new->keys[pos],
+			(new->nr - pos) * sizeof(uint64_t));
+		new->keys[pos] = key;
+		new->nr++;
+	}
+
+	new->prev = leaf;
+	new->next = leaf->next;
+	if (leaf->next)
+		leaf->next->prev = new;
+	else
+		tree->last = new;
+	leaf->next = new;
+
+	*sep = new->keys[0];
+	*right = new;
+	return 1;
+}
+
+/*
+ * Insert @key below an interior node, splitting the node if a child split
+ * leaves it with too many children.
+ */
+static int
+bpt_node_insert(
+	struct bptree		*tree,
+	struct bptree_node	*node,
+	int			height,
+	uint64_t		key,
+	uint64_t		*sep,
+	void			**right)
+{
+	struct bptree_node	*new;
+	uint64_t		keys[BPT_NODE_PTRS];
+	void			*ptrs[BPT_NODE_PTRS + 1];
+	uint64_t		csep;
+	void			*cright;
+	unsigned int		i;
+	unsigned int		nr;
+	unsigned int		split;
+	int			error;
+
+	i = bpt_upper_bound(node->keys, node->nr - 1, key);
+	if (height > 1)
+		error = bpt_node_insert(tree, node->ptrs[i], height - 1, key,
+				&csep, &cright);
+	else
+		error = bpt_leaf_insert(tree, node->ptrs[i], key, &csep,
+				&cright);
+	if (error <= 0)
+		return error;
+
+	/* the child split; add the new child after child i */
+	if (node->nr < BPT_NODE_PTRS) {
+		memmove(&node->keys[i + 1], &node->keys[i],
+			(node->nr - 1 - i) * sizeof(uint64_t));
+		memmove(&node->ptrs[i + 2], &node->ptrs[i + 1],
+			(node->nr - 1 - i) * sizeof(void *));
+		node->keys[i] = csep;
+		node->ptrs[i + 1] = cright;
+		node->nr++;
+		return 0;
+	}
+
+	new = malloc(sizeof(struct bptree_node));
+	if (!new)
+		return -ENOMEM;
+
+	if (i + 1 == node->nr) {
+		/* appending: start a new node with just the new child */
+		new->nr = 1;
+		new->ptrs[0] = cright;
+		*sep = csep;
+		*right = new;
+		return 1;
+	}
+
+	/* lay out all the keys and children, then deal them out */
+	nr = node->nr;
+	memcpy(keys, node->keys, i * sizeof(uint64_t));
+	keys[i] = csep;
+	memcpy(&keys[i + 1], &node->keys[i], (nr - 1 - i) * sizeof(uint64_t));
+	memcpy(ptrs, node->ptrs, (i + 1) * sizeof(void *));
+	ptrs[i + 1] = cright;
+	memcpy(&ptrs[i + 2], &node->ptrs[i + 1], (nr - 1 - i) * sizeof(void *));
+	nr++;
+
+	split = nr / 2;
+	node->nr = split;
+	memcpy(node->keys, keys, (split - 1) * sizeof(uint64_t));
+	memcpy(node->ptrs, ptrs, split * sizeof(void *));
+	new->nr = nr - split;
+	memcpy(new->keys, &keys[split], (new->nr - 1) * sizeof(uint64_t));
+	memcpy(new->ptrs, &ptrs[split], new->nr * sizeof(void *));
+
+	*sep = keys[split - 1];
+	*right = new;
+	return 1;
+}
+
+/*
+ * Insert a key.  Returns -EEXIST if it's already in the tree.
+ */
+int
+bptree_insert(
+	struct bptree		*tree,
+	uint64_t		key)
+{
+	struct bptree_leaf	*leaf = tree->last;
+	struct bptree_node	*root;
+	uint64_t		sep;
+	void			*right;
+	int			error;
+
+	/* fast path for loading keys in order */
+	if (leaf && leaf->nr > 0 && leaf->nr < BPT_LEAF_KEYS &&
+	    key > leaf->keys[leaf->nr - 1]) {
+		leaf->keys[leaf->nr++] = key;
+		tree->count++;
+		return 0;
+	}
+
+	if (!tree->root) {
+		leaf = calloc(1, sizeof(struct bptree_leaf));
+		if (!leaf)
+			return -ENOMEM;
+		tree->root = tree->first = tree->last = leaf;
+		tree->height = 0;
+	}
+
+	if (tree->height > 0)
+		error = bpt_node_insert(tree, tree->root, tree->height, key,
+				&sep, &right);
+	else
+		error = bpt_leaf_insert(tree, tree->root, key, &sep, &right);
+	if (error < 0)
+		return error;
+
+	if (error > 0) {
+		root = malloc(sizeof(struct bptree_node));
+		if (!root)
+			return -ENOMEM;
+		root->nr = 2;
+		root->keys[0] = sep;
+		root->ptrs[0] = tree->root;
+		root->ptrs[1] = right;
+		tree->root = root;
+		tree->height++;
+	}
+	tree->count++;
+	return 0;
+}
+
+/*
+ * Remove @key below @node.  Returns 1 if @node emptied out and was freed.
+ */
+static int
+bpt_delete(
+	struct bptree		*tree,
+	void			*node,
+	int			height,
+	uint64_t		key)
+{
+	struct bptree_node	*n = node;
+	struct bptree_leaf	*leaf = node;
+	unsigned int		i;
+	int			error;
+
+	if (height == 0) {
+		i = bpt_lower_bound(leaf->keys, leaf->nr, key);
+		if (i == leaf->nr || leaf->keys[i] != key)
+			return -ENOENT;
+		memmove(&leaf->keys[i], &leaf->keys[i + 1],
+			(leaf->nr - i - 1) * sizeof(uint64_t));
+		if (--leaf->nr > 0)
+			return 0;
+
+		if (leaf->prev)
+			leaf->prev->next = leaf->next;
+		else
+			tree->first = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = leaf->prev;
+		else
+			tree->last = leaf->prev;
+		free(leaf);
+		return 1;
+	}
+
+	i = bpt_upper_bound(n->keys, n->nr - 1, key);
+	error = bpt_delete(tree, n->ptrs[i], height - 1, key);
+	if (error <= 0)
+		return error;
+
+	/* child i is gone, along with the key that bounds it */
+	if (i > 0)
+		memmove(&n->keys[i - 1], &n->keys[i],
+			(n->nr - 1 - i) * sizeof(uint64_t));
+	else if (n->nr > 1)
+		memmove(&n->keys[0], &n->keys[1],
+			(n->nr - 2) * sizeof(uint64_t));
+	memmove(&n->ptrs[i], &n->ptrs[i + 1], (n->nr - 1 - i) * sizeof(void *));
+	if (--n->nr > 0)
+		return 0;
+	free(n);
+	return 1;
+}
+
+/*
+ * Delete a key.  Returns -ENOENT if it isn't in the tree.
+ */
+int
+bptree_delete(
+	struct bptree		*tree,
+	uint64_t		key)
+{
+	struct bptree_node	*root;
+	int			error;
+
+	if (!tree->root)
+		return -ENOENT;
+
+	error = bpt_delete(tree, tree->root, tree->height, key);
+	if (error < 0)
+		return error;
+	tree->count--;
+
+	if (error > 0) {
+		tree->root = NULL;
+		tree->height = 0;
+		tree->first = tree->last = NULL;
+		return 0;
+	}
+
+	/* drop interior roots with a single child */
+	while (tree->height > 0) {
+		root = tree->root;
+		if (root->nr > 1)
+			break;
+		tree->root = root->ptrs[0];
+		tree->height--;
+		free(root);
+	}
+	return 0;
+}
+
+bool
+bptree_first(
+	struct bptree		*tree,
+	struct bptree_cursor	*cur,
+	uint64_t		*key)
+{
+	cur->leaf = tree->first;
+	cur->index = 0;
+	if (!cur->leaf)
+		return false;
+	*key = cur->leaf->keys[0];
+	return true;
+}
+
+bool
+bptree_last(
+	struct bptree		*tree,
+	struct bptree_cursor	*cur,
+	uint64_t		*key)
+{
+	cur->leaf = tree->last;
+	if (!cur->leaf)
+		return false;
+	cur->index = cur->leaf->nr - 1;
+	*key = cur->leaf->keys[cur->index];
+	return true;
+}
+
+/*
+ * Point @cur at the first key >= @key and return it in @found.
+ */
+bool
+bptree_seek(
+	struct bptree		*tree,
+	uint64_t		key,
+	struct bptree_cursor	*cur,
+	uint64_t		*found)
+{
+	struct bptree_node	*node = tree->root;
+	struct bptree_leaf	*leaf;
+	int			height;
+
+	cur->leaf = NULL;
+	if (!node)
+		return false;
+
+	for (height = tree->height; height > 0; height--)
+		node = node->ptrs[bpt_upper_bound(node->keys, node->nr - 1,
+				key)];
+	leaf = (struct bptree_leaf *)node;
+
+	/* deletions can leave the answer in the next leaf over */
+	cur->index = bpt_lower_bound(leaf->keys, leaf->nr, key);
+	if (cur->index == leaf->nr) {
+		leaf = leaf->next;
+		cur->index = 0;
+	}
+	cur->leaf = leaf;
+	if (!leaf)
+		return false;
+	*found = leaf->keys[cur->index];
+	return true;
+}
+
+bool
+bptree_next(
+	struct bptree_cursor	*cur,
+	uint64_t		*key)
+{
+	if (!cur->leaf)
+		return false;
+	if (++cur->index >= cur->leaf->nr) {
+		cur->leaf = cur->leaf->next;
+		cur->index = 0;
+		if (!cur->leaf)
+			return false;
+	}
+	*key = cur->leaf->keys[cur->index];
+	return true;
+}
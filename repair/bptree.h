@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 Oracle.  All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _BPTREE_H
+#define _BPTREE_H
+
+/*
+ * A B+tree of unique 64-bit keys with no values attached.  Callers pack
+ * whatever they need to sort on into the key.
+ */
+struct bptree;
+struct bptree_leaf;
+
+struct bptree_cursor {
+	struct bptree_leaf	*leaf;
+	unsigned int		index;
+};
+
+int
+bptree_init(
+	struct bptree		**tree);
+
+void
+bptree_destroy(
+	struct bptree		*tree);
+
+void
+bptree_clear(
+	struct bptree		*tree);
+
+size_t
+bptree_count(
+	struct bptree		*tree);
+
+int
+bptree_insert(
+	struct bptree		*tree,
+	uint64_t		key);
+
+int
+bptree_delete(
+	struct bptree		*tree,
+	uint64_t		key);
+
+bool
+bptree_first(
+	struct bptree		*tree,
+	struct bptree_cursor	*cur,
+	uint64_t		*key);
+
+bool
+bptree_last(
+	struct bptree		*tree,
+	struct bptree_cursor	*cur,
+	uint64_t		*key);
+
+bool
+bptree_seek(
+	struct bptree		*tree,
+	uint64_t		key,
+	struct bptree_cursor	*cur,
+	uint64_t		*found);
+
+bool
+bptree_next(
+	struct bptree_cursor	*cur,
+	uint64_t		*key);
+
+#endif /* _BPTREE_H */
@@ -38,6 +38,22 @@ static int states[16] =
 
 static struct btree_root	**ag_bmap;
 
+/*
+ * Alternatively, the block map can be kept as a flat array with four bits
+ * per block, packed the same way as the realtime map below.  This costs a
+ * fixed half byte per block, but lookups and updates never have to walk a
+ * tree or split and merge extents, so it wins on fragmented filesystems as
+ * long as it fits in memory.
+ */
+struct ag_pmap {
+	uint64_t		*words;
+	xfs_agblock_t		nblocks;	/* blocks in this AG */
+};
+
+static struct ag_pmap		*ag_pmap;
+
+int				bmap_mode = BMAP_AUTO;
+
 static void
 update_bmap(
 	struct btree_root	*bmap,
@@ -134,6 +150,98 @@ update_bmap(
 	btree_insert(bmap, end, prev_state);
 }
 
+/* block records fit into uint64_t's units */
+#define XR_BB_UNIT	64			/* number of bits/unit */
+#define XR_BB		4			/* bits per block record */
+#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
+#define XR_BB_MASK	0xF			/* block record mask */
+
+/* a whole unit of records in the same state */
+#define XR_BB_FILL(state)	((uint64_t)(state) * 0x1111111111111111ULL)
+
+static void
+update_pmap(
+	struct ag_pmap		*pm,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		blen,
+	int			state)
+{
+	uint64_t		fill = XR_BB_FILL(state);
+	uint64_t		first_mask;
+	uint64_t		last_mask;
+	uint64_t		end;
+	size_t			first;
+	size_t			last;
+	size_t			i;
+
+	end = min((uint64_t)agbno + blen, (uint64_t)pm->nblocks);
+	if (agbno >= end)
+		return;
+
+	first = agbno / XR_BB_NUM;
+	last = (end - 1) / XR_BB_NUM;
+	first_mask = ~0ULL << ((agbno % XR_BB_NUM) * XR_BB);
+	last_mask = ~0ULL >> ((XR_BB_NUM - 1 - (end - 1) % XR_BB_NUM) * XR_BB);
+
+	if (first == last) {
+		first_mask &= last_mask;
+		pm->words[first] = (pm->words[first] & ~first_mask) |
+				   (fill & first_mask);
+		return;
+	}
+
+	pm->words[first] = (pm->words[first] & ~first_mask) |
+			   (fill & first_mask);
+	for (i = first + 1; i < last; i++)
+		pm->words[i] = fill;
+	pm->words[last] = (pm->words[last] & ~last_mask) | (fill & last_mask);
+}
+
+static int
+lookup_pmap(
+	struct ag_pmap		*pm,
+	xfs_agblock_t		agbno,
+	xfs_agblock_t		maxbno,
+	xfs_extlen_t		*blen)
+{
+	uint64_t		diff;
+	xfs_agblock_t		end;
+	size_t			i;
+	size_t			last;
+	int			state;
+
+	/* everything past the end of the AG is out of bounds */
+	if (agbno >= pm->nblocks)
+		return blen ? -1 : XR_E_BAD_STATE;
+
+	i = agbno / XR_BB_NUM;
+	state = (pm->words[i] >> ((agbno % XR_BB_NUM) * XR_BB)) & XR_BB_MASK;
+	if (!blen)
+		return state;
+
+	end = min(maxbno, pm->nblocks);
+	if (end <= agbno) {
+		*blen = 0;
+		return state;
+	}
+
+	/*
+	 * Find the first record that differs from @state, a unit at a time.
+	 * Records before @agbno in the first unit don't count.
+	 */
+	last = (end - 1) / XR_BB_NUM;
+	diff = (pm->words[i] ^ XR_BB_FILL(state)) &
+	       (~0ULL << ((agbno % XR_BB_NUM) * XR_BB));
+	while (!diff && i < last)
+		diff = pm->words[++i] ^ XR_BB_FILL(state);
+
+	if (diff)
+		end = min((xfs_agblock_t)(i * XR_BB_NUM +
+				__builtin_ctzll(diff) / XR_BB), end);
+	*blen = end - agbno;
+	return state;
+}
+
 void
 set_bmap_ext(
 	xfs_agnumber_t		agno,
@@ -141,6 +249,10 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
+	if (ag_pmap) {
+		update_pmap(&ag_pmap[agno], agbno, blen, state);
+		return;
+	}
 	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
 }
 
@@ -154,6 +266,9 @@ get_bmap_ext(
 	int			*statep;
 	unsigned long		key;
 
+	if (ag_pmap)
+		return lookup_pmap(&ag_pmap[agno], agbno, maxbno, blen);
+
 	statep = btree_find(ag_bmap[agno], agbno, &key);
 	if (!statep)
 		return -1;
@@ -179,12 +294,6 @@ get_bmap_ext(
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
-/* block records fit into uint64_t's units */
-#define XR_BB_UNIT	64			/* number of bits/unit */
-#define XR_BB		4			/* bits per block record */
-#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
-#define XR_BB_MASK	0xF			/* block record mask */
-
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
  */
@@ -255,6 +364,13 @@ reset_bmaps(xfs_mount_t *mp)
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		if (ag_pmap) {
+			memset(ag_pmap[agno].words, 0,
+				howmany(ag_size, XR_BB_NUM) * sizeof(uint64_t));
+			update_pmap(&ag_pmap[agno], 0, ag_hdr_block,
+					XR_E_INUSE_FS);
+			continue;
+		}
 #ifdef BTREE_STATS
 		if (btree_find(ag_bmap[agno], 0, NULL)) {
 			printf("ag_bmap[%d] btree stats:\n", i);
@@ -285,22 +401,73 @@ reset_bmaps(xfs_mount_t *mp)
 	reset_rt_bmap();
 }
 
+/*
+ * Pick the block map representation.  The packed map needs half a byte per
+ * block whatever the filesystem looks like, so use it when that is no more
+ * than a quarter of @max_mem (in kilobytes) and the AGs are big enough for
+ * tree walks to hurt; otherwise fall back to the extent btree, whose size
+ * depends on how fragmented the filesystem is.
+ */
+void
+select_bmap_mode(
+	xfs_mount_t	*mp,
+	unsigned long	max_mem)
+{
+	if (bmap_mode != BMAP_AUTO)
+		return;
+
+	if (mp->m_sb.sb_agblocks >= BMAP_PACKED_MIN_AGBLOCKS &&
+	    (mp->m_sb.sb_dblocks >> (10 + 1)) <= max_mem / 4)
+		bmap_mode = BMAP_PACKED;
+	else
+		bmap_mode = BMAP_BTREE;
+}
+
+static void
+init_pmaps(xfs_mount_t *mp)
+{
+	xfs_agnumber_t	agno;
+	xfs_agblock_t	ag_size = mp->m_sb.sb_agblocks;
+
+	ag_pmap = calloc(mp->m_sb.sb_agcount, sizeof(struct ag_pmap));
+	if (!ag_pmap)
+		do_error(_("couldn't allocate block map\n"));
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (agno == mp->m_sb.sb_agcount - 1)
+			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
+				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		ag_pmap[agno].nblocks = ag_size;
+		ag_pmap[agno].words = malloc(howmany(ag_size, XR_BB_NUM) *
+				sizeof(uint64_t));
+		if (!ag_pmap[agno].words)
+			do_error(
+	_("couldn't allocate block map for AG %u, size = %u\n"),
+				agno, ag_size);
+	}
+}
+
 void
 init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
-	if (!ag_bmap)
-		do_error(_("couldn't allocate block map btree roots\n"));
-
 	ag_locks = calloc(mp->m_sb.sb_agcount, sizeof(struct aglock));
 	if (!ag_locks)
 		do_error(_("couldn't allocate block map locks\n"));
-
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+	for (i = 0; i < mp->m_sb.sb_agcount; i++)
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
+
+	if (bmap_mode == BMAP_PACKED) {
+		init_pmaps(mp);
+	} else {
+		ag_bmap = calloc(mp->m_sb.sb_agcount,
+				sizeof(struct btree_root *));
+		if (!ag_bmap)
+			do_error(
+			_("couldn't allocate block map btree roots\n"));
+		for (i = 0; i < mp->m_sb.sb_agcount; i++)
+			btree_init(&ag_bmap[i]);
 	}
 
 	init_rt_bmap(mp);
@@ -312,10 +479,128 @@ free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
-	free(ag_bmap);
-	ag_bmap = NULL;
+	if (ag_pmap) {
+		for (i = 0; i < mp->m_sb.sb_agcount; i++)
+			free(ag_pmap[i].words);
+		free(ag_pmap);
+		ag_pmap = NULL;
+	} else {
+		for (i = 0; i < mp->m_sb.sb_agcount; i++)
+			btree_destroy(ag_bmap[i]);
+		free(ag_bmap);
+		ag_bmap = NULL;
+	}
 
 	free_rt_bmap(mp);
 }
+
+#ifdef BMAP_BENCHMARK
+/*
+ * Compare the btree and packed block maps on a randomly fragmented set of
+ * AGs: first mark extents the way the inode and btree scans do, with a
+ * lookup before every update, then walk every AG the way phase 4 and 5 do.
+ * Build with "make bmapbench".
+ */
+#include <time.h>
+
+struct aglock	*ag_locks;
+
+void
+do_error(char const *msg, ...)
+{
+	va_list		args;
+
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+	exit(1);
+}
+
+static uint64_t
+bench_nsec(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+bench_one(
+	xfs_mount_t	*mp,
+	int		mode,
+	unsigned long	nr_extents)
+{
+	xfs_agnumber_t	agno;
+	xfs_agblock_t	agbno, end;
+	xfs_extlen_t	blen;
+	uint64_t	seed = 42;
+	uint64_t	start, mark, walk;
+	uint64_t	sum = 0;
+	unsigned long	runs = 0;
+	unsigned long	i;
+	int		state;
+
+	bmap_mode = mode;
+	init_bmaps(mp);
+
+	start = bench_nsec();
+	for (i = 0; i < nr_extents; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		agno = (seed >> 33) % mp->m_sb.sb_agcount;
+		agbno = (seed >> 13) % mp->m_sb.sb_agblocks;
+		end = min(agbno + 1 + (xfs_agblock_t)(seed >> 60),
+			  mp->m_sb.sb_agblocks);
+		while (agbno < end) {
+			state = get_bmap_ext(agno, agbno, end, &blen);
+			set_bmap_ext(agno, agbno, blen, state == XR_E_UNKNOWN ?
+					XR_E_INUSE : XR_E_MULT);
+			agbno += blen;
+		}
+	}
+	mark = bench_nsec() - start;
+
+	start = bench_nsec();
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno += blen) {
+			state = get_bmap_ext(agno, agbno, mp->m_sb.sb_agblocks,
+					&blen);
+			sum += (uint64_t)state * blen;
+			runs++;
+		}
+	}
+	walk = bench_nsec() - start;
+
+	printf("%-8s %10.1f %10.1f %10lu %16llx\n",
+		mode == BMAP_PACKED ? "packed" : "btree",
+		mark / 1e6, walk / 1e6, runs, (unsigned long long)sum);
+	free_bmaps(mp);
+	free(ag_locks);
+}
+
+int
+main(
+	int		argc,
+	char		**argv)
+{
+	xfs_mount_t	mp = { 0 };
+	unsigned long	nr_extents;
+
+	mp.m_sb.sb_agcount = 4;
+	mp.m_sb.sb_agblocks = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 24;
+	mp.m_sb.sb_dblocks = (xfs_rfsblock_t)mp.m_sb.sb_agcount *
+			     mp.m_sb.sb_agblocks;
+	mp.m_sb.sb_sectsize = 512;
+	mp.m_sb.sb_blocksize = 4096;
+	nr_extents = argc > 2 ? strtoul(argv[2], NULL, 0) :
+			mp.m_sb.sb_dblocks / 16;
+
+	printf("%u AGs of %u blocks, %lu extents\n", mp.m_sb.sb_agcount,
+		mp.m_sb.sb_agblocks, nr_extents);
+	printf("%-8s %10s %10s %10s %16s\n", "map", "mark(ms)", "walk(ms)",
+		"runs", "checksum");
+	bench_one(&mp, BMAP_BTREE, nr_extents);
+	bench_one(&mp, BMAP_PACKED, nr_extents);
+	return 0;
+}
+#endif /* BMAP_BENCHMARK */
@@ -31,6 +31,19 @@
  * block map -- track state of each filesystem block.
  */
 
+/* how the block map is kept */
+enum bmap_mode {
+	BMAP_AUTO,		/* decide from the AG size and memory budget */
+	BMAP_BTREE,		/* extents of blocks in the same state */
+	BMAP_PACKED,		/* four bits per block */
+};
+
+/* don't bother packing AGs smaller than this, in blocks */
+#define BMAP_PACKED_MIN_AGBLOCKS	65536
+
+extern int	bmap_mode;
+
+void		select_bmap_mode(xfs_mount_t *mp, unsigned long max_mem);
 void		init_bmaps(xfs_mount_t *mp);
 void		reset_bmaps(xfs_mount_t *mp);
 void		free_bmaps(xfs_mount_t *mp);
@@ -66,14 +79,15 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
 
 typedef unsigned char extent_state_t;
 
+/*
+ * free space extent record, as handed out by the bno/bcnt tree routines.
+ * The records belong to the trees and are only valid until the next
+ * call into the same tree.
+ */
 typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
 	extent_state_t		ex_state;	/* see state flags below */
-
-	struct extent_tree_node		*next;	/* for bcnt extent lists */
-	struct extent_tree_node		*last;	/* for bcnt extent list anchors */
 #if 0
 	xfs_ino_t		ex_inode;	/* owner, NULL if free or  */
 						/*	multiply allocated */
@@ -132,14 +146,18 @@ extent_tree_node_t *
 find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
 
 extent_tree_node_t *
-findfirst_bno_extent(xfs_agnumber_t agno);
-
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
+/*
+ * bulk load both trees from free extents sorted by start block and
+ * packed as (startblock << 32 | blockcount)
+ */
+void
+load_free_extents(xfs_agnumber_t agno, uint64_t *exts, size_t nr);
+
 /*
  * bcnt tree functions
  */
@@ -150,9 +168,6 @@ add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 extent_tree_node_t *
 findfirst_bcnt_extent(xfs_agnumber_t agno);
 
-extent_tree_node_t *
-find_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
-
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno);
 
@@ -181,11 +196,6 @@ int		search_rt_dup_extent(xfs_mount_t	*mp,
  * extent/tree recyling and deletion routines
  */
 
-/*
- * return an extent node to the extent node free list
- */
-void		release_extent_tree_node(extent_tree_node_t *node);
-
 /*
  * recycle all the nodes in the per-AG tree
  */
@@ -264,35 +274,43 @@ typedef struct parent_list  {
 #endif
 } parent_list_t;
 
-union ino_nlink {
-	uint8_t		*un8;
-	uint16_t	*un16;
-	uint32_t	*un32;
-};
+/*
+ * Link counts are kept in a byte per inode.  Counts that don't fit are
+ * stored in a per-AG side table and the byte is set to XR_NLINK_SPILL.
+ */
+#define XR_NLINK_SPILL		0xff
 
 typedef struct ino_ex_data  {
 	uint64_t		ino_reached;	/* bit == 1 if reached */
 	uint64_t		ino_processed;	/* reference checked bit mask */
 	parent_list_t		*parents;
-	union ino_nlink		counted_nlinks;/* counted nlinks in P6 */
+	uint8_t			counted_nlinks[XFS_INODES_PER_CHUNK];
+						/* counted nlinks in P6 */
 } ino_ex_data_t;
 
+/*
+ * Inode records are carved out of per-AG arenas and indexed by chunk
+ * number (agino >> XFS_INODES_PER_CHUNK_LOG) of their starting inode, so
+ * they carry no tree linkage of their own.
+ */
 typedef struct ino_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agino_t		ino_startnum;	/* starting inode # */
+	xfs_agnumber_t		ino_agno;	/* AG owning the record */
 	xfs_inofree_t		ir_free;	/* inode free bit mask */
 	uint64_t		ir_sparse;	/* sparse inode bitmask */
 	uint64_t		ino_confirmed;	/* confirmed bitmask */
 	uint64_t		ino_isa_dir;	/* bit == 1 if a directory */
 	uint64_t		ino_was_rl;	/* bit == 1 if reflink flag set */
 	uint64_t		ino_is_rl;	/* bit == 1 if reflink flag should be set */
-	uint8_t			nlink_size;
-	union ino_nlink		disk_nlinks;	/* on-disk nlinks, set in P3 */
 	union  {
 		ino_ex_data_t	*ex_data;	/* phases 6,7 */
 		parent_list_t	*plist;		/* phases 2-5 */
+		struct ino_tree_node *next_free; /* on the arena free list */
 	} ino_un;
-	uint8_t			*ftypes;	/* phases 3,6 */
+	uint8_t			disk_nlinks[XFS_INODES_PER_CHUNK];
+						/* on-disk nlinks, set in P3 */
+	uint8_t			ftypes[XFS_INODES_PER_CHUNK / 2];
+						/* phases 3,6, 4 bits each */
 } ino_tree_node_t;
 
 #define INOS_PER_IREC	(sizeof(uint64_t) * NBBY)
@@ -311,29 +329,15 @@ void		free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
 void		get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 			      ino_tree_node_t *ino_rec);
 
-extern avltree_desc_t     **inode_tree_ptrs;
-
 static inline int
 get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
 {
 	return XFS_INO_TO_AGINO(mp, ino) - irec->ino_startnum;
 }
-static inline ino_tree_node_t *
-findfirst_inode_rec(xfs_agnumber_t agno)
-{
-	return((ino_tree_node_t *) inode_tree_ptrs[agno]->avl_firstino);
-}
-static inline ino_tree_node_t *
-find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
-{
-	/*
-	 * Is the AG inside the file system
-	 */
-	if (agno >= mp->m_sb.sb_agcount)
-		return NULL;
-	return((ino_tree_node_t *)
-		avl_findrange(inode_tree_ptrs[agno], ino));
-}
+ino_tree_node_t	*findfirst_inode_rec(xfs_agnumber_t agno);
+unsigned int	count_inode_recs(xfs_agnumber_t agno);
+ino_tree_node_t	*find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
+			xfs_agino_t ino);
 void		find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
 			ino_tree_node_t **first, ino_tree_node_t **last);
@@ -368,16 +372,9 @@ void			get_uncertain_inode_rec(struct xfs_mount *mp,
 void			clear_uncertain_ino_cache(xfs_agnumber_t agno);
 
 /*
- * return next in-order inode tree node.  takes an "ino_tree_node_t *"
- */
-#define next_ino_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_nextino))
-/*
- * return the next linked inode (forward avl tree link)-- meant to be used
- * by linked list routines (uncertain inode routines/records)
+ * return next in-order inode tree node.
  */
-#define next_link_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_forw))
+ino_tree_node_t		*next_ino_rec(ino_tree_node_t *ino_rec);
 
 /*
  * finobt helpers
@@ -561,16 +558,18 @@ static inline void add_inode_reached(struct ino_tree_node *irec, int offset)
 }
 
 /*
- * get/set inode filetype. Only used if the superblock feature bit is set
- * which allocates irec->ftypes.
+ * get/set inode filetype.  The type is only checked if the superblock
+ * feature bit is set; two types are packed into each byte of irec->ftypes.
  */
 static inline void
 set_inode_ftype(struct ino_tree_node *irec,
 	int		ino_offset,
 	uint8_t		ftype)
 {
-	if (irec->ftypes)
-		irec->ftypes[ino_offset] = ftype;
+	uint8_t		*p = &irec->ftypes[ino_offset >> 1];
+	int		shift = (ino_offset & 1) << 2;
+
+	*p = (*p & ~(0xf << shift)) | ((ftype & 0xf) << shift);
 }
 
 static inline uint8_t
@@ -578,9 +577,7 @@ get_inode_ftype(
 	struct ino_tree_node *irec,
 	int		ino_offset)
 {
-	if (!irec->ftypes)
-		return XFS_DIR3_FT_UNKNOWN;
-	return irec->ftypes[ino_offset];
+	return (irec->ftypes[ino_offset >> 1] >> ((ino_offset & 1) << 2)) & 0xf;
 }
 
 /*
@@ -18,7 +18,7 @@
 
 #include "libxfs.h"
 #include "avl.h"
-#include "btree.h"
+#include "bptree.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
@@ -47,20 +47,57 @@
 static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
 static pthread_mutex_t	rt_ext_tree_lock;
 
-static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
-static pthread_mutex_t *dup_extent_tree_locks;
-
-static avltree_desc_t	**extent_bno_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by starting block
-						 * number
-						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by size
-						 */
+/*
+ * Duplicate extents for each AG are kept as an array sorted by block number.
+ * Phase 4 builds each AG's array from a single thread before anything looks
+ * at it, so adding needs no locking; the lock only keeps searches from other
+ * AGs' threads away while the array is released.
+ */
+struct dup_extent {
+	xfs_agblock_t		start;
+	xfs_agblock_t		end;
+};
+
+struct dup_extent_list {
+	pthread_rwlock_t	lock;
+	struct dup_extent	*ext;
+	size_t			nr;
+	size_t			max;
+};
+
+static struct dup_extent_list	*dup_extents;	/* per ag dup extents */
+
+/*
+ * Free space extents for each AG live in two B+trees, one sorted by start
+ * block and one by length and then start block.  Both record start and
+ * length in a single 64-bit key, so there is nothing to allocate per extent.
+ * Each tree remembers the last record handed out along with its position so
+ * the findnext routines can carry on from there.
+ */
+struct extent_tree {
+	struct bptree		*tree;
+	struct bptree_cursor	cur;
+	extent_tree_node_t	rec;
+};
+
+static struct extent_tree	*extent_bno_trees;	/* per ag, by bno */
+static struct extent_tree	*extent_bcnt_trees;	/* per ag, by size */
+
+static inline uint64_t
+bno_key(
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
+{
+	return ((uint64_t)startblock << 32) | blockcount;
+}
+
+static inline uint64_t
+bcnt_key(
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
+{
+	return ((uint64_t)blockcount << 32) | startblock;
+}
 
 /*
  * duplicate extent tree functions
@@ -70,146 +107,170 @@ void
 release_dup_extent_tree(
 	xfs_agnumber_t		agno)
 {
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	btree_clear(dup_extent_trees[agno]);
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+	struct dup_extent_list	*dl = &dup_extents[agno];
+
+	pthread_rwlock_wrlock(&dl->lock);
+	free(dl->ext);
+	dl->ext = NULL;
+	dl->nr = dl->max = 0;
+	pthread_rwlock_unlock(&dl->lock);
 }
 
+/*
+ * Extents must be added in increasing block order, and only by the thread
+ * that owns the AG's list.
+ */
 int
 add_dup_extent(
 	xfs_agnumber_t		agno,
 	xfs_agblock_t		startblock,
 	xfs_extlen_t		blockcount)
 {
-	int	ret;
+	struct dup_extent_list	*dl = &dup_extents[agno];
+	struct dup_extent	*ext;
+	size_t			max;
+
 #ifdef XR_DUP_TRACE
 	fprintf(stderr, "Adding dup extent - %d/%d %d\n", agno, startblock,
 		blockcount);
 #endif
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	ret = btree_insert(dup_extent_trees[agno], startblock,
-				(void *)(uintptr_t)(startblock + blockcount));
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
-	return ret;
+	ASSERT(dl->nr == 0 || dl->ext[dl->nr - 1].end <= startblock);
+
+	if (dl->nr == dl->max) {
+		max = dl->max ? dl->max * 2 : 64;
+		ext = realloc(dl->ext, max * sizeof(struct dup_extent));
+		if (!ext)
+			return ENOMEM;
+		dl->ext = ext;
+		dl->max = max;
+	}
+	dl->ext[dl->nr].start = startblock;
+	dl->ext[dl->nr].end = startblock + blockcount;
+	dl->nr++;
+	return 0;
 }
 
+/*
+ * returns 1 if any block in [start_agbno, end_agbno) is a dup, 0 if not
+ */
 int
 search_dup_extent(
 	xfs_agnumber_t		agno,
 	xfs_agblock_t		start_agbno,
 	xfs_agblock_t		end_agbno)
 {
-	unsigned long	bno;
-	int		ret;
+	struct dup_extent_list	*dl = &dup_extents[agno];
+	size_t			lo = 0;
+	size_t			hi;
+	size_t			mid;
+	int			ret = 0;
 
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	if (!btree_find(dup_extent_trees[agno], start_agbno, &bno)) {
-		ret = 0;
-		goto out;	/* this really shouldn't happen */
+	pthread_rwlock_rdlock(&dl->lock);
+
+	/* find the last extent that starts before end_agbno */
+	hi = dl->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dl->ext[mid].start < end_agbno)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	if (bno < end_agbno) {
+	if (lo > 0 && dl->ext[lo - 1].end > start_agbno)
 		ret = 1;
-		goto out;
-	}
-	ret = (uintptr_t)btree_peek_prev(dup_extent_trees[agno], NULL) >
-								start_agbno;
-out:
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+
+	pthread_rwlock_unlock(&dl->lock);
 	return ret;
 }
 
-
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * top-level (visible) routines
  */
-
-static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
-	xfs_extlen_t new_blockcount, extent_state_t new_state)
+void
+release_agbno_extent_tree(xfs_agnumber_t agno)
 {
-	extent_tree_node_t *new;
-
-	new = malloc(sizeof(*new));
-	if (!new)
-		do_error(_("couldn't allocate new extent descriptor.\n"));
-
-	new->avl_node.avl_nextino = NULL;
-	new->ex_startblock = new_startblock;
-	new->ex_blockcount = new_blockcount;
-	new->ex_state = new_state;
-	new->next = NULL;
-	new->last = NULL;
-
-	return new;
+	bptree_clear(extent_bno_trees[agno].tree);
 }
 
 void
-release_extent_tree_node(extent_tree_node_t *node)
+release_agbcnt_extent_tree(xfs_agnumber_t agno)
 {
-	free(node);
+	bptree_clear(extent_bcnt_trees[agno].tree);
 }
 
-/*
- * routines to recycle all nodes in a tree.  it walks the tree
- * and puts all nodes back on the free list so the nodes can be
- * reused.  the duplicate and bno/bcnt extent trees for each AG
- * are recycled after they're no longer needed to save memory
- */
-void
-release_extent_tree(avltree_desc_t *tree)
+static extent_tree_node_t *
+extent_tree_rec(
+	struct extent_tree	*et,
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
 {
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
-
-	if (tree->avl_firstino == NULL)
-		return;
-
-	ext = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
+	et->rec.ex_startblock = startblock;
+	et->rec.ex_blockcount = blockcount;
+	et->rec.ex_state = XR_E_FREE;
+	return &et->rec;
+}
 
-		/*
-		 * ext->next is guaranteed to be set only in bcnt trees
-		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
-		}
+static extent_tree_node_t *
+bno_tree_rec(
+	struct extent_tree	*et,
+	uint64_t		key)
+{
+	return extent_tree_rec(et, key >> 32, key & 0xffffffff);
+}
 
-		release_extent_tree_node(ext);
-		ext = tmp;
-	}
+static extent_tree_node_t *
+bcnt_tree_rec(
+	struct extent_tree	*et,
+	uint64_t		key)
+{
+	return extent_tree_rec(et, key & 0xffffffff, key >> 32);
+}
 
-	tree->avl_root = tree->avl_firstino = NULL;
+static int
+uint64_cmp(
+	const void		*a,
+	const void		*b)
+{
+	uint64_t		ka = *(const uint64_t *)a;
+	uint64_t		kb = *(const uint64_t *)b;
 
-	return;
+	return ka < kb ? -1 : ka > kb;
 }
 
 /*
- * top-level (visible) routines
+ * Load the free space trees of an empty AG from the free extents in @exts,
+ * which must be sorted by start block.  Appending keys in order packs the
+ * tree nodes full, so sort a copy by size for the bcnt tree rather than
+ * inserting into it at random.
  */
 void
-release_agbno_extent_tree(xfs_agnumber_t agno)
+load_free_extents(
+	xfs_agnumber_t		agno,
+	uint64_t		*exts,
+	size_t			nr)
 {
-	release_extent_tree(extent_bno_ptrs[agno]);
+	struct bptree		*bno = extent_bno_trees[agno].tree;
+	struct bptree		*bcnt = extent_bcnt_trees[agno].tree;
+	size_t			i;
+	int			error = 0;
 
-	return;
-}
+	ASSERT(bptree_count(bno) == 0 && bptree_count(bcnt) == 0);
 
-void
-release_agbcnt_extent_tree(xfs_agnumber_t agno)
-{
-	release_extent_tree(extent_bcnt_ptrs[agno]);
+	for (i = 0; i < nr && !error; i++)
+		error = bptree_insert(bno, exts[i]);
 
-	return;
+	/* turn (start, len) keys into (len, start) keys and sort those */
+	for (i = 0; i < nr; i++)
+		exts[i] = bcnt_key(exts[i] >> 32, exts[i] & 0xffffffff);
+	qsort(exts, nr, sizeof(uint64_t), uint64_cmp);
+
+	for (i = 0; i < nr && !error; i++)
+		error = bptree_insert(bcnt, exts[i]);
+
+	if (error == -EEXIST)
+		do_error(_("duplicate bno extent range\n"));
+	if (error)
+		do_error(_("couldn't allocate new extent descriptor.\n"));
 }
 
 /*
@@ -221,59 +282,66 @@ void
 add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext;
+	int			error;
 
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	ASSERT(extent_bno_trees != NULL);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
-
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	error = bptree_insert(extent_bno_trees[agno].tree,
+			bno_key(startblock, blockcount));
+	if (error == -EEXIST)
 		do_error(_("duplicate bno extent range\n"));
-	}
+	if (error)
+		do_error(_("couldn't allocate new extent descriptor.\n"));
 }
 
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct extent_tree	*et = &extent_bno_trees[agno];
+	uint64_t		key;
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	if (!bptree_first(et->tree, &et->cur, &key))
+		return NULL;
+	return bno_tree_rec(et, key);
+}
+
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+{
+	struct extent_tree	*et = &extent_bno_trees[agno];
+	uint64_t		key;
+
+	ASSERT(ext == &et->rec);
+	if (!bptree_next(&et->cur, &key))
+		return NULL;
+	return bno_tree_rec(et, key);
 }
 
 extent_tree_node_t *
 find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct extent_tree	*et = &extent_bno_trees[agno];
+	uint64_t		key;
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	if (!bptree_seek(et->tree, bno_key(startblock, 0), &et->cur, &key) ||
+	    (key >> 32) != startblock)
+		return NULL;
+	return bno_tree_rec(et, key);
 }
 
 /*
- * delete a node that's in the tree (pointer obtained by a find routine)
+ * delete an extent that's in the tree (pointer obtained by a find routine)
  */
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
-
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	int			error;
 
-	return;
+	error = bptree_delete(extent_bno_trees[agno].tree,
+			bno_key(ext->ex_startblock, ext->ex_blockcount));
+	ASSERT(error == 0);
 }
 
-/*
- * normalizing constant for bcnt size -> address conversion (see avl ops)
- * used by the AVL tree code to convert sizes and must be used when
- * doing an AVL search in the tree (e.g. avl_findrange(s))
- */
-#define MAXBCNT		0xFFFFFFFF
-#define BCNT_ADDR(cnt)	((unsigned int) MAXBCNT - (cnt))
-
 /*
  * the next 4 routines manage the trees of free extents -- 2 trees
  * per AG.  The first tree is sorted by block number.  The second
@@ -283,270 +351,75 @@ void
 add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
-
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+	int			error;
 
-	ASSERT(ext->next == NULL);
+	ASSERT(extent_bcnt_trees != NULL);
 
 #ifdef XR_BCNT_TRACE
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) != NULL)  {
-		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
-		 *
-		 * when called from mk_incore_fstree,
-		 * startblock is in increasing order.
-		 * current is an "anchor" node.
-		 * quick check if the new ext goes to the end.
-		 * if so, append at the end, using the last field
-		 * of the "anchor".
-		 */
-		ASSERT(current->last != NULL);
-		if (startblock > current->last->ex_startblock) {
-			current->last->next = ext;
-			current->last = ext;
-			return;
-		}
-
-		/*
-		 * scan, to find the proper location for new entry.
-		 * this scan is *very* expensive and gets worse with
-		 * with increasing entries.
-		 */
-		top = prev = current;
-		while (current != NULL &&
-				startblock > current->ex_startblock)  {
-			prev = current;
-			current = current->next;
-		}
-
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
-
-		prev->next = ext;
-		ext->next = current;
-
-		return;
-	}
-
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	error = bptree_insert(extent_bcnt_trees[agno].tree,
+			bcnt_key(startblock, blockcount));
+	if (error == -EEXIST)
 		do_error(_(":  duplicate bno extent range\n"));
-	}
-
-	ext->last = ext;	/* ext is an "anchor" node */
-
-	return;
+	if (error)
+		do_error(_("couldn't allocate new extent descriptor.\n"));
 }
 
 extent_tree_node_t *
 findfirst_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct extent_tree	*et = &extent_bcnt_trees[agno];
+	uint64_t		key;
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	if (!bptree_first(et->tree, &et->cur, &key))
+		return NULL;
+	return bcnt_tree_rec(et, key);
 }
 
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct extent_tree	*et = &extent_bcnt_trees[agno];
+	uint64_t		key;
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	if (!bptree_last(et->tree, &et->cur, &key))
+		return NULL;
+	return bcnt_tree_rec(et, key);
 }
 
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	avlnode_t *nextino;
+	struct extent_tree	*et = &extent_bcnt_trees[agno];
+	uint64_t		key;
 
-	if (ext->next != NULL)  {
-		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
-		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
-		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
-	}
+	ASSERT(ext == &et->rec);
+	if (!bptree_next(&et->cur, &key))
+		return NULL;
+	return bcnt_tree_rec(et, key);
 }
 
 /*
  * this is meant to be called after you walk the bno tree to
  * determine exactly which extent you want (so you'll know the
  * desired value for startblock when you call this routine).
+ * The extent is removed from the tree and returned; the pointer
+ * is only good until the next call into the bcnt tree.
  */
 extent_tree_node_t *
 get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	struct extent_tree	*et = &extent_bcnt_trees[agno];
 
-	prev = NULL;
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
-		return(NULL);
-
-	top = ext;
-
-	if (ext->next != NULL)  {
-		/*
-		 * pull it off the list
-		 */
-		while (ext != NULL && startblock != ext->ex_startblock)  {
-			prev = ext;
-			ext = ext->next;
-		}
-		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
-		/*
-		 * now, a simple list deletion
-		 */
-		prev->next = ext->next;
-		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
-	}
-
-	ASSERT(ext->ex_startblock == startblock);
-	ASSERT(ext->ex_blockcount == blockcount);
-	return(ext);
-}
-
-static uintptr_t
-avl_ext_start(avlnode_t *node)
-{
-	return((uintptr_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
-
-static uintptr_t
-avl_ext_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
-}
-
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static uintptr_t
-avl_ext_bcnt_start(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static uintptr_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
+	if (bptree_delete(et->tree, bcnt_key(startblock, blockcount)))
+		return NULL;
+	et->cur.leaf = NULL;
+	return extent_tree_rec(et, startblock, blockcount);
 }
 
-avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
-
 /*
  * for real-time extents -- have to dup code since realtime extent
  * startblocks can be 64-bit values.
@@ -747,42 +620,30 @@ incore_ext_init(xfs_mount_t *mp)
 
 	pthread_mutex_init(&rt_ext_tree_lock, NULL);
 
-	dup_extent_trees = calloc(agcount, sizeof(struct btree_root *));
-	if (!dup_extent_trees)
-		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
-
-	dup_extent_tree_locks = calloc(agcount, sizeof(pthread_mutex_t));
-	if (!dup_extent_tree_locks)
+	dup_extents = calloc(agcount, sizeof(struct dup_extent_list));
+	if (!dup_extents)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
-	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	extent_bno_trees = calloc(agcount, sizeof(struct extent_tree));
+	if (!extent_bno_trees)
 		do_error(
 	_("couldn't malloc free by-bno extent tree descriptor table\n"));
 
-	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	extent_bcnt_trees = calloc(agcount, sizeof(struct extent_tree));
+	if (!extent_bcnt_trees)
 		do_error(
 	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
 
 	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+		pthread_rwlock_init(&dup_extents[i].lock, NULL);
+		if (bptree_init(&extent_bno_trees[i].tree))
 			do_error(
 			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
+		if (bptree_init(&extent_bcnt_trees[i].tree))
 			do_error(
 			_("couldn't malloc bcnt extent tree descriptor\n"));
 	}
 
-	for (i = 0; i < agcount; i++)  {
-		btree_init(&dup_extent_trees[i]);
-		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
-	}
-
 	if ((rt_ext_tree_ptr = malloc(sizeof(avl64tree_desc_t))) == NULL)
 		do_error(_("couldn't malloc dup rt extent tree descriptor\n"));
 
@@ -798,37 +659,19 @@ incore_ext_teardown(xfs_mount_t *mp)
 	xfs_agnumber_t i;
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		free(dup_extents[i].ext);
+		pthread_rwlock_destroy(&dup_extents[i].lock);
+		bptree_destroy(extent_bno_trees[i].tree);
+		bptree_destroy(extent_bcnt_trees[i].tree);
 	}
 
-	free(dup_extent_trees);
-	free(extent_bcnt_ptrs);
-	free(extent_bno_ptrs);
-
-	dup_extent_trees = NULL;
-	extent_bcnt_ptrs = NULL;
-	extent_bno_ptrs = NULL;
-}
+	free(dup_extents);
+	free(extent_bcnt_trees);
+	free(extent_bno_trees);
 
-int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
-{
-	extent_tree_node_t *node;
-	int i = 0;
-
-	node = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (node != NULL)  {
-		i++;
-		if (whichtree)
-			node = findnext_bcnt_extent(agno, node);
-		else
-			node = findnext_bno_extent(node);
-	}
-
-	return(i);
+	dup_extents = NULL;
+	extent_bcnt_trees = NULL;
+	extent_bno_trees = NULL;
 }
 
 int
@@ -842,12 +685,12 @@ count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 
 	nblocks = 0;
 
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
+	node = findfirst_bno_extent(agno);
 
 	while (node != NULL) {
 		nblocks += node->ex_blockcount;
 		i++;
-		node = findnext_bno_extent(node);
+		node = findnext_bno_extent(agno, node);
 	}
 
 	*numblocks = nblocks;
@@ -858,12 +701,12 @@ int
 count_bno_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bno_ptrs[agno], 0));
+	return bptree_count(extent_bno_trees[agno].tree);
 }
 
 int
 count_bcnt_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bcnt_ptrs[agno], 1));
+	return bptree_count(extent_bcnt_trees[agno].tree);
 }
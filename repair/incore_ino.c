@@ -17,137 +17,292 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "bptree.h"
 
 /*
- * array of inode tree ptrs, one per ag
+ * Inode records are indexed by the chunk number of their starting inode,
+ * i.e. agino >> XFS_INODES_PER_CHUNK_LOG.  Records need not be chunk
+ * aligned, but they never overlap, so at most one record starts in any
+ * slot and a lookup only has to check the slot holding the inode and the
+ * one before it.  The slot index is a two level table: a directory of
+ * pages that are only allocated once a record lands in them.
  */
-avltree_desc_t	**inode_tree_ptrs;
+#define IREC_PAGE_LOG		6
+#define IREC_PAGE_SLOTS		(1U << IREC_PAGE_LOG)
+#define IREC_PAGE_MASK		(IREC_PAGE_SLOTS - 1)
+
+/* records and extra data are handed out from arena blocks of this size */
+#define IREC_ARENA_RECS		256
+
+struct irec_page {
+	struct ino_tree_node	*recs[IREC_PAGE_SLOTS];
+};
+
+struct irec_index {
+	struct irec_page	**dir;
+	uint32_t		nslots;
+	uint32_t		first;		/* no records below this slot */
+	uint32_t		nrecs;
+};
+
+struct ag_inodes {
+	struct irec_index	recs;
+	struct irec_index	uncertain;
+
+	/*
+	 * Arenas shared by both indexes.  Uncertain records are added by
+	 * threads working on other AGs while this AG's thread frees
+	 * records, so the record arena and free list need a lock.
+	 */
+	pthread_mutex_t		arena_lock;
+	struct ino_tree_node	*free_recs;
+	struct ino_tree_node	*arena;
+	unsigned int		arena_used;
+	struct ino_ex_data	*ex_arena;
+	unsigned int		ex_arena_used;
+
+	/* link counts >= XR_NLINK_SPILL, keyed by agino << 32 | nlinks */
+	struct bptree		*disk_nlinks;
+	struct bptree		*counted_nlinks;
+};
 
 /*
- * ditto for uncertain inodes
+ * array of inode trees and uncertain inode trees, one pair per ag
  */
-static avltree_desc_t	**inode_uncertain_tree_ptrs;
+static struct ag_inodes	*ag_inodes;
 
-/* memory optimised nlink counting for all inodes */
+static void
+init_irec_index(
+	struct xfs_mount	*mp,
+	struct irec_index	*idx)
+{
+	unsigned int		agino_log;
+
+	agino_log = mp->m_sb.sb_agblklog + mp->m_sb.sb_inopblog;
+	if (agino_log > XFS_INODES_PER_CHUNK_LOG)
+		idx->nslots = 1U << (agino_log - XFS_INODES_PER_CHUNK_LOG);
+	else
+		idx->nslots = 1;
+	idx->first = idx->nslots;
+
+	/* mostly untouched, so this costs address space rather than memory */
+	idx->dir = calloc(howmany(idx->nslots, IREC_PAGE_SLOTS),
+			sizeof(struct irec_page *));
+	if (!idx->dir)
+		do_error(_("couldn't malloc inode tree descriptor\n"));
+}
 
-static void *
-alloc_nlink_array(uint8_t nlink_size)
+static inline struct ino_tree_node *
+irec_slot(
+	struct irec_index	*idx,
+	uint32_t		slot)
 {
-	void *ptr;
+	struct irec_page	*page;
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, nlink_size);
-	if (!ptr)
-		do_error(_("could not allocate nlink array\n"));
-	return ptr;
+	if (slot >= idx->nslots)
+		return NULL;
+	page = idx->dir[slot >> IREC_PAGE_LOG];
+	if (!page)
+		return NULL;
+	return page->recs[slot & IREC_PAGE_MASK];
 }
 
-static void
-nlink_grow_8_to_16(ino_tree_node_t *irec)
+static struct ino_tree_node *
+irec_lookup(
+	struct irec_index	*idx,
+	xfs_agino_t		agino)
 {
-	uint16_t	*new_nlinks;
-	int		i;
+	struct ino_tree_node	*irec;
+	uint32_t		slot = agino >> XFS_INODES_PER_CHUNK_LOG;
+
+	irec = irec_slot(idx, slot);
+	if (irec && irec->ino_startnum <= agino)
+		return irec;
+	if (slot == 0)
+		return NULL;
+	irec = irec_slot(idx, slot - 1);
+	if (irec && agino < irec->ino_startnum + XFS_INODES_PER_CHUNK)
+		return irec;
+	return NULL;
+}
 
-	irec->nlink_size = sizeof(uint16_t);
+/* Find the first record starting at or after the given slot. */
+static struct ino_tree_node *
+irec_next_slot(
+	struct irec_index	*idx,
+	uint32_t		slot)
+{
+	struct irec_page	*page;
 
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
-	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
-		new_nlinks[i] = irec->disk_nlinks.un8[i];
-	free(irec->disk_nlinks.un8);
-	irec->disk_nlinks.un16 = new_nlinks;
+	if (slot < idx->first)
+		slot = idx->first;
 
-	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
-		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
-			new_nlinks[i] =
-				irec->ino_un.ex_data->counted_nlinks.un8[i];
+	while (slot < idx->nslots) {
+		page = idx->dir[slot >> IREC_PAGE_LOG];
+		if (!page) {
+			slot = (slot | IREC_PAGE_MASK) + 1;
+			continue;
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un8);
-		irec->ino_un.ex_data->counted_nlinks.un16 = new_nlinks;
+		do {
+			if (page->recs[slot & IREC_PAGE_MASK])
+				return page->recs[slot & IREC_PAGE_MASK];
+		} while (++slot & IREC_PAGE_MASK);
+	}
+	return NULL;
+}
+
+/* Returns false if the record overlaps one already in the tree. */
+static bool
+irec_insert(
+	struct irec_index	*idx,
+	struct ino_tree_node	*irec)
+{
+	struct ino_tree_node	*other;
+	struct irec_page	**pagep;
+	uint32_t		slot;
+
+	slot = irec->ino_startnum >> XFS_INODES_PER_CHUNK_LOG;
+	ASSERT(slot < idx->nslots);
+
+	if (irec_slot(idx, slot))
+		return false;
+	other = irec_slot(idx, slot + 1);
+	if (other && other->ino_startnum <
+			irec->ino_startnum + XFS_INODES_PER_CHUNK)
+		return false;
+	other = slot ? irec_slot(idx, slot - 1) : NULL;
+	if (other && irec->ino_startnum <
+			other->ino_startnum + XFS_INODES_PER_CHUNK)
+		return false;
+
+	pagep = &idx->dir[slot >> IREC_PAGE_LOG];
+	if (!*pagep) {
+		*pagep = calloc(1, sizeof(struct irec_page));
+		if (!*pagep)
+			do_error(_("inode map malloc failed\n"));
 	}
+	(*pagep)->recs[slot & IREC_PAGE_MASK] = irec;
+	idx->nrecs++;
+	if (slot < idx->first)
+		idx->first = slot;
+	return true;
 }
 
 static void
-nlink_grow_16_to_32(ino_tree_node_t *irec)
+irec_remove(
+	struct irec_index	*idx,
+	struct ino_tree_node	*irec)
 {
-	uint32_t	*new_nlinks;
-	int		i;
+	uint32_t		slot;
 
-	irec->nlink_size = sizeof(uint32_t);
+	slot = irec->ino_startnum >> XFS_INODES_PER_CHUNK_LOG;
+	ASSERT(irec_slot(idx, slot) == irec);
 
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
-	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
-		new_nlinks[i] = irec->disk_nlinks.un16[i];
-	free(irec->disk_nlinks.un16);
-	irec->disk_nlinks.un32 = new_nlinks;
+	idx->dir[slot >> IREC_PAGE_LOG]->recs[slot & IREC_PAGE_MASK] = NULL;
+	idx->nrecs--;
+	if (slot == idx->first)
+		idx->first = slot + 1;
+}
 
-	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
+/* memory optimised nlink counting for all inodes */
 
-		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
-			new_nlinks[i] =
-				irec->ino_un.ex_data->counted_nlinks.un16[i];
-		}
-		free(irec->ino_un.ex_data->counted_nlinks.un16);
-		irec->ino_un.ex_data->counted_nlinks.un32 = new_nlinks;
+static uint32_t
+nlink_spill_get(
+	struct bptree		*spill,
+	xfs_agino_t		agino)
+{
+	struct bptree_cursor	cur;
+	uint64_t		key;
+
+	if (!spill || !bptree_seek(spill, (uint64_t)agino << 32, &cur, &key) ||
+	    (key >> 32) != agino) {
+		ASSERT(0);
+		return XR_NLINK_SPILL;
 	}
+	return (uint32_t)key;
+}
+
+static void
+nlink_spill_set(
+	struct bptree		**spill,
+	xfs_agino_t		agino,
+	uint32_t		nlinks)
+{
+	struct bptree_cursor	cur;
+	uint64_t		key;
+
+	if (!*spill && bptree_init(spill))
+		do_error(_("could not allocate nlink array\n"));
+
+	if (bptree_seek(*spill, (uint64_t)agino << 32, &cur, &key) &&
+	    (key >> 32) == agino)
+		bptree_delete(*spill, key);
+
+	if (nlinks >= XR_NLINK_SPILL &&
+	    bptree_insert(*spill, ((uint64_t)agino << 32) | nlinks))
+		do_error(_("could not allocate nlink array\n"));
+}
+
+static uint32_t
+get_irec_nlink(
+	struct ino_tree_node	*irec,
+	uint8_t			*nlinks,
+	struct bptree		*spill,
+	int			ino_offset)
+{
+	if (nlinks[ino_offset] != XR_NLINK_SPILL)
+		return nlinks[ino_offset];
+	return nlink_spill_get(spill, irec->ino_startnum + ino_offset);
+}
+
+static void
+set_irec_nlink(
+	struct ino_tree_node	*irec,
+	uint8_t			*nlinks,
+	struct bptree		**spill,
+	int			ino_offset,
+	uint32_t		value)
+{
+	if (nlinks[ino_offset] == XR_NLINK_SPILL || value >= XR_NLINK_SPILL)
+		nlink_spill_set(spill, irec->ino_startnum + ino_offset, value);
+	nlinks[ino_offset] = min(value, (uint32_t)XR_NLINK_SPILL);
 }
 
 void add_inode_ref(struct ino_tree_node *irec, int ino_offset)
 {
+	struct ag_inodes	*ag = &ag_inodes[irec->ino_agno];
+	uint8_t			*counted;
+
 	ASSERT(irec->ino_un.ex_data != NULL);
 
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		if (irec->ino_un.ex_data->counted_nlinks.un8[ino_offset] < 0xff) {
-			irec->ino_un.ex_data->counted_nlinks.un8[ino_offset]++;
-			break;
-		}
-		nlink_grow_8_to_16(irec);
-		/*FALLTHRU*/
-	case sizeof(uint16_t):
-		if (irec->ino_un.ex_data->counted_nlinks.un16[ino_offset] < 0xffff) {
-			irec->ino_un.ex_data->counted_nlinks.un16[ino_offset]++;
-			break;
-		}
-		nlink_grow_16_to_32(irec);
-		/*FALLTHRU*/
-	case sizeof(uint32_t):
-		irec->ino_un.ex_data->counted_nlinks.un32[ino_offset]++;
-		break;
-	default:
-		ASSERT(0);
+	counted = irec->ino_un.ex_data->counted_nlinks;
+	if (counted[ino_offset] < XR_NLINK_SPILL - 1) {
+		counted[ino_offset]++;
+		return;
 	}
+	set_irec_nlink(irec, counted, &ag->counted_nlinks, ino_offset,
+			get_irec_nlink(irec, counted, ag->counted_nlinks,
+					ino_offset) + 1);
 }
 
 void drop_inode_ref(struct ino_tree_node *irec, int ino_offset)
 {
-	uint32_t	refs = 0;
+	struct ag_inodes	*ag = &ag_inodes[irec->ino_agno];
+	uint8_t			*counted;
+	uint32_t		refs;
 
 	ASSERT(irec->ino_un.ex_data != NULL);
 
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un8[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un8[ino_offset];
-		break;
-	case sizeof(uint16_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un16[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un16[ino_offset];
-		break;
-	case sizeof(uint32_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un32[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un32[ino_offset];
-		break;
-	default:
-		ASSERT(0);
-	}
+	counted = irec->ino_un.ex_data->counted_nlinks;
+	refs = get_irec_nlink(irec, counted, ag->counted_nlinks, ino_offset);
+	ASSERT(refs > 0);
+	set_irec_nlink(irec, counted, &ag->counted_nlinks, ino_offset, --refs);
 
 	if (refs == 0)
 		irec->ino_un.ex_data->ino_reached &= ~IREC_MASK(ino_offset);
@@ -157,73 +312,22 @@ uint32_t num_inode_references(struct ino_tree_node *irec, int ino_offset)
 {
 	ASSERT(irec->ino_un.ex_data != NULL);
 
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		return irec->ino_un.ex_data->counted_nlinks.un8[ino_offset];
-	case sizeof(uint16_t):
-		return irec->ino_un.ex_data->counted_nlinks.un16[ino_offset];
-	case sizeof(uint32_t):
-		return irec->ino_un.ex_data->counted_nlinks.un32[ino_offset];
-	default:
-		ASSERT(0);
-	}
-	return 0;
+	return get_irec_nlink(irec, irec->ino_un.ex_data->counted_nlinks,
+			ag_inodes[irec->ino_agno].counted_nlinks, ino_offset);
 }
 
 void set_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset,
 		uint32_t nlinks)
 {
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		if (nlinks < 0xff) {
-			irec->disk_nlinks.un8[ino_offset] = nlinks;
-			break;
-		}
-		nlink_grow_8_to_16(irec);
-		/*FALLTHRU*/
-	case sizeof(uint16_t):
-		if (nlinks < 0xffff) {
-			irec->disk_nlinks.un16[ino_offset] = nlinks;
-			break;
-		}
-		nlink_grow_16_to_32(irec);
-		/*FALLTHRU*/
-	case sizeof(uint32_t):
-		irec->disk_nlinks.un32[ino_offset] = nlinks;
-		break;
-	default:
-		ASSERT(0);
-	}
+	set_irec_nlink(irec, irec->disk_nlinks,
+			&ag_inodes[irec->ino_agno].disk_nlinks, ino_offset,
+			nlinks);
 }
 
 uint32_t get_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset)
 {
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		return irec->disk_nlinks.un8[ino_offset];
-	case sizeof(uint16_t):
-		return irec->disk_nlinks.un16[ino_offset];
-	case sizeof(uint32_t):
-		return irec->disk_nlinks.un32[ino_offset];
-	default:
-		ASSERT(0);
-	}
-	return 0;
-}
-
-static uint8_t *
-alloc_ftypes_array(
-	struct xfs_mount *mp)
-{
-	uint8_t		*ptr;
-
-	if (!xfs_sb_version_hasftype(&mp->m_sb))
-		return NULL;
-
-	ptr = calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
-	if (!ptr)
-		do_error(_("could not allocate ftypes array\n"));
-	return ptr;
+	return get_irec_nlink(irec, irec->disk_nlinks,
+			ag_inodes[irec->ino_agno].disk_nlinks, ino_offset);
 }
 
 /*
@@ -241,72 +345,61 @@ alloc_ftypes_array(
  */
 static struct ino_tree_node *
 alloc_ino_node(
-	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
 	xfs_agino_t		starting_ino)
 {
+	struct ag_inodes	*ag = &ag_inodes[agno];
 	struct ino_tree_node 	*irec;
 
-	irec = malloc(sizeof(*irec));
-	if (!irec)
-		do_error(_("inode map malloc failed\n"));
-
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
+	pthread_mutex_lock(&ag->arena_lock);
+	if (ag->free_recs) {
+		irec = ag->free_recs;
+		ag->free_recs = irec->ino_un.next_free;
+	} else {
+		if (!ag->arena || ag->arena_used == IREC_ARENA_RECS) {
+			ag->arena = malloc(IREC_ARENA_RECS * sizeof(*irec));
+			if (!ag->arena)
+				do_error(_("inode map malloc failed\n"));
+			ag->arena_used = 0;
+		}
+		irec = &ag->arena[ag->arena_used++];
+	}
+	pthread_mutex_unlock(&ag->arena_lock);
 
+	memset(irec, 0, sizeof(*irec));
 	irec->ino_startnum = starting_ino;
-	irec->ino_confirmed = 0;
-	irec->ino_isa_dir = 0;
-	irec->ino_was_rl = 0;
-	irec->ino_is_rl = 0;
+	irec->ino_agno = agno;
 	irec->ir_free = (xfs_inofree_t) - 1;
-	irec->ir_sparse = 0;
-	irec->ino_un.ex_data = NULL;
-	irec->nlink_size = sizeof(uint8_t);
-	irec->disk_nlinks.un8 = alloc_nlink_array(irec->nlink_size);
-	irec->ftypes = alloc_ftypes_array(mp);
 	return irec;
 }
 
-static void
-free_nlink_array(union ino_nlink nlinks, uint8_t nlink_size)
-{
-	switch (nlink_size) {
-	case sizeof(uint8_t):
-		free(nlinks.un8);
-		break;
-	case sizeof(uint16_t):
-		free(nlinks.un16);
-		break;
-	case sizeof(uint32_t):
-		free(nlinks.un32);
-		break;
-	default:
-		ASSERT(0);
-	}
-}
-
 static void
 free_ino_tree_node(
 	struct ino_tree_node	*irec)
 {
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
+	struct ag_inodes	*ag = &ag_inodes[irec->ino_agno];
+	parent_list_t		*ptbl;
+	int			i;
 
-	free_nlink_array(irec->disk_nlinks, irec->nlink_size);
-	if (irec->ino_un.ex_data != NULL)  {
-		if (full_ino_ex_data) {
-			free(irec->ino_un.ex_data->parents);
-			free_nlink_array(irec->ino_un.ex_data->counted_nlinks,
-					 irec->nlink_size);
-		}
-		free(irec->ino_un.ex_data);
+	for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+		if (irec->disk_nlinks[i] == XR_NLINK_SPILL)
+			set_inode_disk_nlinks(irec, i, 0);
+	}
 
+	if (full_ino_ex_data)
+		ptbl = irec->ino_un.ex_data ?
+				irec->ino_un.ex_data->parents : NULL;
+	else
+		ptbl = irec->ino_un.plist;
+	if (ptbl) {
+		free(ptbl->pentries);
+		free(ptbl);
 	}
 
-	free(irec->ftypes);
-	free(irec);
+	pthread_mutex_lock(&ag->arena_lock);
+	irec->ino_un.next_free = ag->free_recs;
+	ag->free_recs = irec;
+	pthread_mutex_unlock(&ag->arena_lock);
 }
 
 /*
@@ -356,13 +449,11 @@ add_aginode_uncertain(
 	 * check to see if record containing inode is already in the tree.
 	 * if not, add it
 	 */
-	ino_rec = (ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], s_ino);
+	ino_rec = irec_lookup(&ag_inodes[agno].uncertain, s_ino);
 	if (!ino_rec) {
-		ino_rec = alloc_ino_node(mp, s_ino);
+		ino_rec = alloc_ino_node(agno, s_ino);
 
-		if (!avl_insert(inode_uncertain_tree_ptrs[agno],
-				&ino_rec->avl_node))
+		if (!irec_insert(&ag_inodes[agno].uncertain, ino_rec))
 			do_error(
 	_("add_aginode_uncertain - duplicate inode range\n"));
 	}
@@ -396,29 +487,22 @@ void
 get_uncertain_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 			ino_tree_node_t *ino_rec)
 {
-	ASSERT(inode_tree_ptrs != NULL);
+	ASSERT(ag_inodes != NULL);
 	ASSERT(agno < mp->m_sb.sb_agcount);
-	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
-
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	irec_remove(&ag_inodes[agno].uncertain, ino_rec);
 }
 
 ino_tree_node_t *
 findfirst_uncertain_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *)
-		inode_uncertain_tree_ptrs[agno]->avl_firstino);
+	return irec_next_slot(&ag_inodes[agno].uncertain, 0);
 }
 
 ino_tree_node_t *
 find_uncertain_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
-	return((ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], ino));
+	return irec_lookup(&ag_inodes[agno].uncertain, ino);
 }
 
 void
@@ -429,7 +513,7 @@ clear_uncertain_ino_cache(xfs_agnumber_t agno)
 
 
 /*
- * Next comes the inode trees.  One per AG,  AVL trees of inode records, each
+ * Next comes the inode trees.  One per AG, an index of inode records, each
  * inode record tracking 64 inodes
  */
 
@@ -457,8 +541,8 @@ add_inode(
 {
 	struct ino_tree_node	*irec;
 
-	irec = alloc_ino_node(mp, agino);
-	if (!avl_insert(inode_tree_ptrs[agno],	&irec->avl_node))
+	irec = alloc_ino_node(agno, agino);
+	if (!irec_insert(&ag_inodes[agno].recs, irec))
 		do_warn(_("add_inode - duplicate inode range\n"));
 	return irec;
 }
@@ -469,15 +553,40 @@ add_inode(
 void
 get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 {
-	ASSERT(inode_tree_ptrs != NULL);
+	ASSERT(ag_inodes != NULL);
 	ASSERT(agno < mp->m_sb.sb_agcount);
-	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
+	irec_remove(&ag_inodes[agno].recs, ino_rec);
+}
+
+ino_tree_node_t *
+findfirst_inode_rec(xfs_agnumber_t agno)
+{
+	return irec_next_slot(&ag_inodes[agno].recs, 0);
+}
+
+unsigned int
+count_inode_recs(xfs_agnumber_t agno)
+{
+	return ag_inodes[agno].recs.nrecs;
+}
 
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+ino_tree_node_t *
+next_ino_rec(ino_tree_node_t *ino_rec)
+{
+	return irec_next_slot(&ag_inodes[ino_rec->ino_agno].recs,
+			(ino_rec->ino_startnum >> XFS_INODES_PER_CHUNK_LOG) + 1);
+}
+
+ino_tree_node_t *
+find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
+{
+	/*
+	 * Is the AG inside the file system
+	 */
+	if (agno >= mp->m_sb.sb_agcount)
+		return NULL;
+	return irec_lookup(&ag_inodes[agno].recs, ino);
 }
 
 /*
@@ -495,14 +604,31 @@ find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
 			ino_tree_node_t **first, ino_tree_node_t **last)
 {
+	struct irec_index	*idx;
+	ino_tree_node_t		*irec;
+
 	*first = *last = NULL;
 
 	/*
 	 * Is the AG inside the file system ?
 	 */
-	if (agno < mp->m_sb.sb_agcount)
-		avl_findranges(inode_tree_ptrs[agno], start_ino,
-			end_ino, (avlnode_t **) first, (avlnode_t **) last);
+	if (agno >= mp->m_sb.sb_agcount)
+		return;
+
+	/* first record ending after start_ino, last one starting before end */
+	idx = &ag_inodes[agno].recs;
+	irec = irec_lookup(idx, start_ino);
+	if (!irec)
+		irec = irec_next_slot(idx,
+				start_ino >> XFS_INODES_PER_CHUNK_LOG);
+	if (!irec || irec->ino_startnum >= end_ino)
+		return;
+
+	*first = irec;
+	do {
+		*last = irec;
+		irec = next_ino_rec(irec);
+	} while (irec && irec->ino_startnum < end_ino);
 }
 
 /*
@@ -730,31 +856,19 @@ get_inode_parent(ino_tree_node_t *irec, int offset)
 void
 alloc_ex_data(ino_tree_node_t *irec)
 {
-	parent_list_t 	*ptbl;
+	struct ag_inodes	*ag = &ag_inodes[irec->ino_agno];
+	parent_list_t 		*ptbl;
 
-	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
-	if (irec->ino_un.ex_data == NULL)
-		do_error(_("could not malloc inode extra data\n"));
+	if (!ag->ex_arena || ag->ex_arena_used == IREC_ARENA_RECS) {
+		ag->ex_arena = calloc(IREC_ARENA_RECS, sizeof(ino_ex_data_t));
+		if (ag->ex_arena == NULL)
+			do_error(_("could not malloc inode extra data\n"));
+		ag->ex_arena_used = 0;
+	}
 
+	ptbl = irec->ino_un.plist;
+	irec->ino_un.ex_data = &ag->ex_arena[ag->ex_arena_used++];
 	irec->ino_un.ex_data->parents = ptbl;
-
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		irec->ino_un.ex_data->counted_nlinks.un8 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	case sizeof(uint16_t):
-		irec->ino_un.ex_data->counted_nlinks.un16 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	case sizeof(uint32_t):
-		irec->ino_un.ex_data->counted_nlinks.un32 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	default:
-		ASSERT(0);
-	}
 }
 
 void
@@ -774,51 +888,19 @@ add_ino_ex_data(xfs_mount_t *mp)
 	full_ino_ex_data = 1;
 }
 
-static uintptr_t
-avl_ino_start(avlnode_t *node)
-{
-	return((uintptr_t) ((ino_tree_node_t *) node)->ino_startnum);
-}
-
-static uintptr_t
-avl_ino_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((ino_tree_node_t *) node)->ino_startnum +
-		XFS_INODES_PER_CHUNK));
-}
-
-avlops_t avl_ino_tree_ops = {
-	avl_ino_start,
-	avl_ino_end
-};
-
 void
 incore_ino_init(xfs_mount_t *mp)
 {
 	int i;
 	int agcount = mp->m_sb.sb_agcount;
 
-	if ((inode_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	if ((ag_inodes = calloc(agcount, sizeof(struct ag_inodes))) == NULL)
 		do_error(_("couldn't malloc inode tree descriptor table\n"));
-	if ((inode_uncertain_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
-		do_error(
-		_("couldn't malloc uncertain ino tree descriptor table\n"));
 
 	for (i = 0; i < agcount; i++)  {
-		if ((inode_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(_("couldn't malloc inode tree descriptor\n"));
-		if ((inode_uncertain_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc uncertain ino tree descriptor\n"));
-	}
-	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(inode_tree_ptrs[i], &avl_ino_tree_ops);
-		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
+		init_irec_index(mp, &ag_inodes[i].recs);
+		init_irec_index(mp, &ag_inodes[i].uncertain);
+		pthread_mutex_init(&ag_inodes[i].arena_lock, NULL);
 	}
 
 	if ((last_rec = malloc(sizeof(ino_tree_node_t *) * agcount)) == NULL)
@@ -268,6 +268,55 @@ process_rmap_data(
 	destroy_work_queue(&wq);
 }
 
+/*
+ * Record the multiply claimed extents of one AG.  Each AG's list is built
+ * by a single worker, in block order, so this needs no locking.
+ */
+static void
+setup_dup_extents(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	xfs_agblock_t		ag_hdr_block = *(xfs_agblock_t *)arg;
+	xfs_agblock_t		ag_end;
+	xfs_agblock_t		j;
+	xfs_extlen_t		blen;
+	int			bstate;
+
+	ag_end = (agno < mp->m_sb.sb_agcount - 1) ? mp->m_sb.sb_agblocks :
+		mp->m_sb.sb_dblocks -
+			(xfs_rfsblock_t) mp->m_sb.sb_agblocks * agno;
+
+	for (j = ag_hdr_block; j < ag_end; j += blen)  {
+		bstate = get_bmap_ext(agno, j, ag_end, &blen);
+		switch (bstate) {
+		case XR_E_BAD_STATE:
+		default:
+			do_warn(
+			_("unknown block state, ag %d, block %d\n"),
+				agno, j);
+			/* fall through .. */
+		case XR_E_UNKNOWN:
+		case XR_E_FREE1:
+		case XR_E_FREE:
+		case XR_E_INUSE:
+		case XR_E_INUSE_FS:
+		case XR_E_INO:
+		case XR_E_FS_MAP:
+			break;
+		case XR_E_MULT:
+			if (add_dup_extent(agno, j, blen))
+				do_error(
+			_("couldn't allocate duplicate extent list\n"));
+			break;
+		}
+	}
+
+	PROG_RPT_INC(prog_rpt_done[agno], 1);
+}
+
 void
 phase4(xfs_mount_t *mp)
 {
@@ -276,12 +325,10 @@ phase4(xfs_mount_t *mp)
 	xfs_rtblock_t		rt_start;
 	xfs_extlen_t		rt_len;
 	xfs_agnumber_t		i;
-	xfs_agblock_t		j;
-	xfs_agblock_t		ag_end;
-	xfs_extlen_t		blen;
 	int			ag_hdr_len = 4 * mp->m_sb.sb_sectsize;
-	int			ag_hdr_block;
+	xfs_agblock_t		ag_hdr_block;
 	int			bstate;
+	struct workqueue	wq;
 
 	if (rmap_needs_work(mp))
 		collect_rmaps = true;
@@ -307,39 +354,10 @@ phase4(xfs_mount_t *mp)
 			do_warn(_("root inode lost\n"));
 	}
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		ag_end = (i < mp->m_sb.sb_agcount - 1) ? mp->m_sb.sb_agblocks :
-			mp->m_sb.sb_dblocks -
-				(xfs_rfsblock_t) mp->m_sb.sb_agblocks * i;
-
-		/*
-		 * set up duplicate extent list for this ag
-		 */
-		for (j = ag_hdr_block; j < ag_end; j += blen)  {
-			bstate = get_bmap_ext(i, j, ag_end, &blen);
-			switch (bstate) {
-			case XR_E_BAD_STATE:
-			default:
-				do_warn(
-				_("unknown block state, ag %d, block %d\n"),
-					i, j);
-				/* fall through .. */
-			case XR_E_UNKNOWN:
-			case XR_E_FREE1:
-			case XR_E_FREE:
-			case XR_E_INUSE:
-			case XR_E_INUSE_FS:
-			case XR_E_INO:
-			case XR_E_FS_MAP:
-				break;
-			case XR_E_MULT:
-				add_dup_extent(i, j, blen);
-				break;
-			}
-		}
-
-		PROG_RPT_INC(prog_rpt_done[i], 1);
-	}
+	create_work_queue(&wq, mp, libxfs_nproc());
+	for (i = 0; i < mp->m_sb.sb_agcount; i++)
+		queue_work(&wq, setup_dup_extents, i, &ag_hdr_block);
+	destroy_work_queue(&wq);
 	print_final_rpt();
 
 	/*
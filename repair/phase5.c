@@ -90,9 +90,42 @@ static uint64_t	*sb_icount_ag;		/* allocated inodes per ag */
 static uint64_t	*sb_ifree_ag;		/* free inodes per ag */
 static uint64_t	*sb_fdblocks_ag;	/* free data blocks per ag */
 
+/*
+ * AGs are rebuilt concurrently, but libxfs transactions update the incore
+ * superblock counters and log the superblock buffer without any locking of
+ * their own.  Serialise the transactional parts of the per-AG rebuild.
+ */
+static pthread_mutex_t	trans_lock;
+
+/*
+ * Stash a free extent for load_free_extents(), packed the way it wants.
+ */
+static void
+stash_free_extent(
+	uint64_t		**exts,
+	size_t			*nr,
+	size_t			*max,
+	xfs_agblock_t		start,
+	xfs_extlen_t		len)
+{
+	uint64_t		*p;
+
+	if (*nr == *max) {
+		*max = *max ? *max * 2 : 1024;
+		p = realloc(*exts, *max * sizeof(uint64_t));
+		if (!p)
+			do_error(_("couldn't allocate new extent descriptor.\n"));
+		*exts = p;
+	}
+	(*exts)[(*nr)++] = ((uint64_t)start << 32) | len;
+}
+
 static int
 mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
+	uint64_t		*exts = NULL;
+	size_t			nr_exts = 0;
+	size_t			max_exts = 0;
 	int			in_extent;
 	int			num_extents;
 	xfs_agblock_t		extent_start;
@@ -148,16 +181,16 @@ mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 		} else   {
 			if (in_extent)  {
 				/*
-				 * free extent ends here, add extent to the
-				 * 2 incore extent (avl-to-be-B+) trees
+				 * free extent ends here, save it for the
+				 * 2 incore extent B+trees
 				 */
 				in_extent = 0;
 #if defined(XR_BLD_FREE_TRACE) && defined(XR_BLD_ADD_EXTENT)
 				fprintf(stderr, "adding extent %u [%u %u]\n",
 					agno, extent_start, extent_len);
 #endif
-				add_bno_extent(agno, extent_start, extent_len);
-				add_bcnt_extent(agno, extent_start, extent_len);
+				stash_free_extent(&exts, &nr_exts, &max_exts,
+						extent_start, extent_len);
 			}
 		}
 	}
@@ -169,10 +202,14 @@ mk_incore_fstree(xfs_mount_t *mp, xfs_agnumber_t agno)
 		fprintf(stderr, "adding extent %u [%u %u]\n",
 			agno, extent_start, extent_len);
 #endif
-		add_bno_extent(agno, extent_start, extent_len);
-		add_bcnt_extent(agno, extent_start, extent_len);
+		stash_free_extent(&exts, &nr_exts, &max_exts,
+				extent_start, extent_len);
 	}
 
+	/* the extents came out in block order, so bulk load the trees */
+	load_free_extents(agno, exts, nr_exts);
+	free(exts);
+
 	return(num_extents);
 }
 
@@ -274,11 +311,9 @@ _("error - not enough free space in filesystem\n"));
 						ext_ptr->ex_startblock);
 			ASSERT(bno_ext_ptr != NULL);
 			get_bno_extent(agno, bno_ext_ptr);
-			release_extent_tree_node(bno_ext_ptr);
 
 			ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 					ext_ptr->ex_blockcount);
-			release_extent_tree_node(ext_ptr);
 #ifdef XR_BLD_FREE_TRACE
 			fprintf(stderr, "releasing extent: %u [%u %u]\n",
 				agno, ext_ptr->ex_startblock,
@@ -303,12 +338,10 @@ _("error - not enough free space in filesystem\n"));
 		bno_ext_ptr = find_bno_extent(agno, ext_ptr->ex_startblock);
 		ASSERT(bno_ext_ptr != NULL);
 		get_bno_extent(agno, bno_ext_ptr);
-		release_extent_tree_node(bno_ext_ptr);
 
 		ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
 				ext_ptr->ex_blockcount);
 		ASSERT(ext_ptr != NULL);
-		release_extent_tree_node(ext_ptr);
 
 		ext_ptr = findfirst_bcnt_extent(agno);
 	}
@@ -829,7 +862,7 @@ build_freespace_tree(xfs_mount_t *mp, xfs_agnumber_t agno,
 							ext_ptr->ex_blockcount);
 			freeblks += ext_ptr->ex_blockcount;
 			if (btnum == XFS_BTNUM_BNO)
-				ext_ptr = findnext_bno_extent(ext_ptr);
+				ext_ptr = findnext_bno_extent(agno, ext_ptr);
 			else
 				ext_ptr = findnext_bcnt_extent(agno, ext_ptr);
 #if 0
@@ -2138,7 +2171,9 @@ _("Insufficient memory saving lost blocks.\n"));
 	/*
 	 * now fix up the free list appropriately
 	 */
+	pthread_mutex_lock(&trans_lock);
 	fix_freelist(mp, agno, true);
+	pthread_mutex_unlock(&trans_lock);
 
 #ifdef XR_BLD_FREE_TRACE
 	fprintf(stderr, "wrote agf for ag %u\n", agno);
@@ -2189,10 +2224,12 @@ keep_fsinos(xfs_mount_t *mp)
 
 static void
 phase5_func(
-	xfs_mount_t	*mp,
-	xfs_agnumber_t	agno,
-	struct xfs_slab	*lost_fsb)
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
 {
+	xfs_mount_t	*mp = wq->wq_ctx;
+	struct xfs_slab	*lost_fsb = arg;
 	uint64_t	num_inos;
 	uint64_t	num_free_inos;
 	uint64_t	finobt_num_inos;
@@ -2407,7 +2444,9 @@ phase5_func(
 		/*
 		 * Put the per-AG btree rmap data into the rmapbt
 		 */
+		pthread_mutex_lock(&trans_lock);
 		error = rmap_store_ag_btree_rec(mp, agno);
+		pthread_mutex_unlock(&trans_lock);
 		if (error)
 			do_error(
 _("unable to add AG %u reverse-mapping data to btree.\n"), agno);
@@ -2466,7 +2505,8 @@ out_cancel:
 void
 phase5(xfs_mount_t *mp)
 {
-	struct xfs_slab		*lost_fsb;
+	struct workqueue	wq;
+	struct xfs_slab		**lost_fsb;
 	xfs_agnumber_t		agno;
 	int			error;
 
@@ -2509,12 +2549,32 @@ phase5(xfs_mount_t *mp)
 	if (sb_fdblocks_ag == NULL)
 		do_error(_("cannot alloc sb_fdblocks_ag buffers\n"));
 
-	error = init_slab(&lost_fsb, sizeof(xfs_fsblock_t));
-	if (error)
+	/*
+	 * keep the lost blocks of each AG separate so that they are put
+	 * back in the same order no matter how the AGs were scheduled
+	 */
+	lost_fsb = calloc(mp->m_sb.sb_agcount, sizeof(struct xfs_slab *));
+	if (lost_fsb == NULL)
 		do_error(_("cannot alloc lost block slab\n"));
 
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
+		error = init_slab(&lost_fsb[agno], sizeof(xfs_fsblock_t));
+		if (error)
+			do_error(_("cannot alloc lost block slab\n"));
+	}
+
+	pthread_mutex_init(&trans_lock, NULL);
+
+	/*
+	 * rebuild the AGs in parallel, one worker per ag_stride segment
+	 * of the filesystem, or on a single thread if no stride was set.
+	 */
+	create_work_queue(&wq, mp, ag_stride ? thread_count : 1);
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		phase5_func(mp, agno, lost_fsb);
+		queue_work(&wq, phase5_func, agno, lost_fsb[agno]);
+	destroy_work_queue(&wq);
+
+	pthread_mutex_destroy(&trans_lock);
 
 	print_final_rpt();
 
@@ -2542,10 +2602,14 @@ phase5(xfs_mount_t *mp)
 	 */
 	sync_sb(mp);
 
-	error = inject_lost_blocks(mp, lost_fsb);
-	if (error)
-		do_error(_("Unable to reinsert lost blocks into filesystem.\n"));
-	free_slab(&lost_fsb);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
+		error = inject_lost_blocks(mp, lost_fsb[agno]);
+		if (error)
+			do_error(
+		_("Unable to reinsert lost blocks into filesystem.\n"));
+		free_slab(&lost_fsb[agno]);
+	}
+	free(lost_fsb);
 
 	bad_ino_btree = 0;
 
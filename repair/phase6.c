@@ -34,6 +34,96 @@ static struct cred		zerocr;
 static struct fsxattr 		zerofsx;
 static xfs_ino_t		orphanage_ino;
 
+/*
+ * Directories are checked concurrently during the traversal.  Any entry can
+ * point to an inode in any AG, so the incore inode records of an AG are only
+ * looked at or updated under that AG's ag_lock.  Transactions that allocate
+ * or free blocks update the AGF, the free space btrees and the incore
+ * superblock counters that every directory shares, so they are serialised by
+ * dir_alloc_lock.  orphanage_lock protects orphanage_ino and the
+ * dotdot_update_list.
+ */
+static pthread_mutex_t		dir_alloc_lock;
+static pthread_mutex_t		orphanage_lock;
+
+static inline void
+lock_inode_rec(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&ag_locks[XFS_INO_TO_AGNO(mp, ino)].lock);
+}
+
+static inline void
+unlock_inode_rec(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino)
+{
+	pthread_mutex_unlock(&ag_locks[XFS_INO_TO_AGNO(mp, ino)].lock);
+}
+
+/* Count a link to an inode that other directories may also reference. */
+static void
+add_inode_ref_locked(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino,
+	struct ino_tree_node	*irec,
+	int			ino_offset)
+{
+	lock_inode_rec(mp, ino);
+	add_inode_ref(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
+}
+
+static void
+add_inode_reached_locked(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino,
+	struct ino_tree_node	*irec,
+	int			ino_offset)
+{
+	lock_inode_rec(mp, ino);
+	add_inode_reached(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
+}
+
+static xfs_ino_t
+get_inode_parent_locked(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino,
+	struct ino_tree_node	*irec,
+	int			ino_offset)
+{
+	xfs_ino_t		parent;
+
+	lock_inode_rec(mp, ino);
+	parent = get_inode_parent(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
+	return parent;
+}
+
+/* Remember the first lost+found found in the root directory. */
+static void
+set_orphanage_ino(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (!orphanage_ino)
+		orphanage_ino = ino;
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
+/* Forget the orphanage if the entry being junked pointed to it. */
+static void
+clear_orphanage_ino(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (ino == orphanage_ino)
+		orphanage_ino = 0;
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
 static struct xfs_name		xfs_name_dot = {(unsigned char *)".",
 						1,
 						XFS_DIR3_FT_DIR};
@@ -69,7 +159,33 @@ add_dotdot_update(
 	dir->agno = agno;
 	dir->ino_offset = ino_offset;
 
+	pthread_mutex_lock(&orphanage_lock);
 	list_add(&dir->list, &dotdot_update_list);
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
+/*
+ * Sort the directories needing a ".." update by inode number so that they
+ * are rebuilt in the same order however the traversal was scheduled.
+ */
+static int
+dotdot_update_cmp(
+	void			*priv,
+	struct list_head	*a,
+	struct list_head	*b)
+{
+	struct dotdot_update	*da;
+	struct dotdot_update	*db;
+
+	da = list_entry(a, struct dotdot_update, list);
+	db = list_entry(b, struct dotdot_update, list);
+
+	if (da->agno != db->agno)
+		return da->agno < db->agno ? -1 : 1;
+	if (da->irec->ino_startnum != db->irec->ino_startnum)
+		return da->irec->ino_startnum < db->irec->ino_startnum ?
+				-1 : 1;
+	return da->ino_offset - db->ino_offset;
 }
 
 /*
@@ -990,7 +1106,7 @@ mk_orphanage(xfs_mount_t *mp)
 	ino_offset = get_inode_offset(mp, ino, irec);
 
 	/*
-	 * Mark the inode allocated to lost+found as used in the AVL tree
+	 * Mark the inode allocated to lost+found as used in the inode tree
 	 * so it is not skipped in phase 7
 	 */
 	set_inode_used(irec, ino_offset);
@@ -1292,11 +1408,13 @@ longform_dir2_rebuild(
 	 * orphanage later (the inode number here needs to be valid
 	 * for the libxfs_dir_init() call).
 	 */
-	pip.i_ino = get_inode_parent(irec, ino_offset);
+	pip.i_ino = get_inode_parent_locked(mp, ino, irec, ino_offset);
 	if (pip.i_ino == NULLFSINO ||
 	    libxfs_dir_ino_validate(mp, pip.i_ino))
 		pip.i_ino = mp->m_sb.sb_rootino;
 
+	pthread_mutex_lock(&dir_alloc_lock);
+
 	libxfs_defer_init(&dfops, &firstblock);
 
 	nres = XFS_REMOVE_SPACE_RES(mp);
@@ -1372,11 +1490,13 @@ _("name create failed in ino %" PRIu64 " (%d), filesystem may be out of space\n"
 		libxfs_trans_commit(tp);
 	}
 
+	pthread_mutex_unlock(&dir_alloc_lock);
 	return;
 
 out_bmap_cancel:
 	libxfs_defer_cancel(&dfops);
 	libxfs_trans_cancel(tp);
+	pthread_mutex_unlock(&dir_alloc_lock);
 	return;
 }
 
@@ -1399,6 +1519,7 @@ dir2_kill_block(
 	int		nres;
 	xfs_trans_t	*tp;
 
+	pthread_mutex_lock(&dir_alloc_lock);
 	nres = XFS_REMOVE_SPACE_RES(mp);
 	error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove, nres, 0, 0, &tp);
 	if (error)
@@ -1424,6 +1545,7 @@ dir2_kill_block(
 	libxfs_defer_ijoin(&dfops, ip);
 	libxfs_defer_finish(&tp, &dfops);
 	libxfs_trans_commit(tp);
+	pthread_mutex_unlock(&dir_alloc_lock);
 }
 
 /*
@@ -1721,8 +1843,7 @@ longform_dir2_entry_check_data(
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = inum;
+			set_orphanage_ino(inum);
 		}
 
 		/*
@@ -1737,8 +1858,7 @@ longform_dir2_entry_check_data(
 				dep->name[0] = '/';
 				libxfs_dir2_data_log_entry(&da, bp, dep);
 			}
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			clear_orphanage_ino(inum);
 			continue;
 		}
 
@@ -1783,7 +1903,8 @@ longform_dir2_entry_check_data(
 		 */
 		if (ip->i_ino == inum)  {
 			ASSERT(dep->name[0] == '.' && dep->namelen == 1);
-			add_inode_ref(current_irec, current_ino_offset);
+			add_inode_ref_locked(mp, ip->i_ino, current_irec,
+					current_ino_offset);
 			if (da_bno != 0 ||
 			    dep != M_DIROPS(mp)->data_entry_p(d)) {
 				/* "." should be the first entry */
@@ -1837,9 +1958,15 @@ longform_dir2_entry_check_data(
 		 * the link count and continue
 		 */
 		if (!inode_isadir(irec, ino_offset))  {
-			add_inode_reached(irec, ino_offset);
+			add_inode_reached_locked(mp, inum, irec, ino_offset);
 			continue;
 		}
+		/*
+		 * the child may be reached from a directory being checked
+		 * by another thread, so look at and claim it under its
+		 * AG lock.
+		 */
+		lock_inode_rec(mp, inum);
 		parent = get_inode_parent(irec, ino_offset);
 		ASSERT(parent != 0);
 		junkit = 0;
@@ -1851,33 +1978,38 @@ longform_dir2_entry_check_data(
 		 * blow away the entry also.
 		 */
 		if (is_inode_reached(irec, ino_offset))  {
+			unlock_inode_rec(mp, inum);
 			junkit = 1;
 			do_warn(
 _("entry \"%s\" in dir %" PRIu64" points to an already connected directory inode %" PRIu64 "\n"),
 				fname, ip->i_ino, inum);
 		} else if (parent == ip->i_ino)  {
 			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			unlock_inode_rec(mp, inum);
+			add_inode_ref_locked(mp, ip->i_ino, current_irec,
+					current_ino_offset);
 		} else if (parent == NULLFSINO) {
 			/* ".." was missing, but this entry refers to it,
 			   so, set it as the parent and mark for rebuild */
+			set_inode_parent(irec, ino_offset, ip->i_ino);
+			add_inode_reached(irec, ino_offset);
+			unlock_inode_rec(mp, inum);
 			do_warn(
 	_("entry \"%s\" in dir ino %" PRIu64 " doesn't have a .. entry, will set it in ino %" PRIu64 ".\n"),
 				fname, ip->i_ino, inum);
-			set_inode_parent(irec, ino_offset, ip->i_ino);
-			add_inode_reached(irec, ino_offset);
-			add_inode_ref(current_irec, current_ino_offset);
+			add_inode_ref_locked(mp, ip->i_ino, current_irec,
+					current_ino_offset);
 			add_dotdot_update(XFS_INO_TO_AGNO(mp, inum), irec,
 								ino_offset);
 		} else  {
+			unlock_inode_rec(mp, inum);
 			junkit = 1;
 			do_warn(
 _("entry \"%s\" in dir inode %" PRIu64 " inconsistent with .. value (%" PRIu64 ") in ino %" PRIu64 "\n"),
 				fname, ip->i_ino, parent, inum);
 		}
 		if (junkit)  {
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			clear_orphanage_ino(inum);
 			nbad++;
 			if (!no_modify)  {
 				dep->name[0] = '/';
@@ -2419,8 +2551,7 @@ shortform_dir2_junk(
 	int			next_len;
 	int			next_elen;
 
-	if (lino == orphanage_ino)
-		orphanage_ino = 0;
+	clear_orphanage_ino(lino);
 
 	next_elen = M_DIROPS(mp)->sf_entsize(sfp, sfep->namelen);
 	next_sfep = M_DIROPS(mp)->sf_nextentry(sfp, sfep);
@@ -2497,7 +2628,8 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * if just rebuild a directory due to a "..", update and return
 	 */
 	if (dotdot_update) {
-		parent = get_inode_parent(current_irec, current_ino_offset);
+		parent = get_inode_parent_locked(mp, ino, current_irec,
+				current_ino_offset);
 		if (no_modify) {
 			do_warn(
 	_("would set .. in sf dir inode %" PRIu64 " to %" PRIu64 "\n"),
@@ -2518,7 +2650,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 	 * the directory is reached or will be taken care of when the
 	 * directory is moved to orphanage.
 	 */
-	add_inode_ref(current_irec, current_ino_offset);
+	add_inode_ref_locked(mp, ino, current_irec, current_ino_offset);
 
 	/*
 	 * Initialise i8 counter -- the parent inode number counts as well.
@@ -2648,8 +2780,7 @@ shortform_dir2_entry_check(xfs_mount_t	*mp,
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = lino;
+			set_orphanage_ino(lino);
 		}
 		/*
 		 * check for duplicate names in directory.
@@ -2672,8 +2803,9 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * check easy case first, regular inode, just bump
 			 * the link count
 			 */
-			add_inode_reached(irec, ino_offset);
+			add_inode_reached_locked(mp, lino, irec, ino_offset);
 		} else  {
+			lock_inode_rec(mp, lino);
 			parent = get_inode_parent(irec, ino_offset);
 
 			/*
@@ -2682,6 +2814,7 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 			 * the .. in the child, blow out the entry
 			 */
 			if (is_inode_reached(irec, ino_offset))  {
+				unlock_inode_rec(mp, lino);
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " references already connected inode %" PRIu64 ".\n"),
@@ -2692,19 +2825,24 @@ _("entry \"%s\" (ino %" PRIu64 ") in dir %" PRIu64 " is a duplicate name"),
 				continue;
 			} else if (parent == ino)  {
 				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				unlock_inode_rec(mp, lino);
+				add_inode_ref_locked(mp, ino, current_irec,
+						current_ino_offset);
 			} else if (parent == NULLFSINO) {
 				/* ".." was missing, but this entry refers to it,
 				so, set it as the parent and mark for rebuild */
+				set_inode_parent(irec, ino_offset, ino);
+				add_inode_reached(irec, ino_offset);
+				unlock_inode_rec(mp, lino);
 				do_warn(
 	_("entry \"%s\" in dir ino %" PRIu64 " doesn't have a .. entry, will set it in ino %" PRIu64 ".\n"),
 					fname, ino, lino);
-				set_inode_parent(irec, ino_offset, ino);
-				add_inode_reached(irec, ino_offset);
-				add_inode_ref(current_irec, current_ino_offset);
+				add_inode_ref_locked(mp, ino, current_irec,
+						current_ino_offset);
 				add_dotdot_update(XFS_INO_TO_AGNO(mp, lino),
 							irec, ino_offset);
 			} else  {
+				unlock_inode_rec(mp, lino);
 				do_warn(
 	_("entry \"%s\" in directory inode %" PRIu64
 	  " not consistent with .. value (%" PRIu64
@@ -2850,12 +2988,16 @@ process_dir_inode(
 			 * as being disconnected in the no_modify case.
 			 */
 			if (mp->m_sb.sb_rootino == ino)  {
+				lock_inode_rec(mp, ino);
 				add_inode_reached(irec, 0);
 				add_inode_ref(irec, 0);
+				unlock_inode_rec(mp, ino);
 			}
 		}
 
+		lock_inode_rec(mp, ino);
 		add_inode_refchecked(irec, 0);
+		unlock_inode_rec(mp, ino);
 		return;
 	}
 
@@ -2870,10 +3012,12 @@ process_dir_inode(
 		 * that root's '..' is always good --
 		 * guaranteed by phase 3 and/or below.
 		 */
-		add_inode_reached(irec, ino_offset);
+		add_inode_reached_locked(mp, ino, irec, ino_offset);
 	}
 
+	lock_inode_rec(mp, ino);
 	add_inode_refchecked(irec, ino_offset);
+	unlock_inode_rec(mp, ino);
 
 	hashtab = dir_hash_init(ip->i_d.di_size);
 
@@ -2944,6 +3088,7 @@ process_dir_inode(
 
 		do_warn(_("recreating root directory .. entry\n"));
 
+		pthread_mutex_lock(&dir_alloc_lock);
 		nres = XFS_MKDIR_SPACE_RES(mp, 2);
 		error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_mkdir,
 					    nres, 0, 0, &tp);
@@ -2966,6 +3111,7 @@ process_dir_inode(
 		error = -libxfs_defer_finish(&tp, &dfops);
 		ASSERT(error == 0);
 		libxfs_trans_commit(tp);
+		pthread_mutex_unlock(&dir_alloc_lock);
 
 		need_root_dotdot = 0;
 	} else if (need_root_dotdot && ino == mp->m_sb.sb_rootino)  {
@@ -2989,7 +3135,7 @@ process_dir_inode(
 		 * it turns out to be wrong, we'll catch
 		 * that in phase 7.
 		 */
-		add_inode_ref(irec, ino_offset);
+		add_inode_ref_locked(mp, ino, irec, ino_offset);
 
 		if (no_modify)  {
 			do_warn(
@@ -3002,6 +3148,7 @@ process_dir_inode(
 			do_warn(
 	_("creating missing \".\" entry in dir ino %" PRIu64 "\n"), ino);
 
+			pthread_mutex_lock(&dir_alloc_lock);
 			nres = XFS_MKDIR_SPACE_RES(mp, 1);
 			error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_mkdir,
 						    nres, 0, 0, &tp);
@@ -3025,6 +3172,7 @@ process_dir_inode(
 			error = -libxfs_defer_finish(&tp, &dfops);
 			ASSERT(error == 0);
 			libxfs_trans_commit(tp);
+			pthread_mutex_unlock(&dir_alloc_lock);
 		}
 	}
 	IRELE(ip);
@@ -3177,8 +3325,9 @@ update_missing_dotdot_entries(
 	 * set dotdot_update flag so processing routines do not count links
 	 */
 	dotdot_update = 1;
+	list_sort(NULL, &dotdot_update_list, dotdot_update_cmp);
 	while (!list_empty(&dotdot_update_list)) {
-		dir = list_entry(dotdot_update_list.prev, struct dotdot_update,
+		dir = list_entry(dotdot_update_list.next, struct dotdot_update,
 				 list);
 		list_del(&dir->list);
 		process_dir_inode(mp, dir->agno, dir->irec, dir->ino_offset);
@@ -3186,11 +3335,51 @@ update_missing_dotdot_entries(
 	}
 }
 
+/* Did any directory come out of phase 4 without a ".." entry? */
+static bool
+missing_dotdot(
+	struct xfs_mount	*mp)
+{
+	struct ino_tree_node	*irec;
+	xfs_agnumber_t		agno;
+	int			i;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		for (irec = findfirst_inode_rec(agno);
+		     irec;
+		     irec = next_ino_rec(irec)) {
+			if (irec->ino_isa_dir == 0)
+				continue;
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				if (inode_isadir(irec, i) &&
+				    get_inode_parent(irec, i) == NULLFSINO)
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Check the directories of several AGs at once, either one thread per
+ * ag_stride segment or, if the directory blocks are all still cached,
+ * one thread per CPU.
+ *
+ * A directory without a ".." entry is adopted by the first directory found
+ * to point at it, and every other entry pointing at it is junked.  To keep
+ * that choice from depending on which thread gets there first, walk the
+ * AGs one at a time in inode order if there are any such directories, so
+ * the lowest numbered directory always keeps its entry.
+ */
 static void
 traverse_ags(
 	struct xfs_mount	*mp)
 {
-	do_inode_prefetch(mp, 0, traverse_function, false, true);
+	if (missing_dotdot(mp)) {
+		do_inode_prefetch(mp, 0, traverse_function, false, true);
+		return;
+	}
+	do_inode_prefetch(mp, ag_stride, traverse_function, true, true);
 }
 
 void
@@ -3202,6 +3391,8 @@ phase6(xfs_mount_t *mp)
 	memset(&zerocr, 0, sizeof(struct cred));
 	memset(&zerofsx, 0, sizeof(struct fsxattr));
 	orphanage_ino = 0;
+	pthread_mutex_init(&dir_alloc_lock, NULL);
+	pthread_mutex_init(&orphanage_lock, NULL);
 
 	do_log(_("Phase 6 - check inode connectivity...\n"));
 
@@ -92,6 +92,66 @@ update_inode_nlinks(
 	IRELE(ip);
 }
 
+/*
+ * Phase 7 work is queued per AG, but a busy AG can be split into ranges
+ * of inode records (by starting agino) when other workers run dry.
+ */
+struct link_range {
+	xfs_agino_t		start;
+	xfs_agino_t		end;		/* exclusive */
+};
+
+/* check whether to split every this many inode records */
+#define LINK_SPLIT_INTERVAL	16
+
+/* ranges not yet finished in each AG, for progress reporting */
+static unsigned int		*ag_ranges;
+
+static xfs_agino_t
+ag_end_agino(
+	struct xfs_mount	*mp)
+{
+	return min((uint64_t)mp->m_sb.sb_agblocks << mp->m_sb.sb_inopblog,
+		   (uint64_t)NULLAGINO);
+}
+
+static void do_link_updates(struct workqueue *wq, xfs_agnumber_t agno,
+		void *arg);
+
+/*
+ * Hand the back half of [from, end) to another worker and return the new
+ * end of our own range.  Split on an allocation unit boundary so that no
+ * inode cluster buffer is shared between two ranges.
+ */
+static xfs_agino_t
+split_link_range(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	xfs_agino_t		from,
+	xfs_agino_t		end)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	struct link_range	*range;
+	xfs_agino_t		mid;
+
+	if (from >= end)
+		return end;
+	mid = rounddown(from + (end - from) / 2, mp->m_ialloc_inos);
+	if (mid <= from)
+		return end;
+
+	range = malloc(sizeof(struct link_range));
+	if (!range)
+		return end;
+	range->start = mid;
+	range->end = end;
+
+	__atomic_add_fetch(&ag_ranges[agno], 1, __ATOMIC_RELAXED);
+	queue_work_cost(wq, do_link_updates, agno, range,
+			(end - mid) / XFS_INODES_PER_CHUNK);
+	return mid;
+}
+
 /*
  * for each ag, look at each inode 1 at a time. If the number of
  * links is bad, reset it, log the inode core, commit the transaction
@@ -103,12 +163,34 @@ do_link_updates(
 	void			*arg)
 {
 	struct xfs_mount	*mp = wq->wq_ctx;
+	struct link_range	*range = arg;
 	ino_tree_node_t		*irec;
+	ino_tree_node_t		*last;
+	xfs_agino_t		start = 0;
+	xfs_agino_t		end;
+	unsigned int		nr = 0;
 	int			j;
 	uint32_t		nrefs;
 
-	for (irec = findfirst_inode_rec(agno); irec;
-	     irec = next_ino_rec(irec)) {
+	if (range) {
+		start = range->start;
+		end = range->end;
+		free(range);
+	} else
+		end = ag_end_agino(mp);
+
+	/* records belong to the range holding their first inode */
+	find_inode_rec_range(mp, agno, start, end, &irec, &last);
+	if (irec && irec->ino_startnum < start)
+		irec = next_ino_rec(irec);
+
+	for (; irec && irec->ino_startnum < end; irec = next_ino_rec(irec)) {
+		if (++nr % LINK_SPLIT_INTERVAL == 0 &&
+		    workqueue_should_split(wq))
+			end = split_link_range(wq, agno,
+					irec->ino_startnum + XFS_INODES_PER_CHUNK,
+					end);
+
 		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
 			ASSERT(is_inode_confirmed(irec, j));
 
@@ -128,7 +210,8 @@ do_link_updates(
 		}
 	}
 
-	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	if (__atomic_sub_fetch(&ag_ranges[agno], 1, __ATOMIC_RELAXED) == 0)
+		PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
 void
@@ -146,12 +229,21 @@ phase7(
 
 	set_progress_msg(PROGRESS_FMT_CORR_LINK, (uint64_t) glob_agcount);
 
+	ag_ranges = malloc(mp->m_sb.sb_agcount * sizeof(unsigned int));
+	if (!ag_ranges)
+		do_error(_("couldn't allocate phase 7 range counts\n"));
+
 	create_work_queue(&wq, mp, scan_threads);
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, do_link_updates, agno, NULL);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ag_ranges[agno] = 1;
+		queue_work_cost(&wq, do_link_updates, agno, NULL,
+				count_inode_recs(agno));
+	}
 
 	destroy_work_queue(&wq);
+	free(ag_ranges);
+	ag_ranges = NULL;
 
 	print_final_rpt();
 }
@@ -31,6 +31,10 @@ static int		pf_max_bbs;
 static int		pf_max_fsbs;
 static int		pf_batch_bytes;
 static int		pf_batch_fsbs;
+static bool		pf_scatter;
+
+int			pf_io_mode = PF_IO_AUTO;
+int			pf_io_depth = PF_DEF_IO_DEPTH;
 
 static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 
@@ -70,6 +74,12 @@ static void		pf_read_inode_dirs(prefetch_args_t *, xfs_buf_t *);
 
 #define IO_THRESHOLD	(MAX_BUFS * 2)
 
+/* number of reads used to estimate device latency */
+#define PF_PROBE_READS	8
+
+/* average read latency (usecs) above which we always coalesce */
+#define PF_SCATTER_MAX_LATENCY	1000
+
 typedef enum pf_which {
 	PF_PRIMARY,
 	PF_SECONDARY,
@@ -454,6 +464,57 @@ pf_read_inode_dirs(
 		XFS_BUF_SET_PRIORITY(bp, B_DIR_INODE);
 }
 
+/*
+ * A prefetch read has filled this buffer, so mark it up to date and work out
+ * how much we care about keeping it around.  @num is the number of buffers
+ * read by the same batch.
+ */
+static void
+pf_read_done(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	xfs_buf_t		*bp,
+	int			num)
+{
+	bp->b_flags |= (LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED);
+	if (B_IS_INODE(XFS_BUF_PRIORITY(bp)))
+		pf_read_inode_dirs(args, bp);
+	else if (which == PF_META_ONLY)
+		XFS_BUF_SET_PRIORITY(bp, B_DIR_META_H);
+	else if (which == PF_PRIMARY && num == 1)
+		XFS_BUF_SET_PRIORITY(bp, B_DIR_META_S);
+}
+
+/*
+ * Read each buffer directly into its own memory, with as many reads in
+ * flight at once as the libxfs I/O threads allow.  This doesn't waste
+ * bandwidth on the gaps between buffers or a copy out of a bounce buffer,
+ * which is what we want on devices that are fast at small random reads.
+ * If anything fails, we leave all the buffers for the processing threads
+ * to read and report on.
+ */
+static void
+pf_scatter_read(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	xfs_buf_t		**bplist,
+	int			num)
+{
+	struct xfs_iobatch	batch;
+	int			i;
+
+	libxfs_iobatch_init(&batch);
+	for (i = 0; i < num; i++)
+		libxfs_iobatch_submit(&batch, LIBXFS_BREAD, mp_fd,
+				XFS_BUF_PTR(bplist[i]), XFS_BUF_SIZE(bplist[i]),
+				LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])), 0);
+	if (libxfs_iobatch_wait(&batch) == 0) {
+		for (i = 0; i < num; i++)
+			pf_read_done(args, which, bplist[i], num);
+	}
+	libxfs_iobatch_destroy(&batch);
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -464,10 +525,13 @@ pf_batch_read(
 	void			*buf)
 {
 	xfs_buf_t		*bplist[MAX_BUFS];
+	xfs_buf_t		*dbp;
+	struct xfs_iobatch	batch;
 	unsigned int		num;
 	off64_t			first_off, last_off, next_off;
 	int			len, size;
 	int			i;
+	int			error;
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
@@ -511,17 +575,20 @@ pf_batch_read(
 		/*
 		 * do a big read if 25% of the potential buffer is useful,
 		 * otherwise, find as many close together blocks and
-		 * read them in one read
+		 * read them in one read.  Scatter reads go straight into the
+		 * buffers, so they don't care how far apart the buffers are.
 		 */
 		first_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[0]));
 		last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
 			XFS_BUF_SIZE(bplist[num-1]);
-		while (num > 1 && last_off - first_off > pf_max_bytes) {
+		while (!pf_scatter && num > 1 &&
+		       last_off - first_off > pf_max_bytes) {
 			num--;
 			last_off = LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[num-1])) +
 				XFS_BUF_SIZE(bplist[num-1]);
 		}
-		if (num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
+		if (!pf_scatter &&
+		    num < ((last_off - first_off) >> (mp->m_sb.sb_blocklog + 3))) {
 			/*
 			 * not enough blocks for one big read, so determine
 			 * the number of blocks that are close enough.
@@ -562,49 +629,55 @@ pf_batch_read(
 #endif
 		pthread_mutex_unlock(&args->lock);
 
-		/*
-		 * now read the data and put into the xfs_but_t's
-		 */
-		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
-
 		/*
 		 * Check the last buffer on the list to see if we need to
 		 * process a discontiguous buffer. The gather above loop
 		 * guarantees that only the last buffer in the list will be a
-		 * discontiguous buffer.
+		 * discontiguous buffer.  Start reading its segments now so
+		 * that they're in flight while we do the big read.
 		 */
+		dbp = NULL;
 		if ((bplist[num - 1]->b_flags & LIBXFS_B_DISCONTIG)) {
-			libxfs_readbufr_map(mp->m_ddev_targp, bplist[num - 1], 0);
-			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
-			libxfs_putbuf(bplist[num - 1]);
+			dbp = bplist[num - 1];
+			libxfs_iobatch_init(&batch);
+			libxfs_readbuf_submit(&batch, mp->m_ddev_targp, dbp, 0);
 			num--;
 		}
 
-		if (len > 0) {
+		if (pf_scatter) {
+			pf_scatter_read(args, which, bplist, num);
+		} else {
+			/*
+			 * now read the data and put into the xfs_but_t's
+			 */
+			len = pread(mp_fd, buf, (int)(last_off - first_off),
+					first_off);
+
 			/*
 			 * go through the xfs_buf_t list copying from the
 			 * read buffer into the xfs_buf_t's and release them.
 			 */
-			for (i = 0; i < num; i++) {
-
+			for (i = 0; len > 0 && i < num; i++) {
 				pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(XFS_BUF_ADDR(bplist[i])) - first_off);
 				size = XFS_BUF_SIZE(bplist[i]);
 				if (len < size)
 					break;
 				memcpy(XFS_BUF_PTR(bplist[i]), pbuf, size);
-				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
-						       LIBXFS_B_UNCHECKED);
 				len -= size;
-				if (B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					XFS_BUF_SET_PRIORITY(bplist[i],
-								B_DIR_META_S);
+				pf_read_done(args, which, bplist[i], num);
 			}
 		}
+
+		if (dbp) {
+			error = libxfs_iobatch_wait(&batch);
+			libxfs_iobatch_destroy(&batch);
+			if (error)
+				dbp->b_error = error;
+			else
+				dbp->b_flags |= LIBXFS_B_UPTODATE;
+			dbp->b_flags |= LIBXFS_B_UNCHECKED;
+			libxfs_putbuf(dbp);
+		}
 		for (i = 0; i < num; i++) {
 			pftrace("putbuf %c %p (%llu) in AG %d",
 				B_IS_INODE(XFS_BUF_PRIORITY(bplist[i])) ? 'I' : 'M',
@@ -851,6 +924,104 @@ pf_create_prefetch_thread(
 	return err == 0;
 }
 
+/*
+ * Ask sysfs whether the data device (or the device holding the image file)
+ * is rotational.  Returns 1 or 0, or -1 if we can't tell.
+ */
+static int
+pf_device_rotational(void)
+{
+	struct stat		sb;
+	char			path[PATH_MAX];
+	dev_t			dev;
+	FILE			*fp;
+	int			rot = -1;
+
+	if (fstat(mp_fd, &sb) < 0)
+		return -1;
+	dev = S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev;
+
+	/* partitions don't have a queue directory, their parent disk does */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+			major(dev), minor(dev));
+	fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(path, sizeof(path),
+				"/sys/dev/block/%u:%u/../queue/rotational",
+				major(dev), minor(dev));
+		fp = fopen(path, "r");
+	}
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &rot) != 1)
+		rot = -1;
+	fclose(fp);
+	return rot;
+}
+
+/*
+ * Time a handful of single block reads spread across the data device and
+ * return the average latency in microseconds, or -1 if the reads failed.
+ */
+static long
+pf_measure_latency(void)
+{
+	struct timespec		start, end;
+	void			*buf;
+	off64_t			off;
+	long			usecs;
+	int			i;
+
+	buf = memalign(libxfs_device_alignment(), mp->m_sb.sb_blocksize);
+	if (!buf)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < PF_PROBE_READS; i++) {
+		off = XFS_FSB_TO_B(mp, (mp->m_sb.sb_dblocks / PF_PROBE_READS) *
+				i + mp->m_sb.sb_dblocks / (2 * PF_PROBE_READS));
+		if (pread(mp_fd, buf, mp->m_sb.sb_blocksize, off) !=
+				mp->m_sb.sb_blocksize) {
+			free(buf);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(buf);
+
+	usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	return usecs / PF_PROBE_READS;
+}
+
+/*
+ * Coalesced reads suit disks that seek: one big read that includes some
+ * unwanted blocks is far cheaper than lots of little ones.  Devices that
+ * do small random reads quickly are better off with many reads in flight
+ * that only transfer what we want.
+ */
+static bool
+pf_want_scatter(void)
+{
+	long			latency;
+	int			rot;
+
+	switch (pf_io_mode) {
+	case PF_IO_COALESCE:
+		return false;
+	case PF_IO_SCATTER:
+		return true;
+	}
+
+	rot = pf_device_rotational();
+	if (rot == 1)
+		return false;
+	latency = pf_measure_latency();
+	if (latency < 0 || latency > PF_SCATTER_MAX_LATENCY)
+		return false;
+	return true;
+}
+
 void
 init_prefetch(
 	xfs_mount_t		*pmp)
@@ -862,6 +1033,11 @@ init_prefetch(
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
 	pf_batch_bytes = DEF_BATCH_BYTES;
 	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+	pf_scatter = pf_want_scatter();
+
+	if (verbose)
+		do_log(_("        - prefetch using %s reads\n"),
+			pf_scatter ? _("scatter") : _("coalesced"));
 }
 
 prefetch_args_t *
@@ -8,7 +8,18 @@ struct workqueue;
 
 extern int 	do_prefetch;
 
+/* how prefetch issues its reads */
+enum pf_io_mode {
+	PF_IO_AUTO,		/* decide from the device characteristics */
+	PF_IO_COALESCE,		/* big reads spanning gaps, copied out */
+	PF_IO_SCATTER,		/* one read per buffer, many in flight */
+};
+
+extern int	pf_io_mode;
+extern int	pf_io_depth;
+
 #define PF_THREAD_COUNT	4
+#define PF_DEF_IO_DEPTH	32
 
 typedef struct prefetch_args {
 	pthread_mutex_t		lock;
@@ -18,7 +18,9 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 #include <libxfs.h>
+#include <sys/mman.h>
 #include "slab.h"
+#include "err_protos.h"
 
 #undef SLAB_DEBUG
 
@@ -35,10 +37,19 @@
  * maintains a list of slabs of increasing size; when a slab fills up, another
  * is allocated.  Each slab is sorted individually, which means that one must
  * use an iterator to walk the entire logical array, sorted order or otherwise.
+ * Sorting a multi-slab array merges the slabs into a chain of slabs that is
+ * sorted from end to end, a bounded chunk at a time, if there is space to do
+ * so; otherwise the cursor merges the slabs on the fly with a binary heap.
  * Array items can neither be removed nor accessed randomly, since (at the
  * moment) the only user of them (storing reverse mappings) doesn't need either
  * piece.  Pointers are not stable across sort operations.
  *
+ * Slab memory can be capped with slab_set_memory_limit().  Once the cap is
+ * reached, new slabs are carved out of an unlinked temporary file and mapped
+ * into memory, so the kernel can write them back and drop them from the page
+ * cache instead of the process running out of memory.  Sorting and merging
+ * spilled slabs then costs mostly sequential I/O to the temporary file.
+ *
  * A bag is a collection of pointers.  The bag can be added to or removed from
  * arbitrarily, and the bag items can be iterated.  Bags are used to process
  * rmaps into refcount btree entries.
@@ -57,16 +68,29 @@
 struct xfs_slab_hdr {
 	size_t			sh_nr;
 	size_t			sh_inuse;	/* items in use */
+	size_t			sh_start;	/* items dropped from the front */
 	struct xfs_slab_hdr	*sh_next;	/* next slab hdr */
+	size_t			sh_map_len;	/* spilled: mapping length */
+	off_t			sh_map_off;	/* spilled: spill file offset */
 						/* objects follow */
 };
 
+/* Memory budget for slabs and the file that takes the overflow. */
+static pthread_mutex_t	slab_spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t		slab_mem_limit;		/* 0 means no limit */
+static size_t		slab_mem_used;
+static const char	*slab_spill_dir;
+static int		slab_spill_fd = -1;
+static off_t		slab_spill_end;
+static bool		slab_spill_broken;	/* stopped spilling */
+
 struct xfs_slab {
 	size_t			s_item_sz;	/* item size */
 	size_t			s_nr_slabs;	/* # of slabs */
 	size_t			s_nr_items;	/* # of items */
 	struct xfs_slab_hdr	*s_first;	/* first slab header */
 	struct xfs_slab_hdr	*s_last;	/* last sh_next pointer */
+	bool			s_merged;	/* slabs sorted end to end */
 };
 
 /*
@@ -75,10 +99,16 @@ struct xfs_slab {
  * returns objects in increasing order (if you've previously sorted the
  * slabs with qsort_slab()).  If compare_fn == NULL, it returns slab items
  * in order.
+ *
+ * Sorted cursors keep the non-empty slab_hdr_cursors in a binary min-heap
+ * ordered by the item each one points at, so finding the next item costs
+ * O(log nr) comparisons instead of a scan over every slab.  Equal items
+ * are returned in slab order.
  */
 struct xfs_slab_hdr_cursor {
 	struct xfs_slab_hdr	*hdr;		/* a slab header */
 	size_t			loc;		/* where we are in the slab */
+	size_t			end;		/* stop before this item */
 };
 
 typedef int (*xfs_slab_compare_fn)(const void *, const void *);
@@ -87,7 +117,10 @@ struct xfs_slab_cursor {
 	size_t				nr;		/* # of per-slab cursors */
 	struct xfs_slab			*slab;		/* pointer to the slab */
 	struct xfs_slab_hdr_cursor	*last_hcur;	/* last header we took from */
+	size_t				cur_hcur;	/* in order: current header */
 	xfs_slab_compare_fn		compare_fn;	/* compare items */
+	size_t				heap_nr;	/* # of heap entries */
+	struct xfs_slab_hdr_cursor	**heap;		/* min-heap of hcurs */
 	struct xfs_slab_hdr_cursor	hcur[0];	/* per-slab cursors */
 };
 
@@ -104,6 +137,166 @@ struct xfs_bag {
 #define BAG_SIZE(nr)	(sizeof(struct xfs_bag) + ((nr) * sizeof(void *)))
 #define BAG_END(bag)	(&(bag)->bg_ptrs[(bag)->bg_nr])
 
+/*
+ * Cap the memory used by all slabs at @limit bytes (0 for no cap).  Slabs
+ * allocated past the cap are backed by a temporary file in @dir, or in
+ * $TMPDIR or /tmp if @dir is NULL.
+ */
+void
+slab_set_memory_limit(
+	size_t		limit,
+	const char	*dir)
+{
+	pthread_mutex_lock(&slab_spill_lock);
+	slab_mem_limit = limit;
+	slab_spill_dir = dir;
+	pthread_mutex_unlock(&slab_spill_lock);
+}
+
+/*
+ * Map @len bytes of the spill file for a new slab.  Called with the spill
+ * lock held.
+ */
+static struct xfs_slab_hdr *
+spill_slab_hdr(
+	size_t			len)
+{
+	struct xfs_slab_hdr	*hdr;
+	const char		*dir;
+	char			*path;
+	size_t			pagesize = getpagesize();
+	void			*p;
+	int			error;
+
+	if (slab_spill_fd < 0) {
+		dir = slab_spill_dir;
+		if (!dir)
+			dir = getenv("TMPDIR");
+		if (!dir)
+			dir = "/tmp";
+		path = malloc(strlen(dir) + sizeof("/xfs_repair.XXXXXX"));
+		if (!path)
+			return NULL;
+		sprintf(path, "%s/xfs_repair.XXXXXX", dir);
+		slab_spill_fd = mkstemp(path);
+		if (slab_spill_fd >= 0)
+			unlink(path);
+		free(path);
+		if (slab_spill_fd < 0)
+			return NULL;
+	}
+
+	/*
+	 * Allocate the file space up front.  A sparse spill file that hits
+	 * ENOSPC would only tell us with a SIGBUS when the mapping is
+	 * written back.  posix_fallocate writes zeroes itself if the
+	 * filesystem can't preallocate.
+	 */
+	len = roundup(len, pagesize);
+	error = posix_fallocate(slab_spill_fd, slab_spill_end, len);
+	if (error) {
+		errno = error;
+		return NULL;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, slab_spill_fd,
+			slab_spill_end);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	hdr = p;
+	hdr->sh_map_len = len;
+	hdr->sh_map_off = slab_spill_end;
+	slab_spill_end += len;
+	return hdr;
+}
+
+/*
+ * Allocate @len bytes of memory for a new slab.  Called with the spill lock
+ * held.
+ */
+static struct xfs_slab_hdr *
+mem_slab_hdr(
+	size_t			len)
+{
+	struct xfs_slab_hdr	*hdr;
+
+	hdr = malloc(len);
+	if (hdr) {
+		hdr->sh_map_len = 0;
+		hdr->sh_map_off = 0;
+		slab_mem_used += len;
+	}
+	return hdr;
+}
+
+/*
+ * Allocate a slab header with room for @nr items, in memory if the budget
+ * allows and in the spill file otherwise.  If the spill file can't grow,
+ * say so once and carry on in memory past the budget.
+ */
+static struct xfs_slab_hdr *
+alloc_slab_hdr(
+	struct xfs_slab		*slab,
+	size_t			nr)
+{
+	struct xfs_slab_hdr	*hdr = NULL;
+	size_t			len;
+
+	len = sizeof(struct xfs_slab_hdr) + (nr * slab->s_item_sz);
+
+	pthread_mutex_lock(&slab_spill_lock);
+	if (!slab_mem_limit || slab_spill_broken ||
+	    slab_mem_used + len <= slab_mem_limit)
+		hdr = mem_slab_hdr(len);
+	if (!hdr && slab_mem_limit && !slab_spill_broken) {
+		hdr = spill_slab_hdr(len);
+		if (!hdr) {
+			do_warn(
+_("could not extend reverse mapping spill file: %s\n"
+  "keeping reverse mappings in memory instead\n"),
+				strerror(errno));
+			slab_spill_broken = true;
+			hdr = mem_slab_hdr(len);
+		}
+	}
+	pthread_mutex_unlock(&slab_spill_lock);
+	if (!hdr)
+		return NULL;
+
+	hdr->sh_nr = nr;
+	hdr->sh_inuse = 0;
+	hdr->sh_start = 0;
+	hdr->sh_next = NULL;
+	return hdr;
+}
+
+static void
+free_slab_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr)
+{
+	off_t			off;
+	size_t			len;
+
+	if (!hdr->sh_map_len) {
+		pthread_mutex_lock(&slab_spill_lock);
+		slab_mem_used -= sizeof(struct xfs_slab_hdr) +
+				(hdr->sh_nr * slab->s_item_sz);
+		pthread_mutex_unlock(&slab_spill_lock);
+		free(hdr);
+		return;
+	}
+
+	/* Give the space back to the filesystem holding the spill file. */
+	off = hdr->sh_map_off;
+	len = hdr->sh_map_len;
+	munmap(hdr, len);
+#ifdef FALLOC_FL_PUNCH_HOLE
+	fallocate(slab_spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			off, len);
+#endif
+}
+
 /*
  * Create a slab to hold some objects of a particular size.
  */
@@ -141,7 +334,7 @@ free_slab(
 	hdr = ptr->s_first;
 	while (hdr) {
 		nhdr = hdr->sh_next;
-		free(hdr);
+		free_slab_hdr(ptr, hdr);
 		hdr = nhdr;
 	}
 	free(ptr);
@@ -158,7 +351,7 @@ slab_ptr(
 
 	ASSERT(idx < hdr->sh_inuse);
 	p = (char *)(hdr + 1);
-	p += slab->s_item_sz * idx;
+	p += slab->s_item_sz * (hdr->sh_start + idx);
 	return p;
 }
 
@@ -174,18 +367,15 @@ slab_add(
 	void			*p;
 
 	hdr = slab->s_last;
-	if (!hdr || hdr->sh_inuse == hdr->sh_nr) {
+	if (!hdr || hdr->sh_start + hdr->sh_inuse == hdr->sh_nr) {
 		size_t n;
 
 		n = (hdr ? hdr->sh_nr * 2 : MIN_SLAB_NR);
 		if (n * slab->s_item_sz > MAX_SLAB_SIZE)
 			n = MAX_SLAB_SIZE / slab->s_item_sz;
-		hdr = malloc(sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz));
+		hdr = alloc_slab_hdr(slab, n);
 		if (!hdr)
 			return -ENOMEM;
-		hdr->sh_nr = n;
-		hdr->sh_inuse = 0;
-		hdr->sh_next = NULL;
 		if (slab->s_last)
 			slab->s_last->sh_next = hdr;
 		if (!slab->s_first)
@@ -197,10 +387,97 @@ slab_add(
 	p = slab_ptr(slab, hdr, hdr->sh_inuse - 1);
 	memcpy(p, item, slab->s_item_sz);
 	slab->s_nr_items++;
+	slab->s_merged = false;
 
 	return 0;
 }
 
+/*
+ * Binary min-heap of slab header cursors.  The heap is ordered by the item
+ * under each cursor; ties go to the cursor that comes first in memory, which
+ * is always the earlier slab.
+ */
+static inline bool
+hcur_less(
+	struct xfs_slab			*slab,
+	xfs_slab_compare_fn		compare_fn,
+	struct xfs_slab_hdr_cursor	*a,
+	struct xfs_slab_hdr_cursor	*b)
+{
+	int				diff;
+
+	diff = compare_fn(slab_ptr(slab, a->hdr, a->loc),
+			  slab_ptr(slab, b->hdr, b->loc));
+	if (diff)
+		return diff < 0;
+	return a < b;
+}
+
+static void
+hcur_heap_sift_down(
+	struct xfs_slab			*slab,
+	xfs_slab_compare_fn		compare_fn,
+	struct xfs_slab_hdr_cursor	**heap,
+	size_t				nr,
+	size_t				i)
+{
+	struct xfs_slab_hdr_cursor	*hcur = heap[i];
+	size_t				child;
+
+	while ((child = 2 * i + 1) < nr) {
+		if (child + 1 < nr &&
+		    hcur_less(slab, compare_fn, heap[child + 1], heap[child]))
+			child++;
+		if (!hcur_less(slab, compare_fn, heap[child], hcur))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = hcur;
+}
+
+/*
+ * Build a heap out of the non-empty cursors in @hcur and return the number
+ * of heap entries.
+ */
+static size_t
+hcur_heap_init(
+	struct xfs_slab			*slab,
+	xfs_slab_compare_fn		compare_fn,
+	struct xfs_slab_hdr_cursor	**heap,
+	struct xfs_slab_hdr_cursor	*hcur,
+	size_t				nr_hcur)
+{
+	size_t				nr = 0;
+	size_t				i;
+
+	for (i = 0; i < nr_hcur; i++)
+		if (hcur[i].loc < hcur[i].end)
+			heap[nr++] = &hcur[i];
+	for (i = nr / 2; i > 0; i--)
+		hcur_heap_sift_down(slab, compare_fn, heap, nr, i - 1);
+	return nr;
+}
+
+/*
+ * Step past the item at the top of the heap and restore the heap order.
+ * Returns the new number of heap entries.
+ */
+static size_t
+hcur_heap_advance(
+	struct xfs_slab			*slab,
+	xfs_slab_compare_fn		compare_fn,
+	struct xfs_slab_hdr_cursor	**heap,
+	size_t				nr)
+{
+	heap[0]->loc++;
+	if (heap[0]->loc >= heap[0]->end)
+		heap[0] = heap[--nr];
+	if (nr > 1)
+		hcur_heap_sift_down(slab, compare_fn, heap, nr, 0);
+	return nr;
+}
+
 #include "threads.h"
 
 struct qsort_slab {
@@ -222,6 +499,379 @@ qsort_slab_helper(
 	free(qs);
 }
 
+/*
+ * Merging sorted slabs.  The output is cut into partitions at splitter items
+ * sampled from the input; partition p takes the items in
+ * [bounds[p][s], bounds[p + 1][s]) from every slab s and can be merged
+ * independently of the others.  Items equal to a splitter all land in the
+ * same partition, so the result is the same as a single merge.
+ *
+ * Each partition is merged into a slab of its own of about MERGE_CHUNK_SIZE
+ * bytes, so the merged slabs follow one another in sorted order.  Only a
+ * few partitions are merged at a time, and after each round the input that
+ * has been merged is given back: used up slabs are freed, slabs in memory
+ * are compacted and shrunk once a good part of them has gone, and spilled
+ * slabs have the merged part punched out of the spill file.  So merging
+ * needs a few chunks and a fraction of the input on top of the input, not
+ * a second copy of all of it.
+ */
+struct merge_slab {
+	struct xfs_slab		*slab;
+	xfs_slab_compare_fn	compare_fn;
+	struct xfs_slab_hdr	**hdrs;		/* input slabs */
+	size_t			nr_hdrs;
+	size_t			*shift;		/* items dropped, per slab */
+	size_t			**bounds;	/* partition start, per slab */
+	size_t			*offsets;	/* partition start in output */
+	size_t			first_part;	/* first partition this round */
+	struct xfs_slab_hdr_cursor *hcurs;	/* per-thread cursors */
+	struct xfs_slab_hdr_cursor **heaps;	/* per-thread heaps */
+	struct xfs_slab_hdr	**outs;		/* merged slab per partition */
+};
+
+/* Bytes of output per partition. */
+#define MERGE_CHUNK_SIZE	(16 * 1048576)
+/* Items sampled per partition to choose the splitters. */
+#define MERGE_SAMPLES		8
+/* Compact an in-memory input slab once this fraction of it is merged. */
+#define MERGE_SHRINK_SHIFT	2
+
+static void
+merge_slab_helper(
+	struct workqueue		*wq,
+	xfs_agnumber_t			part,
+	void				*arg)
+{
+	struct merge_slab		*ms = arg;
+	struct xfs_slab			*slab = ms->slab;
+	struct xfs_slab_hdr_cursor	*hcur;
+	struct xfs_slab_hdr_cursor	**heap;
+	size_t				slot = part - ms->first_part;
+	char				*dst;
+	size_t				nr;
+	size_t				s;
+
+	hcur = &ms->hcurs[slot * ms->nr_hdrs];
+	heap = &ms->heaps[slot * ms->nr_hdrs];
+	for (s = 0; s < ms->nr_hdrs; s++) {
+		hcur[s].hdr = ms->hdrs[s];
+		hcur[s].loc = ms->bounds[part][s] - ms->shift[s];
+		hcur[s].end = ms->bounds[part + 1][s] - ms->shift[s];
+	}
+	nr = hcur_heap_init(slab, ms->compare_fn, heap, hcur, ms->nr_hdrs);
+
+	dst = (char *)(ms->outs[part] + 1);
+	while (nr > 0) {
+		memcpy(dst, slab_ptr(slab, heap[0]->hdr, heap[0]->loc),
+				slab->s_item_sz);
+		dst += slab->s_item_sz;
+		nr = hcur_heap_advance(slab, ms->compare_fn, heap, nr);
+	}
+}
+
+/* Find the first item in @hdr that is not less than @key. */
+static size_t
+slab_lower_bound(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr,
+	xfs_slab_compare_fn	compare_fn,
+	const void		*key)
+{
+	size_t			lo = 0;
+	size_t			hi = hdr->sh_inuse;
+	size_t			mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (compare_fn(slab_ptr(slab, hdr, mid), key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Choose the partition boundaries.  Each slab contributes samples in
+ * proportion to its size, so the partitions come out roughly the same size.
+ * Returns false if we run out of memory.
+ */
+static bool
+merge_slab_partition(
+	struct merge_slab	*ms,
+	size_t			nr_parts)
+{
+	struct xfs_slab		*slab = ms->slab;
+	struct xfs_slab_hdr	*hdr;
+	char			*samples;
+	size_t			max_samples = nr_parts * MERGE_SAMPLES +
+					      ms->nr_hdrs;
+	size_t			nr_samples = 0;
+	size_t			per_slab;
+	size_t			p, s, i;
+
+	if (nr_parts == 1)
+		return true;
+
+	samples = malloc(max_samples * slab->s_item_sz);
+	if (!samples)
+		return false;
+	for (s = 0; s < ms->nr_hdrs; s++) {
+		hdr = ms->hdrs[s];
+		per_slab = howmany(hdr->sh_inuse * nr_parts * MERGE_SAMPLES,
+				slab->s_nr_items);
+		for (i = 0; i < per_slab && nr_samples < max_samples; i++) {
+			memcpy(samples + nr_samples * slab->s_item_sz,
+				slab_ptr(slab, hdr, i * hdr->sh_inuse / per_slab),
+				slab->s_item_sz);
+			nr_samples++;
+		}
+	}
+	qsort(samples, nr_samples, slab->s_item_sz, ms->compare_fn);
+
+	for (p = 1; p < nr_parts; p++) {
+		const void	*key;
+
+		key = samples + (p * nr_samples / nr_parts) * slab->s_item_sz;
+		for (s = 0; s < ms->nr_hdrs; s++)
+			ms->bounds[p][s] = slab_lower_bound(slab, ms->hdrs[s],
+					ms->compare_fn, key);
+	}
+	free(samples);
+	return true;
+}
+
+/* Drop the first @nr items of an input slab in memory and shrink it. */
+static struct xfs_slab_hdr *
+shrink_slab_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr,
+	size_t			nr)
+{
+	struct xfs_slab_hdr	*new;
+	size_t			old_nr = hdr->sh_nr;
+
+	hdr->sh_inuse -= nr;
+	memmove(hdr + 1, (char *)(hdr + 1) + nr * slab->s_item_sz,
+			hdr->sh_inuse * slab->s_item_sz);
+
+	new = realloc(hdr, sizeof(struct xfs_slab_hdr) +
+			hdr->sh_inuse * slab->s_item_sz);
+	if (!new)
+		return hdr;
+	new->sh_nr = new->sh_inuse;
+	pthread_mutex_lock(&slab_spill_lock);
+	slab_mem_used -= (old_nr - new->sh_nr) * slab->s_item_sz;
+	pthread_mutex_unlock(&slab_spill_lock);
+	return new;
+}
+
+/*
+ * Drop the first @nr items of a spilled input slab and give back the spill
+ * file space behind them.  The items that are left stay where they are, as
+ * writing them into pages we've punched out would need new blocks and
+ * could fault with SIGBUS if the filesystem is full.  Only whole pages of
+ * dropped items are punched, so the header and the items still in use are
+ * never in a hole.
+ */
+static void
+punch_slab_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr,
+	size_t			nr)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	size_t			pagesize = getpagesize();
+	off_t			start;
+	off_t			end;
+#endif
+
+	hdr->sh_start += nr;
+	hdr->sh_inuse -= nr;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	start = roundup(sizeof(struct xfs_slab_hdr), pagesize);
+	end = (sizeof(struct xfs_slab_hdr) + hdr->sh_start * slab->s_item_sz) /
+			pagesize * pagesize;
+	if (end > start)
+		fallocate(slab_spill_fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, hdr->sh_map_off + start,
+				end - start);
+#endif
+}
+
+/*
+ * Give back the input that has been merged into partitions before @part.
+ * Spilled slabs drop the merged items from their front straight away.  If
+ * @all is set, also compact every slab in memory that still has items so
+ * that it can be used on its own again.
+ */
+static void
+merge_slab_release(
+	struct merge_slab	*ms,
+	size_t			part,
+	bool			all)
+{
+	struct xfs_slab_hdr	*hdr;
+	size_t			nr;
+	size_t			s;
+
+	for (s = 0; s < ms->nr_hdrs; s++) {
+		hdr = ms->hdrs[s];
+		if (!hdr)
+			continue;
+		nr = ms->bounds[part][s] - ms->shift[s];
+		if (nr == hdr->sh_inuse) {
+			free_slab_hdr(ms->slab, hdr);
+			ms->hdrs[s] = NULL;
+		} else if (nr > 0 && hdr->sh_map_len) {
+			punch_slab_hdr(ms->slab, hdr, nr);
+			ms->shift[s] += nr;
+		} else if (nr > 0 && (all ||
+				nr >= hdr->sh_inuse >> MERGE_SHRINK_SHIFT)) {
+			ms->hdrs[s] = shrink_slab_hdr(ms->slab, hdr, nr);
+			ms->shift[s] += nr;
+		}
+	}
+}
+
+/*
+ * Merge the individually sorted slabs into a chain of slabs that is sorted
+ * from end to end, so that cursors can walk it without merging.  If we run
+ * out of space partway through, keep what has been merged and leave the
+ * rest of the input for the cursor to merge.
+ */
+static void
+merge_slab(
+	struct xfs_slab		*slab,
+	xfs_slab_compare_fn	compare_fn)
+{
+	struct merge_slab	ms = {
+		.slab		= slab,
+		.compare_fn	= compare_fn,
+		.nr_hdrs	= slab->s_nr_slabs,
+	};
+	struct workqueue	wq;
+	struct xfs_slab_hdr	*hdr;
+	struct xfs_slab_hdr	**last;
+	size_t			nr_parts;
+	size_t			nr_threads;
+	size_t			done = 0;
+	size_t			end;
+	size_t			p, s;
+
+	/*
+	 * Cut the output into chunks of bounded size, and into at least one
+	 * partition per thread as long as each gets a decent amount of work.
+	 */
+	nr_parts = howmany(slab->s_nr_items * slab->s_item_sz,
+			MERGE_CHUNK_SIZE);
+	nr_threads = min((size_t)libxfs_nproc(),
+			slab->s_nr_items / MIN_SLAB_NR);
+	nr_parts = max(nr_parts, nr_threads);
+	if (nr_parts < 1)
+		nr_parts = 1;
+	nr_threads = max(min(nr_threads, nr_parts), (size_t)1);
+
+	ms.hdrs = calloc(ms.nr_hdrs, sizeof(struct xfs_slab_hdr *));
+	ms.shift = calloc(ms.nr_hdrs, sizeof(size_t));
+	ms.bounds = calloc(nr_parts + 1, sizeof(size_t *));
+	ms.offsets = calloc(nr_parts + 1, sizeof(size_t));
+	ms.outs = calloc(nr_parts, sizeof(struct xfs_slab_hdr *));
+	ms.hcurs = calloc(nr_threads * ms.nr_hdrs, sizeof(*ms.hcurs));
+	ms.heaps = calloc(nr_threads * ms.nr_hdrs, sizeof(*ms.heaps));
+	if (!ms.hdrs || !ms.shift || !ms.bounds || !ms.offsets || !ms.outs ||
+	    !ms.hcurs || !ms.heaps)
+		goto out_free;
+	for (p = 0; p <= nr_parts; p++) {
+		ms.bounds[p] = calloc(ms.nr_hdrs, sizeof(size_t));
+		if (!ms.bounds[p])
+			goto out_free;
+	}
+	for (s = 0, hdr = slab->s_first; hdr; s++, hdr = hdr->sh_next) {
+		ms.hdrs[s] = hdr;
+		ms.bounds[nr_parts][s] = hdr->sh_inuse;
+	}
+	if (!merge_slab_partition(&ms, nr_parts))
+		goto out_free;
+	for (p = 1; p <= nr_parts; p++) {
+		ms.offsets[p] = ms.offsets[p - 1];
+		for (s = 0; s < ms.nr_hdrs; s++)
+			ms.offsets[p] += ms.bounds[p][s] - ms.bounds[p - 1][s];
+	}
+	ASSERT(ms.offsets[nr_parts] == slab->s_nr_items);
+
+	/* Merge a round of partitions, then give back what they used up. */
+	while (done < nr_parts) {
+		end = min(done + nr_threads, nr_parts);
+		for (p = done; p < end; p++) {
+			if (ms.offsets[p + 1] == ms.offsets[p])
+				continue;
+			ms.outs[p] = alloc_slab_hdr(slab,
+					ms.offsets[p + 1] - ms.offsets[p]);
+			if (!ms.outs[p])
+				break;
+			ms.outs[p]->sh_inuse = ms.outs[p]->sh_nr;
+		}
+		if (p < end) {
+			for (p = done; p < end; p++) {
+				if (ms.outs[p])
+					free_slab_hdr(slab, ms.outs[p]);
+				ms.outs[p] = NULL;
+			}
+			break;
+		}
+
+		ms.first_part = done;
+		if (end - done == 1) {
+			merge_slab_helper(NULL, done, &ms);
+		} else {
+			create_work_queue(&wq, NULL, end - done);
+			for (p = done; p < end; p++)
+				queue_work(&wq, merge_slab_helper, p, &ms);
+			destroy_work_queue(&wq);
+		}
+		done = end;
+		merge_slab_release(&ms, done, false);
+	}
+	if (done < nr_parts)
+		merge_slab_release(&ms, done, true);
+
+	/* Swap the merged slabs, and anything left unmerged, in. */
+	slab->s_first = NULL;
+	slab->s_last = NULL;
+	slab->s_nr_slabs = 0;
+	slab->s_merged = (done == nr_parts);
+	last = &slab->s_first;
+	for (p = 0; p < done; p++) {
+		if (!ms.outs[p])
+			continue;
+		*last = slab->s_last = ms.outs[p];
+		last = &ms.outs[p]->sh_next;
+		slab->s_nr_slabs++;
+	}
+	for (s = 0; s < ms.nr_hdrs; s++) {
+		if (!ms.hdrs[s])
+			continue;
+		*last = slab->s_last = ms.hdrs[s];
+		last = &ms.hdrs[s]->sh_next;
+		slab->s_nr_slabs++;
+	}
+	*last = NULL;
+
+out_free:
+	if (ms.bounds)
+		for (p = 0; p <= nr_parts; p++)
+			free(ms.bounds[p]);
+	free(ms.bounds);
+	free(ms.offsets);
+	free(ms.outs);
+	free(ms.heaps);
+	free(ms.hcurs);
+	free(ms.shift);
+	free(ms.hdrs);
+}
+
 /*
  * Sort the items in the slab.  Do not run this method if there are any
  * cursors holding on to the slab.
@@ -246,7 +896,7 @@ qsort_slab(
 					slab->s_item_sz, compare_fn);
 			hdr = hdr->sh_next;
 		}
-		return;
+		goto merge;
 	}
 
 	create_work_queue(&wq, NULL, libxfs_nproc());
@@ -260,6 +910,9 @@ qsort_slab(
 		hdr = hdr->sh_next;
 	}
 	destroy_work_queue(&wq);
+merge:
+	if (slab->s_nr_slabs > 1)
+		merge_slab(slab, compare_fn);
 }
 
 /*
@@ -280,21 +933,33 @@ init_slab_cursor(
 	struct xfs_slab_hdr	*hdr;
 
 	c = malloc(sizeof(struct xfs_slab_cursor) +
-		   (sizeof(struct xfs_slab_hdr_cursor) * slab->s_nr_slabs));
+		   (sizeof(struct xfs_slab_hdr_cursor) * slab->s_nr_slabs) +
+		   (sizeof(struct xfs_slab_hdr_cursor *) * slab->s_nr_slabs));
 	if (!c)
 		return -ENOMEM;
+	/* Merged slabs are already in order, so just walk them. */
+	if (slab->s_merged)
+		compare_fn = NULL;
+
 	c->nr = slab->s_nr_slabs;
 	c->slab = slab;
 	c->compare_fn = compare_fn;
 	c->last_hcur = NULL;
+	c->cur_hcur = 0;
+	c->heap = (struct xfs_slab_hdr_cursor **)&c->hcur[c->nr];
 	hcur = (struct xfs_slab_hdr_cursor *)(c + 1);
 	hdr = slab->s_first;
 	while (hdr) {
 		hcur->hdr = hdr;
 		hcur->loc = 0;
+		hcur->end = hdr->sh_inuse;
 		hcur++;
 		hdr = hdr->sh_next;
 	}
+	c->heap_nr = 0;
+	if (compare_fn)
+		c->heap_nr = hcur_heap_init(slab, compare_fn, c->heap,
+				c->hcur, c->nr);
 	*cur = c;
 	return 0;
 }
@@ -321,39 +986,31 @@ peek_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
 	struct xfs_slab_hdr_cursor	*hcur;
-	void			*p = NULL;
-	void			*q;
-	size_t			i;
 
 	cur->last_hcur = NULL;
 
-	/* no compare function; inorder traversal */
+	/*
+	 * No compare function; inorder traversal.  Headers before the
+	 * current one are used up, so only move on when it runs out.
+	 */
 	if (!cur->compare_fn) {
-		if (!cur->last_hcur)
-			cur->last_hcur = &cur->hcur[0];
-		hcur = cur->last_hcur;
-		while (hcur < &cur->hcur[cur->nr] &&
-			hcur->loc >= hcur->hdr->sh_inuse)
-			hcur++;
-		if (hcur == &cur->hcur[cur->nr])
+		while (cur->cur_hcur < cur->nr &&
+		       cur->hcur[cur->cur_hcur].loc >=
+				cur->hcur[cur->cur_hcur].hdr->sh_inuse)
+			cur->cur_hcur++;
+		if (cur->cur_hcur == cur->nr)
 			return NULL;
-		p = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
+		hcur = &cur->hcur[cur->cur_hcur];
 		cur->last_hcur = hcur;
-		return p;
+		return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 	}
 
 	/* otherwise return things in increasing order */
-	for (i = 0, hcur = &cur->hcur[i]; i < cur->nr; i++, hcur++) {
-		if (hcur->loc >= hcur->hdr->sh_inuse)
-			continue;
-		q = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
-		if (!p || cur->compare_fn(p, q) > 0) {
-			p = q;
-			cur->last_hcur = hcur;
-		}
-	}
-
-	return p;
+	if (cur->heap_nr == 0)
+		return NULL;
+	hcur = cur->heap[0];
+	cur->last_hcur = hcur;
+	return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
 }
 
 /*
@@ -364,7 +1021,13 @@ advance_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
 	ASSERT(cur->last_hcur);
-	cur->last_hcur->loc++;
+	if (!cur->compare_fn) {
+		cur->last_hcur->loc++;
+		return;
+	}
+	ASSERT(cur->last_hcur == cur->heap[0]);
+	cur->heap_nr = hcur_heap_advance(cur->slab, cur->compare_fn,
+			cur->heap, cur->heap_nr);
 }
 
 /*
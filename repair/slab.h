@@ -25,6 +25,7 @@ struct xfs_slab_cursor;
 
 extern int init_slab(struct xfs_slab **, size_t);
 extern void free_slab(struct xfs_slab **);
+extern void slab_set_memory_limit(size_t, const char *);
 
 extern int slab_add(struct xfs_slab *, void *);
 extern void qsort_slab(struct xfs_slab *, int (*)(const void *, const void *));
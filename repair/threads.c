@@ -29,30 +29,52 @@ create_work_queue(
 {
 	int			err;
 
-	err = workqueue_create(wq, mp, nworkers);
+	err = workqueue_create_flags(wq, mp, nworkers, WQ_STEAL);
 	if (err)
 		do_error(_("cannot create worker threads, error = [%d] %s\n"),
 				err, strerror(err));
 }
 
 void
-queue_work(
+queue_work_cost(
 	struct workqueue	*wq,
 	workqueue_func_t	func,
 	xfs_agnumber_t		agno,
-	void			*arg)
+	void			*arg,
+	uint64_t		cost)
 {
 	int			err;
 
-	err = workqueue_add(wq, func, agno, arg);
+	err = workqueue_add_cost(wq, func, agno, arg, cost);
 	if (err)
 		do_error(_("cannot allocate worker item, error = [%d] %s\n"),
 				err, strerror(err));
 }
 
+void
+queue_work(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	queue_work_cost(wq, func, agno, arg, 1);
+}
+
 void
 destroy_work_queue(
 	struct workqueue	*wq)
 {
+	struct workqueue_stats	stats;
+
+	workqueue_terminate(wq);
+	if (verbose > 2 && wq->thread_count > 1) {
+		workqueue_get_stats(wq, &stats);
+		do_log(
+	_("        - %u workers ran %" PRIu64 " items (%" PRIu64 " stolen, %" PRIu64 " split off), idle %" PRIu64 "ms, max queue wait %" PRIu64 "ms\n"),
+			wq->thread_count, stats.items, stats.steals,
+			stats.continuations, stats.idle_ns / 1000000,
+			stats.max_wait_ns / 1000000);
+	}
 	workqueue_destroy(wq);
 }
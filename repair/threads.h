@@ -11,6 +11,14 @@ create_work_queue(
 	struct xfs_mount	*mp,
 	unsigned int		nworkers);
 
+void
+queue_work_cost(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t 		agno,
+	void			*arg,
+	uint64_t		cost);
+
 void
 queue_work(
 	struct workqueue	*wq,
@@ -61,6 +61,16 @@ static char *o_opts[] = {
 	"force_geometry",
 #define PHASE2_THREADS	6
 	"phase2_threads",
+#define PF_MODE		7
+	"pf_mode",
+#define PF_IODEPTH	8
+	"pf_iodepth",
+#define SLAB_MEM	9
+	"slab_mem",
+#define SLAB_DIR	10
+	"slab_dir",
+#define BMAP_MODE	11
+	"bmap_mode",
 	NULL
 };
 
@@ -76,6 +86,8 @@ static char *c_opts[] = {
 
 static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
+static long	slab_mem_specified = -1;	/* in megabytes */
+static char	*slab_dir;
 static int	phase2_threads = 32;
 
 static void
@@ -269,6 +281,58 @@ process_args(int argc, char **argv)
 				case PHASE2_THREADS:
 					phase2_threads = (int)strtol(val, NULL, 0);
 					break;
+				case PF_MODE:
+					if (!val)
+						do_abort(
+		_("-o pf_mode requires a parameter\n"));
+					if (!strcmp(val, "auto"))
+						pf_io_mode = PF_IO_AUTO;
+					else if (!strcmp(val, "coalesce"))
+						pf_io_mode = PF_IO_COALESCE;
+					else if (!strcmp(val, "scatter"))
+						pf_io_mode = PF_IO_SCATTER;
+					else
+						do_abort(
+		_("-o pf_mode must be auto, coalesce or scatter\n"));
+					break;
+				case PF_IODEPTH:
+					if (!val)
+						do_abort(
+		_("-o pf_iodepth requires a parameter\n"));
+					pf_io_depth = (int)strtol(val, NULL, 0);
+					if (pf_io_depth < 1)
+						do_abort(
+		_("-o pf_iodepth must be at least 1\n"));
+					break;
+				case SLAB_MEM:
+					if (!val)
+						do_abort(
+		_("-o slab_mem requires a parameter\n"));
+					slab_mem_specified = strtol(val, NULL, 0);
+					if (slab_mem_specified < 1)
+						do_abort(
+		_("-o slab_mem must be at least 1\n"));
+					break;
+				case SLAB_DIR:
+					if (!val)
+						do_abort(
+		_("-o slab_dir requires a parameter\n"));
+					slab_dir = val;
+					break;
+				case BMAP_MODE:
+					if (!val)
+						do_abort(
+		_("-o bmap_mode requires a parameter\n"));
+					if (!strcmp(val, "auto"))
+						bmap_mode = BMAP_AUTO;
+					else if (!strcmp(val, "btree"))
+						bmap_mode = BMAP_BTREE;
+					else if (!strcmp(val, "packed"))
+						bmap_mode = BMAP_PACKED;
+					else
+						do_abort(
+		_("-o bmap_mode must be auto, btree or packed\n"));
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -831,10 +895,11 @@ main(int argc, char **argv)
 	 * filesystem size and inode count.
 	 *
 	 * We'll set the cache size based on 3/4s the memory minus
-	 * space used by the inode AVL tree and block usage map.
+	 * space used by the inode records and block usage map.
 	 *
-	 * Inode AVL tree space is approximately 4 bytes per inode,
-	 * block usage map is currently 1 byte for 2 blocks.
+	 * Inode records take one record, one set of phase 6 extra
+	 * data and one index slot per 64 inodes, block usage map is
+	 * currently 1 byte for 2 blocks.
 	 *
 	 * We assume most blocks will be inode clusters.
 	 *
@@ -844,12 +909,16 @@ main(int argc, char **argv)
 	if (!bhash_option_used || max_mem_specified) {
 		unsigned long 	mem_used;
 		unsigned long	max_mem;
+		uint64_t	imem;
 		struct rlimit	rlim;
 
 		libxfs_bcache_purge();
 		cache_destroy(libxfs_bcache);
 
-		mem_used = (mp->m_sb.sb_icount >> (10 - 2)) +
+		imem = (mp->m_sb.sb_icount / XFS_INODES_PER_CHUNK) *
+			(sizeof(ino_tree_node_t) + sizeof(ino_ex_data_t) +
+			 sizeof(ino_tree_node_t *)) >> 10;
+		mem_used = imem +
 					(mp->m_sb.sb_dblocks >> (10 + 1)) +
 					50000;	/* rough estimate of 50MB overhead */
 		max_mem = max_mem_specified ? max_mem_specified * 1024 :
@@ -867,8 +936,7 @@ main(int argc, char **argv)
 		if (verbose > 1)
 			do_log(
 	_("        - max_mem = %lu, icount = %" PRIu64 ", imem = %" PRIu64 ", dblock = %" PRIu64 ", dmem = %" PRIu64 "\n"),
-				max_mem, mp->m_sb.sb_icount,
-				mp->m_sb.sb_icount >> (10 - 2),
+				max_mem, mp->m_sb.sb_icount, imem,
 				mp->m_sb.sb_dblocks,
 				mp->m_sb.sb_dblocks >> (10 + 1));
 
@@ -896,6 +964,14 @@ main(int argc, char **argv)
 		}
 
 		max_mem -= mem_used;
+
+		/*
+		 * Under an explicit memory limit, give the reverse mapping
+		 * slabs half of what is left and spill the rest to disk.
+		 */
+		if (max_mem_specified && slab_mem_specified < 0)
+			slab_mem_specified = max(max_mem / 2048, 1UL);
+
 		if (max_mem >= (1 << 30))
 			max_mem = 1 << 30;
 		libxfs_bhash_size = max_mem / (HASH_CACHE_RATIO *
@@ -907,10 +983,26 @@ main(int argc, char **argv)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(CACHE_SCALABLE, libxfs_bhash_size,
 						&libxfs_bcache_operations);
 	}
 
+	if (slab_mem_specified > 0) {
+		slab_set_memory_limit((size_t)slab_mem_specified << 20,
+				slab_dir);
+		if (verbose)
+			do_log(
+	_("        - reverse mapping memory limited to %ldMB\n"),
+				slab_mem_specified);
+	}
+
+	/*
+	 * Let discontiguous buffers (directory blocks, mostly) and scatter
+	 * prefetch keep enough reads in flight to keep the device queue busy.
+	 */
+	if (libxfs_aio_init(pf_io_depth))
+		do_warn(_("couldn't start asynchronous I/O, using synchronous I/O\n"));
+
 	/*
 	 * calculate what mkfs would do to this filesystem
 	 */
@@ -919,6 +1011,11 @@ main(int argc, char **argv)
 	/*
 	 * initialize block alloc map
 	 */
+	select_bmap_mode(mp, max_mem_specified ? max_mem_specified * 1024 :
+					libxfs_physmem() * 3 / 4);
+	if (verbose)
+		do_log(_("        - using %s block map\n"),
+			bmap_mode == BMAP_PACKED ? _("packed") : _("btree"));
 	init_bmaps(mp);
 	incore_ino_init(mp);
 	incore_ext_init(mp);
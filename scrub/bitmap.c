@@ -159,8 +159,8 @@ __bitmap_set(
 	bool			res = true;
 
 	/* Find any existing nodes adjacent or within that range. */
-	avl64_findranges(bmap->bt_tree, start - 1, start + length + 1,
-			&firstn, &lastn);
+	avl64_findranges(bmap->bt_tree, start ? start - 1 : 0,
+			start + length + 1, &firstn, &lastn);
 
 	/* Nothing, just insert a new extent. */
 	if (firstn == NULL && lastn == NULL) {
@@ -193,9 +193,9 @@ __bitmap_set(
 		/* Check for overlapping and adjacent extents. */
 		if (ext->btn_start + ext->btn_length >= start ||
 		    ext->btn_start <= start + length) {
-			if (ext->btn_start < start) {
+			if (ext->btn_start < new_start) {
+				new_length += new_start - ext->btn_start;
 				new_start = ext->btn_start;
-				new_length += ext->btn_length;
 			}
 
 			if (ext->btn_start + ext->btn_length >
@@ -319,7 +319,6 @@ bitmap_clear(
 }
 #endif
 
-#ifdef DEBUG
 /* Iterate the set regions of this bitmap. */
 bool
 bitmap_iterate(
@@ -342,7 +341,34 @@ bitmap_iterate(
 
 	return moveon;
 }
-#endif
+
+/*
+ * Find the first set region that overlaps the given range.  Returns false
+ * if there isn't one.
+ */
+bool
+bitmap_find_first(
+	struct bitmap		*bmap,
+	uint64_t		start,
+	uint64_t		len,
+	uint64_t		*set_start,
+	uint64_t		*set_len)
+{
+	struct avl64node	*firstn;
+	struct avl64node	*lastn;
+	struct bitmap_node	*ext;
+
+	pthread_mutex_lock(&bmap->bt_lock);
+	avl64_findranges(bmap->bt_tree, start, start + len, &firstn, &lastn);
+	if (firstn) {
+		ext = container_of(firstn, struct bitmap_node, btn_node);
+		*set_start = ext->btn_start;
+		*set_len = ext->btn_length;
+	}
+	pthread_mutex_unlock(&bmap->bt_lock);
+
+	return firstn != NULL;
+}
 
 /* Do any bitmap extents overlap the given one?  (locked) */
 static bool
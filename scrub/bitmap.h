@@ -32,6 +32,8 @@ bool bitmap_iterate(struct bitmap *bmap,
 		bool (*fn)(uint64_t, uint64_t, void *), void *arg);
 bool bitmap_test(struct bitmap *bmap, uint64_t start,
 		uint64_t len);
+bool bitmap_find_first(struct bitmap *bmap, uint64_t start, uint64_t len,
+		uint64_t *set_start, uint64_t *set_len);
 bool bitmap_empty(struct bitmap *bmap);
 void bitmap_dump(struct bitmap *bmap);
 
@@ -0,0 +1,571 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include "path.h"
+#include "xfs_scrub.h"
+#include "common.h"
+#include "bitmap.h"
+#include "checkpoint.h"
+
+/*
+ * Scrub Checkpoints
+ *
+ * A checkpoint file records how far a scrub cycle got: which phases are
+ * finished, which AGs and inodes have been checked, and which byte ranges
+ * of the disks have been read-verified.  A run that starts with the same
+ * checkpoint file skips the work that an earlier, interrupted run already
+ * did, so media verification of a big filesystem can be spread over
+ * several runs.  Once every phase has finished the cycle is over and the
+ * file is removed.
+ *
+ * The file is rewritten every CKPT_INTERVAL seconds and when we're killed
+ * by SIGINT, SIGTERM or SIGHUP.  We block those signals in every thread
+ * and let a helper thread wait for them, so that the save doesn't happen
+ * in signal context.
+ *
+ * Phases 2, 3 and 5 queue repairs for phase 4, so in repair mode we only
+ * trust the media verification progress and redo everything else, which
+ * also means that we don't carry over the old error counts.
+ *
+ * Ranges with media errors are never marked verified, so a resumed run
+ * reads them and reports their errors again.  Until media verification
+ * has finished we therefore save the error counts from before it started,
+ * so that those errors aren't counted twice.
+ */
+
+#define CKPT_MAGIC		"xfs_scrub checkpoint 1\n"
+#define CKPT_INTERVAL		30	/* seconds */
+
+/* Sent to the helper thread to make it exit. */
+#define CKPT_STOP_SIGNAL	SIGUSR1
+
+static const char *ckpt_map_names[CKPT_NR_MAPS] = {
+	[CKPT_METADATA]		= "metadata",
+	[CKPT_INODES]		= "inodes",
+	[CKPT_CONNECTIONS]	= "connections",
+	[CKPT_DATA]		= "data",
+	[CKPT_RTDATA]		= "rtdata",
+};
+
+struct scrub_ckpt {
+	char			*path;
+	char			*tmppath;
+	pthread_t		thread;
+	sigset_t		sigs;
+	pthread_mutex_t		lock;		/* serializes saves */
+	bool			loaded;
+	bool			save_failed;
+	bool			media_started;	/* media_* are valid */
+	unsigned long long	media_errors;	/* counts when phase 6 began */
+	unsigned long long	media_warnings;
+	unsigned int		done;		/* 1 << map for finished maps */
+	unsigned int		incomplete;	/* maps that stopped early */
+	uint64_t		nr_inodes;	/* inodes in CKPT_INODES */
+	struct bitmap		*maps[CKPT_NR_MAPS];
+};
+
+/* Forget all recorded progress. */
+static bool
+ckpt_reset(
+	struct scrub_ckpt	*ckpt)
+{
+	int			i;
+
+	ckpt->done = 0;
+	ckpt->nr_inodes = 0;
+	for (i = CKPT_NONE + 1; i < CKPT_NR_MAPS; i++) {
+		if (ckpt->maps[i])
+			bitmap_free(&ckpt->maps[i]);
+		if (!bitmap_init(&ckpt->maps[i]))
+			return false;
+	}
+	return true;
+}
+
+static void
+ckpt_format_uuid(
+	struct scrub_ctx	*ctx,
+	char			*buf)
+{
+	int			i;
+
+	for (i = 0; i < sizeof(ctx->geo.uuid); i++)
+		sprintf(buf + i * 2, "%02x", ctx->geo.uuid[i]);
+}
+
+static bool
+ckpt_save_range(
+	uint64_t		start,
+	uint64_t		length,
+	void			*arg)
+{
+	void			**args = arg;
+
+	return fprintf(args[0], "%s %"PRIu64" %"PRIu64"\n",
+			(char *)args[1], start, length) > 0;
+}
+
+/* Write the checkpoint to a temporary file and rename it into place. */
+static void
+ckpt_save(
+	struct scrub_ctx	*ctx)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+	char			uuid[sizeof(ctx->geo.uuid) * 2 + 1];
+	unsigned long long	errors;
+	unsigned long long	warnings;
+	void			*args[2];
+	FILE			*fp;
+	bool			moveon = true;
+	int			i;
+
+	pthread_mutex_lock(&ckpt->lock);
+	if (!ckpt->loaded)
+		goto out;
+
+	fp = fopen(ckpt->tmppath, "w");
+	if (!fp)
+		goto err;
+
+	pthread_mutex_lock(&ctx->lock);
+	errors = ctx->errors_found;
+	warnings = ctx->warnings_found;
+	pthread_mutex_unlock(&ctx->lock);
+	if (ckpt->media_started && !(ckpt->done & (1U << CKPT_DATA))) {
+		errors = ckpt->media_errors;
+		warnings = ckpt->media_warnings;
+	}
+
+	ckpt_format_uuid(ctx, uuid);
+	fputs(CKPT_MAGIC, fp);
+	fprintf(fp, "uuid %s\n", uuid);
+	fprintf(fp, "agcount %u\n", ctx->geo.agcount);
+	fprintf(fp, "done %x\n", ckpt->done);
+	fprintf(fp, "errors %llu\n", errors);
+	fprintf(fp, "warnings %llu\n", warnings);
+	fprintf(fp, "inode_count %"PRIu64"\n",
+			__atomic_load_n(&ckpt->nr_inodes, __ATOMIC_RELAXED));
+
+	args[0] = fp;
+	for (i = CKPT_NONE + 1; moveon && i < CKPT_NR_MAPS; i++) {
+		args[1] = (void *)ckpt_map_names[i];
+		moveon = bitmap_iterate(ckpt->maps[i], ckpt_save_range, args);
+	}
+
+	if (!moveon || fflush(fp) || fsync(fileno(fp))) {
+		fclose(fp);
+		unlink(ckpt->tmppath);
+		goto err;
+	}
+	if (fclose(fp) || rename(ckpt->tmppath, ckpt->path))
+		goto err;
+	ckpt->save_failed = false;
+out:
+	pthread_mutex_unlock(&ckpt->lock);
+	return;
+err:
+	/*
+	 * Only complain once until we manage to save again.  This is our
+	 * problem, not the filesystem's, so don't count it as an error.
+	 */
+	if (!ckpt->save_failed)
+		str_info(ctx, ckpt->path, _("Could not save checkpoint: %s"),
+				strerror(errno));
+	ckpt->save_failed = true;
+	pthread_mutex_unlock(&ckpt->lock);
+}
+
+/* Save the checkpoint every so often, or when we're told to die. */
+static void *
+ckpt_thread(
+	void			*arg)
+{
+	struct scrub_ctx	*ctx = arg;
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+	struct timespec		ts = { .tv_sec = CKPT_INTERVAL };
+	sigset_t		sigs;
+	int			sig;
+
+	while ((sig = sigtimedwait(&ckpt->sigs, NULL, &ts)) !=
+			CKPT_STOP_SIGNAL) {
+		if (sig < 0 && errno == EINTR)
+			continue;
+
+		ckpt_save(ctx);
+		if (sig < 0)
+			continue;
+
+		/* Now die the way we would have without a checkpoint. */
+		signal(sig, SIG_DFL);
+		sigemptyset(&sigs);
+		sigaddset(&sigs, sig);
+		pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+		raise(sig);
+	}
+
+	return NULL;
+}
+
+/*
+ * Set up checkpointing.  This must be called before any other thread is
+ * started so that they all inherit the blocked signals.  The checkpoint
+ * itself is loaded later, once we know the filesystem geometry.
+ */
+bool
+ckpt_init(
+	struct scrub_ctx	*ctx,
+	const char		*path)
+{
+	struct scrub_ckpt	*ckpt;
+	sigset_t		sigs;
+	int			error;
+
+	ckpt = calloc(1, sizeof(struct scrub_ckpt));
+	if (!ckpt)
+		goto err;
+	ckpt->path = strdup(path);
+	if (!ckpt->path)
+		goto out_ckpt;
+	ckpt->tmppath = malloc(strlen(path) + 5);
+	if (!ckpt->tmppath)
+		goto out_path;
+	sprintf(ckpt->tmppath, "%s.tmp", path);
+	pthread_mutex_init(&ckpt->lock, NULL);
+	if (!ckpt_reset(ckpt))
+		goto out_maps;
+
+	sigemptyset(&ckpt->sigs);
+	sigaddset(&ckpt->sigs, SIGINT);
+	sigaddset(&ckpt->sigs, SIGTERM);
+	sigaddset(&ckpt->sigs, SIGHUP);
+	sigaddset(&ckpt->sigs, CKPT_STOP_SIGNAL);
+	error = pthread_sigmask(SIG_BLOCK, &ckpt->sigs, &sigs);
+	if (error) {
+		errno = error;
+		goto out_maps;
+	}
+
+	ctx->ckpt = ckpt;
+	error = pthread_create(&ckpt->thread, NULL, ckpt_thread, ctx);
+	if (error) {
+		ctx->ckpt = NULL;
+		pthread_sigmask(SIG_SETMASK, &sigs, NULL);
+		errno = error;
+		goto out_maps;
+	}
+	return true;
+
+out_maps:
+	for (error = CKPT_NONE + 1; error < CKPT_NR_MAPS; error++)
+		if (ckpt->maps[error])
+			bitmap_free(&ckpt->maps[error]);
+	free(ckpt->tmppath);
+out_path:
+	free(ckpt->path);
+out_ckpt:
+	free(ckpt);
+err:
+	str_errno(ctx, path);
+	return false;
+}
+
+/* Find a progress map by name. */
+static enum ckpt_map
+ckpt_map_lookup(
+	const char		*name)
+{
+	int			i;
+
+	for (i = CKPT_NONE + 1; i < CKPT_NR_MAPS; i++)
+		if (!strcmp(name, ckpt_map_names[i]))
+			return i;
+	return CKPT_NONE;
+}
+
+/* Parse a checkpoint file.  Returns false if it's garbage. */
+static bool
+ckpt_parse(
+	struct scrub_ctx	*ctx,
+	FILE			*fp,
+	unsigned long long	*errors,
+	unsigned long long	*warnings)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+	char			line[256];
+	char			want_uuid[sizeof(ctx->geo.uuid) * 2 + 1];
+	char			uuid[sizeof(line)];
+	char			name[sizeof(line)];
+	unsigned long long	start;
+	unsigned long long	length;
+	unsigned long long	nr;
+	unsigned int		agcount;
+	unsigned int		done;
+	bool			uuid_ok = false;
+	bool			agcount_ok = false;
+	enum ckpt_map		map;
+
+	if (!fgets(line, sizeof(line), fp) || strcmp(line, CKPT_MAGIC))
+		return false;
+
+	ckpt_format_uuid(ctx, want_uuid);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "uuid %255s", uuid) == 1) {
+			uuid_ok = !strcmp(uuid, want_uuid);
+		} else if (sscanf(line, "agcount %u", &agcount) == 1) {
+			agcount_ok = agcount == ctx->geo.agcount;
+		} else if (sscanf(line, "done %x", &done) == 1) {
+			ckpt->done = done;
+		} else if (sscanf(line, "errors %llu", &nr) == 1) {
+			*errors = nr;
+		} else if (sscanf(line, "warnings %llu", &nr) == 1) {
+			*warnings = nr;
+		} else if (sscanf(line, "inode_count %llu", &nr) == 1) {
+			ckpt->nr_inodes = nr;
+		} else if (sscanf(line, "%255s %llu %llu", name, &start,
+				&length) == 3) {
+			map = ckpt_map_lookup(name);
+			if (map == CKPT_NONE)
+				return false;
+			if (!bitmap_set(ckpt->maps[map], start, length))
+				return false;
+		} else {
+			return false;
+		}
+	}
+
+	return !ferror(fp) && uuid_ok && agcount_ok;
+}
+
+/* Load the checkpoint file, if there is one. */
+bool
+ckpt_load(
+	struct scrub_ctx	*ctx)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+	unsigned long long	errors = 0;
+	unsigned long long	warnings = 0;
+	FILE			*fp;
+	bool			moveon = true;
+
+	if (!ckpt)
+		return true;
+
+	pthread_mutex_lock(&ckpt->lock);
+	fp = fopen(ckpt->path, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			str_errno(ctx, ckpt->path);
+		goto out;
+	}
+
+	if (!ckpt_parse(ctx, fp, &errors, &warnings)) {
+		str_info(ctx, ckpt->path,
+_("Checkpoint is damaged or for another filesystem; starting over."));
+		errors = warnings = 0;
+		moveon = ckpt_reset(ckpt);
+		if (!moveon)
+			str_errno(ctx, ckpt->path);
+	}
+	fclose(fp);
+	if (!moveon)
+		goto out_unlock;
+
+	/* Phases 2, 3 and 5 must run in full to queue their repairs. */
+	if (ctx->mode == SCRUB_MODE_REPAIR) {
+		errors = warnings = 0;
+		ckpt->done &= (1U << CKPT_DATA);
+		ckpt->nr_inodes = 0;
+		bitmap_free(&ckpt->maps[CKPT_METADATA]);
+		bitmap_free(&ckpt->maps[CKPT_INODES]);
+		bitmap_free(&ckpt->maps[CKPT_CONNECTIONS]);
+		moveon = bitmap_init(&ckpt->maps[CKPT_METADATA]) &&
+			 bitmap_init(&ckpt->maps[CKPT_INODES]) &&
+			 bitmap_init(&ckpt->maps[CKPT_CONNECTIONS]);
+		if (!moveon) {
+			str_errno(ctx, ckpt->path);
+			goto out_unlock;
+		}
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->errors_found += errors;
+	ctx->warnings_found += warnings;
+	pthread_mutex_unlock(&ctx->lock);
+	ctx->inodes_checked = ckpt->nr_inodes;
+	if (ckpt->done & ~(1U << CKPT_DATA))
+		log_info(ctx, _("Resuming scrub from checkpoint."));
+
+out:
+	ckpt->loaded = true;
+out_unlock:
+	pthread_mutex_unlock(&ckpt->lock);
+	if (moveon)
+		ctx->bytes_checked = ckpt_verified_bytes(ctx);
+	return moveon;
+}
+
+/*
+ * Stop checkpointing.  If every phase finished, the cycle is over and we
+ * delete the checkpoint; otherwise save it for the next run.
+ */
+void
+ckpt_finish(
+	struct scrub_ctx	*ctx,
+	bool			moveon)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+	int			i;
+
+	if (!ckpt)
+		return;
+
+	pthread_kill(ckpt->thread, CKPT_STOP_SIGNAL);
+	pthread_join(ckpt->thread, NULL);
+
+	if (moveon && ckpt->loaded && !ckpt->incomplete) {
+		if (unlink(ckpt->path) && errno != ENOENT)
+			str_errno(ctx, ckpt->path);
+	} else {
+		ckpt_save(ctx);
+	}
+
+	pthread_sigmask(SIG_UNBLOCK, &ckpt->sigs, NULL);
+	ctx->ckpt = NULL;
+	for (i = CKPT_NONE + 1; i < CKPT_NR_MAPS; i++)
+		bitmap_free(&ckpt->maps[i]);
+	free(ckpt->tmppath);
+	free(ckpt->path);
+	free(ckpt);
+}
+
+/* Did an earlier run finish this part of the scrub? */
+bool
+ckpt_done(
+	struct scrub_ctx	*ctx,
+	enum ckpt_map		map)
+{
+	return ctx->ckpt && ctx->ckpt->loaded &&
+	       (ctx->ckpt->done & (1U << map));
+}
+
+/* This part of the scrub is finished, unless it stopped early. */
+void
+ckpt_mark_done(
+	struct scrub_ctx	*ctx,
+	enum ckpt_map		map)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+
+	if (!ckpt || !ckpt->loaded)
+		return;
+
+	pthread_mutex_lock(&ckpt->lock);
+	if (!(ckpt->incomplete & (1U << map)))
+		ckpt->done |= (1U << map);
+	pthread_mutex_unlock(&ckpt->lock);
+	ckpt_save(ctx);
+}
+
+/*
+ * Media verification is starting.  Remember the error counts so far; they
+ * are what we save until it finishes, as a resumed run finds the media
+ * errors again.
+ */
+void
+ckpt_start_media(
+	struct scrub_ctx	*ctx)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+
+	if (!ckpt || !ckpt->loaded)
+		return;
+
+	pthread_mutex_lock(&ckpt->lock);
+	pthread_mutex_lock(&ctx->lock);
+	ckpt->media_errors = ctx->errors_found;
+	ckpt->media_warnings = ctx->warnings_found;
+	pthread_mutex_unlock(&ctx->lock);
+	ckpt->media_started = true;
+	pthread_mutex_unlock(&ckpt->lock);
+}
+
+/* This part of the scrub stopped early; finish it next time. */
+void
+ckpt_mark_incomplete(
+	struct scrub_ctx	*ctx,
+	enum ckpt_map		map)
+{
+	struct scrub_ckpt	*ckpt = ctx->ckpt;
+
+	if (!ckpt)
+		return;
+
+	pthread_mutex_lock(&ckpt->lock);
+	ckpt->incomplete |= (1U << map);
+	pthread_mutex_unlock(&ckpt->lock);
+}
+
+/* Return the progress bitmap for part of the scrub, or NULL. */
+struct bitmap *
+ckpt_bitmap(
+	struct scrub_ctx	*ctx,
+	enum ckpt_map		map)
+{
+	if (!ctx->ckpt || !ctx->ckpt->loaded)
+		return NULL;
+	return ctx->ckpt->maps[map];
+}
+
+/* Return the count of inodes recorded in CKPT_INODES, or NULL. */
+uint64_t *
+ckpt_inode_count(
+	struct scrub_ctx	*ctx)
+{
+	if (!ctx->ckpt || !ctx->ckpt->loaded)
+		return NULL;
+	return &ctx->ckpt->nr_inodes;
+}
+
+static bool
+ckpt_add_length(
+	uint64_t		start,
+	uint64_t		length,
+	void			*arg)
+{
+	*(uint64_t *)arg += length;
+	return true;
+}
+
+/* How many bytes have been verified in this cycle? */
+uint64_t
+ckpt_verified_bytes(
+	struct scrub_ctx	*ctx)
+{
+	uint64_t		bytes = 0;
+
+	if (!ctx->ckpt || !ctx->ckpt->loaded)
+		return 0;
+	bitmap_iterate(ctx->ckpt->maps[CKPT_DATA], ckpt_add_length, &bytes);
+	bitmap_iterate(ctx->ckpt->maps[CKPT_RTDATA], ckpt_add_length, &bytes);
+	return bytes;
+}
@@ -0,0 +1,43 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef XFS_SCRUB_CHECKPOINT_H_
+#define XFS_SCRUB_CHECKPOINT_H_
+
+/* Progress records kept in a checkpoint. */
+enum ckpt_map {
+	CKPT_NONE = 0,
+	CKPT_METADATA,		/* AG numbers; agcount means whole-fs metadata */
+	CKPT_INODES,		/* inode numbers scrubbed */
+	CKPT_CONNECTIONS,	/* inode numbers checked for connectivity */
+	CKPT_DATA,		/* data device bytes verified */
+	CKPT_RTDATA,		/* realtime device bytes verified */
+	CKPT_NR_MAPS,
+};
+
+struct scrub_ckpt;
+
+bool ckpt_init(struct scrub_ctx *ctx, const char *path);
+bool ckpt_load(struct scrub_ctx *ctx);
+void ckpt_finish(struct scrub_ctx *ctx, bool moveon);
+bool ckpt_done(struct scrub_ctx *ctx, enum ckpt_map map);
+void ckpt_mark_done(struct scrub_ctx *ctx, enum ckpt_map map);
+void ckpt_start_media(struct scrub_ctx *ctx);
+void ckpt_mark_incomplete(struct scrub_ctx *ctx, enum ckpt_map map);
+struct bitmap *ckpt_bitmap(struct scrub_ctx *ctx, enum ckpt_map map);
+uint64_t *ckpt_inode_count(struct scrub_ctx *ctx);
+uint64_t ckpt_verified_bytes(struct scrub_ctx *ctx);
+
+#endif /* XFS_SCRUB_CHECKPOINT_H_ */
@@ -30,6 +30,11 @@
 #ifdef HAVE_HDIO_GETGEO
 # include <linux/hdreg.h>
 #endif
+#ifdef HAVE_IO_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
 #include "platform_defs.h"
 #include "libfrog.h"
 #include "path.h"
@@ -306,3 +311,379 @@ disk_read_verify(
 
 	return pread(disk->d_fd, buf, length, start);
 }
+
+/*
+ * Asynchronous Read Verification
+ *
+ * A disk_aio is an io_uring with a fixed number of request slots, each of
+ * which has its own buffer.  Reads are split into slot-sized pieces and
+ * kept in flight until the whole extent has been read; the caller is told
+ * how each piece fared.  A disk_aio is not thread safe, so each thread
+ * should have its own.
+ */
+#ifdef HAVE_IO_URING
+struct disk_aio_req {
+	uint64_t		start;		/* bytes */
+	uint64_t		length;		/* bytes */
+	bool			inflight;
+};
+
+struct disk_aio {
+	int			ring_fd;
+	unsigned int		depth;
+	size_t			iosize;
+
+	/* mapped rings */
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	/* submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* request slots */
+	void			*bufs;
+	struct disk_aio_req	*reqs;
+	unsigned int		*free_slots;
+	unsigned int		nr_free;
+	unsigned int		nr_inflight;
+};
+
+/*
+ * Kernels before 5.6 set up a ring but fail every IORING_OP_READ with
+ * -EINVAL, so make sure the ring knows the opcode before we use it.
+ */
+static bool
+disk_aio_probe(
+	int			ring_fd)
+{
+	struct io_uring_probe	*probe;
+	size_t			nr_ops = IORING_OP_READ + 1;
+	bool			ret = false;
+
+	probe = calloc(1, sizeof(*probe) +
+			nr_ops * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+			probe, nr_ops) == 0 &&
+	    probe->ops_len > IORING_OP_READ &&
+	    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+		ret = true;
+	free(probe);
+	return ret;
+}
+
+/* Set up an io_uring with this many request slots of iosize bytes each. */
+struct disk_aio *
+disk_aio_init(
+	unsigned int		depth,
+	size_t			iosize)
+{
+	struct io_uring_params	p = {0};
+	struct disk_aio		*aio;
+	unsigned int		i;
+	int			error;
+
+	aio = calloc(1, sizeof(struct disk_aio));
+	if (!aio)
+		return NULL;
+
+	aio->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (aio->ring_fd < 0)
+		goto out_free;
+	if (!disk_aio_probe(aio->ring_fd)) {
+		errno = EOPNOTSUPP;
+		goto out_close;
+	}
+	aio->depth = min(depth, p.sq_entries);
+	aio->iosize = iosize;
+
+	aio->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	aio->sq_ring = mmap(NULL, aio->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			IORING_OFF_SQ_RING);
+	if (aio->sq_ring == MAP_FAILED)
+		goto out_close;
+
+	aio->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	aio->cq_ring = mmap(NULL, aio->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			IORING_OFF_CQ_RING);
+	if (aio->cq_ring == MAP_FAILED)
+		goto out_sq;
+
+	aio->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	aio->sqes = mmap(NULL, aio->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+			IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+		goto out_cq;
+
+	aio->sq_head = aio->sq_ring + p.sq_off.head;
+	aio->sq_tail = aio->sq_ring + p.sq_off.tail;
+	aio->sq_mask = aio->sq_ring + p.sq_off.ring_mask;
+	aio->sq_array = aio->sq_ring + p.sq_off.array;
+	aio->cq_head = aio->cq_ring + p.cq_off.head;
+	aio->cq_tail = aio->cq_ring + p.cq_off.tail;
+	aio->cq_mask = aio->cq_ring + p.cq_off.ring_mask;
+	aio->cqes = aio->cq_ring + p.cq_off.cqes;
+
+	error = posix_memalign(&aio->bufs, page_size, aio->depth * iosize);
+	if (error) {
+		errno = error;
+		goto out_sqes;
+	}
+	aio->reqs = calloc(aio->depth, sizeof(struct disk_aio_req));
+	if (!aio->reqs)
+		goto out_bufs;
+	aio->free_slots = calloc(aio->depth, sizeof(unsigned int));
+	if (!aio->free_slots)
+		goto out_reqs;
+	for (i = 0; i < aio->depth; i++)
+		aio->free_slots[i] = i;
+	aio->nr_free = aio->depth;
+
+	return aio;
+
+out_reqs:
+	free(aio->reqs);
+out_bufs:
+	free(aio->bufs);
+out_sqes:
+	munmap(aio->sqes, aio->sqes_sz);
+out_cq:
+	munmap(aio->cq_ring, aio->cq_ring_sz);
+out_sq:
+	munmap(aio->sq_ring, aio->sq_ring_sz);
+out_close:
+	close(aio->ring_fd);
+out_free:
+	free(aio);
+	return NULL;
+}
+
+/* Tear down an io_uring. */
+void
+disk_aio_free(
+	struct disk_aio		*aio)
+{
+	/* Closing the ring waits for anything still in flight. */
+	close(aio->ring_fd);
+	munmap(aio->sqes, aio->sqes_sz);
+	munmap(aio->cq_ring, aio->cq_ring_sz);
+	munmap(aio->sq_ring, aio->sq_ring_sz);
+	free(aio->free_slots);
+	free(aio->reqs);
+	free(aio->bufs);
+	free(aio);
+}
+
+/* Queue a read of part of the extent into a free slot. */
+static void
+disk_aio_prep(
+	struct disk_aio		*aio,
+	struct disk		*disk,
+	uint64_t		start,
+	uint64_t		length)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		slot;
+	unsigned int		tail;
+	unsigned int		idx;
+
+	slot = aio->free_slots[--aio->nr_free];
+	aio->reqs[slot].start = start;
+	aio->reqs[slot].length = length;
+	aio->reqs[slot].inflight = true;
+
+	tail = *aio->sq_tail;
+	idx = tail & *aio->sq_mask;
+	sqe = &aio->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = disk->d_fd;
+	sqe->addr = (uintptr_t)aio->bufs + (size_t)slot * aio->iosize;
+	sqe->len = length;
+	sqe->off = start;
+	sqe->user_data = slot;
+	aio->sq_array[idx] = idx;
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	aio->nr_inflight++;
+}
+
+/* Pass completed reads to the caller and free their slots. */
+static void
+disk_aio_reap(
+	struct disk_aio		*aio,
+	struct disk		*disk,
+	disk_aio_done_fn_t	done_fn,
+	void			*arg)
+{
+	struct io_uring_cqe	*cqe;
+	struct disk_aio_req	*req;
+	unsigned int		head;
+	unsigned int		tail;
+	unsigned int		slot;
+
+	head = *aio->cq_head;
+	tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &aio->cqes[head & *aio->cq_mask];
+		slot = cqe->user_data;
+		req = &aio->reqs[slot];
+
+		/* Short reads are not errors, same as pread. */
+		done_fn(disk, req->start, req->length,
+				cqe->res < 0 ? -cqe->res : 0, arg);
+
+		req->inflight = false;
+		aio->free_slots[aio->nr_free++] = slot;
+		aio->nr_inflight--;
+		head++;
+	}
+	__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * The ring failed, so take back the reads the kernel hasn't picked up yet
+ * and wait for the ones it has.  The caller re-reads the failed pieces
+ * synchronously, and that mustn't race with the kernel still reading the
+ * same blocks into our slots.  Anything we can't wait for is left marked
+ * in flight; closing the ring fd will wait for it.
+ */
+static void
+disk_aio_drain(
+	struct disk_aio		*aio,
+	struct disk		*disk,
+	disk_aio_done_fn_t	done_fn,
+	void			*arg,
+	int			error)
+{
+	unsigned int		head;
+	unsigned int		tail;
+	unsigned int		idx;
+	unsigned int		slot;
+	int			ret;
+
+	head = __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+	for (tail = *aio->sq_tail; tail != head; tail--) {
+		idx = aio->sq_array[(tail - 1) & *aio->sq_mask];
+		slot = aio->sqes[idx].user_data;
+		aio->reqs[slot].inflight = false;
+		aio->free_slots[aio->nr_free++] = slot;
+		aio->nr_inflight--;
+		done_fn(disk, aio->reqs[slot].start, aio->reqs[slot].length,
+				error, arg);
+	}
+	__atomic_store_n(aio->sq_tail, head, __ATOMIC_RELEASE);
+
+	while (aio->nr_inflight > 0) {
+		ret = syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			break;
+		disk_aio_reap(aio, disk, done_fn, arg);
+	}
+}
+
+/*
+ * Read-verify an extent of a disk device with up to depth reads in flight.
+ * done_fn is called for every piece with zero or the error it hit.  If the
+ * ring itself fails, reads already in the kernel are waited for, every
+ * piece not yet read is failed with that error, the ring is no longer
+ * usable, and we return -1 with errno set.
+ */
+int
+disk_aio_read_verify(
+	struct disk_aio		*aio,
+	struct disk		*disk,
+	uint64_t		start,
+	uint64_t		length,
+	disk_aio_done_fn_t	done_fn,
+	void			*arg)
+{
+	uint64_t		next = start;
+	uint64_t		end = start + length;
+	unsigned int		to_submit;
+	unsigned int		i;
+	int			ret;
+	int			error;
+
+	while (next < end || aio->nr_inflight > 0) {
+		while (next < end && aio->nr_free > 0) {
+			length = min(end - next, aio->iosize);
+			disk_aio_prep(aio, disk, next, length);
+			next += length;
+		}
+
+		to_submit = *aio->sq_tail -
+				__atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+		ret = syscall(__NR_io_uring_enter, aio->ring_fd, to_submit,
+				1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			goto out_fail;
+
+		disk_aio_reap(aio, disk, done_fn, arg);
+	}
+
+	return 0;
+
+out_fail:
+	error = errno;
+	disk_aio_drain(aio, disk, done_fn, arg, error);
+	for (i = 0; i < aio->depth; i++) {
+		if (aio->reqs[i].inflight)
+			done_fn(disk, aio->reqs[i].start, aio->reqs[i].length,
+					error, arg);
+	}
+	if (next < end)
+		done_fn(disk, next, end - next, error, arg);
+	errno = error;
+	return -1;
+}
+#else
+struct disk_aio *
+disk_aio_init(
+	unsigned int		depth,
+	size_t			iosize)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+disk_aio_free(
+	struct disk_aio		*aio)
+{
+}
+
+int
+disk_aio_read_verify(
+	struct disk_aio		*aio,
+	struct disk		*disk,
+	uint64_t		start,
+	uint64_t		length,
+	disk_aio_done_fn_t	done_fn,
+	void			*arg)
+{
+	done_fn(disk, start, length, ENOSYS, arg);
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* HAVE_IO_URING */
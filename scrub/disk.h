@@ -37,4 +37,14 @@ int disk_close(struct disk *disk);
 ssize_t disk_read_verify(struct disk *disk, void *buf, uint64_t startblock,
 		uint64_t blockcount);
 
+struct disk_aio;
+typedef void (*disk_aio_done_fn_t)(struct disk *disk, uint64_t start,
+		uint64_t length, int error, void *arg);
+
+struct disk_aio *disk_aio_init(unsigned int depth, size_t iosize);
+void disk_aio_free(struct disk_aio *aio);
+int disk_aio_read_verify(struct disk_aio *aio, struct disk *disk,
+		uint64_t start, uint64_t length, disk_aio_done_fn_t done_fn,
+		void *arg);
+
 #endif /* XFS_SCRUB_DISK_H_ */
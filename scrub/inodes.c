@@ -31,6 +31,8 @@
 #include "xfs_scrub.h"
 #include "common.h"
 #include "inodes.h"
+#include "throttle.h"
+#include "bitmap.h"
 
 /*
  * Iterate a range of inodes.
@@ -41,19 +43,25 @@
  * are broken, but if we ask for n inodes starting at x, it'll skip the bad
  * ones and fill from beyond the range (x + n).
  *
- * Therefore, we ask INUMBERS to return one inobt chunk's worth of inode
- * bitmap information.  Then we try to BULKSTAT only the inodes that were
- * present in that chunk, and compare what we got against what INUMBERS said
- * was there.  If there's a mismatch, we know that we have an inode that fails
- * the verifiers but we can inject the bulkstat information to force the scrub
- * code to deal with the broken inodes.
+ * Therefore, we ask INUMBERS to return a batch of inobt chunks' worth of
+ * inode bitmap information.  Then, for each chunk, we try to BULKSTAT only
+ * the inodes that were present in that chunk, and compare what we got
+ * against what INUMBERS said was there.  If there's a mismatch, we know that
+ * we have an inode that fails the verifiers but we can inject the bulkstat
+ * information to force the scrub code to deal with the broken inodes.
  *
  * If the iteration function returns ESTALE, that means that the inode has
  * been deleted and possibly recreated since the BULKSTAT call.  We wil
  * refresh the stat information and try again up to 30 times before reporting
  * the staleness as an error.
+ *
+ * When resuming from a checkpoint, chunks whose first inode is already in
+ * the done bitmap were scanned by an earlier run and are skipped.
  */
 
+/* Number of inobt chunks to ask INUMBERS for at a time. */
+#define XFS_SCAN_INOGRP_BATCH	64
+
 /*
  * Did we get exactly the inodes we expected?  If not, load them one at a
  * time (or fake it) into the bulkstat data.
@@ -109,22 +117,27 @@ xfs_iterate_inodes_range(
 	void			*fshandle,
 	uint64_t		first_ino,
 	uint64_t		last_ino,
+	struct bitmap		*done,
+	uint64_t		*nr_inodes,
 	xfs_inode_iter_fn	fn,
 	void			*arg)
 {
 	struct xfs_fsop_bulkreq	igrpreq = {0};
 	struct xfs_fsop_bulkreq	bulkreq = {0};
 	struct xfs_handle	handle;
-	struct xfs_inogrp	inogrp;
+	struct xfs_inogrp	inogrp[XFS_SCAN_INOGRP_BATCH];
 	struct xfs_bstat	bstat[XFS_INODES_PER_CHUNK];
 	char			idescr[DESCR_BUFSZ];
 	char			buf[DESCR_BUFSZ];
+	struct xfs_inogrp	*ig;
 	struct xfs_bstat	*bs;
 	__u64			igrp_ino;
 	__u64			ino;
+	uint64_t		start;
 	__s32			bulklen = 0;
 	__s32			igrplen = 0;
 	bool			moveon = true;
+	int			g;
 	int			i;
 	int			error;
 	int			stale_count = 0;
@@ -137,8 +150,8 @@ xfs_iterate_inodes_range(
 	bulkreq.ocount  = &bulklen;
 
 	igrpreq.lastip  = &igrp_ino;
-	igrpreq.icount  = 1;
-	igrpreq.ubuffer = &inogrp;
+	igrpreq.icount  = XFS_SCAN_INOGRP_BATCH;
+	igrpreq.ubuffer = inogrp;
 	igrpreq.ocount  = &igrplen;
 
 	memcpy(&handle.ha_fsid, fshandle, sizeof(handle.ha_fsid));
@@ -146,57 +159,70 @@ xfs_iterate_inodes_range(
 			sizeof(handle.ha_fid.fid_len);
 	handle.ha_fid.fid_pad = 0;
 
-	/* Find the inode chunk & alloc mask */
+	/* Find the inode chunks & alloc masks */
 	igrp_ino = first_ino;
 	error = ioctl(ctx->mnt_fd, XFS_IOC_FSINUMBERS, &igrpreq);
 	while (!error && igrplen) {
-		/* Load the inodes. */
-		ino = inogrp.xi_startino - 1;
-		bulkreq.icount = inogrp.xi_alloccount;
-		error = ioctl(ctx->mnt_fd, XFS_IOC_FSBULKSTAT, &bulkreq);
-		if (error)
-			str_info(ctx, descr, "%s", strerror_r(errno,
-						buf, DESCR_BUFSZ));
-
-		xfs_iterate_inodes_range_check(ctx, &inogrp, bstat);
-
-		/* Iterate all the inodes. */
-		for (i = 0, bs = bstat; i < inogrp.xi_alloccount; i++, bs++) {
-			if (bs->bs_ino > last_ino)
+		for (g = 0, ig = inogrp; g < igrplen; g++, ig++) {
+			if (ig->xi_startino > last_ino)
 				goto out;
+			if (done && bitmap_test(done, ig->xi_startino, 1))
+				continue;
 
-			handle.ha_fid.fid_ino = bs->bs_ino;
-			handle.ha_fid.fid_gen = bs->bs_gen;
-			error = fn(ctx, &handle, bs, arg);
-			switch (error) {
-			case 0:
-				break;
-			case ESTALE:
-				stale_count++;
-				if (stale_count < 30) {
-					igrp_ino = inogrp.xi_startino;
-					goto igrp_retry;
-				}
-				snprintf(idescr, DESCR_BUFSZ, "inode %"PRIu64,
-						(uint64_t)bs->bs_ino);
-				str_info(ctx, idescr,
+			/* Load the inodes. */
+			ino = ig->xi_startino - 1;
+			bulkreq.icount = ig->xi_alloccount;
+			start = throttle_start((uint64_t)ig->xi_alloccount *
+					ctx->geo.inodesize, 1);
+			error = ioctl(ctx->mnt_fd, XFS_IOC_FSBULKSTAT, &bulkreq);
+			throttle_cpu_done(start);
+			if (error)
+				str_info(ctx, descr, "%s", strerror_r(errno,
+							buf, DESCR_BUFSZ));
+
+			xfs_iterate_inodes_range_check(ctx, ig, bstat);
+
+			/* Iterate all the inodes. */
+			for (i = 0, bs = bstat; i < ig->xi_alloccount;
+			     i++, bs++) {
+				if (bs->bs_ino > last_ino)
+					goto out;
+
+				handle.ha_fid.fid_ino = bs->bs_ino;
+				handle.ha_fid.fid_gen = bs->bs_gen;
+				error = fn(ctx, &handle, bs, arg);
+				switch (error) {
+				case 0:
+					break;
+				case ESTALE:
+					stale_count++;
+					if (stale_count < 30) {
+						igrp_ino = ig->xi_startino;
+						goto igrp_retry;
+					}
+					snprintf(idescr, DESCR_BUFSZ,
+							"inode %"PRIu64,
+							(uint64_t)bs->bs_ino);
+					str_info(ctx, idescr,
 _("Changed too many times during scan; giving up."));
-				break;
-			case XFS_ITERATE_INODES_ABORT:
-				error = 0;
-				/* fall thru */
-			default:
-				moveon = false;
-				errno = error;
-				goto err;
-			}
-			if (xfs_scrub_excessive_errors(ctx)) {
-				moveon = false;
-				goto out;
+					break;
+				case XFS_ITERATE_INODES_ABORT:
+					error = 0;
+					/* fall thru */
+				default:
+					moveon = false;
+					errno = error;
+					goto err;
+				}
+				if (xfs_scrub_excessive_errors(ctx)) {
+					moveon = false;
+					goto out;
+				}
 			}
-		}
 
-		stale_count = 0;
+			*nr_inodes += ig->xi_alloccount;
+			stale_count = 0;
+		}
 igrp_retry:
 		error = ioctl(ctx->mnt_fd, XFS_IOC_FSINUMBERS, &igrpreq);
 	}
@@ -210,14 +236,118 @@ out:
 	return moveon;
 }
 
-/* BULKSTAT wrapper routines. */
+/*
+ * BULKSTAT wrapper routines.
+ *
+ * Inodes are rarely spread evenly over the AGs, so we don't scan whole AGs
+ * in one work item.  Instead, each AG's work item walks the inobt with
+ * INUMBERS and queues a range work item for every XFS_SCAN_RANGE_CHUNKS
+ * inode chunks it finds.  The ranges tile the AG's inode number space, so
+ * chunks allocated after the walk are still covered by some range.
+ *
+ * If the caller passes in a done bitmap, each range that finishes is
+ * recorded there and the number of inodes it saw is added to nr_done.
+ */
+#define XFS_SCAN_RANGE_CHUNKS	128
+
 struct xfs_scan_inodes {
 	xfs_inode_iter_fn	fn;
 	void			*arg;
+	struct bitmap		*done;
+	uint64_t		*nr_done;
 	bool			moveon;
 };
 
-/* Scan all the inodes in an AG. */
+struct xfs_scan_range {
+	struct xfs_scan_inodes	*si;
+	uint64_t		first_ino;
+	uint64_t		last_ino;
+};
+
+static void
+xfs_scan_ag_descr(
+	struct scrub_ctx	*ctx,
+	xfs_agnumber_t		agno,
+	char			*descr)
+{
+	snprintf(descr, DESCR_BUFSZ, _("dev %d:%d AG %u inodes"),
+				major(ctx->fsinfo.fs_datadev),
+				minor(ctx->fsinfo.fs_datadev),
+				agno);
+}
+
+/* Scan a range of inodes in an AG. */
+static void
+xfs_scan_range_inodes(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct xfs_scan_range	*range = arg;
+	struct xfs_scan_inodes	*si = range->si;
+	struct scrub_ctx	*ctx = (struct scrub_ctx *)wq->wq_ctx;
+	char			descr[DESCR_BUFSZ];
+	uint64_t		nr_inodes = 0;
+	bool			moveon;
+
+	xfs_scan_ag_descr(ctx, agno, descr);
+
+	moveon = xfs_iterate_inodes_range(ctx, descr, ctx->fshandle,
+			range->first_ino, range->last_ino, si->done,
+			&nr_inodes, si->fn, si->arg);
+	if (!moveon) {
+		si->moveon = false;
+		goto out;
+	}
+
+	if (si->done) {
+		if (!bitmap_set(si->done, range->first_ino,
+				range->last_ino - range->first_ino + 1)) {
+			str_errno(ctx, descr);
+			si->moveon = false;
+			goto out;
+		}
+		if (si->nr_done)
+			__atomic_add_fetch(si->nr_done, nr_inodes,
+					__ATOMIC_RELAXED);
+	}
+out:
+	free(range);
+}
+
+/* Queue a range of inodes in an AG for scanning. */
+static bool
+xfs_queue_range_inodes(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	struct xfs_scan_inodes	*si,
+	uint64_t		first_ino,
+	uint64_t		last_ino)
+{
+	struct scrub_ctx	*ctx = (struct scrub_ctx *)wq->wq_ctx;
+	struct xfs_scan_range	*range;
+	int			ret;
+
+	range = malloc(sizeof(struct xfs_scan_range));
+	if (!range) {
+		str_errno(ctx, ctx->mntpoint);
+		return false;
+	}
+	range->si = si;
+	range->first_ino = first_ino;
+	range->last_ino = last_ino;
+
+	ret = workqueue_add(wq, xfs_scan_range_inodes, agno, range);
+	if (ret) {
+		free(range);
+		str_info(ctx, ctx->mntpoint,
+_("Could not queue AG %u bulkstat work."), agno);
+		return false;
+	}
+	return true;
+}
+
+/* Carve the inodes in an AG into ranges and queue them for scanning. */
 static void
 xfs_scan_ag_inodes(
 	struct workqueue	*wq,
@@ -226,31 +356,67 @@ xfs_scan_ag_inodes(
 {
 	struct xfs_scan_inodes	*si = arg;
 	struct scrub_ctx	*ctx = (struct scrub_ctx *)wq->wq_ctx;
-	char			descr[DESCR_BUFSZ];
+	struct xfs_fsop_bulkreq	igrpreq = {0};
+	struct xfs_inogrp	inogrp[XFS_SCAN_INOGRP_BATCH];
 	uint64_t		ag_ino;
 	uint64_t		next_ag_ino;
-	bool			moveon;
-
-	snprintf(descr, DESCR_BUFSZ, _("dev %d:%d AG %u inodes"),
-				major(ctx->fsinfo.fs_datadev),
-				minor(ctx->fsinfo.fs_datadev),
-				agno);
+	uint64_t		first_ino;
+	__u64			igrp_ino;
+	__s32			igrplen = 0;
+	unsigned int		nr_chunks = 0;
+	int			i;
+	int			error;
 
 	ag_ino = (__u64)agno << (ctx->inopblog + ctx->agblklog);
 	next_ag_ino = (__u64)(agno + 1) << (ctx->inopblog + ctx->agblklog);
 
-	moveon = xfs_iterate_inodes_range(ctx, descr, ctx->fshandle, ag_ino,
-			next_ag_ino - 1, si->fn, si->arg);
-	if (!moveon)
+	igrpreq.lastip  = &igrp_ino;
+	igrpreq.icount  = XFS_SCAN_INOGRP_BATCH;
+	igrpreq.ubuffer = inogrp;
+	igrpreq.ocount  = &igrplen;
+
+	/*
+	 * If INUMBERS fails here we simply stop carving; the last range
+	 * covers the rest of the AG and reports the error when it runs.
+	 */
+	first_ino = ag_ino;
+	igrp_ino = ag_ino;
+	error = ioctl(ctx->mnt_fd, XFS_IOC_FSINUMBERS, &igrpreq);
+	while (!error && igrplen) {
+		for (i = 0; i < igrplen; i++) {
+			if (inogrp[i].xi_startino >= next_ag_ino)
+				goto out;
+			if (nr_chunks > 0 &&
+			    nr_chunks % XFS_SCAN_RANGE_CHUNKS == 0) {
+				if (!xfs_queue_range_inodes(wq, agno, si,
+						first_ino,
+						inogrp[i].xi_startino - 1)) {
+					si->moveon = false;
+					return;
+				}
+				first_ino = inogrp[i].xi_startino;
+			}
+			nr_chunks++;
+		}
+		error = ioctl(ctx->mnt_fd, XFS_IOC_FSINUMBERS, &igrpreq);
+	}
+
+out:
+	if (!xfs_queue_range_inodes(wq, agno, si, first_ino, next_ag_ino - 1))
 		si->moveon = false;
 }
 
-/* Scan all the inodes in a filesystem. */
+/*
+ * Scan all the inodes in a filesystem that aren't in the done bitmap,
+ * recording the ranges we finish in the bitmap.
+ */
 bool
-xfs_scan_all_inodes(
+xfs_scan_all_inodes_resume(
 	struct scrub_ctx	*ctx,
 	xfs_inode_iter_fn	fn,
-	void			*arg)
+	void			*arg,
+	struct bitmap		*done,
+	uint64_t		*nr_done)
 {
 	struct xfs_scan_inodes	si;
 	xfs_agnumber_t		agno;
@@ -260,9 +426,12 @@ xfs_scan_all_inodes(
 	si.moveon = true;
 	si.fn = fn;
 	si.arg = arg;
+	si.done = done;
+	si.nr_done = nr_done;
 
-	ret = workqueue_create(&wq, (struct xfs_mount *)ctx,
-			scrub_nproc_workqueue(ctx));
+	/* Range items queued by a worker can be stolen by idle workers. */
+	ret = workqueue_create_flags(&wq, (struct xfs_mount *)ctx,
+			scrub_nproc_workqueue(ctx), WQ_STEAL);
 	if (ret) {
 		str_info(ctx, ctx->mntpoint, _("Could not create workqueue."));
 		return false;
@@ -283,6 +452,16 @@ _("Could not queue AG %u bulkstat work."), agno);
 	return si.moveon;
 }
 
+/* Scan all the inodes in a filesystem. */
+bool
+xfs_scan_all_inodes(
+	struct scrub_ctx	*ctx,
+	xfs_inode_iter_fn	fn,
+	void			*arg)
+{
+	return xfs_scan_all_inodes_resume(ctx, fn, arg, NULL, NULL);
+}
+
 /*
  * Open a file by handle, or return a negative error code.
  */
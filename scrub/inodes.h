@@ -23,9 +23,13 @@
 typedef int (*xfs_inode_iter_fn)(struct scrub_ctx *ctx,
 		struct xfs_handle *handle, struct xfs_bstat *bs, void *arg);
 
+struct bitmap;
+
 #define XFS_ITERATE_INODES_ABORT	(-1)
 bool xfs_scan_all_inodes(struct scrub_ctx *ctx, xfs_inode_iter_fn fn,
 		void *arg);
+bool xfs_scan_all_inodes_resume(struct scrub_ctx *ctx, xfs_inode_iter_fn fn,
+		void *arg, struct bitmap *done, uint64_t *nr_done);
 
 int xfs_open_handle(struct xfs_handle *handle);
 
@@ -38,6 +38,7 @@
 #include "xfs_scrub.h"
 #include "common.h"
 #include "disk.h"
+#include "checkpoint.h"
 #include "scrub.h"
 
 /* Phase 1: Find filesystem geometry (and clean up after) */
@@ -223,6 +224,10 @@ _("Unable to find realtime device path."));
 		}
 	}
 
+	/* Pick up where an earlier run left off. */
+	if (!ckpt_load(ctx))
+		return false;
+
 	/*
 	 * Everything's set up, which means any failures recorded after
 	 * this point are most probably corruption errors (as opposed to
@@ -27,9 +27,39 @@
 #include "xfs_scrub.h"
 #include "common.h"
 #include "scrub.h"
+#include "bitmap.h"
+#include "checkpoint.h"
 
 /* Phase 2: Check internal metadata. */
 
+/*
+ * Did an earlier run already check this AG?  The whole-fs metadata is
+ * recorded in the checkpoint as AG number agcount.
+ */
+static bool
+xfs_metadata_checked(
+	struct scrub_ctx		*ctx,
+	xfs_agnumber_t			agno)
+{
+	struct bitmap			*done = ckpt_bitmap(ctx, CKPT_METADATA);
+
+	return done && bitmap_test(done, agno, 1);
+}
+
+/* Remember that we checked this AG. */
+static bool
+xfs_metadata_mark_checked(
+	struct scrub_ctx		*ctx,
+	xfs_agnumber_t			agno)
+{
+	struct bitmap			*done = ckpt_bitmap(ctx, CKPT_METADATA);
+
+	if (!done || bitmap_set(done, agno, 1))
+		return true;
+	str_errno(ctx, ctx->mntpoint);
+	return false;
+}
+
 /* Scrub each AG's metadata btrees. */
 static void
 xfs_scan_ag_metadata(
@@ -42,6 +72,9 @@ xfs_scan_ag_metadata(
 	bool				moveon;
 	char				descr[DESCR_BUFSZ];
 
+	if (xfs_metadata_checked(ctx, agno))
+		return;
+
 	snprintf(descr, DESCR_BUFSZ, _("AG %u"), agno);
 
 	/*
@@ -57,6 +90,8 @@ xfs_scan_ag_metadata(
 	if (!moveon)
 		goto err;
 
+	if (!xfs_metadata_mark_checked(ctx, agno))
+		goto err;
 	return;
 err:
 	*pmoveon = false;
@@ -73,8 +108,11 @@ xfs_scan_fs_metadata(
 	bool				*pmoveon = arg;
 	bool				moveon;
 
+	if (xfs_metadata_checked(ctx, ctx->geo.agcount))
+		return;
+
 	moveon = xfs_scrub_fs_metadata(ctx);
-	if (!moveon)
+	if (!moveon || !xfs_metadata_mark_checked(ctx, ctx->geo.agcount))
 		*pmoveon = false;
 }
 
@@ -88,6 +126,12 @@ xfs_scan_metadata(
 	bool			moveon = true;
 	int			ret;
 
+	/*
+	 * Each AG is checked by kernel scrub calls that can't be split into
+	 * smaller pieces, so there is nothing for stealing mode to hand to
+	 * an idle worker; the shared FIFO already gives the next AG to
+	 * whichever worker frees up first.
+	 */
 	ret = workqueue_create(&wq, (struct xfs_mount *)ctx,
 			scrub_nproc_workqueue(ctx));
 	if (ret) {
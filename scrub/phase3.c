@@ -30,6 +30,7 @@
 #include "inodes.h"
 #include "progress.h"
 #include "scrub.h"
+#include "checkpoint.h"
 
 /* Phase 3: Scan all inodes. */
 
@@ -138,13 +139,15 @@ xfs_scan_inodes(
 		return false;
 	}
 
-	ret = xfs_scan_all_inodes(ctx, xfs_scrub_inode, &ictx);
+	ret = xfs_scan_all_inodes_resume(ctx, xfs_scrub_inode, &ictx,
+			ckpt_bitmap(ctx, CKPT_INODES), ckpt_inode_count(ctx));
 	if (!ret)
 		ictx.moveon = false;
 	if (!ictx.moveon)
 		goto free;
 	xfs_scrub_report_preen_triggers(ctx);
-	ctx->inodes_checked = ptcounter_value(ictx.icount);
+	/* Inodes scanned by earlier runs were counted when we resumed. */
+	ctx->inodes_checked += ptcounter_value(ictx.icount);
 
 free:
 	ptcounter_free(ictx.icount);
@@ -35,6 +35,7 @@
 #include "progress.h"
 #include "scrub.h"
 #include "unicrash.h"
+#include "checkpoint.h"
 
 /* Phase 5: Check directory connectivity. */
 
@@ -304,7 +305,8 @@ _("Filesystem has errors, skipping connectivity checks."));
 		return true;
 	}
 
-	ret = xfs_scan_all_inodes(ctx, xfs_scrub_connections, &moveon);
+	ret = xfs_scan_all_inodes_resume(ctx, xfs_scrub_connections, &moveon,
+			ckpt_bitmap(ctx, CKPT_CONNECTIONS), NULL);
 	if (!ret)
 		moveon = false;
 	if (!moveon)
@@ -35,6 +35,7 @@
 #include "read_verify.h"
 #include "spacemap.h"
 #include "vfs.h"
+#include "checkpoint.h"
 
 /*
  * Phase 6: Verify data file integrity.
@@ -46,6 +47,11 @@
  * to tell us if metadata are now corrupt.  Otherwise, we'll scan the
  * whole directory tree looking for files that overlap the bad regions
  * and report the paths of the now corrupt files.
+ *
+ * If we're keeping a checkpoint, extents that an earlier run verified are
+ * skipped and everything we verify is recorded.  If the user gave us a
+ * verification budget, we stop scheduling reads once it's used up and
+ * leave the rest for the next run.
  */
 
 /* Find the fd for a given device identifier. */
@@ -303,6 +309,9 @@ struct xfs_verify_extent {
 	struct ptvar		*rvstate;
 	struct bitmap		*d_bad;		/* bytes */
 	struct bitmap		*r_bad;		/* bytes */
+	struct bitmap		*d_done;	/* bytes, from checkpoint */
+	struct bitmap		*r_done;	/* bytes, from checkpoint */
+	uint64_t		scheduled;	/* bytes */
 };
 
 /* Report an IO error resulting from read-verify based off getfsmap. */
@@ -396,6 +405,81 @@ xfs_check_rmap_ioerr(
 			&start);
 }
 
+/* Find the bitmap of already-verified ranges for a disk, if any. */
+static struct bitmap *
+xfs_verify_done_bitmap(
+	struct scrub_ctx		*ctx,
+	struct xfs_verify_extent	*ve,
+	struct disk			*disk)
+{
+	if (disk == ctx->datadev)
+		return ve->d_done;
+	else if (disk == ctx->rtdev)
+		return ve->r_done;
+	return NULL;
+}
+
+/*
+ * Record a verified range in the checkpoint.  Leave out the blocks that
+ * failed to read so that a resumed run reads them again and reports them;
+ * the checkpoint doesn't remember the bad blocks themselves.
+ */
+static void
+xfs_check_rmap_verified(
+	struct scrub_ctx		*ctx,
+	struct disk			*disk,
+	uint64_t			start,
+	uint64_t			length,
+	void				*arg)
+{
+	struct xfs_verify_extent	*ve = arg;
+	struct bitmap			*done;
+	struct bitmap			*bad;
+	uint64_t			bad_start;
+	uint64_t			bad_len;
+
+	done = xfs_verify_done_bitmap(ctx, ve, disk);
+	if (!done)
+		return;
+	bad = (disk == ctx->datadev) ? ve->d_bad : ve->r_bad;
+
+	while (length > 0 &&
+	       bitmap_find_first(bad, start, length, &bad_start, &bad_len)) {
+		if (bad_start > start &&
+		    !bitmap_set(done, start, bad_start - start))
+			goto err;
+		if (bad_start + bad_len >= start + length)
+			return;
+		length -= bad_start + bad_len - start;
+		start = bad_start + bad_len;
+	}
+	if (length > 0 && !bitmap_set(done, start, length))
+		goto err;
+	return;
+err:
+	str_errno(ctx, ctx->mntpoint);
+}
+
+/* Schedule a read-verify of part of an extent, if it's within budget. */
+static void
+xfs_check_rmap_schedule(
+	struct scrub_ctx		*ctx,
+	struct xfs_verify_extent	*ve,
+	struct disk			*disk,
+	uint64_t			start,
+	uint64_t			length)
+{
+	if (verify_budget &&
+	    __atomic_add_fetch(&ve->scheduled, length, __ATOMIC_RELAXED) >
+			verify_budget) {
+		ctx->verify_partial = true;
+		return;
+	}
+
+	read_verify_schedule_io(ve->readverify, ptvar_get(ve->rvstate), disk,
+			start, length, ve);
+}
+
 /* Schedule a read-verify of a (data block) extent. */
 static bool
 xfs_check_rmap(
@@ -406,6 +490,11 @@ xfs_check_rmap(
 {
 	struct xfs_verify_extent	*ve = arg;
 	struct disk			*disk;
+	struct bitmap			*done;
+	uint64_t			start;
+	uint64_t			length;
+	uint64_t			set_start;
+	uint64_t			set_len;
 
 	dbg_printf("rmap dev %d:%d phys %"PRIu64" owner %"PRId64
 			" offset %"PRIu64" len %"PRIu64" flags 0x%x\n",
@@ -433,9 +522,25 @@ xfs_check_rmap(
 
 	/* Schedule the read verify command for (eventual) running. */
 	disk = xfs_dev_to_disk(ctx, map->fmr_device);
-
-	read_verify_schedule_io(ve->readverify, ptvar_get(ve->rvstate), disk,
-			map->fmr_physical, map->fmr_length, ve);
+	done = xfs_verify_done_bitmap(ctx, ve, disk);
+	start = map->fmr_physical;
+	length = map->fmr_length;
+
+	/* Only verify the parts that an earlier run didn't get to. */
+	while (done && length > 0 &&
+	       bitmap_find_first(done, start, length, &set_start, &set_len)) {
+		if (set_start > start)
+			xfs_check_rmap_schedule(ctx, ve, disk, start,
+					set_start - start);
+		if (set_start + set_len >= start + length) {
+			length = 0;
+			break;
+		}
+		length -= set_start + set_len - start;
+		start = set_start + set_len;
+	}
+	if (length > 0)
+		xfs_check_rmap_schedule(ctx, ve, disk, start, length);
 
 out:
 	/* Is this the last extent?  Fire off the read. */
@@ -478,8 +583,14 @@ xfs_scan_blocks(
 		goto out_dbad;
 	}
 
+	ve.d_done = ckpt_bitmap(ctx, CKPT_DATA);
+	ve.r_done = ckpt_bitmap(ctx, CKPT_RTDATA);
+	ckpt_start_media(ctx);
+	ve.scheduled = 0;
 	ve.readverify = read_verify_pool_init(ctx, ctx->geo.blocksize,
-			xfs_check_rmap_ioerr, disk_heads(ctx->datadev));
+			xfs_check_rmap_ioerr,
+			ve.d_done ? xfs_check_rmap_verified : NULL,
+			disk_heads(ctx->datadev), verify_qdepth);
 	if (!ve.readverify) {
 		moveon = false;
 		str_info(ctx, ctx->mntpoint,
@@ -493,6 +604,13 @@ _("Could not create media verifier."));
 	ctx->bytes_checked += read_verify_bytes(ve.readverify);
 	read_verify_pool_destroy(ve.readverify);
 
+	if (ctx->verify_partial) {
+		str_info(ctx, ctx->mntpoint,
+_("Stopped verifying file data after %llu bytes."),
+				verify_budget);
+		ckpt_mark_incomplete(ctx, CKPT_DATA);
+	}
+
 	/* Scan the whole dir tree to see what matches the bad extents. */
 	if (!bitmap_empty(ve.d_bad) || !bitmap_empty(ve.r_bad))
 		moveon = xfs_report_verify_errors(ctx, ve.d_bad, ve.r_bad);
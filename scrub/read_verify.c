@@ -20,6 +20,7 @@
 #include "xfs.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/statvfs.h>
 #include "workqueue.h"
 #include "path.h"
@@ -29,6 +30,7 @@
 #include "disk.h"
 #include "read_verify.h"
 #include "progress.h"
+#include "throttle.h"
 
 /*
  * Read Verify Pool
@@ -38,6 +40,11 @@
  * pool worker.  Adjacent (or nearly adjacent) requests can be combined
  * to reduce overhead when free space fragmentation is high.  The thread
  * pool takes care of issuing multiple IOs to the device, if possible.
+ *
+ * Unless the disk can do SCSI VERIFY, each thread also keeps up to qdepth
+ * reads in flight through its own io_uring, each with its own buffer.
+ * Pieces that fail there are verified again synchronously so that we can
+ * narrow the error down to the bad blocks.
  */
 
 /*
@@ -50,22 +57,43 @@
 /* Tolerate 64k holes in adjacent read verify requests. */
 #define RVP_IO_BATCH_LOCALITY	(65536)
 
+/* Size of each asynchronous read. */
+#define RVP_AIO_IO_SIZE		(524288)
+
+/* When throttled, verify this much at a time. */
+#define RVP_THROTTLE_WINDOW	(4194304)
+
+/* Report progress to the done callback at least this often. */
+#define RVP_DONE_WINDOW		(RVP_IO_MAX_SIZE)
+
 struct read_verify_pool {
 	struct workqueue	wq;		/* thread pool */
 	struct scrub_ctx	*ctx;		/* scrub context */
 	void			*readbuf;	/* read buffer */
 	struct ptcounter	*verified_bytes;
 	read_verify_ioerr_fn_t	ioerr_fn;	/* io error callback */
+	read_verify_done_fn_t	done_fn;	/* verified range callback */
 	size_t			miniosz;	/* minimum io size, bytes */
+	unsigned int		qdepth;		/* async reads per thread */
+	pthread_key_t		aio_key;	/* per-thread disk_aio */
 };
 
+static void
+read_verify_aio_free(
+	void				*aio)
+{
+	disk_aio_free(aio);
+}
+
 /* Create a thread pool to run read verifiers. */
 struct read_verify_pool *
 read_verify_pool_init(
 	struct scrub_ctx		*ctx,
 	size_t				miniosz,
 	read_verify_ioerr_fn_t		ioerr_fn,
-	unsigned int			nproc)
+	read_verify_done_fn_t		done_fn,
+	unsigned int			nproc,
+	unsigned int			qdepth)
 {
 	struct read_verify_pool		*rvp;
 	bool				ret;
@@ -85,14 +113,21 @@ read_verify_pool_init(
 	rvp->miniosz = miniosz;
 	rvp->ctx = ctx;
 	rvp->ioerr_fn = ioerr_fn;
+	rvp->done_fn = done_fn;
+	rvp->qdepth = qdepth;
+	error = pthread_key_create(&rvp->aio_key, read_verify_aio_free);
+	if (error)
+		goto out_counter;
 	/* Run in the main thread if we only want one thread. */
 	if (nproc == 1)
 		nproc = 0;
 	ret = workqueue_create(&rvp->wq, (struct xfs_mount *)rvp, nproc);
 	if (ret)
-		goto out_counter;
+		goto out_key;
 	return rvp;
 
+out_key:
+	pthread_key_delete(rvp->aio_key);
 out_counter:
 	ptcounter_free(rvp->verified_bytes);
 out_buf:
@@ -115,51 +150,197 @@ void
 read_verify_pool_destroy(
 	struct read_verify_pool		*rvp)
 {
+	struct disk_aio			*aio;
+
+	/* Worker threads free theirs on exit; this catches the main thread. */
+	aio = pthread_getspecific(rvp->aio_key);
+	if (aio)
+		disk_aio_free(aio);
+	pthread_key_delete(rvp->aio_key);
 	ptcounter_free(rvp->verified_bytes);
 	free(rvp->readbuf);
 	free(rvp);
 }
 
 /*
- * Issue a read-verify IO in big batches.
+ * Read-verify part of a request synchronously, in big batches.  Returns the
+ * number of bytes we went through.
  */
-static void
-read_verify(
-	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
-	void				*arg)
+static uint64_t
+read_verify_sync(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv,
+	uint64_t			start,
+	uint64_t			length)
 {
-	struct read_verify		*rv = arg;
-	struct read_verify_pool		*rvp;
-	unsigned long long		verified = 0;
+	uint64_t			verified = 0;
 	ssize_t				sz;
 	ssize_t				len;
 
-	rvp = (struct read_verify_pool *)wq->wq_ctx;
-	while (rv->io_length > 0) {
-		len = min(rv->io_length, RVP_IO_MAX_SIZE);
+	while (length > 0) {
+		len = min(length, RVP_IO_MAX_SIZE);
 		dbg_printf("diskverify %d %"PRIu64" %zu\n", rv->io_disk->d_fd,
-				rv->io_start, len);
-		sz = disk_read_verify(rv->io_disk, rvp->readbuf,
-				rv->io_start, len);
+				start, len);
+		sz = disk_read_verify(rv->io_disk, rvp->readbuf, start, len);
 		if (sz < 0) {
 			dbg_printf("IOERR %d %"PRIu64" %zu\n",
 					rv->io_disk->d_fd,
-					rv->io_start, len);
+					start, len);
 			/* IO error, so try the next logical block. */
 			len = rvp->miniosz;
-			rvp->ioerr_fn(rvp->ctx, rv->io_disk, rv->io_start, len,
+			rvp->ioerr_fn(rvp->ctx, rv->io_disk, start, len,
 					errno, rv->io_end_arg);
 		}
 
 		progress_add(len);
 		verified += len;
+		start += len;
+		length -= len;
+	}
+
+	return verified;
+}
+
+/* Find this thread's io_uring, or NULL if we can't do async verify. */
+static struct disk_aio *
+read_verify_get_aio(
+	struct read_verify_pool		*rvp,
+	struct disk			*disk)
+{
+	struct disk_aio			*aio;
+
+	if (disk->d_flags & DISK_FLAG_SCSI_VERIFY)
+		return NULL;
+	if (__atomic_load_n(&rvp->qdepth, __ATOMIC_RELAXED) == 0)
+		return NULL;
+
+	aio = pthread_getspecific(rvp->aio_key);
+	if (aio)
+		return aio;
+
+	aio = disk_aio_init(rvp->qdepth, RVP_AIO_IO_SIZE);
+	if (!aio) {
+		/* No io_uring here, so nobody else should try either. */
+		dbg_printf("async verify unavailable: %s\n", strerror(errno));
+		__atomic_store_n(&rvp->qdepth, 0, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (pthread_setspecific(rvp->aio_key, aio)) {
+		disk_aio_free(aio);
+		return NULL;
+	}
+	return aio;
+}
+
+struct read_verify_aio {
+	struct read_verify_pool		*rvp;
+	struct read_verify		*rv;
+	uint64_t			verified;
+};
+
+/* An async read finished; re-read failed pieces to find the bad blocks. */
+static void
+read_verify_aio_done(
+	struct disk			*disk,
+	uint64_t			start,
+	uint64_t			length,
+	int				error,
+	void				*arg)
+{
+	struct read_verify_aio		*rva = arg;
+
+	if (error) {
+		dbg_printf("AIOERR %d %"PRIu64" %"PRIu64"\n", disk->d_fd,
+				start, length);
+		rva->verified += read_verify_sync(rva->rvp, rva->rv, start,
+				length);
+		return;
+	}
+
+	progress_add(length);
+	rva->verified += length;
+}
+
+/*
+ * Read-verify part of a request, asynchronously if we can.  Returns the
+ * number of IOs we (probably) issued.
+ */
+static unsigned int
+read_verify_extent(
+	struct read_verify_aio		*rva,
+	uint64_t			start,
+	uint64_t			length)
+{
+	struct read_verify_pool		*rvp = rva->rvp;
+	struct read_verify		*rv = rva->rv;
+	struct disk_aio			*aio;
+	int				ret;
+
+	aio = read_verify_get_aio(rvp, rv->io_disk);
+	if (!aio) {
+		rva->verified += read_verify_sync(rvp, rv, start, length);
+		return (length + RVP_IO_MAX_SIZE - 1) / RVP_IO_MAX_SIZE;
+	}
+
+	dbg_printf("aioverify %d %"PRIu64" %"PRIu64"\n", rv->io_disk->d_fd,
+			start, length);
+	ret = disk_aio_read_verify(aio, rv->io_disk, start, length,
+			read_verify_aio_done, rva);
+	if (ret) {
+		/* The ring broke; go back to synchronous reads. */
+		str_info(rvp->ctx, rvp->ctx->mntpoint,
+_("Asynchronous media verification failed: %s"),
+				strerror(errno));
+		pthread_setspecific(rvp->aio_key, NULL);
+		disk_aio_free(aio);
+		__atomic_store_n(&rvp->qdepth, 0, __ATOMIC_RELAXED);
+	}
+	return (length + RVP_AIO_IO_SIZE - 1) / RVP_AIO_IO_SIZE;
+}
+
+/*
+ * Issue a read-verify IO.  If we're being throttled, do it a window at a
+ * time so that we don't dump a big burst of IO on the disk.  If somebody
+ * wants to know what we've verified, tell them after every window.
+ */
+static void
+read_verify(
+	struct workqueue		*wq,
+	xfs_agnumber_t			agno,
+	void				*arg)
+{
+	struct read_verify		*rv = arg;
+	struct read_verify_pool		*rvp;
+	struct read_verify_aio		rva;
+	uint64_t			start;
+	uint64_t			len;
+	unsigned int			nr_ios;
+
+	rvp = (struct read_verify_pool *)wq->wq_ctx;
+	rva.rvp = rvp;
+	rva.rv = rv;
+	rva.verified = 0;
+
+	while (rv->io_length > 0) {
+		len = rv->io_length;
+		if (throttle_enabled())
+			len = min(len, (uint64_t)RVP_THROTTLE_WINDOW);
+		else if (rvp->done_fn)
+			len = min(len, (uint64_t)RVP_DONE_WINDOW);
+		start = throttle_start(len,
+				(len + RVP_AIO_IO_SIZE - 1) / RVP_AIO_IO_SIZE);
+		nr_ios = read_verify_extent(&rva, rv->io_start, len);
+		throttle_io_done(start, nr_ios);
+		if (rvp->done_fn)
+			rvp->done_fn(rvp->ctx, rv->io_disk, rv->io_start, len,
+					rv->io_end_arg);
+
 		rv->io_start += len;
 		rv->io_length -= len;
 	}
 
 	free(rv);
-	ptcounter_add(rvp->verified_bytes, verified);
+	ptcounter_add(rvp->verified_bytes, rva.verified);
 }
 
 /* Queue a read verify request. */
@@ -28,9 +28,18 @@ typedef void (*read_verify_ioerr_fn_t)(struct scrub_ctx *ctx,
 		struct disk *disk, uint64_t start, uint64_t length,
 		int error, void *arg);
 
+/*
+ * Function called when a range has been verified.  Any IO errors in the
+ * range have already been passed to the ioerr function.
+ */
+typedef void (*read_verify_done_fn_t)(struct scrub_ctx *ctx,
+		struct disk *disk, uint64_t start, uint64_t length,
+		void *arg);
+
 struct read_verify_pool *read_verify_pool_init(struct scrub_ctx *ctx,
 		size_t miniosz, read_verify_ioerr_fn_t ioerr_fn,
-		unsigned int nproc);
+		read_verify_done_fn_t done_fn, unsigned int nproc,
+		unsigned int qdepth);
 void read_verify_pool_flush(struct read_verify_pool *rvp);
 void read_verify_pool_destroy(struct read_verify_pool *rvp);
 
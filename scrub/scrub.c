@@ -30,6 +30,7 @@
 #include "common.h"
 #include "progress.h"
 #include "scrub.h"
+#include "throttle.h"
 #include "xfs_errortag.h"
 
 /* Online scrub and repair wrappers. */
@@ -194,6 +195,7 @@ xfs_check_metadata(
 	bool				is_inode)
 {
 	char				buf[DESCR_BUFSZ];
+	uint64_t			start;
 	unsigned int			tries = 0;
 	int				code;
 	int				error;
@@ -204,7 +206,9 @@ xfs_check_metadata(
 
 	dbg_printf("check %s flags %xh\n", buf, meta->sm_flags);
 retry:
+	start = throttle_start(0, 0);
 	error = ioctl(fd, XFS_IOC_SCRUB_METADATA, meta);
+	throttle_cpu_done(start);
 	if (debug_tweak_on("XFS_SCRUB_FORCE_REPAIR") && !error)
 		meta->sm_flags |= XFS_SCRUB_OFLAG_CORRUPT;
 	if (error) {
@@ -669,6 +673,7 @@ xfs_repair_metadata(
 	char				buf[DESCR_BUFSZ];
 	struct xfs_scrub_metadata	meta = { 0 };
 	struct xfs_scrub_metadata	oldm;
+	uint64_t			start;
 	int				error;
 
 	assert(ri->type < XFS_SCRUB_TYPE_NR);
@@ -703,7 +708,9 @@ xfs_repair_metadata(
 	else if (debug || verbose)
 		str_info(ctx, buf, _("Attempting optimization."));
 
+	start = throttle_start(0, 0);
 	error = ioctl(fd, XFS_IOC_SCRUB_METADATA, &meta);
+	throttle_cpu_done(start);
 	/*
 	 * If the caller doesn't want us to complain, tell the caller to
 	 * requeue the repair for later and don't say a thing.
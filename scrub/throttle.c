@@ -0,0 +1,278 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "platform_defs.h"
+#include "convert.h"
+#include "throttle.h"
+
+/*
+ * Scrub Throttling
+ *
+ * Scrub activity is charged against up to three token buckets shared by
+ * every thread: bytes read from disk, disk IOs, and time spent in the
+ * kernel doing scrub work.  Each bucket is kept as the time at which it
+ * will be empty again; a caller reserves its share and sleeps until the
+ * bucket has refilled enough to cover it.  Up to THROTTLE_BURST_NS worth
+ * of idle credit can be saved up, so short pauses are not lost.
+ *
+ * We also watch how long disk IOs take.  When the average latency climbs
+ * well past the best we have seen, the disk is busy with someone else's
+ * work, so we cut the byte and IO rates and recover them slowly once the
+ * latency drops again.
+ */
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/* How much unused credit a bucket can save up. */
+#define THROTTLE_BURST_NS	(NSEC_PER_SEC / 10)
+
+/* Rate scaling, in 1/1024ths of the configured rates. */
+#define THROTTLE_SCALE_ONE	1024
+#define THROTTLE_SCALE_MIN	(THROTTLE_SCALE_ONE / 16)
+#define THROTTLE_SCALE_STEP	(THROTTLE_SCALE_ONE / 32)
+
+/* Ignore latency increases smaller than this; it's just noise. */
+#define THROTTLE_LAT_SLACK_NS	(250000ULL)
+
+/* Don't change the rate scale more often than this. */
+#define THROTTLE_ADJUST_NS	(NSEC_PER_SEC / 10)
+
+enum {
+	THROTTLE_BW = 0,
+	THROTTLE_IOPS,
+	THROTTLE_CPU,
+};
+
+static char *throttle_opts[] = {
+	[THROTTLE_BW] = "bw",
+	[THROTTLE_IOPS] = "iops",
+	[THROTTLE_CPU] = "cpu",
+	NULL,
+};
+
+struct throttle {
+	pthread_mutex_t		lock;
+
+	/* targets; zero means no limit */
+	uint64_t		bw;		/* bytes per second */
+	uint64_t		iops;		/* IOs per second */
+	unsigned int		cpu;		/* percent of one cpu */
+
+	/* when each bucket runs dry */
+	uint64_t		bw_next;
+	uint64_t		iops_next;
+	uint64_t		cpu_next;
+
+	/* latency feedback */
+	uint64_t		lat_avg;	/* ns per IO, moving average */
+	uint64_t		lat_best;	/* lowest average seen */
+	uint64_t		last_adjust;
+	unsigned int		scale;
+};
+
+static struct throttle throttle = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.scale		= THROTTLE_SCALE_ONE,
+};
+
+static uint64_t
+throttle_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Parse -r bw=SIZE,iops=N,cpu=PCT.  Returns false if the options don't
+ * make sense.
+ */
+bool
+throttle_parse(
+	char			*opts)
+{
+	char			*val;
+	long long		x;
+
+	while (*opts != '\0') {
+		switch (getsubopt(&opts, throttle_opts, &val)) {
+		case THROTTLE_BW:
+			if (!val)
+				return false;
+			x = cvtnum(0, 0, val);
+			if (x <= 0)
+				return false;
+			throttle.bw = x;
+			break;
+		case THROTTLE_IOPS:
+			if (!val)
+				return false;
+			throttle.iops = cvt_u64(val, 10);
+			if (errno || throttle.iops == 0)
+				return false;
+			break;
+		case THROTTLE_CPU:
+			if (!val)
+				return false;
+			throttle.cpu = cvt_u32(val, 10);
+			if (errno || throttle.cpu == 0 || throttle.cpu > 100)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Are we throttling anything? */
+bool
+throttle_enabled(void)
+{
+	return throttle.bw || throttle.iops || throttle.cpu;
+}
+
+/*
+ * Reserve cost_ns of a bucket and return how long the caller has to wait
+ * for it.  Caller holds the lock.
+ */
+static uint64_t
+throttle_reserve(
+	uint64_t		*next,
+	uint64_t		now,
+	uint64_t		cost_ns)
+{
+	if (*next + THROTTLE_BURST_NS < now)
+		*next = now - THROTTLE_BURST_NS;
+	*next += cost_ns;
+	return *next > now ? *next - now : 0;
+}
+
+/*
+ * Wait until we're allowed to read this many bytes in this many IOs, and
+ * until any CPU time we've already used has been paid off.  Returns a
+ * timestamp to pass to throttle_io_done or throttle_cpu_done afterwards,
+ * or zero if we're not throttling.
+ */
+uint64_t
+throttle_start(
+	uint64_t		bytes,
+	unsigned int		nr_ios)
+{
+	struct timespec		ts;
+	uint64_t		now;
+	uint64_t		wait = 0;
+	uint64_t		delay;
+	uint64_t		scale;
+
+	if (!throttle_enabled())
+		return 0;
+
+	now = throttle_now();
+	pthread_mutex_lock(&throttle.lock);
+	scale = throttle.scale;
+	if (throttle.bw && bytes) {
+		delay = throttle_reserve(&throttle.bw_next, now,
+				bytes * NSEC_PER_SEC / throttle.bw *
+				THROTTLE_SCALE_ONE / scale);
+		wait = max(wait, delay);
+	}
+	if (throttle.iops && nr_ios) {
+		delay = throttle_reserve(&throttle.iops_next, now,
+				nr_ios * NSEC_PER_SEC / throttle.iops *
+				THROTTLE_SCALE_ONE / scale);
+		wait = max(wait, delay);
+	}
+	if (throttle.cpu) {
+		delay = throttle_reserve(&throttle.cpu_next, now, 0);
+		wait = max(wait, delay);
+	}
+	pthread_mutex_unlock(&throttle.lock);
+
+	if (wait) {
+		ts.tv_sec = wait / NSEC_PER_SEC;
+		ts.tv_nsec = wait % NSEC_PER_SEC;
+		nanosleep(&ts, NULL);
+		now = throttle_now();
+	}
+	return now;
+}
+
+/*
+ * Some disk IOs finished.  Fold their latency into the average and speed
+ * up or slow down accordingly.
+ */
+void
+throttle_io_done(
+	uint64_t		start,
+	unsigned int		nr_ios)
+{
+	uint64_t		now;
+	uint64_t		lat;
+
+	if (!start || !nr_ios || !(throttle.bw || throttle.iops))
+		return;
+
+	now = throttle_now();
+	lat = (now - start) / nr_ios;
+
+	pthread_mutex_lock(&throttle.lock);
+	if (throttle.lat_avg == 0)
+		throttle.lat_avg = lat;
+	else
+		throttle.lat_avg = (throttle.lat_avg * 7 + lat) / 8;
+
+	if (throttle.lat_best == 0 || throttle.lat_avg < throttle.lat_best)
+		throttle.lat_best = throttle.lat_avg;
+
+	if (now - throttle.last_adjust >= THROTTLE_ADJUST_NS) {
+		if (throttle.lat_avg > throttle.lat_best * 2 &&
+		    throttle.lat_avg > throttle.lat_best + THROTTLE_LAT_SLACK_NS)
+			throttle.scale = max(throttle.scale * 3 / 4,
+					(unsigned int)THROTTLE_SCALE_MIN);
+		else if (throttle.lat_avg < throttle.lat_best * 3 / 2)
+			throttle.scale = min(throttle.scale +
+					THROTTLE_SCALE_STEP,
+					(unsigned int)THROTTLE_SCALE_ONE);
+
+		/* Let the baseline drift up in case the disk got slower. */
+		throttle.lat_best += throttle.lat_best / 256 + 1;
+		throttle.last_adjust = now;
+	}
+	pthread_mutex_unlock(&throttle.lock);
+}
+
+/* Charge the time since start to the CPU bucket. */
+void
+throttle_cpu_done(
+	uint64_t		start)
+{
+	uint64_t		now;
+
+	if (!start || !throttle.cpu)
+		return;
+
+	now = throttle_now();
+	pthread_mutex_lock(&throttle.lock);
+	throttle_reserve(&throttle.cpu_next, now,
+			(now - start) * 100 / throttle.cpu);
+	pthread_mutex_unlock(&throttle.lock);
+}
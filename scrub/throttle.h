@@ -0,0 +1,25 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef XFS_SCRUB_THROTTLE_H_
+#define XFS_SCRUB_THROTTLE_H_
+
+bool throttle_parse(char *opts);
+bool throttle_enabled(void);
+uint64_t throttle_start(uint64_t bytes, unsigned int nr_ios);
+void throttle_io_done(uint64_t start, unsigned int nr_ios);
+void throttle_cpu_done(uint64_t start);
+
+#endif /* XFS_SCRUB_THROTTLE_H_ */
@@ -30,6 +30,8 @@
 #include "common.h"
 #include "unicrash.h"
 #include "progress.h"
+#include "throttle.h"
+#include "checkpoint.h"
 
 /*
  * XFS Online Metadata Scrub (and Repair)
@@ -139,6 +141,12 @@ int				nproc;
 /* Number of threads we're allowed to use. */
 unsigned int			nr_threads;
 
+/* Number of asynchronous media verification reads per thread. */
+unsigned int			verify_qdepth = 16;
+
+/* Most file data bytes to verify in one run; zero means no limit. */
+unsigned long long		verify_budget;
+
 /* Verbosity; higher values print more information. */
 bool				verbose;
 
@@ -175,11 +183,15 @@ usage(void)
 	fprintf(stderr, _("Options:\n"));
 	fprintf(stderr, _("  -a count     Stop after this many errors are found.\n"));
 	fprintf(stderr, _("  -b           Background mode.\n"));
+	fprintf(stderr, _("  -c file      Save progress to this checkpoint file.\n"));
 	fprintf(stderr, _("  -C fd        Print progress information to this fd.\n"));
 	fprintf(stderr, _("  -e behavior  What to do if errors are found.\n"));
 	fprintf(stderr, _("  -k           Do not FITRIM the free space.\n"));
+	fprintf(stderr, _("  -l size      Verify at most this much file data per run.\n"));
 	fprintf(stderr, _("  -m path      Path to /etc/mtab.\n"));
 	fprintf(stderr, _("  -n           Dry run.  Do not modify anything.\n"));
+	fprintf(stderr, _("  -Q depth     Media verification reads in flight per thread.\n"));
+	fprintf(stderr, _("  -r limits    Throttle to bw=bytes/s,iops=N,cpu=percent.\n"));
 	fprintf(stderr, _("  -T           Display timing/usage information.\n"));
 	fprintf(stderr, _("  -v           Verbose output.\n"));
 	fprintf(stderr, _("  -V           Print version.\n"));
@@ -253,6 +265,7 @@ struct phase_ops {
 	bool		(*estimate_work)(struct scrub_ctx *, uint64_t *,
 					 unsigned int *, int *);
 	bool		must_run;
+	enum ckpt_map	ckpt;
 };
 
 /* Start tracking resource usage for a phase. */
@@ -390,11 +403,13 @@ run_scrub_phases(
 			.descr = _("Check internal metadata."),
 			.fn = xfs_scan_metadata,
 			.estimate_work = xfs_estimate_metadata_work,
+			.ckpt = CKPT_METADATA,
 		},
 		{
 			.descr = _("Scan all inodes."),
 			.fn = xfs_scan_inodes,
 			.estimate_work = xfs_estimate_inodes_work,
+			.ckpt = CKPT_INODES,
 		},
 		{
 			.descr = _("Defer filesystem repairs."),
@@ -405,11 +420,13 @@ run_scrub_phases(
 			.descr = _("Check directory tree."),
 			.fn = xfs_scan_connections,
 			.estimate_work = xfs_estimate_inodes_work,
+			.ckpt = CKPT_CONNECTIONS,
 		},
 		{
 			.descr = _("Verify data file integrity."),
 			.fn = DATASCAN_DUMMY_FN,
 			.estimate_work = xfs_estimate_verify_work,
+			.ckpt = CKPT_DATA,
 		},
 		{
 			.descr = _("Check summary counters."),
@@ -453,6 +470,15 @@ run_scrub_phases(
 		if (debug_phase && phase != debug_phase && !sp->must_run)
 			continue;
 
+		/* Skip phases that an earlier run already finished. */
+		if (sp->ckpt != CKPT_NONE && ckpt_done(ctx, sp->ckpt)) {
+			if (verbose)
+				fprintf(stdout,
+_("Phase %u: Already done, per checkpoint.\n"),
+						phase);
+			continue;
+		}
+
 		/* Run this phase. */
 		moveon = phase_start(&pi, phase, sp->descr);
 		if (!moveon)
@@ -477,6 +503,8 @@ _("Scrub aborted after phase %d."),
 			break;
 		}
 		progress_end_phase();
+		if (sp->ckpt != CKPT_NONE)
+			ckpt_mark_done(ctx, sp->ckpt);
 		moveon = phase_end(&pi, phase);
 		if (!moveon)
 			break;
@@ -537,6 +565,8 @@ main(
 	struct scrub_ctx	ctx = {0};
 	struct phase_rusage	all_pi;
 	char			*mtab = NULL;
+	char			*ckpt_path = NULL;
+	long long		budget;
 	FILE			*progress_fp = NULL;
 	bool			moveon = true;
 	bool			ismnt;
@@ -554,7 +584,7 @@ main(
 	pthread_mutex_init(&ctx.lock, NULL);
 	ctx.mode = SCRUB_MODE_REPAIR;
 	ctx.error_action = ERRORS_CONTINUE;
-	while ((c = getopt(argc, argv, "a:bC:de:km:nTvxV")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bc:C:de:kl:m:nQ:r:TvxV")) != EOF) {
 		switch (c) {
 		case 'a':
 			ctx.max_errors = cvt_u64(optarg, 10);
@@ -567,6 +597,9 @@ main(
 			nr_threads = 1;
 			bg_mode++;
 			break;
+		case 'c':
+			ckpt_path = optarg;
+			break;
 		case 'C':
 			errno = 0;
 			fd = cvt_u32(optarg, 10);
@@ -598,12 +631,37 @@ main(
 		case 'k':
 			want_fstrim = false;
 			break;
+		case 'l':
+			budget = cvtnum(0, 0, optarg);
+			if (budget <= 0) {
+				fprintf(stderr,
+	_("Bad verification limit \"%s\".\n"),
+						optarg);
+				usage();
+			}
+			verify_budget = budget;
+			break;
 		case 'm':
 			mtab = optarg;
 			break;
 		case 'n':
 			ctx.mode = SCRUB_MODE_DRY_RUN;
 			break;
+		case 'r':
+			if (!throttle_parse(optarg)) {
+				fprintf(stderr,
+	_("Bad throttle options \"%s\".\n"),
+						optarg);
+				usage();
+			}
+			break;
+		case 'Q':
+			verify_qdepth = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				usage();
+			}
+			break;
 		case 'T':
 			display_rusage = true;
 			break;
@@ -704,10 +762,20 @@ _("%s: Not a XFS mount point or block device.\n"),
 	if (debug_tweak_on("XFS_SCRUB_FORCE_REPAIR"))
 		ctx.mode = SCRUB_MODE_REPAIR;
 
+	/*
+	 * Start checkpointing before we spawn any threads so that they all
+	 * leave the termination signals to the checkpoint thread.
+	 */
+	if (ckpt_path && !ckpt_init(&ctx, ckpt_path)) {
+		ctx.runtime_errors++;
+		goto out;
+	}
+
 	/* Scrub a filesystem. */
 	moveon = run_scrub_phases(&ctx, progress_fp);
 	if (!moveon && ctx.runtime_errors == 0)
 		ctx.runtime_errors++;
+	ckpt_finish(&ctx, moveon && !xfs_scrub_excessive_errors(&ctx));
 
 	/*
 	 * Excessive errors will cause the scrub phases to bail out early.
@@ -23,6 +23,8 @@
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
 
 extern unsigned int		nr_threads;
+extern unsigned int		verify_qdepth;
+extern unsigned long long	verify_budget;
 extern unsigned int		bg_mode;
 extern unsigned int		debug;
 extern int			nproc;
@@ -85,6 +87,9 @@ struct scrub_ctx {
 	/* Data block read verification buffer */
 	void			*readbuf;
 
+	/* Progress checkpoint, if the user asked for one */
+	struct scrub_ckpt	*ckpt;
+
 	/* Mutable scrub state; use lock. */
 	pthread_mutex_t		lock;
 	unsigned long long	max_errors;
@@ -93,6 +98,7 @@ struct scrub_ctx {
 	unsigned long long	warnings_found;
 	unsigned long long	inodes_checked;
 	unsigned long long	bytes_checked;
+	bool			verify_partial;	/* hit verify_budget */
 	unsigned long long	naming_warnings;
 	unsigned long long	repairs;
 	unsigned long long	preens;